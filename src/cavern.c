@@ -1,6 +1,6 @@
 /* cavern.c
  * SURVEX Cave surveying software: data reduction main and related functions
- * Copyright (C) 1991-2024 Olly Betts
+ * Copyright (C) 1991-2024,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -21,6 +21,7 @@
 
 #define MSG_SETUP_PROJ_SEARCH_PATH 1
 
+#include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <time.h>
@@ -36,9 +37,13 @@
 #include "filelist.h"
 #include "img_hosted.h"
 #include "listpos.h"
+#include "matrix.h"
 #include "netbits.h"
 #include "netskel.h"
 #include "out.h"
+#include "parsecache.h"
+#include "pool.h"
+#include "prefetch.h"
 #include "str.h"
 #include "validate.h"
 
@@ -46,6 +51,14 @@
 # include <conio.h> /* for _kbhit() and _getch() */
 #endif
 
+#ifdef HAVE_FORK
+# include <sys/stat.h>
+# include <sys/types.h>
+# include <sys/wait.h>
+# include <signal.h>
+# include <unistd.h>
+#endif
+
 /* Globals */
 node *fixedlist = NULL; // Fixed points
 node *stnlist = NULL; // Unfixed stations
@@ -57,15 +70,24 @@ long cComponents = 0;
 long cSolves = 0;
 bool fExportUsed = false;
 char * proj_str_out = NULL;
-PJ * pj_cached = NULL;
 
 FILE *fhErrStat = NULL;
 img *pimg = NULL;
 bool fQuiet = false; /* just show brief summary + errors */
 bool fMute = false; /* just show errors */
 bool fSuppress = false; /* only output 3d file */
+int n_threads = 1; /* number of threads to use for solving */
+real iterate_tolerance = 1e-12; /* residual to stop iterative solving at */
+bool f_station_errors = false; /* calculate station position errors */
+bool f_no_covariances = false; /* ignore covariances between leg components */
+bool f_internal_stats = false; /* report cache hit counts, etc */
 static bool fLog = false; /* stdout to .log file */
 static bool f_warnings_are_errors = false; /* turn warnings into errors */
+static bool f_version_specified = false; /* --3d-version given */
+bool f_watch = false; /* reprocess when input files change */
+#ifdef HAVE_FORK
+static int watch_fd = -1; /* pipe to report input files to watcher on */
+#endif
 
 nosurveylink *nosurveyhead;
 
@@ -98,6 +120,15 @@ static const struct option long_opts[] = {
    {"warnings-are-errors", no_argument, 0, 'w'},
    {"log", no_argument, 0, 1},
    {"3d-version", required_argument, 0, 'v'},
+   {"threads", required_argument, 0, 3},
+   {"iterate-tolerance", required_argument, 0, 4},
+   {"station-errors", no_argument, 0, 5},
+   {"no-covariances", no_argument, 0, 6},
+   {"cache", no_argument, 0, 8},
+   {"internal-stats", no_argument, 0, 9},
+#ifdef HAVE_FORK
+   {"watch", no_argument, 0, 7},
+#endif
 #ifdef _WIN32
    {"pause", no_argument, 0, 2},
 #endif
@@ -122,6 +153,24 @@ static struct help_msg help[] = {
    {HLP_ENCODELONG(6),	      /*log output to .log file*/170, 0, 0},
    /* TRANSLATORS: --help output for cavern --3d-version option */
    {HLP_ENCODELONG(7),	      /*specify the 3d file format version to output*/171, 0, 0},
+   /* TRANSLATORS: --help output for cavern --threads option */
+   {HLP_ENCODELONG(8),	      /*number of threads to use when solving the network*/533, 0, 0},
+   /* TRANSLATORS: --help output for cavern --iterate-tolerance option.
+    * This only affects the iterative solver, which is selected with the
+    * -zi or -zj development options. */
+   {HLP_ENCODELONG(9),	      /*relative residual at which to stop iterative solving*/534, 0, 0},
+   /* TRANSLATORS: --help output for cavern --station-errors option */
+   {HLP_ENCODELONG(10),	      /*calculate the covariance of each station position*/537, 0, 0},
+   /* TRANSLATORS: --help output for cavern --no-covariances option */
+   {HLP_ENCODELONG(11),	      /*ignore covariances when solving (faster but less accurate)*/538, 0, 0},
+   /* TRANSLATORS: --help output for cavern --cache option */
+   {HLP_ENCODELONG(12),	      /*keep a cache of processed survey files to speed up reprocessing*/543, 0, 0},
+   /* TRANSLATORS: --help output for cavern --internal-stats option */
+   {HLP_ENCODELONG(13),	      /*report internal statistics such as cache hit counts*/544, 0, 0},
+#ifdef HAVE_FORK
+   /* TRANSLATORS: --help output for cavern --watch option */
+   {HLP_ENCODELONG(14),	      /*keep running and reprocess when input files change*/539, 0, 0},
+#endif
  /*{'z',			"set optimizations for network reduction"},*/
    {0, 0, 0, 0}
 };
@@ -143,6 +192,241 @@ pause_on_exit(void)
 }
 #endif
 
+#ifdef HAVE_FORK
+typedef struct {
+   char *filename;
+   time_t mtime;
+   off_t size;
+} watched_file;
+
+/* Write len bytes from p to the watching process. */
+static void
+watch_write(const void *p, size_t len)
+{
+   const char *q = p;
+   while (watch_fd >= 0 && len) {
+      ssize_t r = write(watch_fd, q, len);
+      if (r < 0) {
+	 if (errno == EINTR) continue;
+	 /* The watcher has gone, so just carry on. */
+	 close(watch_fd);
+	 watch_fd = -1;
+	 return;
+      }
+      q += r;
+      len -= r;
+   }
+}
+
+void
+watch_file(const char *fnm)
+{
+   /* Report the file to the watching process, including the nul. */
+   if (watch_fd >= 0) {
+      watch_write("f", 1);
+      watch_write(fnm, strlen(fnm) + 1);
+   }
+}
+
+void
+watch_solution(const void *data, size_t len)
+{
+   if (watch_fd >= 0) {
+      watch_write("s", 1);
+      watch_write(&len, sizeof(len));
+      watch_write(data, len);
+   }
+}
+
+void
+watch_stop(void)
+{
+   if (watch_fd >= 0) {
+      close(watch_fd);
+      watch_fd = -1;
+   }
+}
+
+static volatile sig_atomic_t watch_interrupted = 0;
+
+static void
+watch_interrupt_handler(int sig)
+{
+   (void)sig;
+   watch_interrupted = 1;
+}
+
+static bool
+watched_file_changed(const watched_file *w)
+{
+   struct stat buf;
+   if (stat(w->filename, &buf) != 0) return w->size >= 0;
+   return buf.st_mtime != w->mtime || buf.st_size != w->size;
+}
+
+/* Process the survey data in a child process, then wait until one of the
+ * input files it read changes and repeat.  Using a fresh child process each
+ * time means we don't need to be able to reset all of cavern's global state,
+ * but we avoid redoing work which a change can't affect: --watch turns on
+ * the cache of processed survey files, so only files which have changed
+ * are parsed again, and the child sends back each system of equations it
+ * solves so that the next child can reuse the solution for each block of
+ * the network which is unchanged (see remember_solution()).
+ *
+ * Interrupting the watcher while it waits makes it exit with the status of
+ * the last run, while if a run is killed by a signal the watcher is too.
+ *
+ * This only returns in the child processes.
+ */
+static void
+watch_input_files(void)
+{
+   watched_file *files = NULL;
+   size_t n_files = 0, max_files = 0;
+   char *buf = NULL;
+   size_t buf_len, buf_size = 0;
+   signal(SIGINT, watch_interrupt_handler);
+   signal(SIGTERM, watch_interrupt_handler);
+   while (true) {
+      int status, exit_code;
+      int fds[2];
+      pid_t pid;
+      /* Don't duplicate any buffered output in the child. */
+      fflush(stdout);
+      fflush(stderr);
+      if (pipe(fds) < 0) {
+	 /* TRANSLATORS: Error if cavern --watch can't start the process
+	  * which processes the survey data. */
+	 fatalerror(/*Failed to watch input files*/540);
+      }
+      pid = fork();
+      if (pid < 0) {
+	 fatalerror(/*Failed to watch input files*/540);
+      }
+      if (pid == 0) {
+	 signal(SIGINT, SIG_DFL);
+	 signal(SIGTERM, SIG_DFL);
+	 close(fds[0]);
+	 watch_fd = fds[1];
+	 return;
+      }
+      close(fds[1]);
+
+      /* Read what the child reports: the nul-terminated name of each file it
+       * reads (after an "f"), and each system of equations it solves (after
+       * an "s" and the length).  Once the child is done we can make sense of
+       * it all.
+       */
+      buf_len = 0;
+      while (true) {
+	 if (buf_size - buf_len < 4096) {
+	    buf_size = buf_size ? buf_size * 2 : 65536;
+	    buf = osrealloc(buf, buf_size);
+	 }
+	 ssize_t r = read(fds[0], buf + buf_len, buf_size - buf_len);
+	 if (r < 0 && errno == EINTR) continue;
+	 if (r <= 0) break;
+	 buf_len += r;
+      }
+      close(fds[0]);
+      while (waitpid(pid, &status, 0) < 0) {
+	 if (errno != EINTR) fatalerror(/*Failed to watch input files*/540);
+      }
+      if (WIFSIGNALED(status)) {
+	 /* Pass on the signal which killed the child, e.g. SIGINT if the user
+	  * hit Ctrl-C while it was running. */
+	 int sig = WTERMSIG(status);
+	 signal(sig, SIG_DFL);
+	 raise(sig);
+	 exit(EXIT_FAILURE);
+      }
+      exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+
+      while (n_files) osfree(files[--n_files].filename);
+      bool have_solutions = false;
+      size_t off = 0;
+      while (off < buf_len) {
+	 char type = buf[off++];
+	 size_t len;
+	 if (type == 'f') {
+	    const char *end = memchr(buf + off, '\0', buf_len - off);
+	    if (!end) break;
+	    if (n_files == max_files) {
+	       max_files = max_files ? max_files * 2 : 16;
+	       files = osrealloc(files, max_files * ossizeof(watched_file));
+	    }
+	    files[n_files++].filename = osstrdup(buf + off);
+	    off = end + 1 - buf;
+	 } else {
+	    SVX_ASSERT(type == 's');
+	    if (buf_len - off < sizeof(len)) break;
+	    memcpy(&len, buf + off, sizeof(len));
+	    off += sizeof(len);
+	    if (buf_len - off < len) break;
+	    /* If the child got as far as solving, the systems it solved
+	     * replace those from the previous run so we don't accumulate
+	     * ones which are out of date.  Otherwise we keep them for next
+	     * time.
+	     */
+	    if (!have_solutions) {
+	       forget_solutions();
+	       have_solutions = true;
+	    }
+	    remember_solution(buf + off, len);
+	    off += len;
+	 }
+      }
+      if (n_files == 0) {
+	 /* The child failed before it read any input files (e.g. the file
+	  * given on the command line doesn't exist), so there's nothing which
+	  * could change to make a rerun worthwhile. */
+	 /* TRANSLATORS: Error from cavern --watch if processing the survey
+	  * data failed before any input files were read. */
+	 error(/*No input files were read, so there is nothing to watch*/545);
+	 exit(exit_code ? exit_code : EXIT_FAILURE);
+      }
+
+      /* Note the state of each file now the child is done with them, so an
+       * edit made while it was running triggers a rerun. */
+      for (size_t i = 0; i < n_files; ++i) {
+	 struct stat st;
+	 if (stat(files[i].filename, &st) == 0) {
+	    files[i].mtime = st.st_mtime;
+	    files[i].size = st.st_size;
+	 } else {
+	    files[i].mtime = 0;
+	    files[i].size = -1;
+	 }
+      }
+
+      if (!fMute) {
+	 putnl();
+	 /* TRANSLATORS: Shown by cavern --watch after processing the survey
+	  * data. */
+	 puts(msg(/*Waiting for input files to change*/541));
+	 fflush(stdout);
+      }
+      while (true) {
+	 size_t i;
+	 sleep(1);
+	 if (watch_interrupted) exit(exit_code);
+	 for (i = 0; i < n_files; ++i) {
+	    if (watched_file_changed(&files[i])) break;
+	 }
+	 if (i < n_files) {
+	    /* TRANSLATORS: Shown by cavern --watch when an input file is
+	     * modified, before it processes the survey data again. */
+	    printf(msg(/*“%s” changed - reprocessing*/542), files[i].filename);
+	    putnl();
+	    /* Give the editor a chance to finish writing. */
+	    sleep(1);
+	    break;
+	 }
+      }
+   }
+}
+#endif
+
 int current_days_since_1900;
 
 static void discarding_proj_logger(void *ctx, int level, const char *message) {
@@ -175,14 +459,14 @@ main(int argc, char **argv)
    pcs = osnew(settings);
    pcs->next = NULL;
    pcs->from_equals_to_is_only_a_warning = false;
-   pcs->Translate = ((short*) osmalloc(ossizeof(short) * 257)) + 1;
+   pcs->Translate = NULL;
+   pcs->Var = pcs->z = pcs->sc = pcs->units = NULL;
    pcs->meta = NULL;
    pcs->proj_str = NULL;
    pcs->declination = HUGE_REAL;
    pcs->convergence = HUGE_REAL;
    pcs->input_convergence = HUGE_REAL;
-   pcs->dec_filename = NULL;
-   pcs->dec_line = 0;
+   pcs->dec_loc = SRCLOC_NONE;
    pcs->dec_context = NULL;
    pcs->dec_lat = HUGE_VAL;
    pcs->dec_lon = HUGE_VAL;
@@ -192,15 +476,17 @@ main(int argc, char **argv)
    pcs->cartesian_north = TRUE_NORTH;
    pcs->cartesian_rotation = 0.0;
 
+   atexit(srcloc_release);
+
    /* Set up root of prefix hierarchy */
-   root = osnew(prefix);
+   root = pool_new(prefix);
    root->up = root->right = root->down = NULL;
    root->stn = NULL;
    root->pos = NULL;
    root->ident.p = NULL;
    root->min_export = root->max_export = 0;
    root->sflags = BIT(SFLAGS_SURVEY);
-   root->filename = NULL;
+   root->loc = SRCLOC_NONE;
 
    nosurveyhead = NULL;
 
@@ -256,6 +542,7 @@ main(int argc, char **argv)
 	    fatalerror(/*3d file format versions %d to %d supported*/88,
 		       IMG_VERSION_MIN, IMG_VERSION_MAX);
 	 img_output_version = v;
+	 f_version_specified = true;
 	 break;
        }
        case 'w':
@@ -269,13 +556,41 @@ main(int argc, char **argv)
 	    optimize = 0;
 	    first_opt_z = 0;
 	 }
-	 /* Lollipops, Parallel legs, Iterate mx, Delta* */
+	 /* Lollipops, Parallel legs, Iterate mx (IC or Jacobi), Delta* */
 	 while ((c = *optarg++) != '\0')
 	    if (islower((unsigned char)c)) optimize |= BITA(c);
 	 break;
        case 1:
 	 fLog = true;
 	 break;
+       case 3:
+	 n_threads = cmdline_int_arg();
+	 if (n_threads < 1)
+	    fatalerror(/*numeric argument “%s” out of range*/185, optarg);
+	 break;
+       case 4:
+	 iterate_tolerance = cmdline_double_arg();
+	 if (!(iterate_tolerance > 0.0 && iterate_tolerance < 1.0))
+	    fatalerror(/*numeric argument “%s” out of range*/185, optarg);
+	 break;
+       case 5:
+	 f_station_errors = true;
+	 break;
+       case 6:
+	 f_no_covariances = true;
+	 break;
+       case 8:
+	 f_cache = true;
+	 break;
+       case 9:
+	 f_internal_stats = true;
+	 break;
+#ifdef HAVE_FORK
+       case 7:
+	 f_watch = true;
+	 f_cache = true;
+	 break;
+#endif
 #ifdef _WIN32
        case 2:
 	 atexit(pause_on_exit);
@@ -285,6 +600,12 @@ main(int argc, char **argv)
       }
    }
 
+   /* Station covariances need a newer format version than we write by
+    * default, but respect an explicitly specified version.
+    */
+   if (f_station_errors && !f_version_specified)
+      img_output_version = IMG_VERSION_MAX;
+
    if (fLog) {
       char *fnm;
       if (!fnm_output_base) {
@@ -325,6 +646,16 @@ main(int argc, char **argv)
       }
    }
 
+#ifdef HAVE_FORK
+   if (f_watch) {
+      watch_input_files();
+      /* Only the child processes return here, so the time used should be
+       * counted from now. */
+      tmUserStart = time(NULL);
+      tmCPUStart = clock();
+   }
+#endif
+
    atexit(delete_output_on_error);
 
    /* end of options, now process data files */
@@ -349,6 +680,11 @@ main(int argc, char **argv)
       optind++;
    }
 
+   prefetch_finish();
+   /* We've finished reading the survey data. */
+   filename_free_dir_cache();
+   parse_cache_write();
+
    validate();
 
    report_declination(pcs);
@@ -367,6 +703,17 @@ main(int argc, char **argv)
 
    out_current_action(msg(/*Calculating statistics*/120));
    if (!fMute) do_stats();
+   if (f_internal_stats) {
+      print_parse_cache_stats();
+      print_pj_cache_stats();
+      print_data_normal_stats();
+      print_solve_stats();
+      print_pool_stats();
+   }
+   /* We don't release the pools from an atexit() handler as exit() may be
+    * called from an error path while prefetch or solver threads are still
+    * using them.  By now all those threads have been joined. */
+   release_pools();
    if (!fQuiet) {
       /* clock() typically wraps after 72 minutes, but there doesn't seem
        * to be a better way.  Still 72 minutes means some cave!
@@ -1,6 +1,6 @@
 /* cavern.h
  * SURVEX Cave surveying software - header file
- * Copyright (C) 1991-2024 Olly Betts
+ * Copyright (C) 1991-2024,2026 Olly Betts
  * Copyright (C) 2004 Simeon Warner
  *
  * This program is free software; you can redistribute it and/or modify
@@ -32,10 +32,12 @@
 #include <ctype.h>
 #include <math.h>
 #include <float.h>
+#include <stddef.h> /* for offsetof */
 
 #include <proj.h>
 
 #include "img_hosted.h"
+#include "srcloc.h"
 #include "str.h"
 #include "useful.h"
 
@@ -146,13 +148,16 @@ typedef enum {
    SFLAGS_SURFACE = 0, SFLAGS_UNDERGROUND, SFLAGS_ENTRANCE, SFLAGS_EXPORTED,
    SFLAGS_FIXED, SFLAGS_ANON, SFLAGS_WALL,
    /* These values don't need to match img.h, but mustn't clash. */
+   // The children of this prefix may not be in sorted order.
+   SFLAGS_UNSORTED = 8,
    SFLAGS_HANGING = 9,
    SFLAGS_UNUSED_FIXED_POINT = 10,
    SFLAGS_SOLVED = 11,
    SFLAGS_SUSPECTTYPO = 12,
    SFLAGS_SURVEY = 13,
    SFLAGS_PREFIX_ENTERED = 14,
-   // If set, use ident.i; if unset, use ident.p
+   // If set, use ident.i; if unset, use ident.p (which points to an interned
+   // copy of the identifier - see intern_ident()).
    SFLAGS_IDENT_INLINE = 15
 } sflags;
 
@@ -230,8 +235,7 @@ typedef struct Prefix {
    // then this will be the location of such a *fix, otherwise if it's a
    // station used in *equate then it's the location of such a *equate.
    // Otherwise it's the first place it was used.
-   const char *filename;
-   unsigned int line;
+   srcloc loc;
    /* If (min_export == 0) then max_export is max # levels above is this
     * prefix is used (and so needs to be exported) (0 == parent only).
     * If (min_export > 0) then max_export is max # levels above this
@@ -262,10 +266,10 @@ typedef struct Meta_data {
 /* stuff stored for both forward & reverse legs */
 typedef struct {
    struct Node *to;
-   /* bits 0..1 = reverse leg number; bit7 is fFullLeg */
-   /* bit6 = fReplacementLeg (by reduction rules) */
-   /* bit5 = articulation leg (i.e. carries no error) */
-   unsigned char reverse;
+   /* bits 0..27 = reverse leg number; bit31 is fFullLeg */
+   /* bit30 = fReplacementLeg (by reduction rules) */
+   /* bit29 = articulation leg (i.e. carries no error) */
+   unsigned int reverse;
    /* flags - e.g. surface, duplicate survey
     * only used if (FLAG_DATAHERE & !(FLAG_REPLACEMENTLEG|FLAG_FAKE))
     * This could be only in linkfor, but this is actually more space
@@ -274,11 +278,11 @@ typedef struct {
    unsigned char flags;
 } linkcommon;
 
-#define FLAG_DATAHERE 0x80
-#define FLAG_REPLACEMENTLEG 0x40
-#define FLAG_ARTICULATION 0x20
-#define FLAG_FAKE 0x10 /* an equate or leg inside an sdfix */
-#define MASK_REVERSEDIRN 0x03
+#define FLAG_DATAHERE 0x80000000u
+#define FLAG_REPLACEMENTLEG 0x40000000u
+#define FLAG_ARTICULATION 0x20000000u
+#define FLAG_FAKE 0x10000000u /* an equate or leg inside an sdfix */
+#define MASK_REVERSEDIRN 0x0fffffffu
 
 /* forward leg - deltas & vars stored here */
 typedef struct Link {
@@ -288,13 +292,17 @@ typedef struct Link {
    meta_data *meta;
 } linkfor;
 
-/* node - like a station, except several nodes are used to represent a
- * station with more than 3 legs connected to it
+/* node - a station, with however many legs are connected to it
  */
 typedef struct Node {
    struct Prefix *name;
-   struct Link *leg[3];
+   // NULL-terminated array of the legs.  This points to inline_legs unless
+   // the node has more than 3 legs (see freeleg()).
+   struct Link **leg;
    struct Node *prev, *next;
+   // Used in network.c to record whether a node is queued to be checked for
+   // network reductions.
+   //
    // Used in netartic.c to identify unconnected components and articulation
    // points within components.
    //
@@ -302,12 +310,16 @@ typedef struct Node {
    // or -1 for nodes already fixed (more than one node may map to the same
    // row).
    long colour;
+   struct Link *inline_legs[4];
 } node;
 
 /* station position */
 typedef struct Pos {
    // Easting, Northing, Altitude.
    real p[3];
+   // Covariance of the position, or NULL if not known (only calculated if
+   // --station-errors is specified).
+   svar *var;
 } pos;
 
 /*
@@ -331,7 +343,29 @@ typedef int compiletimeassert_style3[STYLE_CARTESIAN == img_STYLE_CARTESIAN ? 1
 typedef int compiletimeassert_style4[STYLE_CYLPOLAR == img_STYLE_CYLPOLAR ? 1 : -1];
 typedef int compiletimeassert_style5[STYLE_NOSURVEY == img_STYLE_NOSURVEY ? 1 : -1];
 
-/* various settings preserved by *BEGIN and *END */
+/* A character translation table - settings::Translate points to t + 1 so it
+ * can be indexed by EOF.  generation is unique to this table and its current
+ * contents, so code which caches information derived from the table can
+ * check if it needs to recompute it.
+ */
+typedef struct {
+   unsigned long generation;
+   short t[257];
+} translate_table;
+
+#define translate_generation(T) \
+   (((const translate_table*)((const char*)((T) - 1) - \
+			       offsetof(translate_table, t)))->generation)
+
+/* various settings preserved by *BEGIN and *END
+ *
+ * *BEGIN copies this struct, but the larger parts (Translate, the Q_MAC
+ * arrays, ordering, proj_str and meta) are pointers shared with the parent
+ * scope until something changes them, so the copy is a few hundred bytes.
+ * The declination and convergence fields are updated as legs are read, so
+ * moving them into a shared block would mean copying it in most blocks
+ * anyway.
+ */
 typedef struct Settings {
    struct Settings *next;
    unsigned int Truncate;
@@ -352,11 +386,18 @@ typedef struct Settings {
    int recorded_style;
    prefix *Prefix;
    prefix *begin_survey; /* used to check BEGIN and END match */
-   short *Translate; /* if short is >= 16 bits, which ANSI requires */
-   real Var[Q_MAC];
-   real z[Q_MAC];
-   real sc[Q_MAC];
-   real units[Q_MAC];
+   /* Character translation table (indexed by EOF and 0-255).  This is
+    * allocated by new_translate_table() and changed with set_translate().
+    */
+   const short *Translate;
+   /* Arrays of Q_MAC entries.  Like Translate, these are shared with the
+    * parent scope until modified - use copy_on_write_grade(),
+    * copy_on_write_calib() or copy_on_write_units() before changing them.
+    */
+   real *Var;
+   real *z;
+   real *sc;
+   real *units;
    const reading *ordering;
    long begin_lpos; /* File offset for start of BEGIN line */
    int begin_lineno; /* 0 means no block started in this file */
@@ -376,8 +417,8 @@ typedef struct Settings {
    real declination;
    double min_declination, max_declination;
    int min_declination_days, max_declination_days;
-   const char* dec_filename;
-   int dec_line;
+   /* Location of the `*declination auto ...` line. */
+   srcloc dec_loc;
    /* Copy of the text of the `*declination auto ...` line (malloced). */
    char* dec_context;
    /* Grid convergence in radians. */
@@ -399,7 +440,6 @@ extern node *fixedlist;
 extern node *stnlist;
 extern unsigned long optimize;
 extern char * proj_str_out;
-extern PJ * pj_cached;
 
 extern string survey_title;
 
@@ -413,6 +453,24 @@ extern prefix *pfxHi[9], *pfxLo[9];
 extern bool fQuiet; /* just show brief summary + errors */
 extern bool fMute; /* just show errors */
 extern bool fSuppress; /* only output 3d file */
+extern int n_threads; /* number of threads to use for solving */
+extern real iterate_tolerance; /* residual to stop iterative solving at */
+extern bool f_station_errors; /* calculate station position errors */
+extern bool f_no_covariances; /* ignore covariances between leg components */
+extern bool f_internal_stats; /* report cache hit counts, etc */
+extern bool f_watch; /* reprocess when input files change */
+
+/* Note an input file so cavern --watch can reprocess when it changes. */
+#ifdef HAVE_FORK
+void watch_file(const char *fnm);
+/* Pass on a solved system so cavern --watch can reuse it next time. */
+void watch_solution(const void *data, size_t len);
+/* Stop reporting to cavern --watch (in a child process). */
+void watch_stop(void);
+#else
+# define watch_file(FNM) (void)0
+# define watch_solution(DATA, LEN) (void)0
+#endif
 
 /* macros */
 
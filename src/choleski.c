@@ -0,0 +1,331 @@
+/* choleski.c
+ * Dense symmetric positive definite matrix solving routines
+ * Copyright (C) 1993-2003,2010,2013,2024,2026 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <config.h>
+
+#include "debug.h"
+#include "cavern.h"
+#include "choleski.h"
+
+/* Solve MX=B for X by first factoring M into LDL'.  This is a modified form
+ * of Choleski factorisation - the original Choleski factorisation is LL',
+ * but this modified version has the advantage of avoiding O(n) square root
+ * calculations.
+ */
+/* Note M must be symmetric positive definite */
+/* routine is entitled to scribble on M and B if it wishes */
+void
+choleski(real *M, real *B, long n)
+{
+   for (int j = 1; j < n; j++) {
+      real V;
+      for (int i = 0; i < j; i++) {
+	 V = (real)0.0;
+	 for (int k = 0; k < i; k++) V += M(i,k) * M(j,k) * M(k,k);
+	 M(j,i) = (M(j,i) - V) / M(i,i);
+      }
+      V = (real)0.0;
+      for (int k = 0; k < j; k++) V += M(j,k) * M(j,k) * M(k,k);
+      M(j,j) -= V; /* may be best to add M() last for numerical reasons too */
+   }
+
+   /* Multiply x by L inverse */
+   for (int i = 0; i < n - 1; i++) {
+      for (int j = i + 1; j < n; j++) {
+	 B[j] -= M(j,i) * B[i];
+      }
+   }
+
+   /* Multiply x by D inverse */
+   for (int i = 0; i < n; i++) {
+      B[i] /= M(i,i);
+   }
+
+   /* Multiply x by (L transpose) inverse */
+   for (int i = (int)(n - 1); i > 0; i--) {
+      for (int j = i - 1; j >= 0; j--) {
+	 B[j] -= M(i,j) * B[i];
+      }
+   }
+
+   /* printf("\n%ld/%ld\n\n",flops,flopsTot); */
+}
+
+/* The blocked version works with 3x3 blocks, each padded to 3 rows of 4 so
+ * that a row of a block fits exactly in a SIMD register (or two on
+ * platforms with 128-bit vectors) and every block is suitably aligned.
+ */
+#define BLK_W 4
+#define BLK_SIZE (3 * BLK_W)
+
+/* Index of block (I, J) in a packed lower triangle of blocks (J <= I). */
+#define BLK(I, J) (((((OSSIZE_T)(I)) * ((I) + 1)) >> 1) + (J))
+
+#ifdef __GNUC__
+/* Use GCC's vector extensions (also supported by clang), which the compiler
+ * maps to whatever SIMD instructions are available - e.g. AVX on x86-64
+ * or NEON on aarch64.
+ */
+typedef real vec4 __attribute__((vector_size(BLK_W * sizeof(real))));
+#endif
+
+/* Runtime dispatch: on x86-64 with glibc we build an AVX2 version of
+ * choleski_blocked() alongside a baseline version, and the dynamic linker
+ * picks the best one for the CPU it's running on.
+ */
+#if defined __x86_64__ && defined __GLIBC__ && defined __has_attribute
+# if __has_attribute(target_clones)
+#  define SIMD_CLONES __attribute__((target_clones("avx2", "default")))
+#  define SIMD_CLONES_AVX2
+# endif
+#endif
+#ifndef SIMD_CLONES
+# define SIMD_CLONES
+#endif
+
+/* C -= sum(A[k] * B[k], k = 0 .. count - 1) where A[k] and B[k] are the
+ * blocks at A + k * BLK_SIZE and B + k * BLK_SIZE.
+ */
+static inline void
+block_dot_sub(real *C, const real *A, const real *B, long count)
+{
+#ifdef __GNUC__
+   vec4 c0 = *(vec4 *)C;
+   vec4 c1 = *(vec4 *)(C + BLK_W);
+   vec4 c2 = *(vec4 *)(C + 2 * BLK_W);
+   for (long k = 0; k < count; k++) {
+      const vec4 *b = (const vec4 *)B;
+      c0 -= A[0] * b[0] + A[1] * b[1] + A[2] * b[2];
+      c1 -= A[4] * b[0] + A[5] * b[1] + A[6] * b[2];
+      c2 -= A[8] * b[0] + A[9] * b[1] + A[10] * b[2];
+      A += BLK_SIZE;
+      B += BLK_SIZE;
+   }
+   *(vec4 *)C = c0;
+   *(vec4 *)(C + BLK_W) = c1;
+   *(vec4 *)(C + 2 * BLK_W) = c2;
+#else
+   for (long k = 0; k < count; k++) {
+      for (int r = 0; r < 3; r++) {
+	 for (int c = 0; c < 3; c++) {
+	    C[r * BLK_W + c] -= A[r * BLK_W] * B[c] +
+				A[r * BLK_W + 1] * B[BLK_W + c] +
+				A[r * BLK_W + 2] * B[2 * BLK_W + c];
+	 }
+      }
+      A += BLK_SIZE;
+      B += BLK_SIZE;
+   }
+#endif
+}
+
+/* Invert the 3x3 symmetric positive definite block D into Dinv. */
+static void
+invert_block(real *Dinv, const real *D)
+{
+   real a = D[0], b = D[1], c = D[2];
+   real d = D[BLK_W + 1], e = D[BLK_W + 2];
+   real f = D[2 * BLK_W + 2];
+   real ce_bf = c * e - b * f;
+   real be_cd = b * e - c * d;
+   real df_ee = d * f - e * e;
+   real det = a * df_ee + b * ce_bf + c * be_cd;
+   SVX_ASSERT(det != 0.0);
+   real r = 1.0 / det;
+   Dinv[0] = df_ee * r;
+   Dinv[1] = Dinv[BLK_W] = ce_bf * r;
+   Dinv[2] = Dinv[2 * BLK_W] = be_cd * r;
+   Dinv[BLK_W + 1] = (a * f - c * c) * r;
+   Dinv[BLK_W + 2] = Dinv[2 * BLK_W + 1] = (b * c - a * e) * r;
+   Dinv[2 * BLK_W + 2] = (a * d - b * b) * r;
+}
+
+/* Tiles are TILE by TILE blocks.  The factorisation works on a column of
+ * tiles at a time, and the update from each earlier column of tiles only
+ * touches two tiles of L and U at once (about 48KB with double precision),
+ * so these stay in cache however big the whole matrix is.
+ */
+#define TILE 16
+
+/* Finish block (I,J) of the factorisation, which is in X (stored in L) and
+ * has had all the updates applied, so X = X(I,J) below.
+ */
+static inline void
+finish_block(real *L, real *U, real *Dinv, real *tmp, long I, long J)
+{
+   real *X = L + BLK(I, J) * BLK_SIZE;
+   if (J == I) {
+      invert_block(Dinv + I * BLK_SIZE, X);
+      return;
+   }
+   real *Ut = U + BLK(I, J) * BLK_SIZE;
+   for (int r = 0; r < 3; r++) {
+      for (int c = 0; c < 3; c++) Ut[c * BLK_W + r] = X[r * BLK_W + c];
+      Ut[r * BLK_W + 3] = (real)0.0;
+   }
+   // L(I,J) = X(I,J) D(J)^-1.
+   const real *Di = Dinv + J * BLK_SIZE;
+   for (int r = 0; r < 3; r++) {
+      for (int c = 0; c < 3; c++) {
+	 tmp[r * BLK_W + c] = X[r * BLK_W] * Di[c] +
+			      X[r * BLK_W + 1] * Di[BLK_W + c] +
+			      X[r * BLK_W + 2] * Di[2 * BLK_W + c];
+      }
+   }
+   for (int r = 0; r < 3; r++) {
+      for (int c = 0; c < 3; c++) X[r * BLK_W + c] = tmp[r * BLK_W + c];
+   }
+}
+
+/* Solve MX=B for X by factoring M into LDL' where L is unit lower
+ * triangular in 3x3 blocks and D is block diagonal.
+ *
+ * If X = L D then for J < I:
+ *
+ *   X(I,J) = M(I,J) - sum(L(I,k) X(J,k)', k < J)
+ *   L(I,J) = X(I,J) D(J)^-1
+ *   D(I) = M(I,I) - sum(L(I,k) X(I,k)', k < I)
+ *
+ * We store the transpose U = X' alongside L, so both the operands of the
+ * inner sums are contiguous rows in memory and block_dot_sub() can stream
+ * through them.
+ *
+ * The sums are split up by tiles of TILE by TILE blocks: for each column of
+ * tiles we first subtract the contributions from each earlier column of
+ * tiles in turn, then factorise the blocks in the column, working down from
+ * the diagonal tile.  Each sum is still accumulated in order of k, so the
+ * result is exactly the same as without tiling.
+ */
+/* Note M must be symmetric positive definite */
+/* routine is entitled to scribble on M and B if it wishes */
+SIMD_CLONES
+void
+choleski_blocked(real *M, real *B, long n)
+{
+   SVX_ASSERT(n % 3 == 0);
+   long nb = n / 3;
+   OSSIZE_T n_blocks = BLK(nb, 0);
+   // Allocate L, U, Dinv (nb blocks) and one block of workspace, aligned
+   // to the size of a block row so vector loads are aligned.
+   char *mem = osmalloc(((2 * n_blocks + nb + 1) * BLK_SIZE) * ossizeof(real) +
+			BLK_W * ossizeof(real));
+   real *L = (real *)(mem + (-(OSSIZE_T)mem & (BLK_W * sizeof(real) - 1)));
+   real *U = L + n_blocks * BLK_SIZE;
+   real *Dinv = U + n_blocks * BLK_SIZE;
+   real *tmp = Dinv + nb * BLK_SIZE;
+
+   // Copy M into X (stored in L for now), zeroing the padding.
+   for (long I = 0; I < nb; I++) {
+      for (long J = 0; J <= I; J++) {
+	 real *X = L + BLK(I, J) * BLK_SIZE;
+	 for (int r = 0; r < 3; r++) {
+	    for (int c = 0; c < 3; c++) {
+	       long row = I * 3 + r, col = J * 3 + c;
+	       X[r * BLK_W + c] = (col <= row) ? M(row, col) : M(col, row);
+	    }
+	    X[r * BLK_W + 3] = (real)0.0;
+	 }
+      }
+   }
+
+   for (long J0 = 0; J0 < nb; J0 += TILE) {
+      long J1 = (J0 + TILE < nb) ? J0 + TILE : nb;
+      for (long I0 = J0; I0 < nb; I0 += TILE) {
+	 long I1 = (I0 + TILE < nb) ? I0 + TILE : nb;
+	 // Subtract the contributions from each earlier column of tiles.
+	 for (long K0 = 0; K0 < J0; K0 += TILE) {
+	    for (long I = I0; I < I1; I++) {
+	       const real *l = L + BLK(I, K0) * BLK_SIZE;
+	       long J_end = (I < J1) ? I + 1 : J1;
+	       for (long J = J0; J < J_end; J++) {
+		  block_dot_sub(L + BLK(I, J) * BLK_SIZE,
+				l, U + BLK(J, K0) * BLK_SIZE, TILE);
+	       }
+	    }
+	 }
+	 // Then the contributions from within this column of tiles, which
+	 // we have to interleave with finishing off each block.
+	 for (long J = J0; J < J1; J++) {
+	    for (long I = (I0 > J ? I0 : J); I < I1; I++) {
+	       block_dot_sub(L + BLK(I, J) * BLK_SIZE,
+			     L + BLK(I, J0) * BLK_SIZE,
+			     U + BLK(J, J0) * BLK_SIZE, J - J0);
+	       finish_block(L, U, Dinv, tmp, I, J);
+	    }
+	 }
+      }
+   }
+
+   /* Multiply x by L inverse */
+   for (long I = 1; I < nb; I++) {
+      for (long J = 0; J < I; J++) {
+	 const real *l = L + BLK(I, J) * BLK_SIZE;
+	 for (int r = 0; r < 3; r++) {
+	    B[I * 3 + r] -= l[r * BLK_W] * B[J * 3] +
+			    l[r * BLK_W + 1] * B[J * 3 + 1] +
+			    l[r * BLK_W + 2] * B[J * 3 + 2];
+	 }
+      }
+   }
+
+   /* Multiply x by D inverse */
+   for (long I = 0; I < nb; I++) {
+      const real *Di = Dinv + I * BLK_SIZE;
+      real x0 = B[I * 3], x1 = B[I * 3 + 1], x2 = B[I * 3 + 2];
+      for (int r = 0; r < 3; r++) {
+	 B[I * 3 + r] = Di[r * BLK_W] * x0 + Di[r * BLK_W + 1] * x1 +
+			Di[r * BLK_W + 2] * x2;
+      }
+   }
+
+   /* Multiply x by (L transpose) inverse */
+   for (long I = nb - 1; I > 0; I--) {
+      for (long J = I - 1; J >= 0; J--) {
+	 const real *l = L + BLK(I, J) * BLK_SIZE;
+	 for (int c = 0; c < 3; c++) {
+	    B[J * 3 + c] -= l[c] * B[I * 3] +
+			    l[BLK_W + c] * B[I * 3 + 1] +
+			    l[2 * BLK_W + c] * B[I * 3 + 2];
+	 }
+      }
+   }
+
+   osfree(mem);
+}
+
+const char *
+choleski_blocked_simd(void)
+{
+#ifdef SIMD_CLONES_AVX2
+   if (__builtin_cpu_supports("avx2")) return "AVX2";
+#endif
+#if !defined __GNUC__
+   return "scalar code";
+#elif defined __AVX2__
+   return "AVX2";
+#elif defined __AVX__
+   return "AVX";
+#elif defined __SSE2__
+   return "SSE2";
+#elif defined __ARM_NEON
+   return "NEON";
+#else
+   return "GCC vector extensions";
+#endif
+}
@@ -0,0 +1,36 @@
+/* choleski.h
+ * Dense symmetric positive definite matrix solving routines
+ * Copyright (C) 1993-2003,2010,2013,2024,2026 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* The matrices are stored as a packed lower triangle - for M(row, col) col
+ * must be <= row, so Y <= X.
+ */
+#define M(X, Y) ((real *)M)[((((OSSIZE_T)(X)) * ((X) + 1)) >> 1) + (Y)]
+
+/* Solve MX=B for X, overwriting B with X.  M is n by n, and is also
+ * overwritten.
+ */
+void choleski(real *M, real *B, long n);
+
+/* Equivalent to choleski() but works in 3x3 blocks using SIMD where
+ * available.  n must be a multiple of 3.
+ */
+void choleski_blocked(real *M, real *B, long n);
+
+/* Return a description of the SIMD instructions choleski_blocked() uses. */
+const char *choleski_blocked_simd(void);
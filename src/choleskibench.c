@@ -0,0 +1,185 @@
+/* choleskibench.c
+ * Microbenchmark for the dense matrix solving routines
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Built by "make check" - use "make choleskibench" to build it on its own.
+ *
+ * Usage: choleskibench [BLOCKS...]
+ *        choleskibench --check
+ *
+ * For each size (in 3x3 blocks, like a matrix for BLOCKS stations with
+ * covariances) this times choleski() and choleski_blocked() on the same
+ * random symmetric positive definite matrix and reports the largest
+ * difference between the solutions.
+ *
+ * With --check, nothing is timed - instead the two routines are compared for
+ * a range of sizes around the tile size used by choleski_blocked(), and the
+ * exit status is non-zero if they disagree.  The test suite runs this so
+ * that whichever SIMD code choleski_blocked() uses on the platform gets
+ * tested.
+ */
+
+#include <config.h>
+
+#include <time.h>
+
+#include "debug.h"
+#include "cavern.h"
+#include "choleski.h"
+
+typedef void (*solver)(real *M, real *B, long n);
+
+/* Simple deterministic pseudo-random number in [-1, 1). */
+static real
+rnd(void)
+{
+   static unsigned long state = 1;
+   state = (state * 1103515245ul + 12345ul) & 0x7fffffff;
+   return (real)state / (real)0x40000000 - 1.0;
+}
+
+/* Fill in a random symmetric positive definite n by n matrix M and vector B.
+ */
+static void
+random_system(real *M, real *B, long n)
+{
+   // Make a diagonally dominant symmetric matrix, which is therefore
+   // positive definite.
+   for (long i = 0; i < n; i++) {
+      real sum = 0.0;
+      for (long j = 0; j < i; j++) {
+	 M(i, j) = rnd();
+	 sum += fabs(M(i, j));
+      }
+      M(i, i) = sum + 1.0;
+      B[i] = rnd() * 100.0;
+   }
+   for (long i = 0; i < n; i++) {
+      for (long j = i + 1; j < n; j++) M(j, j) += fabs(M(j, i));
+   }
+}
+
+/* Solve a random system with nb blocks using both routines, and check the
+ * solutions agree to within rounding error.
+ */
+static bool
+check_size(long nb)
+{
+   long n = nb * 3;
+   OSSIZE_T m_size = (((OSSIZE_T)n * (n + 1)) >> 1);
+   real *M1 = osmalloc(m_size * ossizeof(real));
+   real *M2 = osmalloc(m_size * ossizeof(real));
+   real *X1 = osmalloc(n * ossizeof(real));
+   real *X2 = osmalloc(n * ossizeof(real));
+   random_system(M1, X1, n);
+   memcpy(M2, M1, m_size * sizeof(real));
+   memcpy(X2, X1, n * sizeof(real));
+   choleski(M1, X1, n);
+   choleski_blocked(M2, X2, n);
+   bool ok = true;
+   for (long i = 0; i < n; i++) {
+      if (!(fabs(X1[i] - X2[i]) <= 1e-9 * (1.0 + fabs(X1[i])))) {
+	 printf("%ld blocks: element %ld is %.15g not %.15g\n",
+		nb, i, X2[i], X1[i]);
+	 ok = false;
+	 break;
+      }
+   }
+   osfree(X2);
+   osfree(X1);
+   osfree(M2);
+   osfree(M1);
+   return ok;
+}
+
+/* Time calls to fn, returning the average time per call in seconds. */
+static double
+time_solver(solver fn, const real *M0, const real *B0, real *X, long n)
+{
+   OSSIZE_T m_size = (((OSSIZE_T)n * (n + 1)) >> 1);
+   real *M = osmalloc(m_size * ossizeof(real));
+   long reps = 0;
+   clock_t start = clock(), elapsed;
+   do {
+      memcpy(M, M0, m_size * sizeof(real));
+      memcpy(X, B0, n * sizeof(real));
+      fn(M, X, n);
+      ++reps;
+      elapsed = clock() - start;
+   } while (elapsed < CLOCKS_PER_SEC / 4);
+   osfree(M);
+   return (double)elapsed / CLOCKS_PER_SEC / reps;
+}
+
+int
+main(int argc, char **argv)
+{
+   static const long default_sizes[] = { 2, 4, 8, 15, 30, 60, 120, 250 };
+   long n_sizes = argc > 1 ? argc - 1 : (long)(sizeof(default_sizes) / sizeof(default_sizes[0]));
+
+   msg_init(argv);
+
+   if (argc == 2 && strcmp(argv[1], "--check") == 0) {
+      // Cover a single block, partial tiles, exact multiples of the tile
+      // size and several columns of tiles.
+      static const long check_sizes[] = {
+	 1, 2, 3, 7, 15, 16, 17, 31, 32, 33, 47, 48, 49, 64, 100
+      };
+      bool ok = true;
+      for (size_t s = 0; s < sizeof(check_sizes) / sizeof(check_sizes[0]); s++) {
+	 if (!check_size(check_sizes[s])) ok = false;
+      }
+      printf("choleski_blocked() using %s: %s\n",
+	     choleski_blocked_simd(), ok ? "OK" : "FAILED");
+      return ok ? 0 : 1;
+   }
+
+   printf("choleski_blocked() using %s\n", choleski_blocked_simd());
+   printf("%8s %14s %14s %8s %10s\n",
+	  "blocks", "choleski", "blocked", "speedup", "max diff");
+   for (long s = 0; s < n_sizes; s++) {
+      long nb = argc > 1 ? atol(argv[s + 1]) : default_sizes[s];
+      if (nb <= 0) {
+	 fprintf(stderr, "Bad size '%s'\n", argv[s + 1]);
+	 return 1;
+      }
+      long n = nb * 3;
+      real *M = osmalloc((((OSSIZE_T)n * (n + 1)) >> 1) * ossizeof(real));
+      real *B = osmalloc(n * ossizeof(real));
+      real *X1 = osmalloc(n * ossizeof(real));
+      real *X2 = osmalloc(n * ossizeof(real));
+
+      random_system(M, B, n);
+
+      double t1 = time_solver(choleski, M, B, X1, n);
+      double t2 = time_solver(choleski_blocked, M, B, X2, n);
+      real max_diff = 0.0;
+      for (long i = 0; i < n; i++) {
+	 real d = fabs(X1[i] - X2[i]);
+	 if (d > max_diff) max_diff = d;
+      }
+      printf("%8ld %12.3fus %12.3fus %7.2fx %10.3g\n",
+	     nb, t1 * 1e6, t2 * 1e6, t1 / t2, max_diff);
+
+      osfree(X2);
+      osfree(X1);
+      osfree(B);
+      osfree(M);
+   }
+   return 0;
+}
@@ -1,6 +1,6 @@
 /* commands.c
  * Code for directives
- * Copyright (C) 1991-2025 Olly Betts
+ * Copyright (C) 1991-2025,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -38,6 +38,8 @@
 #include "netbits.h"
 #include "netskel.h"
 #include "out.h"
+#include "parsecache.h"
+#include "pool.h"
 #include "readval.h"
 #include "str.h"
 
@@ -47,10 +49,9 @@ move_to_fixedlist(node *stn, int ignore_dirn)
     remove_stn_from_list(&stnlist, stn);
     add_stn_to_list(&fixedlist, stn);
     pos *p = stn->name->pos;
-    for (int d = 0; d < 3; d++) {
+    for (int d = 0; stn->leg[d]; d++) {
 	if (d == ignore_dirn) continue;
 	linkfor *leg = stn->leg[d];
-	if (!leg) break;
 	node *to = leg->l.to;
 	if (to->name->pos == p) {
 	    move_to_fixedlist(to, reverse_leg_dirn(leg));
@@ -85,8 +86,7 @@ int fix_station(prefix *fix_name, const double* coords) {
     }
 
     // Make the station's file:line location reflect where it was fixed.
-    fix_name->filename = file.filename;
-    fix_name->line = file.line;
+    fix_name->loc = srcloc_make(file.filename, file.line);
     return 0;
 }
 
@@ -103,10 +103,11 @@ void fix_station_with_variance(prefix *fix_name, const double* coords,
 
     node *stn = StnFromPfx(fix_name);
     if (!fixed(stn)) {
-	node *fixpt = osnew(node);
+	node *fixpt = pool_new(node);
 	prefix *name;
-	name = osnew(prefix);
-	name->pos = osnew(pos);
+	name = pool_new(prefix);
+	name->pos = pool_new(pos);
+	name->pos->var = NULL;
 	name->ident.p = NULL;
 	fixpt->name = name;
 	name->stn = fixpt;
@@ -122,7 +123,7 @@ void fix_station_with_variance(prefix *fix_name, const double* coords,
 	POS(fixpt, 0) = coords[0];
 	POS(fixpt, 1) = coords[1];
 	POS(fixpt, 2) = coords[2];
-	fixpt->leg[0] = fixpt->leg[1] = fixpt->leg[2] = NULL;
+	init_legs(fixpt);
 	addfakeleg(fixpt, stn, 0, 0, 0,
 		   var_x, var_y, var_z
 #ifndef NO_COVARIANCES
@@ -132,9 +133,50 @@ void fix_station_with_variance(prefix *fix_name, const double* coords,
     }
 }
 
+/* Make *p (one of the Q_MAC entry arrays in settings) safe to modify by
+ * allocating a private copy if it's currently shared with parent scope
+ * array parent_array (or allocating a zero-filled array if it's NULL).
+ */
+static void
+copy_on_write_quantities(real **p, const real *parent_array)
+{
+   if (*p == NULL || *p == parent_array) {
+      real *new_array = osmalloc(ossizeof(real) * Q_MAC);
+      if (*p) {
+	 memcpy(new_array, *p, sizeof(real) * Q_MAC);
+      } else {
+	 /* Not every quantity gets a default (e.g. default_grade() doesn't
+	  * set Var[Q_DEFAULT]), and the parse cache hashes the whole array
+	  * so it mustn't contain junk. */
+	 for (int q = 0; q < Q_MAC; q++) new_array[q] = (real)0.0;
+      }
+      *p = new_array;
+   }
+}
+
+void
+copy_on_write_grade(settings *s)
+{
+   copy_on_write_quantities(&s->Var, s->next ? s->next->Var : NULL);
+}
+
+void
+copy_on_write_calib(settings *s)
+{
+   copy_on_write_quantities(&s->z, s->next ? s->next->z : NULL);
+   copy_on_write_quantities(&s->sc, s->next ? s->next->sc : NULL);
+}
+
+void
+copy_on_write_units(settings *s)
+{
+   copy_on_write_quantities(&s->units, s->next ? s->next->units : NULL);
+}
+
 static void
 default_grade(settings *s)
 {
+   copy_on_write_grade(s);
    /* Values correspond to those in bcra5.svx */
    s->Var[Q_POS] = (real)sqrd(0.05);
    s->Var[Q_LENGTH] = (real)sqrd(0.05);
@@ -164,13 +206,11 @@ default_case(settings *s)
    s->Case = LOWER;
 }
 
-static reading default_order[] = { Fr, To, Tape, Comp, Clino, End };
-
 static void
 default_style(settings *s)
 {
    s->recorded_style = s->style = STYLE_NORMAL;
-   s->ordering = default_order;
+   s->ordering = default_data_order;
    s->dash_for_anon_wall_station = false;
 }
 
@@ -210,20 +250,54 @@ init_default_translate_map(short * t)
 #endif
 }
 
-static void
-default_translate(settings *s)
+/* The generation of the most recently created or changed translation
+ * table. */
+static unsigned long last_translate_generation = 0;
+
+short *
+new_translate_table(void)
 {
+   translate_table *p = osnew(translate_table);
+   p->generation = ++last_translate_generation;
+   return p->t + 1;
+}
+
+void
+free_translate_table(const short *t)
+{
+   if (t) osfree((char*)(t - 1) - offsetof(translate_table, t));
+}
+
+void
+set_translate(settings *s, int c, short value)
+{
+   translate_table *p;
+   if (s->Translate[c] == value) return;
    if (s->next && s->next->Translate == s->Translate) {
-      /* We're currently using the same character translation map as our parent
-       * scope so allocate a new one before we modify it.
-       */
-      s->Translate = ((short*)osmalloc(ossizeof(short) * 257)) + 1;
-   } else {
-/*  SVX_ASSERT(EOF==-1);*/ /* important, since we rely on this */
+      /* We're currently using the same character translation map as our
+       * parent scope so allocate a new one before we modify it. */
+      short *t = new_translate_table();
+      memcpy(t - 1, s->Translate - 1, sizeof(short) * 257);
+      s->Translate = t;
    }
-   s->Translate[EOF] = SPECIAL_EOL;
-   memset(s->Translate, 0, sizeof(short) * 256);
-   init_default_translate_map(s->Translate);
+   p = (translate_table*)((char*)(s->Translate - 1) -
+			  offsetof(translate_table, t));
+   p->t[c + 1] = value;
+   p->generation = ++last_translate_generation;
+}
+
+static void
+default_translate(settings *s)
+{
+/* SVX_ASSERT(EOF==-1);*/ /* important, since we rely on this */
+   short *t = new_translate_table();
+   t[EOF] = SPECIAL_EOL;
+   memset(t, 0, sizeof(short) * 256);
+   init_default_translate_map(t);
+   /* Free the old table unless it's the parent scope's. */
+   if (!s->next || s->next->Translate != s->Translate)
+      free_translate_table(s->Translate);
+   s->Translate = t;
 }
 
 /* Flag anything used in SPECIAL_* cumulatively to help us pick a suitable
@@ -238,6 +312,7 @@ scan_compass_station_name(prefix *stn)
      * separator_map via cmd_set() plus adding the defaults in
      * find_output_separator().
      */
+    parse_cache_scan(stn);
     for (const char *p = prefix_ident(stn); *p; ++p) {
 	separator_map[(unsigned char)*p] |= SPECIAL_NAMES;
     }
@@ -292,6 +367,7 @@ void
 default_units(settings *s)
 {
    int quantity;
+   copy_on_write_units(s);
    for (quantity = 0; quantity < Q_MAC; quantity++) {
       if (TSTBIT(ANG_QMASK, quantity))
 	 s->units[quantity] = (real)(M_PI / 180.0); /* degrees */
@@ -306,6 +382,7 @@ void
 default_calib(settings *s)
 {
    int quantity;
+   copy_on_write_calib(s);
    for (quantity = 0; quantity < Q_MAC; quantity++) {
       s->z[quantity] = (real)0.0;
       s->sc[quantity] = (real)1.0;
@@ -670,6 +747,9 @@ cmd_set(void)
    };
    int i;
 
+   /* This can change the output separator, which the parse cache doesn't
+    * track. */
+   parse_cache_abandon();
    get_token();
    int mask = match_tok(chartab, TABSIZE(chartab));
 
@@ -698,20 +778,11 @@ cmd_set(void)
    }
 #endif
 
-   /* if we're currently using an inherited translation table, allocate a new
-    * table, and copy old one into it */
-   if (pcs->next && pcs->next->Translate == pcs->Translate) {
-      short *p;
-      p = ((short*)osmalloc(ossizeof(short) * 257)) + 1;
-      memcpy(p - 1, pcs->Translate - 1, sizeof(short) * 257);
-      pcs->Translate = p;
-   }
-
    skipblanks();
 
    /* clear this flag for all non-alphanums */
    for (i = 0; i < 256; i++)
-      if (!isalnum(i)) pcs->Translate[i] &= ~mask;
+      if (!isalnum(i)) set_translate(pcs, i, pcs->Translate[i] & ~mask);
 
    /* now set this flag for all specified chars */
    while (!isEol(ch)) {
@@ -738,7 +809,7 @@ cmd_set(void)
       } else {
 	 break;
       }
-      pcs->Translate[char_to_set] |= mask;
+      set_translate(pcs, char_to_set, pcs->Translate[char_to_set] | mask);
       separator_map[char_to_set] |= mask;
       nextch();
    }
@@ -761,6 +832,8 @@ check_reentry(prefix *survey, const filepos* fpos_ptr)
       static int reenter_depr_count = 0;
       filepos fp_tmp;
 
+      parse_cache_abandon();
+
       if (reenter_depr_count >= 5)
 	 return;
 
@@ -813,8 +886,7 @@ check_reentry(prefix *survey, const filepos* fpos_ptr)
       }
    } else {
       survey->sflags |= BIT(SFLAGS_PREFIX_ENTERED);
-      survey->filename = file.filename;
-      survey->line = file.line;
+      survey->loc = srcloc_make(file.filename, file.line);
    }
 }
 
@@ -825,6 +897,7 @@ cmd_prefix(void)
    static int prefix_depr_count = 0;
    prefix *survey;
    filepos fp;
+   parse_cache_abandon();
    /* Issue warning first, so "*prefix \" warns first that *prefix is
     * deprecated and then that ROOT is...
     */
@@ -897,14 +970,101 @@ cmd_begin(void)
    }
 }
 
-void
-invalidate_pj_cached(void)
+/* Cache of PROJ transformations between pairs of coordinate systems.
+ * Creating a transformation can take milliseconds, and the same few pairs
+ * tend to be used over and over.
+ */
+typedef struct pj_cache_entry {
+    struct pj_cache_entry *next;
+    char *proj_from;
+    char *proj_to;
+    PJ *transform;
+} pj_cache_entry;
+
+/* Maximum number of transformations to keep. */
+#define PJ_CACHE_SIZE 16
+
+/* The cached transformations, most recently used first. */
+static pj_cache_entry *pj_cache = NULL;
+static int pj_cache_count = 0;
+
+static unsigned long pj_cache_hits = 0, pj_cache_misses = 0;
+
+static void
+free_pj_cache(void)
 {
-    /* Invalidate the cached PJ. */
-    if (pj_cached) {
-	proj_destroy(pj_cached);
-	pj_cached = NULL;
+    while (pj_cache) {
+	pj_cache_entry *e = pj_cache;
+	pj_cache = e->next;
+	proj_destroy(e->transform);
+	osfree(e->proj_from);
+	osfree(e->proj_to);
+	osfree(e);
     }
+    pj_cache_count = 0;
+}
+
+PJ *
+get_pj_transform(const char *proj_from, const char *proj_to)
+{
+    pj_cache_entry **p = &pj_cache;
+    while (*p) {
+	pj_cache_entry *e = *p;
+	if (strcmp(e->proj_from, proj_from) == 0 &&
+	    strcmp(e->proj_to, proj_to) == 0) {
+	    /* Move to the front. */
+	    *p = e->next;
+	    e->next = pj_cache;
+	    pj_cache = e;
+	    ++pj_cache_hits;
+	    return e->transform;
+	}
+	if (!e->next && pj_cache_count == PJ_CACHE_SIZE) {
+	    /* Discard the least recently used entry to make room. */
+	    *p = NULL;
+	    --pj_cache_count;
+	    proj_destroy(e->transform);
+	    osfree(e->proj_from);
+	    osfree(e->proj_to);
+	    osfree(e);
+	    break;
+	}
+	p = &e->next;
+    }
+    ++pj_cache_misses;
+
+    PJ *transform = proj_create_crs_to_crs(PJ_DEFAULT_CTX,
+					   proj_from, proj_to, NULL);
+    if (transform) {
+	/* Normalise the output order so x is longitude and y latitude - by
+	 * default new PROJ has them switched for EPSG:4326 which just seems
+	 * confusing.
+	 */
+	PJ* pj_norm = proj_normalize_for_visualization(PJ_DEFAULT_CTX,
+						       transform);
+	proj_destroy(transform);
+	transform = pj_norm;
+    }
+
+    if (pj_cache_misses == 1) {
+	/* First entry, so arrange to free the cache on exit. */
+	atexit(free_pj_cache);
+    }
+    pj_cache_entry *e = osnew(pj_cache_entry);
+    e->proj_from = osstrdup(proj_from);
+    e->proj_to = osstrdup(proj_to);
+    e->transform = transform;
+    e->next = pj_cache;
+    pj_cache = e;
+    ++pj_cache_count;
+    return transform;
+}
+
+void
+print_pj_cache_stats(void)
+{
+    printf("PROJ transformation cache: %lu hits, %lu misses\n",
+	   pj_cache_hits, pj_cache_misses);
 }
 
 void
@@ -932,7 +1092,9 @@ report_declination(settings *p)
 	 * The first %s will be replaced by the declination range (or single
 	 * value), and %.1f%s by the grid convergence angle.
 	 */
-	compile_diagnostic_at(DIAG_INFO, p->dec_filename, p->dec_line,
+	compile_diagnostic_at(DIAG_INFO,
+			      srcloc_filename(p->dec_loc),
+			      srcloc_line(p->dec_loc),
 			      /*Declination: %s, grid convergence: %.1f%s*/484,
 			      range,
 			      deg(p->convergence), deg_sign);
@@ -950,21 +1112,9 @@ report_declination(settings *p)
 void
 set_declination_location(real x, real y, real z, const char *proj_str)
 {
+    parse_cache_abandon();
     /* Convert to WGS84 lat long. */
-    PJ *transform = proj_create_crs_to_crs(PJ_DEFAULT_CTX,
-					   proj_str,
-					   WGS84_DATUM_STRING,
-					   NULL);
-    if (transform) {
-	/* Normalise the output order so x is longitude and y latitude - by
-	 * default new PROJ has them switched for EPSG:4326 which just seems
-	 * confusing.
-	 */
-	PJ* pj_norm = proj_normalize_for_visualization(PJ_DEFAULT_CTX,
-						       transform);
-	proj_destroy(transform);
-	transform = pj_norm;
-    }
+    PJ *transform = get_pj_transform(proj_str, WGS84_DATUM_STRING);
 
     if (proj_angular_input(transform, PJ_FWD)) {
 	/* Input coordinate system expects radians. */
@@ -985,18 +1135,17 @@ set_declination_location(real x, real y, real z, const char *proj_str)
        /* Set dummy values which are finite. */
        x = y = z = 0;
     }
-    proj_destroy(transform);
 
     report_declination(pcs);
 
     double lon = rad(x);
     double lat = rad(y);
+    copy_on_write_calib(pcs);
     pcs->z[Q_DECLINATION] = HUGE_REAL;
     pcs->dec_lat = lat;
     pcs->dec_lon = lon;
     pcs->dec_alt = z;
-    pcs->dec_filename = file.filename;
-    pcs->dec_line = file.line;
+    pcs->dec_loc = srcloc_make(file.filename, file.line);
     pcs->dec_context = grab_line();
     /* Invalidate cached declination. */
     pcs->declination = HUGE_REAL;
@@ -1026,21 +1175,23 @@ pop_settings(void)
     }
 
     if (p->proj_str != pcs->proj_str) {
-	if (!p->proj_str || !pcs->proj_str ||
-	    strcmp(p->proj_str, pcs->proj_str) != 0) {
-	    invalidate_pj_cached();
-	}
 	/* free proj_str if not used by parent */
 	osfree(p->proj_str);
     }
 
-    /* don't free default ordering or ordering used by parent */
-    if (p->ordering != default_order && p->ordering != pcs->ordering)
+    /* don't free a static common ordering or ordering used by parent */
+    if (!is_common_data_order(p->ordering) && p->ordering != pcs->ordering)
 	osfree((reading*)p->ordering);
 
     /* free Translate if not used by parent */
     if (p->Translate != pcs->Translate)
-	osfree(p->Translate - 1);
+	free_translate_table(p->Translate);
+
+    /* free per-quantity arrays if not used by parent */
+    if (p->Var != pcs->Var) osfree(p->Var);
+    if (p->z != pcs->z) osfree(p->z);
+    if (p->sc != pcs->sc) osfree(p->sc);
+    if (p->units != pcs->units) osfree(p->units);
 
     /* free meta if not used by parent, or in this block */
     if (p->meta && p->meta != pcs->meta && p->meta->ref_count == 0)
@@ -1116,7 +1267,7 @@ cmd_end(void)
       int word_flag = 0;
       if (begin_col) {
 	  word_flag = DIAG_WORD;
-	  fseek(file.fh, begin_lpos + begin_col - 1, SEEK_SET);
+	  file.pos = begin_lpos + begin_col - 1;
 	  nextch();
       }
       compile_diagnostic(DIAG_INFO|word_flag, /*Corresponding %s was here*/22, "BEGIN");
@@ -1146,6 +1297,7 @@ cmd_fix(void)
    PJ_COORD coord;
    filepos fp_stn, fp;
 
+   parse_cache_abandon();
    get_pos(&fp_stn);
    prefix *fix_name = read_prefix(PFX_STATION|PFX_ALLOW_ROOT);
 
@@ -1200,25 +1352,7 @@ cmd_fix(void)
       coord.v[2] = read_numeric(false);
 
       if (pcs->proj_str && proj_str_out) {
-	 PJ *transform = pj_cached;
-	 if (!transform) {
-	     transform = proj_create_crs_to_crs(PJ_DEFAULT_CTX,
-						pcs->proj_str,
-						proj_str_out,
-						NULL);
-	     if (transform) {
-		/* Normalise the output order so x is longitude and y latitude - by
-		 * default new PROJ has them switched for EPSG:4326 which just seems
-		 * confusing.
-		 */
-		PJ* pj_norm = proj_normalize_for_visualization(PJ_DEFAULT_CTX,
-							       transform);
-		proj_destroy(transform);
-		transform = pj_norm;
-	     }
-
-	     pj_cached = transform;
-	 }
+	 PJ *transform = get_pj_transform(pcs->proj_str, proj_str_out);
 
 	 if (proj_angular_input(transform, PJ_FWD)) {
 	    /* Input coordinate system expects radians. */
@@ -1400,8 +1534,7 @@ cmd_equate(void)
       if (!name->stn || !fixed(name->stn)) {
 	  // If the station isn't already fixed, make its file:line location
 	  // reflect this *equate.
-	  name->filename = file.filename;
-	  name->line = file.line;
+	  name->loc = srcloc_make(file.filename, file.line);
       }
       skipblanks();
       if (isEol(ch) || isComm(ch)) {
@@ -1437,7 +1570,7 @@ report_missing_export(prefix *pfx, int depth)
    }
    s = osstrdup(sprint_prefix(survey));
    p = sprint_prefix(pfx);
-   if (survey->filename) {
+   if (survey->loc) {
       /* TRANSLATORS: A station must be exported out of each level it is in, so
        * this would give "Station “\outer.inner.1” not exported from survey
        * “\outer”)":
@@ -1659,6 +1792,7 @@ cmd_data(void)
     * but issue a warning about it */
    if (isOmit(ch)) {
       static int data_depr_count = 0;
+      parse_cache_abandon();
       if (data_depr_count < 5) {
 	 compile_diagnostic(DIAG_WARN|DIAG_TOKEN, /*“*data %s %c …” is deprecated - use “*data %s …” instead*/104,
 			    s_str(&token), ch, s_str(&token));
@@ -1888,13 +2022,19 @@ cmd_data(void)
       return;
    }
 
-   /* don't free default ordering or ordering used by parent */
-   if (pcs->ordering != default_order &&
+   /* don't free a static common ordering or ordering used by parent */
+   if (!is_common_data_order(pcs->ordering) &&
        !(pcs->next && pcs->next->ordering == pcs->ordering))
       osfree((reading*)pcs->ordering);
 
    pcs->recorded_style = pcs->style = style;
-   pcs->ordering = new_order;
+   const reading *common_order = find_common_data_order(new_order);
+   if (common_order) {
+      osfree(new_order);
+      pcs->ordering = common_order;
+   } else {
+      pcs->ordering = new_order;
+   }
 
    osfree(style_name);
 
@@ -1958,6 +2098,7 @@ cmd_units(void)
       factor *= factor_tab[units];
    }
 
+   copy_on_write_units(pcs);
    for (quantity = 0, m = BIT(quantity); m <= qmask; quantity++, m <<= 1)
       if (qmask & m) pcs->units[quantity] = factor;
 }
@@ -2030,6 +2171,7 @@ cmd_calibrate(void)
       skipline();
       return;
    }
+   copy_on_write_calib(pcs);
    for (quantity = 0, m = BIT(quantity); m <= qmask; quantity++, m <<= 1) {
       if (qmask & m) {
 	 pcs->z[quantity] = pcs->units[quantity] * z;
@@ -2102,6 +2244,7 @@ cmd_declination(void)
 	if (units == UNITS_NULL) {
 	    return;
 	}
+	copy_on_write_calib(pcs);
 	pcs->z[Q_DECLINATION] = -v * factor_tab[units];
 	pcs->convergence = 0;
     }
@@ -2119,6 +2262,7 @@ cmd_default(void)
    };
    static int default_depr_count = 0;
 
+   parse_cache_abandon();
    if (default_depr_count < 5) {
       /* TRANSLATORS: If you're unsure what "deprecated" means, see:
        * https://en.wikipedia.org/wiki/Deprecation */
@@ -2171,6 +2315,8 @@ cmd_include(void)
 #endif
    ch_store = ch;
 
+   /* The cache records the effects of each file separately. */
+   parse_cache_abandon();
    data_file(pth, s_str(&fnm));
 
 #ifndef NO_DEPRECATED
@@ -2207,6 +2353,7 @@ cmd_sd(void)
    sd *= factor_tab[units];
    variance = sqrd(sd);
 
+   copy_on_write_grade(pcs);
    for (quantity = 0, m = BIT(quantity); m <= qmask; quantity++, m <<= 1)
       if (qmask & m) pcs->Var[quantity] = variance;
 }
@@ -2299,6 +2446,7 @@ cmd_team(void)
 static void
 cmd_title(void)
 {
+   if (pcs->Prefix == root) parse_cache_abandon();
    if (!fExplicitTitle && pcs->Prefix == root) {
        /* If we don't have an explicit title yet, and we're currently in the
 	* root prefix, use this title explicitly. */
@@ -2380,6 +2528,7 @@ cmd_cs(void)
    enum { YES, NO, MAYBE } ok_for_output = YES;
    static bool had_cs = false;
 
+   parse_cache_abandon();
    if (!had_cs) {
       had_cs = true;
       if (first_fix_name) {
@@ -2673,7 +2822,6 @@ cmd_cs(void)
 	 osfree(p->proj_str);
       p->proj_str = proj_str;
       p->input_convergence = HUGE_REAL;
-      invalidate_pj_cached();
    }
 }
 
@@ -2773,7 +2921,7 @@ cmd_require(void)
 
     if (diff < 0) {
 	// Requirement not satisfied
-	size_t len = (size_t)(ftell(file.fh) - fp.offset);
+	size_t len = (size_t)(file_offset() - fp.offset);
 	char *v = osmalloc(len + 1);
 	set_pos(&fp);
 	for (size_t j = 0; j < len; j++) {
@@ -3053,6 +3201,13 @@ process_dates:;
 
 typedef void (*cmd_fn)(void);
 
+static void
+cmd_solve(void)
+{
+   parse_cache_abandon();
+   solve_network();
+}
+
 static const cmd_fn cmd_funcs[] = {
    cmd_alias,
    cmd_begin,
@@ -3083,7 +3238,7 @@ static const cmd_fn cmd_funcs[] = {
    cmd_require,
    cmd_sd,
    cmd_set,
-   solve_network,
+   cmd_solve,
    cmd_team,
    cmd_title,
    cmd_truncate,
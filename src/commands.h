@@ -1,6 +1,6 @@
 /* commands.h
  * Header file for code for directives
- * Copyright (C) 1994-2024 Olly Betts
+ * Copyright (C) 1994-2024,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -55,12 +55,31 @@ void default_units(settings *s);
 void default_calib(settings *s);
 
 void pop_settings(void);
-void invalidate_pj_cached(void);
+/* Return a transformation from coordinate system proj_from to proj_to (which
+ * may be NULL if PROJ can't create one).  The transformation is owned by a
+ * cache, so the caller mustn't destroy it. */
+PJ *get_pj_transform(const char *proj_from, const char *proj_to);
+void print_pj_cache_stats(void);
 void report_declination(settings *p);
 void set_declination_location(real x, real y, real z, const char *proj_str);
 
 void copy_on_write_meta(settings *s);
 
+/* Allocate a new character translation table, which the caller should fill
+ * in before storing in settings::Translate. */
+short *new_translate_table(void);
+void free_translate_table(const short *t);
+
+/* Set entry c of s->Translate to value, first allocating a private copy of
+ * the table if it's currently shared with the parent scope. */
+void set_translate(settings *s, int c, short value);
+
+/* Allocate a private copy of the Var, z and sc, or units arrays in s if
+ * they're currently shared with the parent scope. */
+void copy_on_write_grade(settings *s);
+void copy_on_write_calib(settings *s);
+void copy_on_write_units(settings *s);
+
 extern string token;
 extern string uctoken;
 
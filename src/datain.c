@@ -1,6 +1,6 @@
 /* datain.c
  * Reads in survey files, dealing with special characters, keywords & data
- * Copyright (C) 1991-2025 Olly Betts
+ * Copyright (C) 1991-2025,2026 Olly Betts
  * Copyright (C) 2004 Simeon Warner
  *
  * This program is free software; you can redistribute it and/or modify
@@ -23,6 +23,15 @@
 #include <limits.h>
 #include <stdarg.h>
 
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 #include "debug.h"
 #include "cavern.h"
 #include "date.h"
@@ -37,6 +46,9 @@
 #include "datain.h"
 #include "commands.h"
 #include "out.h"
+#include "parsecache.h"
+#include "makpar.h"
+#include "prefetch.h"
 #include "str.h"
 #include "thgeomag.h"
 
@@ -125,21 +137,64 @@ static void data_passage(void);
 static void data_nosurvey(void);
 static void data_ignore(void);
 
-void
-get_pos(filepos *fp)
+/* Read the whole of fh into file.buf and close fh.
+ *
+ * We map regular files into memory if we can, and otherwise read them into
+ * a buffer.  Having the whole file available means backtracking and
+ * rereading the current line for diagnostics are just a matter of setting
+ * file.pos.
+ */
+static void
+read_file_contents(FILE *fh, const char *filename)
 {
-   fp->ch = ch;
-   fp->offset = ftell(file.fh);
-   if (fp->offset == -1)
-      fatalerror_in_file(file.filename, 0, /*Error reading file*/18);
+   unsigned char *buf;
+   size_t len = 0, alloc = 65536;
+#ifdef HAVE_MMAP
+   struct stat st;
+   if (fstat(fileno(fh), &st) == 0 && S_ISREG(st.st_mode)) {
+      if (st.st_size > 0 && st.st_size <= LONG_MAX) {
+	 void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+			fileno(fh), 0);
+	 if (p != MAP_FAILED) {
+	    (void)fclose(fh);
+	    file.buf = p;
+	    file.size = st.st_size;
+	    file.pos = 0;
+	    file.mapped = true;
+	    return;
+	 }
+      }
+      /* Start with a buffer the right size if mmap() fails. */
+      if (st.st_size >= 0 && st.st_size < LONG_MAX)
+	 alloc = (size_t)st.st_size + 1;
+   }
+#endif
+   buf = osmalloc(alloc);
+   while (1) {
+      len += FREAD(buf + len, 1, alloc - len, fh);
+      if (len < alloc) break;
+      alloc *= 2;
+      buf = osrealloc(buf, alloc);
+   }
+   if (FERROR(fh) || len > LONG_MAX)
+      fatalerror_in_file(filename, 0, /*Error reading file*/18);
+   (void)fclose(fh);
+   file.buf = buf;
+   file.size = len;
+   file.pos = 0;
+   file.mapped = false;
 }
 
-void
-set_pos(const filepos *fp)
+static void
+free_file_contents(void)
 {
-   ch = fp->ch;
-   if (fseek(file.fh, fp->offset, SEEK_SET) == -1)
-      fatalerror_in_file(file.filename, 0, /*Error reading file*/18);
+#ifdef HAVE_MMAP
+   if (file.mapped) {
+      munmap((void*)file.buf, file.size);
+      return;
+   }
+#endif
+   osfree((void*)file.buf);
 }
 
 static void
@@ -170,16 +225,10 @@ error_list_parent_files(void)
 static void
 show_line(int col, int width)
 {
-   /* Rewind to beginning of line. */
-   long cur_pos = ftell(file.fh);
-   if (cur_pos < 0 || fseek(file.fh, file.lpos, SEEK_SET) == -1)
-      fatalerror_in_file(file.filename, 0, /*Error reading file*/18);
-
-   /* Read the whole line and write it out. */
+   /* Write out the whole line. */
    PUTC(' ', STDERR);
-   while (1) {
-      int c = GETC(file.fh);
-      /* Note: isEol() is true for EOF */
+   for (long i = file.lpos; i < file.size; ++i) {
+      int c = file.buf[i];
       if (isEol(c)) break;
       // Replace tabs with spaces so alignment and length of the `^~~~`
       // highlight works regardless of the terminal's tab rendering.
@@ -199,25 +248,16 @@ show_line(int col, int width)
       }
       fputnl(STDERR);
    }
-
-   /* Revert to where we were. */
-   if (fseek(file.fh, cur_pos, SEEK_SET) == -1)
-      fatalerror_in_file(file.filename, 0, /*Error reading file*/18);
 }
 
 char*
 grab_line(void)
 {
-   /* Rewind to beginning of line. */
-   long cur_pos = ftell(file.fh);
    string p = S_INIT;
-   if (cur_pos < 0 || fseek(file.fh, file.lpos, SEEK_SET) == -1)
-      fatalerror_in_file(file.filename, 0, /*Error reading file*/18);
 
    /* Read the whole line into a string. */
-   while (1) {
-      int c = GETC(file.fh);
-      /* Note: isEol() is true for EOF */
+   for (long i = file.lpos; i < file.size; ++i) {
+      int c = file.buf[i];
       if (isEol(c)) break;
       // Change tabs to spaces for consistency with how we show context
       // lines for other diagnostics.
@@ -225,12 +265,6 @@ grab_line(void)
       s_appendch(&p, c);
    }
 
-   /* Revert to where we were. */
-   if (fseek(file.fh, cur_pos, SEEK_SET) == -1) {
-      s_free(&p);
-      fatalerror_in_file(file.filename, 0, /*Error reading file*/18);
-   }
-
    return s_steal(&p);
 }
 
@@ -241,6 +275,7 @@ compile_v_report_fpos(int diag_flags, long fpos, int en, va_list ap)
 {
    int severity = (diag_flags & DIAG_SEVERITY_MASK);
    int col = 0;
+   parse_cache_abandon();
    error_list_parent_files();
    unsigned line = file.line;
    long prev_line_len = (long)file.prev_line_len;
@@ -253,7 +288,7 @@ compile_v_report_fpos(int diag_flags, long fpos, int en, va_list ap)
    }
    v_report(severity == DIAG_FATAL ? DIAG_ERR : severity,
 	    file.filename, line, col, en, ap);
-   if (file.fh) show_line(col, caret_width);
+   if (file.buf) show_line(col, caret_width);
    if (severity == DIAG_FATAL) {
       exit(EXIT_FAILURE);
    }
@@ -302,11 +337,11 @@ compile_diagnostic(int diag_flags, int en, ...)
 	 break;
 	case DIAG_STRING: {
 	 string p = S_INIT;
-	 len = ftell(file.fh);
+	 len = file_offset();
 	 read_string(&p);
 	 s_free(&p);
 	 /* We want to include any quotes, so can't use s_len(&p). */
-	 len = ftell(file.fh) - len;
+	 len = file_offset() - len;
 	 break;
 	}
 	case DIAG_TAIL: {
@@ -347,10 +382,10 @@ compile_diagnostic(int diag_flags, int en, ...)
 	 break;
       }
       caret_width = len;
-      fpos = ftell(file.fh);
+      fpos = file_offset();
    } else if (diag_flags & DIAG_FROM_MASK) {
       caret_width = diag_flags >> DIAG_FROM_SHIFT;
-      fpos = ftell(file.fh);
+      fpos = file_offset();
    }
    compile_v_report_fpos(diag_flags, fpos, en, ap);
    va_end(ap);
@@ -383,6 +418,7 @@ compile_diagnostic_at(int diag_flags, const char * filename, unsigned line, int
 {
    va_list ap;
    int severity = (diag_flags & DIAG_SEVERITY_MASK);
+   parse_cache_abandon();
    va_start(ap, en);
    v_report(severity, filename, line, 0, en, ap);
    va_end(ap);
@@ -394,8 +430,10 @@ compile_diagnostic_pfx(int diag_flags, const prefix * pfx, int en, ...)
 {
    va_list ap;
    int severity = (diag_flags & DIAG_SEVERITY_MASK);
+   parse_cache_abandon();
    va_start(ap, en);
-   v_report(severity, pfx->filename, pfx->line, 0, en, ap);
+   v_report(severity, srcloc_filename(pfx->loc), srcloc_line(pfx->loc), 0,
+	    en, ap);
    va_end(ap);
    caret_width = 0;
 }
@@ -423,9 +461,9 @@ compile_error_string(const char * s, int en, ...)
     va_list ap;
     va_start(ap, en);
     long fpos = 0;
-    if (file.fh) {
+    if (file.buf) {
 	caret_width = strlen(s);
-	fpos = ftell(file.fh);
+	fpos = file_offset();
     }
     compile_v_report_fpos(DIAG_ERR, fpos, en, ap);
     va_end(ap);
@@ -435,6 +473,7 @@ compile_error_string(const char * s, int en, ...)
 static void
 using_data_file(const char *fnm)
 {
+   watch_file(fnm);
    if (!fnm_output_base) {
       /* was: fnm_output_base = base_from_fnm(fnm); */
       fnm_output_base = baseleaf_from_fnm(fnm);
@@ -450,22 +489,107 @@ using_data_file(const char *fnm)
    }
 }
 
+/* The sets of characters which skipblanks(), skipline() and skipword() scan
+ * over or for, derived from pcs->Translate.  With the default settings these
+ * sets are small, so we can check 16 characters at a time by comparing with
+ * each member.
+ */
+#define SCAN_SET_MAX 8
+
+typedef struct {
+   /* The SPECIAL_* bits which define the set. */
+   short mask;
+   /* Number of characters in the set, or -1 if there are too many. */
+   int n;
+   unsigned char c[SCAN_SET_MAX];
+} scan_set;
+
+static scan_set blank_set = { SPECIAL_BLANK, -1, { 0 } };
+static scan_set eol_set = { SPECIAL_EOL, -1, { 0 } };
+static scan_set word_end_set = {
+   SPECIAL_BLANK | SPECIAL_COMMENT | SPECIAL_EOL, -1, { 0 }
+};
+
+/* The generation of the Translate table the scan sets were built from (0
+ * means they haven't been built yet). */
+static unsigned long scan_generation = 0;
+
+static void
+build_scan_set(scan_set *set)
+{
+   set->n = 0;
+   for (int c = 0; c < 256; c++) {
+      if (pcs->Translate[c] & set->mask) {
+	 if (set->n == SCAN_SET_MAX) {
+	    set->n = -1;
+	    return;
+	 }
+	 set->c[set->n++] = c;
+      }
+   }
+}
+
+/* Return the offset of the first character at or after offset off in the
+ * current file which is in set (if skip_members is false) or isn't in set
+ * (if skip_members is true), or file.size if there isn't one.
+ */
+static long
+scan_file(long off, const scan_set *set, bool skip_members)
+{
+   if (scan_generation != translate_generation(pcs->Translate)) {
+      build_scan_set(&blank_set);
+      build_scan_set(&eol_set);
+      build_scan_set(&word_end_set);
+      scan_generation = translate_generation(pcs->Translate);
+   }
+#ifdef __SSE2__
+   if (set->n > 0) {
+      __m128i members[SCAN_SET_MAX];
+      for (int i = 0; i < set->n; i++) {
+	 members[i] = _mm_set1_epi8((char)set->c[i]);
+      }
+      while (off + 16 <= file.size) {
+	 __m128i v = _mm_loadu_si128((const __m128i*)(file.buf + off));
+	 __m128i m = _mm_cmpeq_epi8(v, members[0]);
+	 for (int i = 1; i < set->n; i++) {
+	    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, members[i]));
+	 }
+	 unsigned bits = (unsigned)_mm_movemask_epi8(m);
+	 if (skip_members) bits ^= 0xffff;
+	 if (bits) return off + __builtin_ctz(bits);
+	 off += 16;
+      }
+   }
+#endif
+   const short *t = pcs->Translate;
+   short mask = set->mask;
+   while (off < file.size && ((t[file.buf[off]] & mask) != 0) == skip_members)
+      off++;
+   return off;
+}
+
 static void
 skipword(void)
 {
-   while (!isBlank(ch) && !isComm(ch) && !isEol(ch)) nextch();
+   if (isBlank(ch) || isComm(ch) || isEol(ch)) return;
+   file.pos = scan_file(file.pos, &word_end_set, false);
+   nextch();
 }
 
 extern void
 skipblanks(void)
 {
-   while (isBlank(ch)) nextch();
+   if (!isBlank(ch)) return;
+   file.pos = scan_file(file.pos, &blank_set, true);
+   nextch();
 }
 
 extern void
 skipline(void)
 {
-   while (!isEol(ch)) nextch();
+   if (isEol(ch)) return;
+   file.pos = scan_file(file.pos, &eol_set, false);
+   nextch();
 }
 
 static void
@@ -494,7 +618,7 @@ process_eol(void)
       if (ch == '\n') eolchar = ch;
    }
    long old_lpos = file.lpos;
-   file.lpos = ftell(file.fh) - 1;
+   file.lpos = file_offset() - 1;
    file.prev_line_len = file.lpos - old_lpos;
 }
 
@@ -540,10 +664,10 @@ read_reading(reading r, bool f_optional)
 	q = Q_NULL; /* Suppress compiler warning */;
 	BUG("Unexpected case");
    }
-   LOC(r) = ftell(file.fh);
+   LOC(r) = file_offset();
    /* since we don't handle bearings in read_readings, it's never quadrant */
    VAL(r) = read_numeric_multi(f_optional, false, &n_readings);
-   WID(r) = ftell(file.fh) - LOC(r);
+   WID(r) = file_offset() - LOC(r);
    VAR(r) = var(q);
    if (n_readings > 1) VAR(r) /= sqrt(n_readings);
 }
@@ -569,9 +693,9 @@ read_bearing_or_omit(reading r)
 	q = Q_NULL; /* Suppress compiler warning */;
 	BUG("Unexpected case");
    }
-   LOC(r) = ftell(file.fh);
+   LOC(r) = file_offset();
    VAL(r) = read_bearing_multi_or_omit(quadrants, &n_readings);
-   WID(r) = ftell(file.fh) - LOC(r);
+   WID(r) = file_offset() - LOC(r);
    VAR(r) = var(q);
    if (n_readings > 1) VAR(r) /= sqrt(n_readings);
 }
@@ -580,7 +704,7 @@ read_bearing_or_omit(reading r)
 static void
 initialise_common_compass_settings(void)
 {
-    short *t = ((short*)osmalloc(ossizeof(short) * 257)) + 1;
+    short *t = new_translate_table();
     int i;
     t[EOF] = SPECIAL_EOL;
     memset(t, 0, sizeof(short) * 33);
@@ -684,7 +808,7 @@ data_file_compass_dat_or_clp(bool is_clp)
 	process_eol();
     }
 
-    while (ch != EOF && !FERROR(file.fh)) {
+    while (ch != EOF) {
 	static const reading compass_order[] = {
 	    CompassDATFr, CompassDATTo, Tape, CompassDATComp, CompassDATClino,
 	    CompassDATLeft, CompassDATUp, CompassDATDown, CompassDATRight,
@@ -735,7 +859,7 @@ data_file_compass_dat_or_clp(bool is_clp)
 	process_eol();
 	/* DECLINATION: 1.00  FORMAT: DDDDLUDRADLN  CORRECTIONS: 2.00 3.00 4.00 */
 	if (GET_TOKEN_AND_CHECK_COLON("DECLINATION")) {
-	    if (pcs->dec_filename == NULL) {
+	    if (pcs->dec_loc == SRCLOC_NONE) {
 		pcs->z[Q_DECLINATION] = -read_numeric(false);
 		pcs->z[Q_DECLINATION] *= pcs->units[Q_DECLINATION];
 	    } else {
@@ -833,10 +957,11 @@ static void
 data_file_compass_mak(void)
 {
     initialise_common_compass_settings();
-    short *t = pcs->Translate;
     // In a Compass MAK file a station name can't contain these three
     // characters due to how the syntax works.
-    t['['] = t[','] = t[';'] = 0;
+    set_translate(pcs, '[', 0);
+    set_translate(pcs, ',', 0);
+    set_translate(pcs, ';', 0);
 
     if (setjmp(jbSkipLine)) {
 	// Recover from errors in nested functions by longjmp() to here.
@@ -857,7 +982,10 @@ data_file_compass_mak(void)
 	int len;
     } *folder_stack = NULL;
 
-    while (ch != EOF && !FERROR(file.fh)) {
+    // With --threads, have worker processes parse the files listed.
+    makpar_start();
+
+    while (ch != EOF) {
 	switch (ch) {
 	  case '#': {
 	      /* include a file */
@@ -898,7 +1026,9 @@ data_file_compass_mak(void)
 		      }
 		  }
 		  ch_store = ch;
-		  data_file(s_str(&path), s_str(&dat_fnm));
+		  if (makpar_file_begin())
+		      data_file(s_str(&path), s_str(&dat_fnm));
+		  makpar_file_end();
 		  ch = ch_store;
 		  s_free(&dat_fnm);
 	      }
@@ -1000,7 +1130,6 @@ update_proj_str:
 		    }
 		}
 	    }
-	    invalidate_pj_cached();
 	    break;
 	  case '&': {
 	      /* Datum */
@@ -1107,6 +1236,7 @@ update_proj_str:
 	folder_stack = next;
     }
 
+    makpar_finish();
     pop_settings();
     s_free(&path);
 }
@@ -1119,17 +1249,24 @@ static struct {
     int img_datum_code;
 } walls_ref = { 0.0, 0.0, 0.0, 0, -1 };
 
-// We don't expect a huge number of macros, and this doesn't limit how many we
-// can handle, only at what point access time stops being O(1).
-#define WALLS_MACRO_HASH_SIZE 0x100
-
-typedef struct walls_macro {
-    struct walls_macro *next;
+typedef struct {
+    // NULL for an empty slot.
     char *name;
+    // NULL means the empty string.
     char *value;
     int name_len;
+    unsigned hash;
 } walls_macro;
 
+// An open-addressing hash table of macros, grown to keep it at most half
+// full so lookups stay O(1) however many macros a file defines.
+typedef struct {
+    walls_macro *entries;
+    // Number of entries (a power of 2, or 0).
+    size_t size;
+    size_t used;
+} walls_macro_table;
+
 // Macros set in the WPJ persist, but those set in an SRV only apply for that
 // SRV so we keep a table for each and when expanding them in the SRV we use
 // a definition from the SRV file in preference to one from the WPJ file.
@@ -1140,67 +1277,92 @@ typedef struct walls_macro {
 //
 // Testing with Walls, macro definitions are NOT affected by SAVE, RESTORE or
 // RESET.
-static walls_macro **walls_macros_wpj = NULL;
-static walls_macro **walls_macros = NULL;
+static walls_macro_table walls_macros_wpj = { NULL, 0, 0 };
+static walls_macro_table walls_macros = { NULL, 0, 0 };
 
 static void
 walls_swap_macro_tables()
 {
-    walls_macro **tmp = walls_macros_wpj;
+    walls_macro_table tmp = walls_macros_wpj;
     walls_macros_wpj = walls_macros;
     walls_macros = tmp;
 }
 
+// Return the entry for name (which has hash value h) in table, or the empty
+// slot where it would go.  The table must not have size 0.
+static walls_macro *
+walls_find_macro(const walls_macro_table *table,
+		 const char *name, int name_len, unsigned h)
+{
+    size_t i = HASH_TABLE_SLOT(h, table->size);
+    while (table->entries[i].name) {
+	const walls_macro *p = &table->entries[i];
+	if (p->hash == h && p->name_len == name_len &&
+	    memcmp(p->name, name, name_len) == 0) {
+	    break;
+	}
+	i = HASH_TABLE_NEXT(i, table->size);
+    }
+    return &table->entries[i];
+}
+
 // Takes ownership of the contents of p_name and of value.
 // Passing NULL for value sets empty string.
 static void
-walls_set_macro(walls_macro ***table, string *p_name, char *val)
+walls_set_macro(walls_macro_table *table, string *p_name, char *val)
 {
     //printf("MACRO: $|%s|=\"%s\":\n", name, val);
-    if (!*table) {
-	*table = osmalloc(WALLS_MACRO_HASH_SIZE * ossizeof(walls_macro*));
-	for (size_t i = 0; i < WALLS_MACRO_HASH_SIZE; i++)
-	    (*table)[i] = NULL;
-    }
-
-    unsigned h = hash_data(s_str(p_name), s_len(p_name)) &
-		 (WALLS_MACRO_HASH_SIZE - 1);
-    walls_macro *p = (*table)[h];
-    while (p) {
-	if (s_eqlen(p_name, p->name, p->name_len)) {
+    unsigned h = hash_data_full(s_str(p_name), s_len(p_name));
+    if (table->size) {
+	walls_macro *p = walls_find_macro(table, s_str(p_name),
+					  s_len(p_name), h);
+	if (p->name) {
 	    // Update existing definition of macro.
 	    s_free(p_name);
 	    osfree(p->value);
 	    p->value = val;
 	    return;
 	}
-	p = p->next;
     }
 
-    walls_macro *entry = osnew(walls_macro);
+    size_t new_size = hash_table_grow(table->size, table->used, 64);
+    if (new_size) {
+	walls_macro *old = table->entries;
+	size_t old_size = table->size;
+	table->size = new_size;
+	table->entries = osmalloc(table->size * ossizeof(walls_macro));
+	for (size_t i = 0; i < table->size; ++i) {
+	    table->entries[i].name = NULL;
+	}
+	for (size_t i = 0; i < old_size; ++i) {
+	    if (old[i].name) {
+		*walls_find_macro(table, old[i].name, old[i].name_len,
+				  old[i].hash) = old[i];
+	    }
+	}
+	osfree(old);
+    }
+
+    walls_macro *entry = walls_find_macro(table, s_str(p_name),
+					  s_len(p_name), h);
     entry->name_len = s_len(p_name);
     entry->name = s_steal(p_name);
     entry->value = val;
-    entry->next = (*table)[h];
-    (*table)[h] = entry;
+    entry->hash = h;
+    ++table->used;
 }
 
-// Returns NULL if not set.
+// Returns NULL if not set.  h is the hash_data_full() value for name, so the
+// caller can look the same name up in both tables while only hashing it once.
 static const char*
-walls_get_macro(walls_macro ***table, const char *name, int name_len)
+walls_get_macro(const walls_macro_table *table,
+		const char *name, int name_len, unsigned h)
 {
-    if (!*table) return NULL;
-
-    unsigned h = hash_data(name, name_len) & (WALLS_MACRO_HASH_SIZE - 1);
-    walls_macro *p = (*table)[h];
-    while (p) {
-	if (name_len == p->name_len && memcmp(name, p->name, name_len) == 0) {
-	    return p->value ? p->value : "";
-	}
-	p = p->next;
-    }
+    if (!table->size) return NULL;
 
-    return NULL;
+    const walls_macro *p = walls_find_macro(table, name, name_len, h);
+    if (!p->name) return NULL;
+    return p->value ? p->value : "";
 }
 
 typedef enum {
@@ -1479,7 +1641,7 @@ walls_initialise_settings(void)
     push_walls_options();
 
     // Generic settings.
-    short *t = ((short*)osmalloc(ossizeof(short) * 257)) + 1;
+    short *t = new_translate_table();
     // "Unprefixed names can have a maximum of eight characters and must not
     // contain any colons, semicolons, commas, pound signs (#), or embedded
     // tabs or spaces.  In order to avoid possible problems when printing or
@@ -1891,6 +2053,10 @@ convert_compass_dat_flags(unsigned long compass_dat_flags)
 static void
 parse_options(void)
 {
+    // Most options set units or calibrations, so get our own copies of these
+    // up front rather than before each assignment.
+    copy_on_write_units(pcs);
+    copy_on_write_calib(pcs);
     skipblanks();
     while (!isEol(ch)) {
 	get_token();
@@ -2410,7 +2576,7 @@ data_file_walls_srv(void)
     else
 	pcs->ordering = p_walls_options->data_order_rect;
 
-    while (ch != EOF && !FERROR(file.fh)) {
+    while (ch != EOF) {
 next_line:
 	skipblanks();
 	if (ch != '#') {
@@ -2429,7 +2595,7 @@ next_line:
 	}
 
 	// Directive:
-	int leading_blanks = ftell(file.fh) - file.lpos - 1;
+	int leading_blanks = file_offset() - file.lpos - 1;
 	nextch();
 	if (ch == '[') {
 	    // "Commented out" data.
@@ -2461,7 +2627,7 @@ next_line:
 	    compile_diagnostic(DIAG_ERR|DIAG_SKIP, /*No matching %s*/192, "#[");
 	}
 	skipblanks();
-	int blanks_after_hash = ftell(file.fh) - file.lpos - leading_blanks - 2;
+	int blanks_after_hash = file_offset() - file.lpos - leading_blanks - 2;
 	get_token();
 	walls_cmd directive = match_tok(walls_cmd_tab, TABSIZE(walls_cmd_tab));
 	parse file_store;
@@ -2505,10 +2671,12 @@ next_line:
 		nextch();
 		const char *name = s_str(&line) + macro_start;
 		int name_len = s_len(&line) - macro_start;
+		unsigned h = hash_data_full(name, name_len);
 		const char *macro = walls_get_macro(&walls_macros,
-						    name, name_len);
+						    name, name_len, h);
 		if (!macro) {
-		    macro = walls_get_macro(&walls_macros_wpj, name, name_len);
+		    macro = walls_get_macro(&walls_macros_wpj,
+					    name, name_len, h);
 		}
 		if (!macro) {
 		    compile_diagnostic(DIAG_ERR, /*Macro “%s” not defined*/499,
@@ -2526,20 +2694,11 @@ next_line:
 		// file.
 		file_store = file;
 		ch_store = ch;
-#ifdef HAVE_FMEMOPEN
-		file.fh = fmemopen((char*)s_str(&line), s_len(&line), "rb");
-		if (!file.fh) {
-		    fatalerror(/*Failed to create temporary file*/498);
-		}
-#else
-		file.fh = tmpfile();
-		if (!file.fh) {
-		    fatalerror(/*Failed to create temporary file*/498);
-		}
-		FWRITE_(s_str(&line), s_len(&line), 1, file.fh);
-#endif
-		fseek(file.fh, fp_args.offset - file.lpos, SEEK_SET);
-		ch = (unsigned char)s_str(&line)[fp_args.offset - file.lpos - 1];
+		file.buf = (const unsigned char*)s_str(&line);
+		file.size = s_len(&line);
+		file.pos = fp_args.offset - file.lpos;
+		file.mapped = false;
+		ch = file.buf[file.pos - 1];
 		file.lpos = 0;
 	    } else {
 		//printf("no macros seen in <%s>\n", line);
@@ -2568,6 +2727,7 @@ next_line:
 	    // simply override each other depending on the ordering of
 	    // directives in your files."
 	    if (walls_ref.img_datum_code >= 0) {
+		copy_on_write_calib(pcs);
 		pcs->z[Q_DECLINATION] = HUGE_REAL;
 	    }
 	    skipblanks();
@@ -2661,20 +2821,8 @@ next_line:
 		    char proj_longlat[32];
 		    snprintf(proj_longlat, sizeof(proj_longlat),
 			     "EPSG:%d", epsg_code);
-		    PJ *transform = proj_create_crs_to_crs(PJ_DEFAULT_CTX,
-							   proj_longlat,
-							   proj_str_out,
-							   NULL);
-		    if (transform) {
-			/* Normalise the output order so x is longitude and y
-			 * latitude - by default new PROJ has them switched for
-			 * EPSG:4326 which just seems confusing.
-			 */
-			PJ* pj_norm = proj_normalize_for_visualization(PJ_DEFAULT_CTX,
-								       transform);
-			proj_destroy(transform);
-			transform = pj_norm;
-		    }
+		    PJ *transform = get_pj_transform(proj_longlat,
+						     proj_str_out);
 
 		    if (proj_angular_input(transform, PJ_FWD)) {
 			/* Input coordinate system expects radians. */
@@ -2695,7 +2843,6 @@ next_line:
 			/* Set dummy values which are finite. */
 			coords[0] = coords[1] = coords[2] = 0;
 		    }
-		    proj_destroy(transform);
 		} else {
 		    if (walls_ref.img_datum_code == 0) {
 			// We already emitted an error that this datum is not
@@ -2805,8 +2952,8 @@ next_line:
 	    // FIXME: Need to actually test this with Walls.
 	    int save_translate_slash = pcs->Translate['/'];
 	    int save_translate_bslash = pcs->Translate['\\'];
-	    pcs->Translate['/'] = 0;
-	    pcs->Translate['\\'] = 0;
+	    set_translate(pcs, '/', 0);
+	    set_translate(pcs, '\\', 0);
 	    while (!isWallsSlash(ch)) {
 		prefix *name = read_walls_station(p_walls_options->prefix,
 						  false, NULL);
@@ -2816,8 +2963,8 @@ next_line:
 
 		skipblanks();
 	    }
-	    pcs->Translate['/'] = save_translate_slash;
-	    pcs->Translate['\\'] = save_translate_bslash;
+	    set_translate(pcs, '/', save_translate_slash);
+	    set_translate(pcs, '\\', save_translate_bslash);
 	    set_pos(&fp_end);
 	    break;
 	  }
@@ -2865,7 +3012,6 @@ next_line:
 
 	if (!s_empty(&line)) {
 	    // Revert to reading from the file.
-	    fclose(file.fh);
 	    s_free(&line);
 	    file = file_store;
 	    ch = ch_store;
@@ -2876,17 +3022,18 @@ next_line:
 
     clear_last_leg();
 
-    if (walls_macros) {
-	// Clear all macros set in this SRV file.
-	for (unsigned i = 0; i < WALLS_MACRO_HASH_SIZE; ++i) {
-	    walls_macro *p = walls_macros[i];
-	    while (p) {
-		walls_macro *to_free = p;
-		p = p->next;
-		osfree(to_free);
+    if (walls_macros.used) {
+	// Clear all macros set in this SRV file, keeping the table for the
+	// next one.
+	for (size_t i = 0; i < walls_macros.size; ++i) {
+	    walls_macro *p = &walls_macros.entries[i];
+	    if (p->name) {
+		osfree(p->name);
+		osfree(p->value);
+		p->name = NULL;
 	    }
-	    walls_macros[i] = NULL;
 	}
+	walls_macros.used = 0;
     }
 
     while (p_walls_options->explicit) {
@@ -3027,7 +3174,7 @@ data_file_walls_wpj(void)
     int depth = 0;
     int detached_nest_level = 0;
     bool in_survey = false;
-    while (!FERROR(file.fh)) {
+    while (true) {
 	walls_wpj_cmd tok = WALLS_WPJ_CMD_NULL;
 	skipblanks();
 	if (ch != '.') {
@@ -3141,9 +3288,9 @@ process_entry:
 	    {
 		parse file_store = file;
 		int ch_store = ch;
-		if (file.fh) file.parent = &file_store;
-		file.fh = fh;
+		if (file.buf) file.parent = &file_store;
 		file.filename = filename;
+		read_file_contents(fh, filename);
 		file.line = 1;
 		file.lpos = 0;
 		file.reported_where = false;
@@ -3158,10 +3305,7 @@ process_entry:
 		walls_swap_macro_tables();
 		pop_walls_options();
 
-		if (FERROR(file.fh))
-		    fatalerror_in_file(file.filename, 0, /*Error reading file*/18);
-
-		(void)fclose(file.fh);
+		free_file_contents();
 
 		/* don't free this - it may be pointed to by prefix.file */
 		/* osfree(file.filename); */
@@ -3373,7 +3517,7 @@ data_file_survex(void)
 	    nextch();
 	    file.lpos = 3;
 	} else {
-	    rewind(file.fh);
+	    file.pos = 1;
 	    ch = 0xef;
 	}
     }
@@ -3384,7 +3528,7 @@ data_file_survex(void)
 	process_eol();
     }
 
-    while (ch != EOF && !FERROR(file.fh)) {
+    while (ch != EOF) {
 	if (!process_non_data_line()) {
 	    f_export_ok = false;
 	    switch (pcs->style) {
@@ -3417,6 +3561,7 @@ data_file_survex(void)
     f_export_ok = false;
 
     if (pcs->begin_lineno) {
+	parse_cache_abandon();
 	/* TRANSLATORS: %s and %s are replaced with e.g. BEGIN and END
 	 * or END and BEGIN or #[ and #] */
 	error_in_file(file.filename, pcs->begin_lineno,
@@ -3438,37 +3583,49 @@ data_file(const char *pth, const char *fnm)
 {
    parse file_store;
    unsigned ext = 0;
+   /* Was the file read ahead in the background? */
+   bool prefetched = false;
 
    {
       char *filename;
-      FILE *fh;
+      FILE *fh = NULL;
+      unsigned char *buf;
       size_t len;
 
       if (!pth) {
 	 /* file specified on command line - don't do special translation */
 	 fh = fopenWithPthAndExt(pth, fnm, EXT_SVX_DATA, "rb", &filename);
+      } else if (prefetch_take(pth, fnm, &filename, &buf, &len)) {
+	 prefetched = true;
       } else {
 	 fh = fopen_portable(pth, fnm, EXT_SVX_DATA, "rb", &filename);
       }
 
-      if (fh == NULL) {
+      if (fh == NULL && !prefetched) {
 	 compile_error_string(fnm, /*Couldn’t open file “%s”*/24, fnm);
 	 return;
       }
 
-      len = strlen(filename);
-      if (len > 4 && filename[len - 4] == FNM_SEP_EXT) {
+      size_t fnm_len = strlen(filename);
+      if (fnm_len > 4 && filename[fnm_len - 4] == FNM_SEP_EXT) {
 	  /* Read extension and pack into ext. */
 	  for (int i = 1; i < 4; ++i) {
-	      unsigned char ext_ch = filename[len - i];
+	      unsigned char ext_ch = filename[fnm_len - i];
 	      ext = (ext << 8) | tolower(ext_ch);
 	  }
       }
 
       file_store = file;
-      if (file.fh) file.parent = &file_store;
-      file.fh = fh;
+      if (file.buf) file.parent = &file_store;
       file.filename = filename;
+      if (prefetched) {
+	 file.buf = buf;
+	 file.size = len;
+	 file.pos = 0;
+	 file.mapped = false;
+      } else {
+	 read_file_contents(fh, filename);
+      }
       file.line = 1;
       file.lpos = 0;
       file.reported_where = false;
@@ -3481,7 +3638,10 @@ data_file(const char *pth, const char *fnm)
    switch (ext) {
      case EXT3('d', 'a', 't'):
        // Compass survey data.
-       data_file_compass_dat();
+       if (!parse_cache_lookup(ext)) {
+	  data_file_compass_dat();
+	  parse_cache_store();
+       }
        break;
      case EXT3('c', 'l', 'p'):
        // Compass closed data.  The format of .clp is the same as .dat,
@@ -3490,30 +3650,42 @@ data_file(const char *pth, const char *fnm)
        // adjusted positions, for example to be able to draw extensions
        // on an existing drawn-up survey.  Or if you managed to lose the
        // original .dat but still have the .clp.
-       data_file_compass_clp();
+       if (!parse_cache_lookup(ext)) {
+	  data_file_compass_clp();
+	  parse_cache_store();
+       }
        break;
      case EXT3('m', 'a', 'k'):
-       // Compass project file.
+       // Compass project file.  This and the Walls formats change state
+       // which the parse cache doesn't record.
+       parse_cache_abandon();
        data_file_compass_mak();
        break;
      case EXT3('s', 'r', 'v'):
        // Walls survey data.
+       parse_cache_abandon();
        data_file_walls_srv();
        break;
      case EXT3('w', 'p', 'j'):
        // Walls project file.
+       parse_cache_abandon();
        data_file_walls_wpj();
        break;
      default:
        // Native Survex data.
-       data_file_survex();
+       if (!prefetched) {
+	  // Start reading any files this one includes.  Those for a file
+	  // which was read ahead were found when it was read.
+	  prefetch_includes(file.filename, file.buf, file.size);
+       }
+       if (!parse_cache_lookup(ext)) {
+	  data_file_survex();
+	  parse_cache_store();
+       }
        break;
    }
 
-   if (FERROR(file.fh))
-      fatalerror_in_file(file.filename, 0, /*Error reading file*/18);
-
-   (void)fclose(file.fh);
+   free_file_contents();
 
    file = file_store;
 
@@ -3739,20 +3911,7 @@ real
 calculate_convergence_xy(const char *proj_str, double x, double y, double z)
 {
     /* Convert to WGS84 lat long. */
-    PJ *transform = proj_create_crs_to_crs(PJ_DEFAULT_CTX,
-					   proj_str,
-					   WGS84_DATUM_STRING,
-					   NULL);
-    if (transform) {
-	/* Normalise the output order so x is longitude and y latitude - by
-	 * default new PROJ has them switched for EPSG:4326 which just seems
-	 * confusing.
-	 */
-	PJ* pj_norm = proj_normalize_for_visualization(PJ_DEFAULT_CTX,
-						       transform);
-	proj_destroy(transform);
-	transform = pj_norm;
-    }
+    PJ *transform = get_pj_transform(proj_str, WGS84_DATUM_STRING);
 
     PJ_COORD coord = {{x, y, z, HUGE_VAL}};
     coord = proj_trans(transform, PJ_FWD, coord);
@@ -3767,7 +3926,6 @@ calculate_convergence_xy(const char *proj_str, double x, double y, double z)
        /* Set dummy values which are finite. */
        x = y = z = 0;
     }
-    proj_destroy(transform);
 
     return calculate_convergence_lonlat(proj_str, rad(x), rad(y));
 }
@@ -3808,6 +3966,78 @@ get_input_convergence(void)
     return pcs->input_convergence;
 }
 
+/* Memo of declinations calculated by thgeomag(), keyed on the date and
+ * location, so surveys which share a date and declination location only
+ * need it calculating once.
+ */
+typedef struct {
+    // Days since 1900, latitude, longitude and altitude.
+    double key[4];
+    // hash_data_full() of key.
+    unsigned hash;
+    real declination;
+    bool used;
+} declination_memo_entry;
+
+static declination_memo_entry *declination_memo = NULL;
+// Number of entries in declination_memo (a power of 2, or 0).
+static size_t declination_memo_size = 0;
+static size_t declination_memo_used = 0;
+
+// Find the entry for key (which has hash h), or the empty slot for it.
+static declination_memo_entry *
+declination_memo_find(const double *key, unsigned h)
+{
+    size_t i = HASH_TABLE_SLOT(h, declination_memo_size);
+    while (declination_memo[i].used &&
+	   (declination_memo[i].hash != h ||
+	    memcmp(declination_memo[i].key, key, 4 * sizeof(double)) != 0)) {
+	i = HASH_TABLE_NEXT(i, declination_memo_size);
+    }
+    return &declination_memo[i];
+}
+
+static real
+memoised_thgeomag(int days)
+{
+    double key[4] = { days, pcs->dec_lat, pcs->dec_lon, pcs->dec_alt };
+    unsigned h = hash_data_full((const char *)key, sizeof(key));
+    if (declination_memo_size) {
+	declination_memo_entry *e = declination_memo_find(key, h);
+	if (e->used) return e->declination;
+    }
+
+    double dat = julian_date_from_days_since_1900(days);
+    /* thgeomag() takes (lat, lon, h, dat) - i.e. (y, x, z, date). */
+    real declination = thgeomag(pcs->dec_lat, pcs->dec_lon, pcs->dec_alt,
+				dat);
+
+    size_t new_size = hash_table_grow(declination_memo_size,
+				      declination_memo_used, 64);
+    if (new_size) {
+	declination_memo_entry *old = declination_memo;
+	size_t old_size = declination_memo_size;
+	declination_memo_size = new_size;
+	declination_memo = osmalloc(declination_memo_size *
+				    ossizeof(declination_memo_entry));
+	for (size_t i = 0; i < declination_memo_size; ++i) {
+	    declination_memo[i].used = false;
+	}
+	for (size_t i = 0; i < old_size; ++i) {
+	    if (old[i].used)
+		*declination_memo_find(old[i].key, old[i].hash) = old[i];
+	}
+	osfree(old);
+    }
+    declination_memo_entry *e = declination_memo_find(key, h);
+    memcpy(e->key, key, sizeof(key));
+    e->hash = h;
+    e->declination = declination;
+    e->used = true;
+    ++declination_memo_used;
+    return declination;
+}
+
 static real
 get_declination(void)
 {
@@ -3825,10 +4055,8 @@ get_declination(void)
 	    declination = 0;
 	} else {
 	    int avg_days = (pcs->meta->days1 + pcs->meta->days2) / 2;
-	    double dat = julian_date_from_days_since_1900(avg_days);
-	    /* thgeomag() takes (lat, lon, h, dat) - i.e. (y, x, z, date). */
-	    declination = thgeomag(pcs->dec_lat, pcs->dec_lon, pcs->dec_alt,
-				   dat);
+	    declination = memoised_thgeomag(avg_days);
+	    parse_cache_declination(declination, avg_days);
 	    if (declination < pcs->min_declination) {
 		pcs->min_declination = declination;
 		pcs->min_declination_days = avg_days;
@@ -4646,6 +4874,109 @@ process_cylpolar(prefix *fr, prefix *to, bool fToFirst, bool fDepthChange)
    return 1;
 }
 
+/* Read a TAPE or BACKTAPE reading, which may be omitted. */
+static void
+read_tape_or_omit(reading r)
+{
+   read_reading(r, true);
+   if (VAL(r) == HUGE_REAL) {
+      if (!isOmit(ch)) {
+	 compile_diagnostic_token_show(DIAG_ERR, /*Expecting numeric field, found “%s”*/9);
+	 /* Avoid also warning about omitted tape reading. */
+	 VAL(r) = 0;
+      } else {
+	 nextch();
+      }
+   } else if (VAL(r) < (real)0.0) {
+      compile_diagnostic_reading(DIAG_WARN, r, /*Negative tape reading*/60);
+   }
+}
+
+/* Read a CLINO or BACKCLINO reading, which may instead be a plumb or level
+ * indicator.  Returns false if the reading is invalid, in which case an error
+ * has been reported and the rest of the line skipped.
+ */
+static bool
+read_clino_or_plumb(reading r, clino_type *p_ctype)
+{
+   read_reading(r, true);
+   if (VAL(r) == HUGE_REAL) {
+      VAL(r) = handle_plumb(p_ctype);
+      if (VAL(r) != HUGE_REAL) {
+	 WID(r) = file_offset() - LOC(r);
+	 return true;
+      }
+      compile_diagnostic_token_show(DIAG_ERR, /*Expecting numeric field, found “%s”*/9);
+      skipline();
+      process_eol();
+      return false;
+   }
+   *p_ctype = CTYPE_READING;
+   return true;
+}
+
+/* The orderings for *data normal which the vast majority of data uses.
+ * cmd_data() uses these static copies when one of them is specified so that
+ * data_normal() can select its fast path for them by just comparing pointers.
+ */
+const reading default_data_order[] = {
+   Fr, To, Tape, Comp, Clino, End
+};
+
+static const reading backsight_data_order[] = {
+   Fr, To, Tape, Comp, Clino, BackComp, BackClino, End
+};
+
+static const reading paired_backsight_data_order[] = {
+   Fr, To, Tape, Comp, BackComp, Clino, BackClino, End
+};
+
+static const reading *const common_data_orders[] = {
+   default_data_order,
+   backsight_data_order,
+   paired_backsight_data_order
+};
+
+#define N_COMMON_DATA_ORDERS \
+   (sizeof(common_data_orders) / sizeof(common_data_orders[0]))
+
+const reading *
+find_common_data_order(const reading *order)
+{
+   for (size_t i = 0; i < N_COMMON_DATA_ORDERS; i++) {
+      const reading *p = common_data_orders[i];
+      size_t j = 0;
+      while (p[j] == order[j] && p[j] != End) j++;
+      if (p[j] == order[j]) return p;
+   }
+   return NULL;
+}
+
+bool
+is_common_data_order(const reading *order)
+{
+   for (size_t i = 0; i < N_COMMON_DATA_ORDERS; i++) {
+      if (order == common_data_orders[i]) return true;
+   }
+   return false;
+}
+
+/* Count of calls to data_normal() using each fast path (in the same order as
+ * common_data_orders), and (in the last entry) using the generic code. */
+static unsigned long data_normal_count[N_COMMON_DATA_ORDERS + 1];
+
+/* print_data_normal_stats() needs updating if this changes. */
+typedef int compiletimeassert_n_common_data_orders[N_COMMON_DATA_ORDERS == 3 ? 1 : -1];
+
+void
+print_data_normal_stats(void)
+{
+   printf("*data normal fast paths: %lu default, %lu backsight, "
+	  "%lu paired backsight; generic: %lu\n",
+	  data_normal_count[0], data_normal_count[1], data_normal_count[2],
+	  data_normal_count[N_COMMON_DATA_ORDERS]);
+}
+
 /* Process tape/compass/clino, diving, and cylpolar styles of survey data
  * Also handles topofil (fromcount/tocount or count) in place of tape */
 static void
@@ -4686,7 +5017,51 @@ data_normal(void)
     * error in a reading, we might not, so make sure it has been cleared here.
     */
    pcs->flags &= ~(BIT(FLAGS_ANON_ONE_END) | BIT(FLAGS_IMPLICIT_SPLAY));
-   for (const reading *ordering = pcs->ordering; ; ordering++) {
+
+   const reading *order = pcs->ordering;
+   if (order == default_data_order ||
+       order == backsight_data_order ||
+       order == paired_backsight_data_order) {
+      /* Fast path for the common orderings, which avoids interpreting the
+       * ordering for each reading.  This reads the same readings in the same
+       * way as the generic code below, then joins it to process the leg.
+       */
+      if (order == default_data_order) {
+	 ++data_normal_count[0];
+      } else if (order == backsight_data_order) {
+	 ++data_normal_count[1];
+      } else {
+	 ++data_normal_count[2];
+      }
+      skipblanks();
+      fr = read_prefix(PFX_STATION|PFX_ALLOW_ROOT|PFX_ANON);
+      skipblanks();
+      to = read_prefix(PFX_STATION|PFX_ALLOW_ROOT|PFX_ANON);
+      first_stn = Fr;
+      skipblanks();
+      read_tape_or_omit(Tape);
+      skipblanks();
+      read_bearing_or_omit(Comp);
+      if (order == paired_backsight_data_order) {
+	 skipblanks();
+	 read_bearing_or_omit(BackComp);
+      }
+      skipblanks();
+      if (!read_clino_or_plumb(Clino, &ctype)) return;
+      if (order == backsight_data_order) {
+	 skipblanks();
+	 read_bearing_or_omit(BackComp);
+      }
+      if (order != default_data_order) {
+	 skipblanks();
+	 if (!read_clino_or_plumb(BackClino, &backctype)) return;
+      }
+      skipblanks();
+      goto end_of_leg;
+   }
+   ++data_normal_count[N_COMMON_DATA_ORDERS];
+
+   for (const reading *ordering = order; ; ordering++) {
       skipblanks();
       switch (*ordering) {
        case Fr:
@@ -4737,22 +5112,9 @@ data_normal(void)
 	  do_legacy_token_warning();
 	  break;
        }
-       case Tape: case BackTape: {
-	  reading r = *ordering;
-	  read_reading(r, true);
-	  if (VAL(r) == HUGE_REAL) {
-	     if (!isOmit(ch)) {
-		compile_diagnostic_token_show(DIAG_ERR, /*Expecting numeric field, found “%s”*/9);
-		/* Avoid also warning about omitted tape reading. */
-		VAL(r) = 0;
-	     } else {
-		nextch();
-	     }
-	  } else if (VAL(r) < (real)0.0) {
-	     compile_diagnostic_reading(DIAG_WARN, r, /*Negative tape reading*/60);
-	  }
+       case Tape: case BackTape:
+	  read_tape_or_omit(*ordering);
 	  break;
-       }
        case Count:
 	  VAL(FrCount) = VAL(ToCount);
 	  LOC(FrCount) = LOC(ToCount);
@@ -4772,20 +5134,8 @@ data_normal(void)
 	  break;
        case Clino: case BackClino: {
 	  reading r = *ordering;
-	  clino_type * p_ctype = (r == Clino ? &ctype : &backctype);
-	  read_reading(r, true);
-	  if (VAL(r) == HUGE_REAL) {
-	     VAL(r) = handle_plumb(p_ctype);
-	     if (VAL(r) != HUGE_REAL) {
-		WID(r) = ftell(file.fh) - LOC(r);
-		break;
-	     }
-	     compile_diagnostic_token_show(DIAG_ERR, /*Expecting numeric field, found “%s”*/9);
-	     skipline();
-	     process_eol();
+	  if (!read_clino_or_plumb(r, r == Clino ? &ctype : &backctype))
 	     return;
-	  }
-	  *p_ctype = CTYPE_READING;
 	  break;
        }
        case FrDepth: case ToDepth:
@@ -4880,7 +5230,7 @@ data_normal(void)
 	  }
 	  break;
        case WallsSRVTape:
-	  LOC(Tape) = ftell(file.fh);
+	  LOC(Tape) = file_offset();
 	  VAL(Tape) = read_numeric(true);
 	  if (VAL(Tape) == HUGE_REAL) {
 	      if (ch == 'i' || ch == 'I') {
@@ -4916,12 +5266,12 @@ inches_only:
 		  nextch();
 	      }
 	  }
-	  WID(Tape) = ftell(file.fh) - LOC(Tape);
+	  WID(Tape) = file_offset() - LOC(Tape);
 	  VAR(Tape) = var(Q_LENGTH);
 	  break;
        case WallsSRVComp: {
 	  skipblanks();
-	  LOC(Comp) = ftell(file.fh);
+	  LOC(Comp) = file_offset();
 	  if (ch != '/') {
 	      if (isalpha(ch)) {
 		  VAL(Comp) = read_quadrant(false);
@@ -4957,7 +5307,7 @@ inches_only:
 		      }
 		  }
 	      }
-	      WID(Comp) = ftell(file.fh) - LOC(Comp);
+	      WID(Comp) = file_offset() - LOC(Comp);
 	      VAR(Comp) = var(Q_BEARING);
 	  } else {
 	      // Omitted foresight, e.g. `/123` or `/` (both omitted).
@@ -4965,7 +5315,7 @@ inches_only:
 	      VAL(Comp) = HUGE_REAL;
 	  }
 	  if (ch == '/' && !isBlank(nextch())) {
-	      LOC(BackComp) = ftell(file.fh);
+	      LOC(BackComp) = file_offset();
 	      if (isalpha(ch)) {
 		  VAL(BackComp) = read_quadrant(false);
 	      } else {
@@ -5000,11 +5350,11 @@ inches_only:
 		      }
 		  }
 	      }
-	      WID(BackComp) = ftell(file.fh) - LOC(BackComp);
+	      WID(BackComp) = file_offset() - LOC(BackComp);
 	      VAR(BackComp) = var(Q_BACKBEARING);
 	  } else {
 	      // Omitted backsight, e.g. `123/` or `/` (both omitted).
-	      LOC(BackComp) = ftell(file.fh);
+	      LOC(BackComp) = file_offset();
 	      WID(BackComp) = 0;
 	      VAL(BackComp) = HUGE_REAL;
 	  }
@@ -5012,7 +5362,7 @@ inches_only:
        }
        case WallsSRVClino: {
 	  skipblanks();
-	  LOC(Clino) = ftell(file.fh);
+	  LOC(Clino) = file_offset();
 	  if (ch != '/') {
 	      real clin = read_number(true, false);
 	      if (clin == HUGE_REAL) {
@@ -5053,14 +5403,14 @@ inches_only:
 		  VAL(Clino) = clin;
 		  ctype = CTYPE_READING;
 	      }
-	      WID(Clino) = ftell(file.fh) - LOC(Clino);
+	      WID(Clino) = file_offset() - LOC(Clino);
 	      VAR(Clino) = var(Q_GRADIENT);
 	  } else {
 	      // Omitted foresight, e.g. `/12` or `/` (both omitted).
 	      WID(Clino) = 0;
 	  }
 	  if (ch == '/' && !isBlank(nextch())) {
-	      LOC(BackClino) = ftell(file.fh);
+	      LOC(BackClino) = file_offset();
 	      real backclin = read_number(true, false);
 	      if (backclin == HUGE_REAL) {
 		  if (ch != '-') {
@@ -5093,11 +5443,11 @@ inches_only:
 		  VAL(BackClino) = backclin;
 		  backctype = CTYPE_READING;
 	      }
-	      WID(BackClino) = ftell(file.fh) - LOC(BackClino);
+	      WID(BackClino) = file_offset() - LOC(BackClino);
 	      VAR(BackClino) = var(Q_BACKGRADIENT);
 	  } else {
 	      // Omitted backsight, e.g. `12/` or `/` (both omitted).
-	      LOC(BackClino) = ftell(file.fh);
+	      LOC(BackClino) = file_offset();
 	      WID(BackClino) = 0;
 	  }
 	  break;
@@ -5262,6 +5612,7 @@ inches_only:
 	  /* fall through */
        case End:
 	  if (!fMulti) {
+end_of_leg:
 	     /* Compass ignore flag is 'X' */
 	     if ((compass_dat_flags & BIT('X' - 'A'))) {
 		process_eol();
@@ -5381,6 +5732,8 @@ static int
 process_lrud(prefix *stn)
 {
    SVX_ASSERT(next_lrud);
+   /* We don't cache passage data. */
+   parse_cache_abandon();
    lrud * xsect = osnew(lrud);
    xsect->stn = stn;
    xsect->l = (VAL(Left) * pcs->units[Q_LEFT] - pcs->z[Q_LEFT]) * pcs->sc[Q_LEFT];
@@ -5441,6 +5794,9 @@ process_nosurvey(prefix *fr, prefix *to, bool fToFirst)
 {
    nosurveylink *link;
 
+   /* We don't cache nosurvey data. */
+   parse_cache_abandon();
+
    /* Suppress "unused fixed point" warnings for these stations. */
    fr->sflags &= ~BIT(SFLAGS_UNUSED_FIXED_POINT);
    to->sflags &= ~BIT(SFLAGS_UNUSED_FIXED_POINT);
@@ -1,7 +1,7 @@
 /* datain.h
  * Header file for code that...
  * Reads in survey files, dealing with special characters, keywords & data
- * Copyright (C) 1994-2024 Olly Betts
+ * Copyright (C) 1994-2024,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -22,14 +22,20 @@
 #define DATAIN_H
 
 #include <setjmp.h>
-#include <stdio.h> /* for FILE */
 
 #include "message.h" /* for DIAG_WARN, etc */
 
 // We rely on implicit initialisation of this struct, so members will be
 // initialised to NULL, 0, false, etc.
 typedef struct parse {
-   FILE *fh;
+   // The whole contents of the file being read (or NULL if there isn't one).
+   const unsigned char *buf;
+   // The length of buf in bytes.
+   long size;
+   // Offset in buf of the next character to read.
+   long pos;
+   // Is buf mapped from the file (rather than allocated)?
+   bool mapped;
    const char *filename;
    long lpos;
    unsigned int line;
@@ -43,15 +49,30 @@ extern parse file;
 extern jmp_buf jbSkipLine;
 extern bool f_export_ok;
 
-#define nextch() (ch = GETC(file.fh))
+#define nextch() (ch = (file.pos < file.size ? file.buf[file.pos++] : EOF))
+
+// Offset in the current file of the character after ch (i.e. what ftell()
+// would return if we were reading with stdio).
+#define file_offset() (file.pos)
 
 typedef struct {
    long offset;
    int ch;
 } filepos;
 
-void get_pos(filepos *fp);
-void set_pos(const filepos *fp);
+static inline void
+get_pos(filepos *fp)
+{
+   fp->ch = ch;
+   fp->offset = file.pos;
+}
+
+static inline void
+set_pos(const filepos *fp)
+{
+   ch = fp->ch;
+   file.pos = fp->offset;
+}
 
 void skipblanks(void);
 
@@ -63,6 +84,21 @@ real calculate_convergence_xy(const char *proj_str,
 
 void skipline(void);
 
+/* The default ordering for *data normal. */
+extern const reading default_data_order[];
+
+/* If order is one of the orderings which data_normal() has a fast path for,
+ * return a pointer to the static copy of it, otherwise return NULL.
+ */
+const reading *find_common_data_order(const reading *order);
+
+/* Is order one of the static copies returned by find_common_data_order()? */
+bool is_common_data_order(const reading *order);
+
+/* Report how many legs data_normal() read using each of its fast paths and
+ * using the generic code (cavern --internal-stats). */
+void print_data_normal_stats(void);
+
 /* Read the current line into a string, converting each tab to a space.
  *
  * The string is allocated with malloc() the caller is responsible for calling
@@ -100,7 +136,7 @@ char* grab_line(void);
 // Specify the caret_width explicitly.
 #define DIAG_WIDTH(W)	((W) << DIAG_FROM_SHIFT)
 // Specify caret_width to be from filepos POS to the current position.
-#define DIAG_FROM(POS)	DIAG_WIDTH(ftell(file.fh) - (POS).offset)
+#define DIAG_FROM(POS)	DIAG_WIDTH(file_offset() - (POS).offset)
 
 void compile_diagnostic(int flags, int en, ...);
 
@@ -1,6 +1,6 @@
 /* debug.h
  * SURVEX debugging info control macros
- * Copyright (C) 1993-1996,2001,2002,2015,2025 Olly Betts
+ * Copyright (C) 1993-1996,2001,2002,2015,2025,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
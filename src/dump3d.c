@@ -1,6 +1,6 @@
 /* dump3d.c */
 /* Show raw contents of .3d file in text form */
-/* Copyright (C) 2001-2024 Olly Betts
+/* Copyright (C) 2001-2024,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -174,6 +174,12 @@ main(int argc, char **argv)
 	    if (pimg->flags & img_SFLAG_FIXED) printf(" FIXED");
 	    if (pimg->flags & img_SFLAG_ANON) printf(" ANON");
 	    if (pimg->flags & img_SFLAG_WALL) printf(" WALL");
+	    if (pimg->have_covariance) {
+		printf(" COVARIANCE %.6f %.6f %.6f %.6f %.6f %.6f",
+		       pimg->covariance[0], pimg->covariance[1],
+		       pimg->covariance[2], pimg->covariance[3],
+		       pimg->covariance[4], pimg->covariance[5]);
+	    }
 	    printf("\n");
 	    break;
 	  case img_XSECT:
@@ -1,6 +1,6 @@
 /* filelist.h
  * Filename extensions used by Survex programs
- * Copyright (C) 1993-2001 Olly Betts
+ * Copyright (C) 1993-2001,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -22,5 +22,6 @@
 #define EXT_SVX_ERRS "err"
 #define EXT_SVX_POS  "pos"
 #define EXT_SVX_MSG  "msg"
+#define EXT_SVX_CACHE "cache"
 #define EXT_INI      "ini"
 #define EXT_LOG      "log"
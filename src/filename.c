@@ -1,5 +1,5 @@
 /* OS dependent filename manipulation routines
- * Copyright (c) Olly Betts 1998-2003,2004,2005,2010,2011,2014
+ * Copyright (c) Olly Betts 1998-2003,2004,2005,2010,2011,2014,2026
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -20,13 +20,21 @@
 
 #include "filename.h"
 #include "debug.h"
+#include "hash.h"
 #include "osalloc.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdio.h>
+#ifndef _WIN32
+# include <dirent.h>
+#endif
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
 
 typedef struct filelist {
    char *fnm;
@@ -303,10 +311,12 @@ fAbsoluteFnm(const char *fnm)
 /* fopen file, found using pth and fnm
  * fnmUsed is used to return filename used to open file (ignored if NULL)
  * or NULL if file didn't open
+ * open_fn is used to try opening each candidate filename
  */
-extern FILE *
-fopenWithPthAndExt(const char *pth, const char *fnm, const char *ext,
-		   const char *mode, char **fnmUsed)
+static FILE *
+open_with_pth_and_ext(const char *pth, const char *fnm, const char *ext,
+		      const char *mode, char **fnmUsed,
+		      FILE *(*open_fn)(const char *, const char *))
 {
    char *fnmFull = NULL;
    FILE *fh = NULL;
@@ -315,20 +325,20 @@ fopenWithPthAndExt(const char *pth, const char *fnm, const char *ext,
     * already absolute.
     */
    if (pth == NULL || *pth == '\0' || fAbsoluteFnm(fnm)) {
-      fh = fopen_not_dir(fnm, mode);
+      fh = open_fn(fnm, mode);
       if (fh) {
 	 if (fnmUsed) fnmFull = osstrdup(fnm);
       } else {
 	 if (ext && *ext) {
 	    /* we've been given an extension so try using it */
 	    fnmFull = add_ext(fnm, ext);
-	    fh = fopen_not_dir(fnmFull, mode);
+	    fh = open_fn(fnmFull, mode);
 	 }
       }
    } else {
       /* try using path given - first of all without the extension */
       fnmFull = use_path(pth, fnm);
-      fh = fopen_not_dir(fnmFull, mode);
+      fh = open_fn(fnmFull, mode);
       if (!fh) {
 	 if (ext && *ext) {
 	    /* we've been given an extension so try using it */
@@ -336,12 +346,12 @@ fopenWithPthAndExt(const char *pth, const char *fnm, const char *ext,
 	    fnmTmp = fnmFull;
 	    fnmFull = add_ext(fnmFull, ext);
 	    osfree(fnmTmp);
-	    fh = fopen_not_dir(fnmFull, mode);
+	    fh = open_fn(fnmFull, mode);
 	 }
       }
    }
 
-   /* either it opened or didn't. If not, fh == NULL from fopen_not_dir() */
+   /* either it opened or didn't. If not, fh == NULL from open_fn() */
 
    /* free name if it didn't open or name isn't wanted */
    if (fh == NULL || fnmUsed == NULL) osfree(fnmFull);
@@ -349,15 +359,277 @@ fopenWithPthAndExt(const char *pth, const char *fnm, const char *ext,
    return fh;
 }
 
+extern FILE *
+fopenWithPthAndExt(const char *pth, const char *fnm, const char *ext,
+		   const char *mode, char **fnmUsed)
+{
+   return open_with_pth_and_ext(pth, fnm, ext, mode, fnmUsed, fopen_not_dir);
+}
+
+#ifndef _WIN32
+/* Cache of directory listings, so fopen_portable() can check which of the
+ * variants of a filename it tries actually exist without a failing open for
+ * each (which is slow on network filing systems).  Listings are read when a
+ * directory is first looked in and kept for the rest of the run.
+ *
+ * Each entry is keyed on its directory and case-folded name, so all the
+ * variants of a name differing only in case are found by the same probe.
+ * On a case-insensitive filing system a name which differs only in case
+ * from a listed one can be opened, so in that case we still try to open
+ * the file.
+ */
+typedef struct {
+   /* Directory, or NULL for an empty slot. */
+   char *dir;
+   unsigned hash;
+   /* Could the directory be read? */
+   bool listed;
+} dir_listing;
+
+typedef struct {
+   /* Directory containing this entry (owned by a dir_listing). */
+   const char *dir;
+   /* Name of the entry, or NULL for an empty slot. */
+   char *name;
+   /* Hash of dir and the case-folded name. */
+   unsigned hash;
+} dir_entry;
+
+/* Open-addressing hash tables, each with a size which is a power of 2 (or 0)
+ * and kept at most half full. */
+static dir_listing *dir_listings = NULL;
+static size_t dir_listings_size = 0, dir_listings_used = 0;
+static dir_entry *dir_entries = NULL;
+static size_t dir_entries_size = 0, dir_entries_used = 0;
+
+#ifdef HAVE_PTHREAD
+/* Files are opened from the worker threads in prefetch.c. */
+static pthread_mutex_t dir_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Continue hash h (the hash of a directory) over the case-folded name. */
+static unsigned
+hash_folded_name(unsigned h, const char *name)
+{
+   char buf[64];
+   size_t n = 0;
+   while (*name) {
+      buf[n++] = tolower((unsigned char)*name++);
+      if (n == sizeof(buf)) {
+	 h = hash_data_full_more(h, buf, n);
+	 n = 0;
+      }
+   }
+   return hash_data_full_more(h, buf, n);
+}
+
+static dir_listing *
+find_dir_listing(const char *dir, size_t len, unsigned h)
+{
+   size_t i = HASH_TABLE_SLOT(h, dir_listings_size);
+   while (dir_listings[i].dir) {
+      const dir_listing *p = &dir_listings[i];
+      if (p->hash == h && strncmp(p->dir, dir, len) == 0 && !p->dir[len])
+	 break;
+      i = HASH_TABLE_NEXT(i, dir_listings_size);
+   }
+   return &dir_listings[i];
+}
+
+static dir_entry *
+find_dir_entry(const char *dir, const char *name, unsigned h)
+{
+   size_t i = HASH_TABLE_SLOT(h, dir_entries_size);
+   while (dir_entries[i].name) {
+      const dir_entry *p = &dir_entries[i];
+      if (p->hash == h && p->dir == dir && strcmp(p->name, name) == 0)
+	 break;
+      i = HASH_TABLE_NEXT(i, dir_entries_size);
+   }
+   return &dir_entries[i];
+}
+
+/* Compare two names ignoring case, in the same way hash_folded_name() folds
+ * it. */
+static bool
+names_equal_folded(const char *a, const char *b)
+{
+   while (tolower((unsigned char)*a) == tolower((unsigned char)*b)) {
+      if (!*a) return true;
+      ++a;
+      ++b;
+   }
+   return false;
+}
+
+/* Is there an entry in dir for name exactly (DIR_ENTRY_EXACT), only for
+ * names differing from it in case (DIR_ENTRY_FOLDED), or neither
+ * (DIR_ENTRY_NONE)?  h is the hash of dir and the case-folded name. */
+typedef enum { DIR_ENTRY_NONE, DIR_ENTRY_FOLDED, DIR_ENTRY_EXACT } dir_match;
+
+static dir_match
+match_dir_entry(const char *dir, const char *name, unsigned h)
+{
+   dir_match result = DIR_ENTRY_NONE;
+   size_t i = HASH_TABLE_SLOT(h, dir_entries_size);
+   while (dir_entries[i].name) {
+      const dir_entry *p = &dir_entries[i];
+      if (p->hash == h && p->dir == dir) {
+	 if (strcmp(p->name, name) == 0) return DIR_ENTRY_EXACT;
+	 if (names_equal_folded(p->name, name)) result = DIR_ENTRY_FOLDED;
+      }
+      i = HASH_TABLE_NEXT(i, dir_entries_size);
+   }
+   return result;
+}
+
+static void
+add_dir_entry(const char *dir, unsigned dir_hash, const char *name)
+{
+   size_t new_size = hash_table_grow(dir_entries_size, dir_entries_used, 256);
+   if (new_size) {
+      dir_entry *old = dir_entries;
+      size_t old_size = dir_entries_size;
+      dir_entries_size = new_size;
+      dir_entries = osmalloc(dir_entries_size * ossizeof(dir_entry));
+      for (size_t i = 0; i < dir_entries_size; ++i) {
+	 dir_entries[i].name = NULL;
+      }
+      for (size_t i = 0; i < old_size; ++i) {
+	 if (old[i].name)
+	    *find_dir_entry(old[i].dir, old[i].name, old[i].hash) = old[i];
+      }
+      osfree(old);
+   }
+   unsigned h = hash_folded_name(dir_hash, name);
+   dir_entry *e = find_dir_entry(dir, name, h);
+   if (e->name) return;
+   e->dir = dir;
+   e->name = osstrdup(name);
+   e->hash = h;
+   ++dir_entries_used;
+}
+
+/* Return the listing for directory dir (of length len), reading it if this
+ * is the first time it's been asked for. */
+static const dir_listing *
+get_dir_listing(const char *dir, size_t len)
+{
+   unsigned h = hash_data_full(dir, len);
+   if (dir_listings_size) {
+      const dir_listing *p = find_dir_listing(dir, len, h);
+      if (p->dir) return p;
+   }
+
+   size_t new_size = hash_table_grow(dir_listings_size, dir_listings_used, 16);
+   if (new_size) {
+      dir_listing *old = dir_listings;
+      size_t old_size = dir_listings_size;
+      dir_listings_size = new_size;
+      dir_listings = osmalloc(dir_listings_size * ossizeof(dir_listing));
+      for (size_t i = 0; i < dir_listings_size; ++i) {
+	 dir_listings[i].dir = NULL;
+      }
+      for (size_t i = 0; i < old_size; ++i) {
+	 if (old[i].dir) {
+	    *find_dir_listing(old[i].dir, strlen(old[i].dir), old[i].hash) =
+	       old[i];
+	 }
+      }
+      osfree(old);
+   }
+
+   dir_listing *p = find_dir_listing(dir, len, h);
+   p->dir = osmalloc(len + 1);
+   memcpy(p->dir, dir, len);
+   p->dir[len] = '\0';
+   p->hash = h;
+   ++dir_listings_used;
+
+   DIR *d = opendir(len ? p->dir : ".");
+   /* If the directory doesn't exist then nothing in it does either, but if
+    * it can't be read for another reason we don't know what's in it. */
+   p->listed = (d != NULL || errno == ENOENT || errno == ENOTDIR);
+   if (d) {
+      struct dirent *ent;
+      while ((ent = readdir(d)) != NULL) {
+	 add_dir_entry(p->dir, h, ent->d_name);
+      }
+      closedir(d);
+   }
+   return p;
+}
+
+/* Like fopen_not_dir(), but if the directory listing shows fnm doesn't exist
+ * (even ignoring case) we return NULL without trying to open it. */
+static FILE *
+fopen_listed(const char *fnm, const char *mode)
+{
+   const char *leaf = strrchr(fnm, '/');
+   size_t dir_len = leaf ? (size_t)(leaf - fnm) : 0;
+   leaf = leaf ? leaf + 1 : fnm;
+   /* For "/foo" the directory is "/", not "". */
+   if (dir_len == 0 && leaf != fnm) dir_len = 1;
+
+   bool exists = true;
+#ifdef HAVE_PTHREAD
+   pthread_mutex_lock(&dir_cache_mutex);
+#endif
+   const dir_listing *listing = get_dir_listing(fnm, dir_len);
+   if (listing->listed) {
+      unsigned h = hash_folded_name(listing->hash, leaf);
+      exists = (dir_entries_size &&
+		match_dir_entry(listing->dir, leaf, h) != DIR_ENTRY_NONE);
+   }
+#ifdef HAVE_PTHREAD
+   pthread_mutex_unlock(&dir_cache_mutex);
+#endif
+   /* If the directory couldn't be read (e.g. it's search-only) we can't tell
+    * so just try to open it.  Likewise if only the name differs in case from
+    * a listed one, since that will open on a case-insensitive filing system.
+    */
+   if (!exists) return NULL;
+   return fopen_not_dir(fnm, mode);
+}
+#endif
+
+void
+filename_free_dir_cache(void)
+{
+#ifndef _WIN32
+#ifdef HAVE_PTHREAD
+   pthread_mutex_lock(&dir_cache_mutex);
+#endif
+   for (size_t i = 0; i < dir_entries_size; ++i) {
+      osfree(dir_entries[i].name);
+   }
+   osfree(dir_entries);
+   dir_entries = NULL;
+   dir_entries_size = dir_entries_used = 0;
+   for (size_t i = 0; i < dir_listings_size; ++i) {
+      osfree(dir_listings[i].dir);
+   }
+   osfree(dir_listings);
+   dir_listings = NULL;
+   dir_listings_size = dir_listings_used = 0;
+#ifdef HAVE_PTHREAD
+   pthread_mutex_unlock(&dir_cache_mutex);
+#endif
+#endif
+}
+
 /* Like fopenWithPthAndExt except that "foreign" paths are translated to
  * native ones (e.g. on Unix dir\file.ext -> dir/file.ext) */
 FILE *
 fopen_portable(const char *pth, const char *fnm, const char *ext,
 	       const char *mode, char **fnmUsed)
 {
-   FILE *fh = fopenWithPthAndExt(pth, fnm, ext, mode, fnmUsed);
+#ifdef _WIN32
+   return fopenWithPthAndExt(pth, fnm, ext, mode, fnmUsed);
+#else
+   FILE *fh = open_with_pth_and_ext(pth, fnm, ext, mode, fnmUsed,
+				    fopen_listed);
    if (fh == NULL) {
-#ifndef _WIN32
       bool changed = false;
       char *fnm_trans = osstrdup(fnm);
       for (char *p = fnm_trans; *p; p++) {
@@ -369,7 +641,8 @@ fopen_portable(const char *pth, const char *fnm, const char *ext,
 	 }
       }
       if (changed)
-	 fh = fopenWithPthAndExt(pth, fnm_trans, ext, mode, fnmUsed);
+	 fh = open_with_pth_and_ext(pth, fnm_trans, ext, mode, fnmUsed,
+				    fopen_listed);
 
       /* To help users process data that originated on a case-insensitive
        * filing system, try lowercasing the filename if not found.
@@ -387,7 +660,8 @@ fopen_portable(const char *pth, const char *fnm, const char *ext,
 	    }
 	 }
 	 if (changed)
-	    fh = fopenWithPthAndExt(pth, fnm_trans, ext, mode, fnmUsed);
+	    fh = open_with_pth_and_ext(pth, fnm_trans, ext, mode, fnmUsed,
+				       fopen_listed);
 
 	 /* If that fails, try upper casing the initial character of the leaf. */
 	 if (fh == NULL) {
@@ -395,7 +669,8 @@ fopen_portable(const char *pth, const char *fnm, const char *ext,
 	    leaf = (leaf ? leaf + 1 : fnm_trans);
 	    if (islower((unsigned char)*leaf)) {
 	       *leaf = toupper((unsigned char)*leaf);
-	       fh = fopenWithPthAndExt(pth, fnm_trans, ext, mode, fnmUsed);
+	       fh = open_with_pth_and_ext(pth, fnm_trans, ext, mode, fnmUsed,
+					  fopen_listed);
 	    }
 	    if (fh == NULL && had_lower) {
 	       /* Finally, try upper casing the filename if it wasn't all
@@ -403,14 +678,15 @@ fopen_portable(const char *pth, const char *fnm, const char *ext,
 	       for (char *p = fnm_trans; *p ; p++) {
 		  *p = toupper((unsigned char)*p);
 	       }
-	       fh = fopenWithPthAndExt(pth, fnm_trans, ext, mode, fnmUsed);
+	       fh = open_with_pth_and_ext(pth, fnm_trans, ext, mode, fnmUsed,
+					  fopen_listed);
 	    }
 	 }
       }
       osfree(fnm_trans);
-#endif
    }
    return fh;
+#endif
 }
 
 void
@@ -448,3 +724,16 @@ filename_delete_output(void)
       osfree(p);
    }
 }
+
+/* Forget the output files without deleting them (in a child process, which
+ * mustn't delete its parent's output if it fails). */
+void
+filename_forget_output(void)
+{
+   while (flhead) {
+      filelist *p = flhead;
+      flhead = flhead->next;
+      osfree(p->fnm);
+      osfree(p);
+   }
+}
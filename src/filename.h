@@ -1,6 +1,6 @@
 /* filename.h
  * OS dependent filename manipulation routines
- * Copyright (C) 1998-2024 Olly Betts
+ * Copyright (C) 1998-2024,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -57,12 +57,16 @@ FILE *fopenWithPthAndExt(const char *pth, const char *fnm, const char *ext,
 FILE *fopen_portable(const char *pth, const char *fnm, const char *ext,
 		     const char *mode, char **fnmUsed);
 
+/* Free the directory listings cached by fopen_portable(). */
+void filename_free_dir_cache(void);
+
 FILE *safe_fopen(const char *fnm, const char *mode);
 FILE *safe_fopen_with_ext(const char *fnm, const char *ext, const char *mode);
 void safe_fclose(FILE *f);
 
 void filename_register_output(const char *fnm);
 void filename_delete_output(void);
+void filename_forget_output(void);
 
 bool fDirectory(const char *fnm);
 
@@ -1,6 +1,6 @@
 /* hash.c */
 /* Hashing functions */
-/* Copyright (C) 1995-2025 Olly Betts
+/* Copyright (C) 1995-2025,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -20,6 +20,7 @@
 #include <config.h>
 
 #include <ctype.h>
+#include <stdint.h>
 
 #include "debug.h"
 #include "hash.h"
@@ -52,3 +53,32 @@ hash_data(const char *p, size_t len)
       hash = (hash * HASH_PRIME + *(const unsigned char*)p) & 0x7fff;
    return hash;
 }
+
+#ifdef __clang__
+__attribute__((no_sanitize("unsigned-integer-overflow")))
+#endif
+unsigned
+hash_data_full_more(unsigned h, const char *p, size_t len)
+{
+   /* FNV-1a */
+   uint32_t hash = h;
+   SVX_ASSERT(p);
+   while (len--) {
+      hash ^= *(const unsigned char*)p++;
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+unsigned
+hash_data_full(const char *p, size_t len)
+{
+   return hash_data_full_more(2166136261u, p, len);
+}
+
+size_t
+hash_table_grow(size_t size, size_t used, size_t initial_size)
+{
+   if ((used + 1) * 2 <= size) return 0;
+   return size ? size * 2 : initial_size;
+}
@@ -1,6 +1,6 @@
 /* hash.h */
 /* Hashing functions */
-/* Copyright (C) 1995-2025 Olly Betts
+/* Copyright (C) 1995-2025,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -24,6 +24,29 @@ extern "C" {
 unsigned hash_string(const char *p);
 unsigned hash_data(const char *p, size_t len);
 
+/* Like hash_data() but the result isn't limited to 15 bits, so it's suitable
+ * for hash tables which can grow large. */
+unsigned hash_data_full(const char *p, size_t len);
+
+/* Continue hash h (from hash_data_full()) over len more bytes at p, so the
+ * hash of several separate pieces of data can be calculated. */
+unsigned hash_data_full_more(unsigned h, const char *p, size_t len);
+
+/* Open-addressing hash tables with linear probing, such as those indexed
+ * using hash_data_full(), have a number of slots which is a power of 2 (or
+ * 0 until the first entry is added) and are grown to keep them at most half
+ * full.
+ *
+ * hash_table_grow() returns the number of slots to grow a table with size
+ * slots (used of which are in use) to before adding an entry, or 0 if it
+ * doesn't need to grow.  initial_size is the size to use for a new table.
+ */
+size_t hash_table_grow(size_t size, size_t used, size_t initial_size);
+
+/* The first slot to probe for hash H, and the slot to probe after I. */
+#define HASH_TABLE_SLOT(H, SIZE) ((size_t)(H) & ((SIZE) - 1))
+#define HASH_TABLE_NEXT(I, SIZE) (((I) + 1) & ((SIZE) - 1))
+
 #ifdef __cplusplus
 }
 #endif
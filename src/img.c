@@ -1,7 +1,7 @@
 /* img.c
  * Routines for reading and writing processed survey data files
  *
- * Copyright (C) 1993-2025 Olly Betts
+ * Copyright (C) 1993-2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -367,7 +367,7 @@ my_lround(double x) {
 }
 #endif
 
-unsigned int img_output_version = IMG_VERSION_MAX;
+unsigned int img_output_version = IMG_VERSION_DEFAULT;
 
 static img_errcode img_errno = IMG_NONE;
 
@@ -1387,7 +1387,7 @@ v03d:
        size_t title_len;
        char * title = getline_alloc_len(pimg->fh, &title_len);
        if (!title) goto out_of_memory_error;
-       if (pimg->version == 8) {
+       if (pimg->version >= 8) {
 	   /* We sneak in extra fields after a zero byte here, containing the
 	    * specified coordinate system (if any) and the level separator
 	    * character.  Older readers will just not see these fields (which
@@ -1678,7 +1678,7 @@ img_write_stream(FILE *stream, int (*close_func)(FILE*),
       if (len < 11 || strcmp(title + len - 11, " (extended)") != 0)
 	 fputs(" (extended)", pimg->fh);
    }
-   if (pimg->version == 8 && ((cs && *cs) || pimg->separator != '.')) {
+   if (pimg->version >= 8 && ((cs && *cs) || pimg->separator != '.')) {
       /* We sneak in extra fields after a zero byte here, containing the
        * specified coordinate system (if any) and the separator character
        * if it isn't the default of '.'.  Older readers will just not see
@@ -1952,6 +1952,7 @@ int
 img_read_item(img *pimg, img_point *p)
 {
    pimg->flags = 0;
+   pimg->have_covariance = 0;
 
    if (pimg->version >= 8) {
       return img_read_item_new(pimg, p);
@@ -2045,6 +2046,18 @@ img_read_item_new(img *pimg, img_point *p)
 		  pimg->H = get32(pimg->fh) / 100.0;
 		  pimg->V = get32(pimg->fh) / 100.0;
 		  return img_ERROR_INFO;
+	      case 0x20: { /* Covariance of the next station's position */
+		  int i;
+		  if (pimg->version < 9) {
+		      img_errno = IMG_BADFORMAT;
+		      return img_BAD;
+		  }
+		  for (i = 0; i < 6; i++) {
+		      pimg->covariance[i] = get32(pimg->fh) / 1000000.0;
+		  }
+		  pimg->have_covariance = 1;
+		  break;
+	      }
 	      case 0x30: case 0x31: /* LRUD */
 	      case 0x32: case 0x33: /* Big LRUD! */
 		  if (read_v8label(pimg, 0, 0) == img_BAD) return img_BAD;
@@ -2070,7 +2083,7 @@ img_read_item_new(img *pimg, img_point *p)
 		      pimg->flags &= ~0x01;
 		  }
 		  return img_XSECT;
-	      default: /* 0x25 - 0x2f and 0x34 - 0x3f are currently unallocated. */
+	      default: /* 0x21 - 0x2f and 0x34 - 0x3f are currently unallocated. */
 		  img_errno = IMG_BADFORMAT;
 		  return img_BAD;
 	  }
@@ -2090,6 +2103,7 @@ img_read_item_new(img *pimg, img_point *p)
       if (!stn_included(pimg)) {
 	 if (!skip_coord(pimg->fh)) return img_BAD;
 	 pimg->pending = 0;
+	 pimg->have_covariance = 0;
 	 goto again3;
       }
 
@@ -3649,6 +3663,21 @@ img_write_errors(img *pimg, int n_legs, double length,
     put32((INT32_T)my_lround(V * 100.0), pimg->fh);
 }
 
+void
+img_write_station_covariance(img *pimg, const double cov[6])
+{
+    int i;
+    if (pimg->version < 9) return;
+    PUTC(0x20, pimg->fh);
+    for (i = 0; i < 6; i++) {
+	/* Stored in mm squared, clamped to what we can represent. */
+	double v = cov[i] * 1000000.0;
+	if (v > 2147483647.0) v = 2147483647.0;
+	if (v < -2147483647.0) v = -2147483647.0;
+	put32((INT32_T)my_lround(v), pimg->fh);
+    }
+}
+
 int
 img_close(img *pimg)
 {
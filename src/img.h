@@ -12,7 +12,7 @@
  *
  * Writing Survex ".3d" image files is supported.
  *
- * Copyright (C) Olly Betts 1993-2025
+ * Copyright (C) Olly Betts 1993-2026
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -149,6 +149,15 @@ typedef struct {
    double length;
    double E, H, V;
 
+   /* Station position covariance - valid when img_LABEL is returned and
+    * have_covariance is non-zero.  The order is xx, yy, zz, xy, xz, yz
+    * (where x is easting, y northing and z altitude) in metres squared.
+    * This is only present if cavern was run with --station-errors and wrote
+    * 3d format version 9 or later.
+    */
+   int have_covariance;
+   double covariance[6];
+
    /* The filename actually opened (e.g. may have ".3d" added).
     *
     * This is only set if img opened the filename - if an existing stream
@@ -217,14 +226,21 @@ typedef struct {
 #define IMG_VERSION_COMPASS_PLT		-2
 #define IMG_VERSION_SURVEX_POS		-1
 
-/* Which version of the file format to output (defaults to newest) */
+/* Which version of the file format to output (defaults to
+ * IMG_VERSION_DEFAULT) */
 extern unsigned int img_output_version;
 
 /* Minimum supported value for img_output_version: */
 #define IMG_VERSION_MIN 1
 
 /* Maximum supported value for img_output_version: */
-#define IMG_VERSION_MAX 8
+#define IMG_VERSION_MAX 9
+
+/* Default value for img_output_version.  Version 9 only adds station
+ * position covariances, so it is only worth writing when there are some
+ * (older readers reject version 9 files).
+ */
+#define IMG_VERSION_DEFAULT 8
 
 /* Open a processed survey data file for reading
  *
@@ -404,6 +420,17 @@ void img_write_item(img *pimg, int code, int flags, const char *s,
 void img_write_errors(img *pimg, int n_legs, double length,
 		      double E, double H, double V);
 
+/* Write the covariance of the position of the station written by the next
+ * img_write_item() call with code img_LABEL.
+ *
+ * cov gives the covariance in metres squared, in the order xx, yy, zz, xy,
+ * xz, yz (where x is easting, y northing and z altitude).
+ *
+ * This is only supported by 3d format version 9 and later - for older
+ * versions this function does nothing.
+ */
+void img_write_station_covariance(img *pimg, const double cov[6]);
+
 /* rewind a processed survey data file opened for reading
  *
  * This is useful if you want to read the data in several passes.
@@ -1,6 +1,6 @@
 /* listpos.c
  * SURVEX Cave surveying software: stuff to do with stn position output
- * Copyright (C) 1991-2002,2011,2012,2013,2014,2024,2025 Olly Betts
+ * Copyright (C) 1991-2002,2011,2012,2013,2014,2024,2025,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -31,6 +31,49 @@
 #include "listpos.h"
 #include "out.h"
 
+/* Merge sort a list of sibling prefixes by identifier. */
+static prefix *
+sort_siblings(prefix *list)
+{
+    if (!list || !list->right) return list;
+
+    /* Split the list in two. */
+    prefix *slow = list, *fast = list->right;
+    while (fast && fast->right) {
+	slow = slow->right;
+	fast = fast->right->right;
+    }
+    prefix *b = sort_siblings(slow->right);
+    slow->right = NULL;
+    prefix *a = sort_siblings(list);
+
+    prefix *head = NULL;
+    prefix **tail = &head;
+    while (a && b) {
+	if (strcmp(prefix_ident(a), prefix_ident(b)) < 0) {
+	    *tail = a;
+	    a = a->right;
+	} else {
+	    *tail = b;
+	    b = b->right;
+	}
+	tail = &(*tail)->right;
+    }
+    *tail = a ? a : b;
+    return head;
+}
+
+/* Return the first child of pfx, sorting its children first if needed. */
+static prefix *
+first_child(prefix *pfx)
+{
+    if (TSTBIT(pfx->sflags, SFLAGS_UNSORTED)) {
+	pfx->down = sort_siblings(pfx->down);
+	pfx->sflags &= ~BIT(SFLAGS_UNSORTED);
+    }
+    return pfx->down;
+}
+
 /* Traverse prefix tree depth first starting at from, and calling function fn
  * at each prefix node in the tree for which:
  *   (prefix->sflags & mask) == need
@@ -42,13 +85,13 @@ traverse_prefix_tree(prefix *from, int mask, int need,
 {
     if ((from->sflags & mask) == need) fn(from);
 
-    prefix *p = from->down;
+    prefix *p = first_child(from);
     if (!p) return;
 
     while (1) {
 	if ((p->sflags & mask) == need) fn(p);
 	if (p->down) {
-	    p = p->down;
+	    p = first_child(p);
 	} else {
 	    while (!p->right) {
 		p = p->up;
@@ -63,7 +106,7 @@ static void
 check_if_unused_fixed_point(prefix *name)
 {
     // TRANSLATORS: fixed survey station that is not part of any survey
-    warning_in_file(name->filename, name->line,
+    warning_in_file(srcloc_filename(name->loc), srcloc_line(name->loc),
 		    /*Unused fixed point “%s”*/73, sprint_prefix(name));
 }
 
@@ -90,7 +133,7 @@ check_node(prefix *p)
 	    /* TRANSLATORS: The first %s is replaced by a station name,
 	     * the second %s by "entrance" or "export".
 	     */
-	    warning_in_file(p->filename, p->line,
+	    warning_in_file(srcloc_filename(p->loc), srcloc_line(p->loc),
 			    /*Station “%s” referred to by *%s but never used*/190,
 			    sprint_prefix(p), "entrance");
 	}
@@ -98,7 +141,7 @@ check_node(prefix *p)
 	    /* TRANSLATORS: The first %s is replaced by a station name,
 	     * the second %s by "entrance" or "export".
 	     */
-	    warning_in_file(p->filename, p->line,
+	    warning_in_file(srcloc_filename(p->loc), srcloc_line(p->loc),
 			    /*Station “%s” referred to by *%s but never used*/190,
 			    sprint_prefix(p), "export");
 	}
@@ -115,7 +158,7 @@ check_node(prefix *p)
 	       SVX_ASSERT(where);
 	       char *s = osstrdup(sprint_prefix(where));
 	       /* Report better when station called 2.1 for example */
-	       while (!where->filename && where->up) where = where->up;
+	       while (!where->loc && where->up) where = where->up;
 
 	       int msgno;
 	       if (TSTBIT(where->sflags, SFLAGS_PREFIX_ENTERED)) {
@@ -140,7 +183,7 @@ check_node(prefix *p)
        if (TSTBIT(p->sflags, SFLAGS_SUSPECTTYPO)) {
 	   /* TRANSLATORS: Here "station" is a survey station, not a train
 	    * station. */
-	   warning_in_file(p->filename, p->line,
+	   warning_in_file(srcloc_filename(p->loc), srcloc_line(p->loc),
 			   /*Station “%s” referred to just once, with an explicit survey name - typo?*/70,
 			   sprint_prefix(p));
        }
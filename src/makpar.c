@@ -0,0 +1,269 @@
+/* makpar.c
+ * Parse the files in a Compass project in worker processes
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Most of the work in processing a Compass .mak project is parsing the .dat
+ * files it lists, and these only interact through the stations they share.
+ * So with --threads we fork worker processes at the start of the project.
+ * Each worker processes the whole .mak file, but only parses every Nth file
+ * in it, recording the effects of parsing each file in the same way as the
+ * parse cache does, and sends the records back through a pipe.
+ *
+ * The main process reads these records in project order and replays each
+ * one, merging stations a record creates with any existing stations of the
+ * same name created by files the worker didn't parse.  If a record can't be
+ * used (for example, the file gave a diagnostic, or a station the worker
+ * already knew about is different in the main process) then the main
+ * process parses the file itself, so the result is always the same as
+ * parsing the files in order.
+ *
+ * Using processes rather than threads means the parser doesn't need to be
+ * able to run more than once at the same time, which it can't as it keeps
+ * its state in global variables.
+ */
+
+#include <config.h>
+
+#include "makpar.h"
+
+#ifdef HAVE_FORK
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "cavern.h"
+#include "filename.h"
+#include "osalloc.h"
+#include "parsecache.h"
+#include "prefetch.h"
+
+/* How many .mak files we're nested inside. */
+static int mak_depth = 0;
+
+/* The number of worker processes, or 0 if we aren't using them. */
+static int n_workers = 0;
+
+/* In the main process, the read end of the pipe from each worker (or -1 if
+ * it couldn't be started or has failed), and its process id (or -1 if it
+ * couldn't be started). */
+static int *worker_fds = NULL;
+static pid_t *worker_pids = NULL;
+
+/* In a worker process, which worker it is and the write end of its pipe.
+ * worker_num is -1 in the main process. */
+static int worker_num = -1;
+static int worker_fd = -1;
+
+/* How many files in the project we've started. */
+static unsigned long file_count = 0;
+
+/* Set up a newly forked worker process. */
+static void
+become_worker(int num, int fd)
+{
+   worker_num = num;
+   worker_fd = fd;
+   /* The main process reports all the diagnostics and writes the output
+    * files, so make sure a worker doesn't do either, even if it fails. */
+   int null_fd = open("/dev/null", O_WRONLY);
+   if (null_fd >= 0) {
+      dup2(null_fd, STDOUT_FILENO);
+      dup2(null_fd, STDERR_FILENO);
+      close(null_fd);
+   }
+   filename_forget_output();
+   watch_stop();
+}
+
+void
+makpar_start(void)
+{
+   if (mak_depth++ || worker_num >= 0 || n_threads < 2) return;
+
+   /* Any reading ahead for *include is done by threads which won't exist in
+    * the workers, so finish it now. */
+   prefetch_finish();
+   /* Don't duplicate any buffered output in the workers. */
+   fflush(NULL);
+
+   n_workers = n_threads;
+   worker_fds = osmalloc(n_workers * ossizeof(int));
+   worker_pids = osmalloc(n_workers * ossizeof(pid_t));
+   for (int i = 0; i < n_workers; ++i) {
+      int fds[2];
+      worker_fds[i] = -1;
+      worker_pids[i] = -1;
+      if (pipe(fds) < 0) continue;
+      pid_t pid = fork();
+      if (pid == 0) {
+	 /* Close the pipes from the workers already started. */
+	 for (int j = 0; j < i; ++j) {
+	    if (worker_fds[j] >= 0) close(worker_fds[j]);
+	 }
+	 close(fds[0]);
+	 become_worker(i, fds[1]);
+	 return;
+      }
+      close(fds[1]);
+      if (pid < 0) {
+	 /* We'll just parse this worker's files ourselves. */
+	 close(fds[0]);
+	 continue;
+      }
+      worker_fds[i] = fds[0];
+      worker_pids[i] = pid;
+   }
+}
+
+/* Read len bytes into p, returning false on error or end of file. */
+static bool
+read_all(int fd, void *p, size_t len)
+{
+   char *q = p;
+   while (len) {
+      ssize_t r = read(fd, q, len);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) return false;
+      q += r;
+      len -= r;
+   }
+   return true;
+}
+
+/* Write len bytes from p, exiting if the main process has gone away. */
+static void
+write_all(int fd, const void *p, size_t len)
+{
+   const char *q = p;
+   while (len) {
+      ssize_t r = write(fd, q, len);
+      if (r < 0) {
+	 if (errno == EINTR) continue;
+	 _exit(EXIT_FAILURE);
+      }
+      q += r;
+      len -= r;
+   }
+}
+
+bool
+makpar_file_begin(void)
+{
+   if (mak_depth != 1 || n_workers == 0) return true;
+   int w = (int)(file_count++ % n_workers);
+   if (worker_num >= 0) {
+      if (w != worker_num) return false;
+      parse_cache_send_next();
+      return true;
+   }
+
+   /* Each record is sent as its key and length, then the record itself.  A
+    * length of 0 means the worker couldn't record the file. */
+   int fd = worker_fds[w];
+   if (fd < 0) return true;
+   uint64_t header[4];
+   unsigned char *data = NULL;
+   if (read_all(fd, header, sizeof(header)) && header[3] <= SIZE_MAX) {
+      size_t len = (size_t)header[3];
+      if (len) {
+	 data = osmalloc(len);
+	 if (!read_all(fd, data, len)) {
+	    osfree(data);
+	    goto failed;
+	 }
+      }
+      parse_cache_offer_record(header, data, len);
+      return true;
+   }
+failed:
+   /* The worker has failed, so parse its remaining files ourselves. */
+   close(fd);
+   worker_fds[w] = -1;
+   return true;
+}
+
+void
+makpar_file_end(void)
+{
+   if (mak_depth != 1 || n_workers == 0) return;
+   if (worker_num < 0) {
+      parse_cache_discard_record();
+      return;
+   }
+   if ((int)((file_count - 1) % n_workers) != worker_num) return;
+   uint64_t header[4] = { 0, 0, 0, 0 };
+   unsigned char *data = NULL;
+   size_t len = 0;
+   if (parse_cache_take_record(header, &data, &len)) header[3] = len;
+   write_all(worker_fd, header, sizeof(header));
+   if (len) write_all(worker_fd, data, len);
+   osfree(data);
+}
+
+void
+makpar_finish(void)
+{
+   if (--mak_depth || n_workers == 0) return;
+   if (worker_num >= 0) {
+      /* We've sent back records for all our files. */
+      close(worker_fd);
+      _exit(EXIT_SUCCESS);
+   }
+   for (int i = 0; i < n_workers; ++i) {
+      if (worker_fds[i] >= 0) close(worker_fds[i]);
+      if (worker_pids[i] < 0) continue;
+      while (waitpid(worker_pids[i], NULL, 0) < 0 && errno == EINTR) { }
+   }
+   osfree(worker_fds);
+   osfree(worker_pids);
+   worker_fds = NULL;
+   worker_pids = NULL;
+   n_workers = 0;
+   file_count = 0;
+}
+
+#else
+
+void
+makpar_start(void)
+{
+}
+
+bool
+makpar_file_begin(void)
+{
+   return true;
+}
+
+void
+makpar_file_end(void)
+{
+}
+
+void
+makpar_finish(void)
+{
+}
+
+#endif
@@ -0,0 +1,44 @@
+/* makpar.h
+ * Parse the files in a Compass project in worker processes
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef MAKPAR_H
+#define MAKPAR_H
+
+#include <stdbool.h>
+
+/* Call at the start of processing a Compass .mak file.  For the outermost
+ * .mak file this starts worker processes if --threads allows more than one.
+ */
+void makpar_start(void);
+
+/* Call before each file listed in the .mak file.  Returns false if the
+ * file should be skipped (because this is a worker process and another
+ * worker is parsing that file).
+ */
+bool makpar_file_begin(void);
+
+/* Call after each file listed in the .mak file (including skipped ones). */
+void makpar_file_end(void);
+
+/* Call at the end of processing a Compass .mak file.  Doesn't return in a
+ * worker process.
+ */
+void makpar_finish(void);
+
+#endif
@@ -1,6 +1,6 @@
 /* matrix.c
  * Matrix building and solving routines
- * Copyright (C) 1993-2003,2010,2013,2024 Olly Betts
+ * Copyright (C) 1993-2003,2010,2013,2024,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -17,17 +17,19 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
-/*#define SOR 1*/
-
 #if 0
 # define DEBUG_INVALID 1
 #endif
 
 #include <config.h>
 
+#include <string.h>
+
 #include "debug.h"
 #include "cavern.h"
+#include "choleski.h"
 #include "filename.h"
+#include "hash.h"
 #include "message.h"
 #include "netbits.h"
 #include "matrix.h"
@@ -46,24 +48,46 @@
 static void print_matrix(real *M, real *B, long n);
 #endif
 
-static void choleski(real *M, real *B, long n);
+/* The solvers are in matrixsolve.c, which we include once for each value
+ * of FACTOR (the number of unknowns per station) with the function names
+ * suffixed by _<FACTOR>:
+ *
+ * FACTOR 3 solves the x, y and z coordinates together, taking into account
+ * the covariances between them.
+ *
+ * FACTOR 1 ignores covariances (which is selected at runtime by
+ * --no-covariances) and solves each dimension in turn, which is a lot
+ * cheaper.  If cavern is built with NO_COVARIANCES defined then this is
+ * the only option.
+ */
+#define SOLVE_FN(N) SOLVE_FN_(N, FACTOR)
+#define SOLVE_FN_(N, F) SOLVE_FN__(N, F)
+#define SOLVE_FN__(N, F) N##_##F
 
-#ifdef SOR
-static void sor(real *M, real *B, long n);
+#ifdef NO_COVARIANCES
+# define SOLVER(N) N##_1
+#else
+# define SOLVER(N) (f_no_covariances ? N##_1 : N##_3)
+#endif
+
+static void solve_dense_1(node *list, long n, pos **stn_tab);
+static bool solve_sparse_1(node *list, long n, pos **stn_tab, bool covariance);
+static void solve_iterative_1(node *list, long n, pos **stn_tab,
+			      solve_info *info);
+#ifndef NO_COVARIANCES
+static void solve_dense_3(node *list, long n, pos **stn_tab);
+static bool solve_sparse_3(node *list, long n, pos **stn_tab, bool covariance);
+static void solve_iterative_3(node *list, long n, pos **stn_tab,
+			      solve_info *info);
 #endif
 
-/* for M(row, col) col must be <= row, so Y <= X */
-# define M(X, Y) ((real *)M)[((((OSSIZE_T)(X)) * ((X) + 1)) >> 1) + (Y)]
-	      /* +(Y>X?0*printf("row<col (line %d)\n",__LINE__):0) */
-/*#define M_(X, Y) ((real *)M)[((((OSSIZE_T)(Y)) * ((Y) + 1)) >> 1) + (X)]*/
 
 static void set_row(node *stn, int row_number) {
     // We store the matrix row/column index in stn->colour for quick and easy
     // lookup when copying out the solved station coordinates.
     stn->colour = row_number;
-    for (int d = 0; d < 3; d++) {
+    for (int d = 0; stn->leg[d]; d++) {
 	linkfor *leg = stn->leg[d];
-	if (!leg) break;
 	node *to = leg->l.to;
 	if (to->colour < 0 && stn->name->pos == to->name->pos) {
 	    set_row(to, row_number);
@@ -71,260 +95,299 @@ static void set_row(node *stn, int row_number) {
     }
 }
 
-#ifdef NO_COVARIANCES
-# define FACTOR 1
-#else
-# define FACTOR 3
-#endif
+/* Systems with fewer than this many unknown positions are solved using a
+ * dense matrix - for these the sparse code's extra bookkeeping costs more
+ * than it saves.  Larger systems are too if the sparse factor would be
+ * nearly dense anyway (see dense_is_cheaper()).
+ */
+#define SPARSE_MIN_N 16
 
-/* Find positions for a subset of the reduced network by solving a matrix
- * equation.
- *
- * list is a non-empty linked list of unfixed stations to solve for.
- *
- * As a pre-condition, all stations in list must have a negative value for
- * stn->colour.  This can be ensured by the caller (which avoids having to
- * make an extra pass over the list just to set the colours suitably).
+/* Systems with more unknown positions than this always use the sparse code,
+ * since a dense matrix needs O(n^2) memory.
  */
-extern void
-solve_matrix(node *list)
+#define DENSE_MAX_N 1000
+
+/* How many times cheaper a block operation in the dense factorisation is
+ * than one in the sparse factorisation, which has to work through index
+ * arrays one element at a time.
+ */
+#define DENSE_SPEEDUP 4
+
+/* Assign a matrix row/column index to each group of stations in list with
+ * the same pos, and return the number of rows.
+ */
+static long
+assign_rows(node *list)
 {
-   // Assign a matrix row/column index to each group of stations with the same
-   // pos.
-   //
-   // We also set listend to the last station in the list while doing so, which
-   // we use after solving to splice list into fixedlist.
-   node *listend = NULL;
    long n = 0;
    for (node *stn = list; stn; stn = stn->next) {
-      listend = stn;
       if (stn->colour < 0) {
 	  set_row(stn, n++);
       }
    }
    SVX_ASSERT(n > 0);
+   return n;
+}
 
-   // Array to map from row/column index to pos.  We fill this in as we build
-   // the matrix, and use it to know where to copy the solved station
-   // coordinates to.
-   pos **stn_tab = osmalloc((OSSIZE_T)(n * ossizeof(pos*)));
-
-   /* (OSSIZE_T) cast may be needed if n >= 181 */
-   real *M = osmalloc((OSSIZE_T)((((OSSIZE_T)n * FACTOR * (n * FACTOR + 1)) >> 1)) * ossizeof(real));
-   real *B = osmalloc((OSSIZE_T)(n * FACTOR * ossizeof(real)));
-
+static void
+report_solving(long n)
+{
    if (!fQuiet) {
       if (n == 1)
 	 out_current_action(msg(/*Solving one equation*/78));
       else
 	 out_current_action1(msg(/*Solving %d simultaneous equations*/75), n);
    }
+}
 
-#ifdef NO_COVARIANCES
-   int dim = 2;
-#else
-   int dim = 0; /* Collapse loop to a single iteration. */
-#endif
-   for ( ; dim >= 0; dim--) {
-      /* Initialise M and B to zero - zeroing "linearly" will minimise
-       * paging when the matrix is large */
-      {
-	 int end = n * FACTOR;
-	 for (int row = 0; row < end; row++) B[row] = (real)0.0;
-	 end = ((OSSIZE_T)n * FACTOR * (n * FACTOR + 1)) >> 1;
-	 for (int row = 0; row < end; row++) M[row] = (real)0.0;
-      }
+/* How many systems each solver has been used for, indexed by SOLVED_DENSE,
+ * etc.  Only updated from the main thread.
+ */
+static unsigned long n_solved[4];
 
-      /* Construct matrix by going through the stn list.
-       *
-       * All legs between two fixed stations can be ignored here.
-       *
-       * Other legs we want to add exactly once to M.  To achieve this we
-       * want to:
-       *
-       * - add forward legs between two unfixed stations,
-       *
-       * - add legs from unfixed stations to fixed stations (we do them from
-       *   the unfixed end so we don't need to detect when we're at a fixed
-       *   point cut line and determine which side we're currently dealing
-       *   with).
-       *
-       * To implement this, we only look at legs from unfixed stations and add
-       * a leg if to a fixed station, or to an unfixed station and it's a
-       * forward leg.
-       */
-      for (node *stn = list; stn; stn = stn->next) {
-	 if (dim == 0) {
-	     stn_tab[stn->colour] = stn->name->pos;
-	 }
+void
+print_solve_stats(void)
+{
+   printf("Systems solved: %lu dense, %lu sparse, %lu iterative, %lu reused\n",
+	  n_solved[SOLVED_DENSE], n_solved[SOLVED_SPARSE],
+	  n_solved[SOLVED_ITERATIVE], n_solved[SOLVED_REUSED]);
+}
 
-#ifdef NO_COVARIANCES
-	 real e;
-#else
-	 svar e;
-	 delta a;
-#endif
-#if DEBUG_MATRIX_BUILD
-	 print_prefix(stn->name);
-	 printf(" used: %d colour %ld\n",
-		(!!stn->leg[2]) << 2 | (!!stn -> leg[1]) << 1 | (!!stn->leg[0]),
-		stn->colour);
-
-	 for (int dirn = 0; dirn <= 2 && stn->leg[dirn]; dirn++) {
-	    printf("Leg %d, vx=%f, reverse=%d, to ", dirn,
-		   stn->leg[dirn]->v[0], stn->leg[dirn]->l.reverse);
-	    print_prefix(stn->leg[dirn]->l.to->name);
-	    putnl();
-	 }
-	 putnl();
-#endif /* DEBUG_MATRIX_BUILD */
-
-	 int f = stn->colour;
-	 SVX_ASSERT(f >= 0);
-	 {
-	    for (int dirn = 0; dirn <= 2 && stn->leg[dirn]; dirn++) {
-	       linkfor *leg = stn->leg[dirn];
-	       node *to = leg->l.to;
-	       if (fixed(to)) {
-		  bool fRev = !data_here(leg);
-		  if (fRev) leg = reverse_leg(leg);
-		  /* Ignore equated nodes */
-#ifdef NO_COVARIANCES
-		  e = leg->v[dim];
-		  if (e != (real)0.0) {
-		     e = ((real)1.0) / e;
-		     M(f,f) += e;
-		     B[f] += e * POS(to, dim);
-		     if (fRev) {
-			B[f] += leg->d[dim];
-		     } else {
-			B[f] -= leg->d[dim];
-		     }
-		  }
-#else
-		  if (invert_svar(&e, &leg->v)) {
-		     if (fRev) {
-			adddd(&a, &POSD(to), &leg->d);
-		     } else {
-			subdd(&a, &POSD(to), &leg->d);
-		     }
-		     delta b;
-		     mulsd(&b, &e, &a);
-		     for (int i = 0; i < 3; i++) {
-			M(f * FACTOR + i, f * FACTOR + i) += e[i];
-			B[f * FACTOR + i] += b[i];
-		     }
-		     M(f * FACTOR + 1, f * FACTOR) += e[3];
-		     M(f * FACTOR + 2, f * FACTOR) += e[4];
-		     M(f * FACTOR + 2, f * FACTOR + 1) += e[5];
-		  }
-#endif
-	       } else if (data_here(leg) &&
-			  (leg->l.reverse & FLAG_ARTICULATION) == 0) {
-		  /* forward leg, unfixed -> unfixed */
-		  int t = to->colour;
-		  SVX_ASSERT(t >= 0);
-#if DEBUG_MATRIX
-# ifdef NO_COVARIANCES
-		  printf("Leg %d to %d, var %f, delta %f\n", f, t, e,
-			 leg->d[dim]);
-# else
-		  printf("Leg %d to %d, var (%f, %f, %f; %f, %f, %f), "
-			 "delta %f\n", f, t, e[0], e[1], e[2], e[3], e[4], e[5],
-			 leg->d[dim]);
-# endif
-#endif
-		  /* Ignore equated nodes & lollipops */
-#ifdef NO_COVARIANCES
-		  e = leg->v[dim];
-		  if (t != f && e != (real)0.0) {
-		     e = ((real)1.0) / e;
-		     M(f,f) += e;
-		     M(t,t) += e;
-		     if (f < t) M(t,f) -= e; else M(f,t) -= e;
-		     real a = e * leg->d[dim];
-		     B[f] -= a;
-		     B[t] += a;
-		  }
-#else
-		  if (t != f && invert_svar(&e, &leg->v)) {
-		     mulsd(&a, &e, &leg->d);
-		     for (int i = 0; i < 3; i++) {
-			M(f * FACTOR + i, f * FACTOR + i) += e[i];
-			M(t * FACTOR + i, t * FACTOR + i) += e[i];
-			if (f < t)
-			   M(t * FACTOR + i, f * FACTOR + i) -= e[i];
-			else
-			   M(f * FACTOR + i, t * FACTOR + i) -= e[i];
-			B[f * FACTOR + i] -= a[i];
-			B[t * FACTOR + i] += a[i];
-		     }
-		     M(f * FACTOR + 1, f * FACTOR) += e[3];
-		     M(t * FACTOR + 1, t * FACTOR) += e[3];
-		     M(f * FACTOR + 2, f * FACTOR) += e[4];
-		     M(t * FACTOR + 2, t * FACTOR) += e[4];
-		     M(f * FACTOR + 2, f * FACTOR + 1) += e[5];
-		     M(t * FACTOR + 2, t * FACTOR + 1) += e[5];
-		     if (f < t) {
-			M(t * FACTOR + 1, f * FACTOR) -= e[3];
-			M(t * FACTOR, f * FACTOR + 1) -= e[3];
-			M(t * FACTOR + 2, f * FACTOR) -= e[4];
-			M(t * FACTOR, f * FACTOR + 2) -= e[4];
-			M(t * FACTOR + 2, f * FACTOR + 1) -= e[5];
-			M(t * FACTOR + 1, f * FACTOR + 2) -= e[5];
-		     } else {
-			M(f * FACTOR + 1, t * FACTOR) -= e[3];
-			M(f * FACTOR, t * FACTOR + 1) -= e[3];
-			M(f * FACTOR + 2, t * FACTOR) -= e[4];
-			M(f * FACTOR, t * FACTOR + 2) -= e[4];
-			M(f * FACTOR + 2, t * FACTOR + 1) -= e[5];
-			M(f * FACTOR + 1, t * FACTOR + 2) -= e[5];
-		     }
-		  }
-#endif
-	       }
+/* With --watch, we describe each system we solve by a signature which
+ * includes everything the solution depends on: the legs between the unknown
+ * stations, the legs to fixed stations along with the fixed positions, and
+ * the options which select the solver.  The signature followed by the
+ * solution is passed on to the watching process, which hands back those
+ * from the previous run via remember_solution().  A block of the network
+ * which an edit didn't affect will have the same signature as last time, so
+ * we can just copy its solution.
+ */
+typedef struct {
+   char *p;
+   size_t len, size;
+} signature;
+
+static void
+sig_add(signature *sig, const void *data, size_t len)
+{
+   if (sig->size - sig->len < len) {
+      do {
+	 sig->size = sig->size ? sig->size * 2 : 1024;
+      } while (sig->size - sig->len < len);
+      sig->p = osrealloc(sig->p, sig->size);
+   }
+   memcpy(sig->p + sig->len, data, len);
+   sig->len += len;
+}
+
+static void
+system_signature(signature *sig, node *list, long n)
+{
+   unsigned long opts = optimize & (BITA('i') | BITA('j'));
+   // The number of rows must come first - see remember_solution().
+   sig_add(sig, &n, sizeof(n));
+   sig_add(sig, &f_no_covariances, sizeof(f_no_covariances));
+   sig_add(sig, &opts, sizeof(opts));
+   sig_add(sig, &iterate_tolerance, sizeof(iterate_tolerance));
+   for (node *stn = list; stn; stn = stn->next) {
+      sig_add(sig, &stn->colour, sizeof(stn->colour));
+      for (int d = 0; stn->leg[d]; d++) {
+	 linkfor *leg = stn->leg[d];
+	 node *to = leg->l.to;
+	 if (fixed(to)) {
+	    if (data_here(leg)) {
+	       sig_add(sig, "f", 1);
+	    } else {
+	       sig_add(sig, "r", 1);
+	       leg = reverse_leg(leg);
 	    }
+	    sig_add(sig, POSD(to), sizeof(delta));
+	 } else if (data_here(leg) &&
+		    (leg->l.reverse & FLAG_ARTICULATION) == 0) {
+	    sig_add(sig, "u", 1);
+	    sig_add(sig, &to->colour, sizeof(to->colour));
+	 } else {
+	    // The solver ignores this leg.
+	    continue;
 	 }
+	 sig_add(sig, leg->d, sizeof(delta));
+	 sig_add(sig, leg->v, sizeof(svar));
       }
+      sig_add(sig, "", 1);
+   }
+}
 
-#if PRINT_MATRICES
-      print_matrix(M, B, n * FACTOR); /* 'ave a look! */
-#endif
+/* A system solved by an earlier run: the signature is followed by the
+ * coordinates for each row.
+ */
+typedef struct {
+   char *data;
+   size_t sig_len;
+   unsigned hash;
+} solved_system;
+
+/* Hash table of solved systems (see hash.h). */
+static solved_system *solved = NULL;
+static size_t solved_size = 0, solved_count = 0;
+
+static const solved_system *
+find_solution(const signature *sig, unsigned h)
+{
+   if (solved_count == 0) return NULL;
+   size_t i = HASH_TABLE_SLOT(h, solved_size);
+   while (solved[i].data) {
+      const solved_system *s = &solved[i];
+      if (s->hash == h && s->sig_len == sig->len &&
+	  memcmp(s->data, sig->p, sig->len) == 0) {
+	 return s;
+      }
+      i = HASH_TABLE_NEXT(i, solved_size);
+   }
+   return NULL;
+}
 
-#ifdef SOR
-      /* defined in network.c, may be altered by -z<letters> on command line */
-      if (optimize & BITA('i'))
-	 sor(M, B, n * FACTOR);
-      else
-#endif
-	 choleski(M, B, n * FACTOR);
+void
+remember_solution(const char *data, size_t len)
+{
+   long n;
+   SVX_ASSERT(len >= sizeof(n));
+   memcpy(&n, data, sizeof(n));
+   SVX_ASSERT(len >= n * sizeof(delta) + sizeof(n));
+   size_t sig_len = len - n * sizeof(delta);
+   unsigned h = hash_data_full(data, sig_len);
+
+   size_t new_size = hash_table_grow(solved_size, solved_count, 64);
+   if (new_size) {
+      /* Rehash into the larger table. */
+      solved_system *old = solved;
+      size_t old_size = solved_size;
+      solved = osmalloc(new_size * ossizeof(solved_system));
+      solved_size = new_size;
+      for (size_t i = 0; i < solved_size; i++) solved[i].data = NULL;
+      for (size_t j = 0; j < old_size; j++) {
+	 if (!old[j].data) continue;
+	 size_t i = HASH_TABLE_SLOT(old[j].hash, solved_size);
+	 while (solved[i].data) i = HASH_TABLE_NEXT(i, solved_size);
+	 solved[i] = old[j];
+      }
+      osfree(old);
+   }
 
-      {
-	 for (int m = (int)(n - 1); m >= 0; m--) {
-#ifdef NO_COVARIANCES
-	    stn_tab[m]->p[dim] = B[m];
-	    if (dim == 0) {
-	       SVX_ASSERT2(pos_fixed(stn_tab[m]),
-		       "setting station coordinates didn't mark pos as fixed");
-	    }
-#else
-	    for (int i = 0; i < 3; i++) {
-	       stn_tab[m]->p[i] = B[m * FACTOR + i];
-	    }
-	    SVX_ASSERT2(pos_fixed(stn_tab[m]),
-		    "setting station coordinates didn't mark pos as fixed");
-#endif
+   size_t i = HASH_TABLE_SLOT(h, solved_size);
+   while (solved[i].data) {
+      // The same system could appear twice, but we only need it once.
+      if (solved[i].hash == h && solved[i].sig_len == sig_len &&
+	  memcmp(solved[i].data, data, sig_len) == 0) {
+	 return;
+      }
+      i = HASH_TABLE_NEXT(i, solved_size);
+   }
+   solved[i].data = osmalloc(len);
+   memcpy(solved[i].data, data, len);
+   solved[i].sig_len = sig_len;
+   solved[i].hash = h;
+   ++solved_count;
+}
+
+void
+forget_solutions(void)
+{
+   for (size_t i = 0; i < solved_size; i++) osfree(solved[i].data);
+   osfree(solved);
+   solved = NULL;
+   solved_size = solved_count = 0;
+}
+
+/* Pass on the signature and solution of a system to the watching process.
+ * Must be called from the main thread.
+ */
+static void
+pass_on_solution(const solve_info *info)
+{
+   if (!info->solution) return;
+   watch_solution(info->solution, info->solution_len);
+   if (info->method != SOLVED_REUSED) osfree(info->solution);
+}
+
+/* Note which solver was used, and report how an iterative solve went (if
+ * one was used).
+ */
+static void
+report_convergence(const solve_info *info)
+{
+   ++n_solved[info->method];
+   if (info->iterations == 0) return;
+   if (info->residual > iterate_tolerance) {
+      /* TRANSLATORS: Warning when cavern's iterative solver (selected with
+       * the -zi or -zj development options) stops before reaching the
+       * requested accuracy.  The residual is relative to that of the
+       * initial estimate. */
+      warning(/*Iterative solving stopped after %d iterations with relative residual %g*/536,
+	      info->iterations, (double)info->residual);
+   } else if (!fQuiet) {
+      /* TRANSLATORS: Report from cavern's iterative solver (selected with
+       * the -zi or -zj development options). */
+      printf(msg(/*Converged after %d iterations with relative residual %g*/535),
+	     info->iterations, (double)info->residual);
+      putnl();
+   }
+}
+
+/* Solve for the positions of the n rows assigned by assign_rows(). */
+static void
+solve_rows(node *list, long n, solve_info *info)
+{
+   info->n = n;
+   info->iterations = 0;
+   info->residual = 0.0;
+   info->solution = NULL;
+
+   // Array to map from row/column index to pos.  We use it to know where to
+   // copy the solved station coordinates to.
+   pos **stn_tab = osmalloc((OSSIZE_T)(n * ossizeof(pos*)));
+   for (node *stn = list; stn; stn = stn->next) {
+      stn_tab[stn->colour] = stn->name->pos;
+   }
+
+   signature sig = { NULL, 0, 0 };
+   if (f_watch) {
+      system_signature(&sig, list, n);
+      const solved_system *s = find_solution(&sig, hash_data_full(sig.p, sig.len));
+      if (s) {
+	 const char *p = s->data + s->sig_len;
+	 for (long m = 0; m < n; m++) {
+	    memcpy(stn_tab[m]->p, p + m * sizeof(delta), sizeof(delta));
 	 }
+	 info->method = SOLVED_REUSED;
+	 info->solution = s->data;
+	 info->solution_len = s->sig_len + n * sizeof(delta);
+	 osfree(sig.p);
+	 osfree(stn_tab);
+	 return;
       }
    }
 
-   // Put the solved stations back on fixedlist.
-   listend->next = fixedlist;
-   if (fixedlist) fixedlist->prev = listend;
-   fixedlist = list;
+   /* optimize is defined in network.c, and may be altered by -z<letters> on
+    * the command line. */
+   if (optimize & (BITA('i') | BITA('j'))) {
+      info->method = SOLVED_ITERATIVE;
+      SOLVER(solve_iterative)(list, n, stn_tab, info);
+   } else if (n >= SPARSE_MIN_N &&
+	      SOLVER(solve_sparse)(list, n, stn_tab, false)) {
+      info->method = SOLVED_SPARSE;
+   } else {
+      info->method = SOLVED_DENSE;
+      SOLVER(solve_dense)(list, n, stn_tab);
+   }
+
+   if (f_watch) {
+      for (long m = 0; m < n; m++) {
+	 sig_add(&sig, stn_tab[m]->p, sizeof(delta));
+      }
+      info->solution = sig.p;
+      info->solution_len = sig.len;
+   }
 
-   osfree(B);
-   osfree(M);
    osfree(stn_tab);
 
 #if DEBUG_MATRIX
@@ -336,119 +399,428 @@ solve_matrix(node *list)
 #endif
 }
 
-/* Solve MX=B for X by first factoring M into LDL'.  This is a modified form
- * of Choleski factorisation - the original Choleski factorisation is LL',
- * but this modified version has the advantage of avoiding O(n) square root
- * calculations.
- */
-/* Note M must be symmetric positive definite */
-/* routine is entitled to scribble on M and B if it wishes */
+/* Put the solved stations in list back on fixedlist. */
 static void
-choleski(real *M, real *B, long n)
+splice_onto_fixedlist(node *list)
 {
-   for (int j = 1; j < n; j++) {
-      real V;
-      for (int i = 0; i < j; i++) {
-	 V = (real)0.0;
-	 for (int k = 0; k < i; k++) V += M(i,k) * M(j,k) * M(k,k);
-	 M(j,i) = (M(j,i) - V) / M(i,i);
+   node *listend = list;
+   while (listend->next) listend = listend->next;
+   listend->next = fixedlist;
+   if (fixedlist) fixedlist->prev = listend;
+   fixedlist = list;
+}
+
+/* Find positions for a subset of the reduced network by solving a matrix
+ * equation.
+ *
+ * list is a non-empty linked list of unfixed stations to solve for.
+ *
+ * As a pre-condition, all stations in list must have a negative value for
+ * stn->colour.  This can be ensured by the caller (which avoids having to
+ * make an extra pass over the list just to set the colours suitably).
+ */
+extern void
+solve_matrix(node *list)
+{
+   solve_info info;
+   long n = assign_rows(list);
+   report_solving(n);
+   solve_rows(list, n, &info);
+   report_convergence(&info);
+   pass_on_solution(&info);
+   splice_onto_fixedlist(list);
+}
+
+/* Like solve_matrix(), but doesn't report progress or touch fixedlist, so
+ * it's safe to call from several threads at once provided the lists are
+ * disjoint and every station adjacent to a list is already fixed.
+ *
+ * Details of the solve are stored in *info, which should be passed to
+ * solve_matrix_finish() along with list.
+ */
+extern void
+solve_matrix_unspliced(node *list, solve_info *info)
+{
+   long n = assign_rows(list);
+   solve_rows(list, n, info);
+}
+
+/* Finish off a solve_matrix_unspliced() call - this must be called from
+ * the main thread.
+ */
+extern void
+solve_matrix_finish(node *list, const solve_info *info)
+{
+   report_solving(info->n);
+   report_convergence(info);
+   pass_on_solution(info);
+   splice_onto_fixedlist(list);
+}
+
+/* Calculate the covariance of the position of each station in list which
+ * doesn't already have one (stations which were fixed before solving should
+ * have been given a zero covariance).
+ *
+ * This needs to be called once the network has been solved and restored to
+ * its original form, since the reductions we make to solve it don't
+ * preserve the covariances.  We can then factorise the matrix for the whole
+ * network in one go, and the cost is similar to solving it.
+ */
+extern void
+compute_station_covariances(node *list)
+{
+   for (node *stn = list; stn; stn = stn->next) stn->colour = -1;
+   long n = 0;
+   for (node *stn = list; stn; stn = stn->next) {
+      if (stn->colour < 0 && !stn->name->pos->var) {
+	  set_row(stn, n++);
       }
-      V = (real)0.0;
-      for (int k = 0; k < j; k++) V += M(j,k) * M(j,k) * M(k,k);
-      M(j,j) -= V; /* may be best to add M() last for numerical reasons too */
    }
+   if (n == 0) return;
 
-   /* Multiply x by L inverse */
-   for (int i = 0; i < n - 1; i++) {
-      for (int j = i + 1; j < n; j++) {
-	 B[j] -= M(j,i) * B[i];
-      }
+   pos **stn_tab = osmalloc((OSSIZE_T)(n * ossizeof(pos*)));
+   for (node *stn = list; stn; stn = stn->next) {
+      if (stn->colour >= 0) stn_tab[stn->colour] = stn->name->pos;
    }
+   (void)SOLVER(solve_sparse)(list, n, stn_tab, true);
+   osfree(stn_tab);
+}
+
+/* Is stn's position one of the unknowns?  When solving these are the
+ * unfixed stations, but when calculating covariances (see
+ * compute_station_covariances()) they're the stations we don't yet have a
+ * covariance for.
+ */
+static inline bool
+is_unknown(const node *stn, bool covariance)
+{
+   return covariance ? stn->name->pos->var == NULL : !fixed(stn);
+}
+
+/* Does leg from stn contribute an off-diagonal block?
+ *
+ * When solving, a leg flagged as an articulation joins stn to a part of the
+ * network which is solved separately, but when calculating covariances we
+ * work with the whole network.
+ */
+static inline bool
+is_off_diagonal_leg(const node *stn, const linkfor *leg, bool covariance)
+{
+   const node *to = leg->l.to;
+   return is_unknown(to, covariance) && data_here(leg) &&
+	  (covariance || (leg->l.reverse & FLAG_ARTICULATION) == 0) &&
+	  to->colour != stn->colour;
+}
 
-   /* Multiply x by D inverse */
-   for (int i = 0; i < n; i++) {
-      B[i] /= M(i,i);
+/* Find a fill-reducing elimination order for the graph with n vertices
+ * given by adjacency lists adj_i[adj_p[v]] ... adj_i[adj_p[v + 1] - 1].
+ *
+ * We use the minimum degree heuristic, explicitly maintaining the
+ * elimination graph.  Survey networks are very sparse and close to planar so
+ * the elimination graph stays small.
+ *
+ * Returns a newly allocated array perm with perm[k] giving the vertex to
+ * eliminate at step k.
+ */
+static int *
+min_degree_order(long n, const OSSIZE_T *adj_p, const int *adj_i)
+{
+   int **nbr = osmalloc(n * ossizeof(int*));
+   int *deg = osmalloc(n * ossizeof(int));
+   int *cap = osmalloc(n * ossizeof(int));
+   // Doubly linked lists of vertices bucketed by current degree.
+   int *head = osmalloc(n * ossizeof(int));
+   int *next = osmalloc(n * ossizeof(int));
+   int *prev = osmalloc(n * ossizeof(int));
+   int *mark = osmalloc(n * ossizeof(int));
+   int *tmp = osmalloc(n * ossizeof(int));
+   int *perm = osmalloc(n * ossizeof(int));
+
+   for (long v = 0; v < n; v++) {
+      head[v] = -1;
+      mark[v] = -1;
+   }
+   for (long v = n - 1; v >= 0; v--) {
+      int d = (int)(adj_p[v + 1] - adj_p[v]);
+      deg[v] = cap[v] = d;
+      nbr[v] = NULL;
+      if (d) {
+	 nbr[v] = osmalloc(d * ossizeof(int));
+	 memcpy(nbr[v], adj_i + adj_p[v], d * sizeof(int));
+      }
+      prev[v] = -1;
+      next[v] = head[d];
+      if (next[v] >= 0) prev[next[v]] = (int)v;
+      head[d] = (int)v;
    }
 
-   /* Multiply x by (L transpose) inverse */
-   for (int i = (int)(n - 1); i > 0; i--) {
-      for (int j = i - 1; j >= 0; j--) {
-	 B[j] -= M(i,j) * B[i];
+   int min_deg = 0;
+   for (long k = 0; k < n; k++) {
+      while (head[min_deg] < 0) ++min_deg;
+      int v = head[min_deg];
+      head[min_deg] = next[v];
+      if (next[v] >= 0) prev[next[v]] = -1;
+      perm[k] = v;
+      // Mark v as eliminated - it'll never be unmarked as marks we use below
+      // are always < n.
+      mark[v] = (int)n;
+
+      // Eliminating v makes its neighbours into a clique.
+      for (int j = 0; j < deg[v]; j++) {
+	 int u = nbr[v][j];
+	 // Unlink u from its degree bucket.
+	 if (prev[u] >= 0) next[prev[u]] = next[u]; else head[deg[u]] = next[u];
+	 if (next[u] >= 0) prev[next[u]] = prev[u];
+
+	 int len = 0;
+	 for (int i = 0; i < deg[u]; i++) {
+	    int w = nbr[u][i];
+	    if (mark[w] == n) continue;
+	    mark[w] = u;
+	    tmp[len++] = w;
+	 }
+	 mark[u] = u;
+	 for (int i = 0; i < deg[v]; i++) {
+	    int w = nbr[v][i];
+	    if (mark[w] == u) continue;
+	    tmp[len++] = w;
+	 }
+	 mark[u] = -1;
+	 if (len > cap[u]) {
+	    cap[u] = len * 2;
+	    nbr[u] = osrealloc(nbr[u], cap[u] * ossizeof(int));
+	 }
+	 memcpy(nbr[u], tmp, len * sizeof(int));
+	 deg[u] = len;
+
+	 prev[u] = -1;
+	 next[u] = head[len];
+	 if (next[u] >= 0) prev[next[u]] = u;
+	 head[len] = u;
+	 if (len < min_deg) min_deg = len;
+      }
+      // Clear the marks we set on v's neighbours' neighbours - we can't
+      // leave them as a later vertex u could match.
+      for (int j = 0; j < deg[v]; j++) {
+	 int u = nbr[v][j];
+	 for (int i = 0; i < deg[u]; i++) {
+	    int w = nbr[u][i];
+	    if (mark[w] != n) mark[w] = -1;
+	 }
       }
+      osfree(nbr[v]);
+      nbr[v] = NULL;
    }
 
-   /* printf("\n%ld/%ld\n\n",flops,flopsTot); */
+   osfree(tmp);
+   osfree(mark);
+   osfree(prev);
+   osfree(next);
+   osfree(head);
+   osfree(cap);
+   osfree(deg);
+   osfree(nbr);
+   return perm;
 }
 
-#ifdef SOR
-/* factor to use for SOR (must have 1 <= SOR_factor < 2) */
-#define SOR_factor 1.93 /* 1.95 */
+static int
+cmp_int(const void *a, const void *b)
+{
+   int x = *(const int *)a, y = *(const int *)b;
+   return (x > y) - (x < y);
+}
 
-/* Solve MX=B for X by SOR of Gauss-Siedel */
-/* routine is entitled to scribble on M and B if it wishes */
+/* Compute the elimination tree (parent) and the number of entries in each
+ * column of L (lnz) for the n by n symmetric matrix whose upper triangle is
+ * given in compressed column form by Ap and Ai (row indices in each column
+ * must be <= the column index).
+ */
 static void
-sor(real *M, real *B, long n)
+ldl_symbolic(long n, const OSSIZE_T *Ap, const int *Ai,
+	     int *parent, OSSIZE_T *lnz, int *flag)
 {
-   long it = 0;
-
-   real *X = osmalloc(n * ossizeof(real));
-
-   const real threshold = 0.00001;
-
-   printf("reciprocating diagonal\n"); /* TRANSLATE */
-
-   /* munge diagonal so we can multiply rather than divide */
-   for (int row = n - 1; row >= 0; row--) {
-      M(row,row) = 1 / M(row,row);
-      X[row] = 0;
+   for (long k = 0; k < n; k++) {
+      parent[k] = -1;
+      flag[k] = (int)k;
+      lnz[k] = 0;
+      for (OSSIZE_T p = Ap[k]; p < Ap[k + 1]; p++) {
+	 // Follow the path from i to the root of the etree, stopping at the
+	 // first node already flagged as in row k of L.
+	 for (int i = Ai[p]; flag[i] != k; i = parent[i]) {
+	    if (parent[i] < 0) parent[i] = (int)k;
+	    lnz[i]++;
+	    flag[i] = (int)k;
+	 }
+      }
    }
+}
 
-   printf("starting iteration\n"); /* TRANSLATE */
-
-   real t;
-   do {
-      /*printf("*");*/
-      it++;
-      t = 0.0;
-      for (int row = 0; row < n; row++) {
-	 real x = B[row];
-	 int col;
-	 for (col = 0; col < row; col++) x -= M(row,col) * X[col];
-	 for (col++; col < n; col++) x -= M(col,row) * X[col];
-	 x *= M(row,row);
-	 real sor_delta = (x - X[row]) * SOR_factor;
-	 X[row] += sor_delta;
-	 real t2 = fabs(sor_delta);
-	 if (t2 > t) t = t2;
-      }
-      printf("% 6ld: %8.6f\n", it, t);
-   } while (t >= threshold && it < 100000);
+/* Would it be cheaper to solve the n by n block system with upper triangle
+ * structure bp and bi (in the form ldl_symbolic() takes, after reordering)
+ * using a dense matrix?
+ *
+ * Factorising needs about sum(c * c) / 2 block operations where c is the
+ * number of blocks in each column of L, which for a dense matrix is about
+ * n^3 / 6.
+ */
+static bool
+dense_is_cheaper(long n, const OSSIZE_T *bp, const int *bi)
+{
+   if (n > DENSE_MAX_N) return false;
+   int *parent = osmalloc(n * ossizeof(int));
+   OSSIZE_T *lnz = osmalloc(n * ossizeof(OSSIZE_T));
+   int *flag = osmalloc(n * ossizeof(int));
+   ldl_symbolic(n, bp, bi, parent, lnz, flag);
+   double sparse_ops = 0.0;
+   for (long k = 0; k < n; k++) sparse_ops += (double)lnz[k] * lnz[k];
+   osfree(flag);
+   osfree(lnz);
+   osfree(parent);
+   return (double)n * n * n / 3.0 < DENSE_SPEEDUP * sparse_ops;
+}
 
-   if (t >= threshold) {
-      fprintf(stderr, "*not* converged after %ld iterations\n", it);
-      BUG("iteration stinks");
+/* Numerically factorise the matrix into L D L' using an up-looking
+ * algorithm, computing one row of L at a time.  Lp must have been set up
+ * from the column counts found by ldl_symbolic().
+ */
+static void
+ldl_numeric(long n, const OSSIZE_T *Ap, const int *Ai, const real *Ax,
+	    const OSSIZE_T *Lp, const int *parent, OSSIZE_T *lnz,
+	    int *Li, real *Lx, real *D, real *Y, int *pattern, int *flag)
+{
+   for (long k = 0; k < n; k++) {
+      // Scatter column k of A into Y and find the nonzero pattern of row k
+      // of L (in topological order, in pattern[top] ... pattern[n - 1]).
+      Y[k] = (real)0.0;
+      long top = n;
+      flag[k] = (int)k;
+      lnz[k] = 0;
+      for (OSSIZE_T p = Ap[k]; p < Ap[k + 1]; p++) {
+	 int i = Ai[p];
+	 Y[i] += Ax[p];
+	 long len = 0;
+	 for ( ; flag[i] != k; i = parent[i]) {
+	    pattern[len++] = i;
+	    flag[i] = (int)k;
+	 }
+	 while (len > 0) pattern[--top] = pattern[--len];
+      }
+      // Compute the numerical values of row k of L.
+      D[k] = Y[k];
+      Y[k] = (real)0.0;
+      for ( ; top < n; top++) {
+	 int i = pattern[top];
+	 real yi = Y[i];
+	 Y[i] = (real)0.0;
+	 OSSIZE_T p, p2 = Lp[i] + lnz[i];
+	 for (p = Lp[i]; p < p2; p++) Y[Li[p]] -= Lx[p] * yi;
+	 real l_ki = yi / D[i];
+	 D[k] -= l_ki * yi;
+	 Li[p] = (int)k;
+	 Lx[p] = l_ki;
+	 lnz[i]++;
+      }
    }
+}
 
-   printf("%ld iterations\n", it); /* TRANSLATE */
-
-#if 0
-   putnl();
-   for (int row = n - 1; row >= 0; row--) {
-      t = 0.0;
-      for (int col = 0; col < row; col++) t += M(row, col) * X[col];
-      t += X[row] / M(row, row);
-      for (col = row + 1; col < n; col++)
-	 t += M(col, row) * X[col];
-      printf("[ %f %f ]\n", t, B[row]);
+/* Solve L D L' x = b, overwriting b with x. */
+static void
+ldl_solve(long n, real *b, const OSSIZE_T *Lp, const int *Li,
+	  const real *Lx, const real *D)
+{
+   for (long j = 0; j < n; j++) {
+      for (OSSIZE_T p = Lp[j]; p < Lp[j + 1]; p++) b[Li[p]] -= Lx[p] * b[j];
    }
-#endif
+   for (long j = 0; j < n; j++) b[j] /= D[j];
+   for (long j = n - 1; j >= 0; j--) {
+      for (OSSIZE_T p = Lp[j]; p < Lp[j + 1]; p++) b[j] -= Lx[p] * b[Li[p]];
+   }
+}
 
-   for (int row = n - 1; row >= 0; row--) B[row] = X[row];
+/* Compute the entries of Z = A^-1 which are in the pattern of the
+ * factorisation L D L' (found by ldl_numeric()) using the recurrence of
+ * Takahashi, Fagan and Chin:
+ *
+ *   Z(i,j) = -sum(L(k,j) Z(i,k), k > j)	for i > j
+ *   Z(j,j) = 1 / D(j) - sum(L(k,j) Z(k,j), k > j)
+ *
+ * Working backwards from the last column, every Z(i,k) needed is in the
+ * pattern and has already been computed, so this costs about the same as
+ * the factorisation.  Zx has the same structure as Lx, and the diagonal is
+ * stored in Zd.
+ */
+static void
+ldl_sparse_inverse(long n, const OSSIZE_T *Lp, const int *Li,
+		   const real *Lx, const real *D, real *Zx, real *Zd)
+{
+   for (long j = n - 1; j >= 0; j--) {
+      OSSIZE_T p_end = Lp[j + 1];
+      for (OSSIZE_T p = Lp[j]; p < p_end; p++) Zx[p] = (real)0.0;
+      for (OSSIZE_T q = Lp[j]; q < p_end; q++) {
+	 int k = Li[q];
+	 real l_kj = Lx[q];
+	 Zx[q] -= l_kj * Zd[k];
+	 // The rows after k in column j are a subset of those in column k,
+	 // and both are in increasing order, so we can find each Z(i,k)
+	 // with a single pass along column k.  We use each Z(i,k) = Z(k,i)
+	 // twice - for Z(i,j) and for Z(k,j).
+	 OSSIZE_T r = Lp[k];
+	 for (OSSIZE_T p = q + 1; p < p_end; p++) {
+	    int i = Li[p];
+	    while (Li[r] != i) {
+	       ++r;
+	       SVX_ASSERT(r < Lp[k + 1]);
+	    }
+	    Zx[p] -= l_kj * Zx[r];
+	    Zx[q] -= Lx[p] * Zx[r];
+	 }
+      }
+      real z_jj = ((real)1.0) / D[j];
+      for (OSSIZE_T p = Lp[j]; p < p_end; p++) z_jj -= Lx[p] * Zx[p];
+      Zd[j] = z_jj;
+   }
+}
 
-   osfree(X);
-   printf("\ndone\n"); /* TRANSLATE */
+/* The sparse and iterative solvers work from the matrix in block compressed
+ * sparse row form.  Both triangles are stored - the off-diagonal blocks in
+ * row r are in columns j[p[r]] ... j[p[r + 1] - 1] (in increasing order)
+ * with values at x + k * BLOCK_SIZE.
+ *
+ * Equated stations are separate nodes which share a row, so here all the
+ * legs of a row end up together, and parallel legs are merged into a single
+ * block.  Once this has been built we don't need to walk the legs again.
+ */
+typedef struct {
+   long n;
+   OSSIZE_T *p;
+   int *j;
+   real *x;
+   /* The diagonal blocks. */
+   real *diag;
+   /* The right hand side. */
+   real *B;
+} block_system;
+
+/* Block incomplete Choleski factorisation with no fill-in.  The strictly
+ * lower triangle is stored in compressed row form - the blocks in row I are
+ * at Lj[Lp[I]] ... Lj[Lp[I + 1] - 1] (in increasing column order) with
+ * values at Lx + p * BLOCK_SIZE.
+ */
+typedef struct {
+   OSSIZE_T *Lp;
+   int *Lj;
+   real *Lx;
+   /* Work space, and then L D (which we need while factorising). */
+   real *Xx;
+} ic_factor;
+
+static real
+dot_product(const real *a, const real *b, long n)
+{
+   real t = (real)0.0;
+   for (long i = 0; i < n; i++) t += a[i] * b[i];
+   return t;
 }
-#endif
 
 #if PRINT_MATRICES
 static void
@@ -465,3 +837,13 @@ print_matrix(real *M, real *B, long n)
    return;
 }
 #endif
+
+#define FACTOR 1
+#include "matrixsolve.c"
+#undef FACTOR
+
+#ifndef NO_COVARIANCES
+# define FACTOR 3
+# include "matrixsolve.c"
+# undef FACTOR
+#endif
@@ -1,6 +1,6 @@
 /* matrix.h
  * Header file for matrix building and solving routines
- * Copyright (C) 1993,1994,2001 Olly Betts
+ * Copyright (C) 1993,1994,2001,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -17,4 +17,38 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+/* Values for solve_info's method member. */
+#define SOLVED_DENSE 0
+#define SOLVED_SPARSE 1
+#define SOLVED_ITERATIVE 2
+#define SOLVED_REUSED 3 /* solution from an earlier run of cavern --watch */
+
+/* Details of solving one system of equations. */
+typedef struct {
+   long n; /* number of equations */
+   int method; /* which solver was used (SOLVED_DENSE, etc) */
+   int iterations; /* iterations used (0 if solved directly) */
+   real residual; /* relative residual (if solved iteratively) */
+   char *solution; /* signature and solution to pass on for --watch */
+   size_t solution_len;
+} solve_info;
+
 void solve_matrix(node *list);
+
+void solve_matrix_unspliced(node *list, solve_info *info);
+
+void solve_matrix_finish(node *list, const solve_info *info);
+
+void compute_station_covariances(node *list);
+
+/* Note a system solved by an earlier run of cavern --watch (data and len
+ * are as passed to watch_solution()), so that it doesn't need solving
+ * again if it's unchanged.
+ */
+void remember_solution(const char *data, size_t len);
+
+/* Forget all the systems passed to remember_solution(). */
+void forget_solutions(void);
+
+/* Report how many systems each solver was used for (for --internal-stats). */
+void print_solve_stats(void);
@@ -0,0 +1,1036 @@
+/* matrixsolve.c
+ * Matrix building and solving routines - included by matrix.c with FACTOR
+ * defined to the number of unknowns per station
+ * Copyright (C) 1993-2003,2010,2013,2024,2026 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* With FACTOR 1 the three dimensions are solved separately using just the
+ * variances in leg->v[dim] (which is all there is if NO_COVARIANCES is
+ * defined).
+ */
+
+#define solve_dense SOLVE_FN(solve_dense)
+#define find_block SOLVE_FN(find_block)
+#define leg_weight SOLVE_FN(leg_weight)
+#define blk_mul_add SOLVE_FN(blk_mul_add)
+#define system_structure SOLVE_FN(system_structure)
+#define system_block SOLVE_FN(system_block)
+#define system_assemble SOLVE_FN(system_assemble)
+#define system_multiply SOLVE_FN(system_multiply)
+#define system_free SOLVE_FN(system_free)
+#define solve_sparse SOLVE_FN(solve_sparse)
+#define blk_mul_t_sub SOLVE_FN(blk_mul_t_sub)
+#define blk_mul SOLVE_FN(blk_mul)
+#define blk_mul_t_sub_blk SOLVE_FN(blk_mul_t_sub_blk)
+#define blk_invert SOLVE_FN(blk_invert)
+#define ic_structure SOLVE_FN(ic_structure)
+#define ic_load SOLVE_FN(ic_load)
+#define ic_numeric SOLVE_FN(ic_numeric)
+#define ic_apply SOLVE_FN(ic_apply)
+#define ic_free SOLVE_FN(ic_free)
+#define solve_iterative SOLVE_FN(solve_iterative)
+
+/* Solve using a dense packed lower triangle.  This needs O(n^2) memory and
+ * O(n^3) time, but has less overhead than solve_sparse() for small systems.
+ */
+static void
+solve_dense(node *list, long n, pos **stn_tab)
+{
+   /* (OSSIZE_T) cast may be needed if n >= 181 */
+   real *M = osmalloc((OSSIZE_T)((((OSSIZE_T)n * FACTOR * (n * FACTOR + 1)) >> 1)) * ossizeof(real));
+   real *B = osmalloc((OSSIZE_T)(n * FACTOR * ossizeof(real)));
+
+#if FACTOR == 1
+   int dim = 2;
+#else
+   int dim = 0; /* Collapse loop to a single iteration. */
+#endif
+   for ( ; dim >= 0; dim--) {
+      /* Initialise M and B to zero - zeroing "linearly" will minimise
+       * paging when the matrix is large */
+      {
+	 int end = n * FACTOR;
+	 for (int row = 0; row < end; row++) B[row] = (real)0.0;
+	 end = ((OSSIZE_T)n * FACTOR * (n * FACTOR + 1)) >> 1;
+	 for (int row = 0; row < end; row++) M[row] = (real)0.0;
+      }
+
+      /* Construct matrix by going through the stn list.
+       *
+       * All legs between two fixed stations can be ignored here.
+       *
+       * Other legs we want to add exactly once to M.  To achieve this we
+       * want to:
+       *
+       * - add forward legs between two unfixed stations,
+       *
+       * - add legs from unfixed stations to fixed stations (we do them from
+       *   the unfixed end so we don't need to detect when we're at a fixed
+       *   point cut line and determine which side we're currently dealing
+       *   with).
+       *
+       * To implement this, we only look at legs from unfixed stations and add
+       * a leg if to a fixed station, or to an unfixed station and it's a
+       * forward leg.
+       */
+      for (node *stn = list; stn; stn = stn->next) {
+#if FACTOR == 1
+	 real e;
+#else
+	 svar e;
+	 delta a;
+#endif
+#if DEBUG_MATRIX_BUILD
+	 int n_legs = 0;
+	 while (stn->leg[n_legs]) n_legs++;
+	 print_prefix(stn->name);
+	 printf(" legs: %d colour %ld\n", n_legs, stn->colour);
+
+	 for (int dirn = 0; stn->leg[dirn]; dirn++) {
+	    printf("Leg %d, vx=%f, reverse=%u, to ", dirn,
+		   stn->leg[dirn]->v[0], stn->leg[dirn]->l.reverse);
+	    print_prefix(stn->leg[dirn]->l.to->name);
+	    putnl();
+	 }
+	 putnl();
+#endif /* DEBUG_MATRIX_BUILD */
+
+	 int f = stn->colour;
+	 SVX_ASSERT(f >= 0);
+	 {
+	    for (int dirn = 0; stn->leg[dirn]; dirn++) {
+	       linkfor *leg = stn->leg[dirn];
+	       node *to = leg->l.to;
+	       if (fixed(to)) {
+		  bool fRev = !data_here(leg);
+		  if (fRev) leg = reverse_leg(leg);
+		  /* Ignore equated nodes */
+#if FACTOR == 1
+		  e = leg->v[dim];
+		  if (e != (real)0.0) {
+		     e = ((real)1.0) / e;
+		     M(f,f) += e;
+		     if (fRev) {
+			B[f] += e * (POS(to, dim) + leg->d[dim]);
+		     } else {
+			B[f] += e * (POS(to, dim) - leg->d[dim]);
+		     }
+		  }
+#else
+		  if (invert_svar(&e, &leg->v)) {
+		     if (fRev) {
+			adddd(&a, &POSD(to), &leg->d);
+		     } else {
+			subdd(&a, &POSD(to), &leg->d);
+		     }
+		     delta b;
+		     mulsd(&b, &e, &a);
+		     for (int i = 0; i < 3; i++) {
+			M(f * FACTOR + i, f * FACTOR + i) += e[i];
+			B[f * FACTOR + i] += b[i];
+		     }
+		     M(f * FACTOR + 1, f * FACTOR) += e[3];
+		     M(f * FACTOR + 2, f * FACTOR) += e[4];
+		     M(f * FACTOR + 2, f * FACTOR + 1) += e[5];
+		  }
+#endif
+	       } else if (data_here(leg) &&
+			  (leg->l.reverse & FLAG_ARTICULATION) == 0) {
+		  /* forward leg, unfixed -> unfixed */
+		  int t = to->colour;
+		  SVX_ASSERT(t >= 0);
+#if DEBUG_MATRIX
+# if FACTOR == 1
+		  printf("Leg %d to %d, var %f, delta %f\n", f, t, e,
+			 leg->d[dim]);
+# else
+		  printf("Leg %d to %d, var (%f, %f, %f; %f, %f, %f), "
+			 "delta %f\n", f, t, e[0], e[1], e[2], e[3], e[4], e[5],
+			 leg->d[dim]);
+# endif
+#endif
+		  /* Ignore equated nodes & lollipops */
+#if FACTOR == 1
+		  e = leg->v[dim];
+		  if (t != f && e != (real)0.0) {
+		     e = ((real)1.0) / e;
+		     M(f,f) += e;
+		     M(t,t) += e;
+		     if (f < t) M(t,f) -= e; else M(f,t) -= e;
+		     real a = e * leg->d[dim];
+		     B[f] -= a;
+		     B[t] += a;
+		  }
+#else
+		  if (t != f && invert_svar(&e, &leg->v)) {
+		     mulsd(&a, &e, &leg->d);
+		     for (int i = 0; i < 3; i++) {
+			M(f * FACTOR + i, f * FACTOR + i) += e[i];
+			M(t * FACTOR + i, t * FACTOR + i) += e[i];
+			if (f < t)
+			   M(t * FACTOR + i, f * FACTOR + i) -= e[i];
+			else
+			   M(f * FACTOR + i, t * FACTOR + i) -= e[i];
+			B[f * FACTOR + i] -= a[i];
+			B[t * FACTOR + i] += a[i];
+		     }
+		     M(f * FACTOR + 1, f * FACTOR) += e[3];
+		     M(t * FACTOR + 1, t * FACTOR) += e[3];
+		     M(f * FACTOR + 2, f * FACTOR) += e[4];
+		     M(t * FACTOR + 2, t * FACTOR) += e[4];
+		     M(f * FACTOR + 2, f * FACTOR + 1) += e[5];
+		     M(t * FACTOR + 2, t * FACTOR + 1) += e[5];
+		     if (f < t) {
+			M(t * FACTOR + 1, f * FACTOR) -= e[3];
+			M(t * FACTOR, f * FACTOR + 1) -= e[3];
+			M(t * FACTOR + 2, f * FACTOR) -= e[4];
+			M(t * FACTOR, f * FACTOR + 2) -= e[4];
+			M(t * FACTOR + 2, f * FACTOR + 1) -= e[5];
+			M(t * FACTOR + 1, f * FACTOR + 2) -= e[5];
+		     } else {
+			M(f * FACTOR + 1, t * FACTOR) -= e[3];
+			M(f * FACTOR, t * FACTOR + 1) -= e[3];
+			M(f * FACTOR + 2, t * FACTOR) -= e[4];
+			M(f * FACTOR, t * FACTOR + 2) -= e[4];
+			M(f * FACTOR + 2, t * FACTOR + 1) -= e[5];
+			M(f * FACTOR + 1, t * FACTOR + 2) -= e[5];
+		     }
+		  }
+#endif
+	       }
+	    }
+	 }
+      }
+
+#if PRINT_MATRICES
+      print_matrix(M, B, n * FACTOR); /* 'ave a look! */
+#endif
+
+#if FACTOR == 1
+      choleski(M, B, n * FACTOR);
+#else
+      choleski_blocked(M, B, n * FACTOR);
+#endif
+
+      {
+	 for (int m = (int)(n - 1); m >= 0; m--) {
+#if FACTOR == 1
+	    stn_tab[m]->p[dim] = B[m];
+	    if (dim == 0) {
+	       SVX_ASSERT2(pos_fixed(stn_tab[m]),
+		       "setting station coordinates didn't mark pos as fixed");
+	    }
+#else
+	    for (int i = 0; i < 3; i++) {
+	       stn_tab[m]->p[i] = B[m * FACTOR + i];
+	    }
+	    SVX_ASSERT2(pos_fixed(stn_tab[m]),
+		    "setting station coordinates didn't mark pos as fixed");
+#endif
+	 }
+      }
+   }
+
+   osfree(B);
+   osfree(M);
+}
+
+/* The sparse solver works in terms of "blocks" - each block is a row/column
+ * index as assigned by set_row() and corresponds to FACTOR rows/columns of
+ * the matrix.  The network graph gives us the block sparsity pattern
+ * directly, so we never need to form the dense matrix.
+ */
+#define BLOCK_SIZE (FACTOR * FACTOR)
+
+/* Return the index in bx of block (row, col) where row <= col. */
+static OSSIZE_T
+find_block(const OSSIZE_T *bp, const int *bi, int row, int col)
+{
+   OSSIZE_T lo = bp[col], hi = bp[col + 1] - 1;
+   while (lo < hi) {
+      OSSIZE_T mid = lo + (hi - lo) / 2;
+      if (bi[mid] < row) lo = mid + 1; else hi = mid;
+   }
+   SVX_ASSERT(bi[lo] == row);
+   return lo * BLOCK_SIZE;
+}
+
+/* Set w to the weight (inverse variance) of leg as a full block.  Returns
+ * false if the leg has zero variance (i.e. it's an equate).
+ */
+static bool
+leg_weight(real *w, const linkfor *leg, int dim)
+{
+#if FACTOR == 1
+   real v = leg->v[dim];
+   if (v == (real)0.0) return false;
+   w[0] = ((real)1.0) / v;
+#else
+   svar e;
+   (void)dim;
+   if (!invert_svar(&e, &leg->v)) return false;
+   w[0] = e[0];
+   w[4] = e[1];
+   w[8] = e[2];
+   w[1] = w[3] = e[3];
+   w[2] = w[6] = e[4];
+   w[5] = w[7] = e[5];
+#endif
+   return true;
+}
+
+/* y += A x for FACTOR by FACTOR block A. */
+static inline void
+blk_mul_add(real *y, const real *A, const real *x)
+{
+   for (int r = 0; r < FACTOR; r++) {
+      for (int c = 0; c < FACTOR; c++) y[r] += A[r * FACTOR + c] * x[c];
+   }
+}
+
+/* Set up the structure of the matrix from the legs. */
+static void
+system_structure(block_system *a, node *list, long n, bool covariance)
+{
+   OSSIZE_T *p = osmalloc((n + 1) * ossizeof(OSSIZE_T));
+   for (long i = 0; i <= n; i++) p[i] = 0;
+   for (node *stn = list; stn; stn = stn->next) {
+      if (!is_unknown(stn, covariance)) continue;
+      for (int dirn = 0; stn->leg[dirn]; dirn++) {
+	 linkfor *leg = stn->leg[dirn];
+	 if (is_off_diagonal_leg(stn, leg, covariance)) {
+	    p[stn->colour + 1]++;
+	    p[leg->l.to->colour + 1]++;
+	 }
+      }
+   }
+   for (long i = 0; i < n; i++) p[i + 1] += p[i];
+   int *j = osmalloc((p[n] + 1) * ossizeof(int));
+   {
+      OSSIZE_T *fill = osmalloc(n * ossizeof(OSSIZE_T));
+      memcpy(fill, p, n * sizeof(OSSIZE_T));
+      for (node *stn = list; stn; stn = stn->next) {
+	 if (!is_unknown(stn, covariance)) continue;
+	 for (int dirn = 0; stn->leg[dirn]; dirn++) {
+	    linkfor *leg = stn->leg[dirn];
+	    if (is_off_diagonal_leg(stn, leg, covariance)) {
+	       int f = stn->colour, t = leg->l.to->colour;
+	       j[fill[f]++] = t;
+	       j[fill[t]++] = f;
+	    }
+	 }
+      }
+      osfree(fill);
+   }
+   // Sort each row and remove duplicates (from parallel legs) in place.
+   OSSIZE_T out = 0, start = 0;
+   for (long i = 0; i < n; i++) {
+      OSSIZE_T end = p[i + 1];
+      qsort(j + start, end - start, sizeof(int), cmp_int);
+      p[i] = out;
+      for (OSSIZE_T k = start; k < end; k++) {
+	 if (k > start && j[k] == j[k - 1]) continue;
+	 j[out++] = j[k];
+      }
+      start = end;
+   }
+   p[n] = out;
+   a->n = n;
+   a->p = p;
+   a->j = j;
+   a->x = osmalloc((out + 1) * BLOCK_SIZE * ossizeof(real));
+   a->diag = osmalloc(n * BLOCK_SIZE * ossizeof(real));
+   a->B = osmalloc(n * FACTOR * ossizeof(real));
+}
+
+/* Find the off-diagonal block for row r, column c. */
+static real *
+system_block(const block_system *a, int r, int c)
+{
+   const int *lo = a->j + a->p[r], *hi = a->j + a->p[r + 1] - 1;
+   while (lo < hi) {
+      const int *mid = lo + (hi - lo) / 2;
+      if (*mid < c) lo = mid + 1; else hi = mid;
+   }
+   SVX_ASSERT(*lo == c);
+   return a->x + (lo - a->j) * BLOCK_SIZE;
+}
+
+/* Fill in the values of the matrix and right hand side for dimension dim
+ * (which is ignored unless FACTOR is 1).  We add the same contributions as
+ * solve_dense(), but the right hand side is for positions relative to
+ * origin.  With FACTOR 1 each leg's offset is weighted by the inverse of its
+ * variance in dimension dim, just as the full covariance is used otherwise.
+ */
+static void
+system_assemble(block_system *a, node *list, int dim, bool covariance,
+		const real *origin)
+{
+   long n = a->n;
+   for (OSSIZE_T i = 0; i < a->p[n] * BLOCK_SIZE; i++) a->x[i] = (real)0.0;
+   for (long i = 0; i < n * BLOCK_SIZE; i++) a->diag[i] = (real)0.0;
+   for (long i = 0; i < n * FACTOR; i++) a->B[i] = (real)0.0;
+   for (node *stn = list; stn; stn = stn->next) {
+      if (!is_unknown(stn, covariance)) continue;
+      int f = stn->colour;
+      real *diag_f = a->diag + f * BLOCK_SIZE;
+      real *B_f = a->B + f * FACTOR;
+      for (int dirn = 0; stn->leg[dirn]; dirn++) {
+	 linkfor *leg = stn->leg[dirn];
+	 node *to = leg->l.to;
+	 real w[BLOCK_SIZE];
+	 real d[FACTOR];
+	 if (!is_unknown(to, covariance)) {
+	    bool fRev = !data_here(leg);
+	    if (fRev) leg = reverse_leg(leg);
+	    /* Ignore equated nodes */
+	    if (!leg_weight(w, leg, dim)) continue;
+	    for (int i = 0; i < FACTOR; i++) {
+#if FACTOR == 1
+	       d[i] = POS(to, dim) - origin[i];
+	       if (fRev) d[i] += leg->d[dim]; else d[i] -= leg->d[dim];
+#else
+	       d[i] = POS(to, i) - origin[i];
+	       if (fRev) d[i] += leg->d[i]; else d[i] -= leg->d[i];
+#endif
+	    }
+	    blk_mul_add(B_f, w, d);
+	    for (int i = 0; i < BLOCK_SIZE; i++) diag_f[i] += w[i];
+	 } else if (is_off_diagonal_leg(stn, leg, covariance)) {
+	    /* forward leg, unfixed -> unfixed */
+	    /* Ignore equated nodes */
+	    if (!leg_weight(w, leg, dim)) continue;
+	    int t = to->colour;
+	    for (int i = 0; i < FACTOR; i++) d[i] = (real)0.0;
+#if FACTOR == 1
+	    d[0] = w[0] * leg->d[dim];
+#else
+	    blk_mul_add(d, w, leg->d);
+#endif
+	    real *diag_t = a->diag + t * BLOCK_SIZE;
+	    real *off_ft = system_block(a, f, t);
+	    real *off_tf = system_block(a, t, f);
+	    for (int i = 0; i < FACTOR; i++) {
+	       B_f[i] -= d[i];
+	       a->B[t * FACTOR + i] += d[i];
+	    }
+	    for (int i = 0; i < BLOCK_SIZE; i++) {
+	       diag_f[i] += w[i];
+	       diag_t[i] += w[i];
+	       off_ft[i] -= w[i];
+	       off_tf[i] -= w[i];
+	    }
+	 }
+      }
+   }
+}
+
+/* Set y = A x. */
+static void
+system_multiply(const block_system *a, const real *x, real *y)
+{
+   for (long r = 0; r < a->n; r++) {
+      real *y_r = y + r * FACTOR;
+      for (int i = 0; i < FACTOR; i++) y_r[i] = (real)0.0;
+      blk_mul_add(y_r, a->diag + r * BLOCK_SIZE, x + r * FACTOR);
+      for (OSSIZE_T k = a->p[r]; k < a->p[r + 1]; k++) {
+	 blk_mul_add(y_r, a->x + k * BLOCK_SIZE, x + a->j[k] * FACTOR);
+      }
+   }
+}
+
+static void
+system_free(block_system *a)
+{
+   osfree(a->B);
+   osfree(a->diag);
+   osfree(a->x);
+   osfree(a->j);
+   osfree(a->p);
+}
+
+/* Solve using a sparse L D L' factorisation.  We reorder the blocks to
+ * reduce fill-in so the time and memory needed scale with the number of
+ * nonzeros in the factor, which for a cave survey network is typically not
+ * much more than the number of legs.
+ *
+ * If covariance is true, we instead calculate the covariance of each
+ * unknown position (the corresponding diagonal block of the inverse of the
+ * matrix) and leave the positions alone.  In this case list can also
+ * contain stations which aren't unknowns, which we skip over.
+ *
+ * Otherwise, if the reordered factor would be nearly dense we return false
+ * without solving, and the caller should use solve_dense() instead.
+ */
+static bool
+solve_sparse(node *list, long n, pos **stn_tab, bool covariance)
+{
+   block_system sys;
+   system_structure(&sys, list, n, covariance);
+
+   int *perm = min_degree_order(n, sys.p, sys.j);
+   int *iperm = osmalloc(n * ossizeof(int));
+   for (long k = 0; k < n; k++) iperm[perm[k]] = (int)k;
+
+   // Upper triangle of the permuted block matrix in compressed column form.
+   // The diagonal block is the last entry in each column.
+   OSSIZE_T *bp = osmalloc((n + 1) * ossizeof(OSSIZE_T));
+   int *bi = osmalloc((sys.p[n] / 2 + n) * ossizeof(int));
+   bp[0] = 0;
+   for (long k = 0; k < n; k++) {
+      int v = perm[k];
+      OSSIZE_T q = bp[k];
+      for (OSSIZE_T p = sys.p[v]; p < sys.p[v + 1]; p++) {
+	 int row = iperm[sys.j[p]];
+	 if (row < k) bi[q++] = row;
+      }
+      qsort(bi + bp[k], q - bp[k], sizeof(int), cmp_int);
+      bi[q++] = (int)k;
+      bp[k + 1] = q;
+   }
+
+   if (!covariance && dense_is_cheaper(n, bp, bi)) {
+      osfree(bi);
+      osfree(bp);
+      osfree(iperm);
+      osfree(perm);
+      system_free(&sys);
+      return false;
+   }
+
+   // Expand the block structure to the scalar structure.  Entry p of
+   // column k comes from element blk_idx[p] of bx.
+   long n_cols = n * FACTOR;
+   OSSIZE_T *Ap = osmalloc((n_cols + 1) * ossizeof(OSSIZE_T));
+   OSSIZE_T nnz_a = (bp[n] - n) * BLOCK_SIZE + n * (FACTOR * (FACTOR + 1) / 2);
+   int *Ai = osmalloc(nnz_a * ossizeof(int));
+   OSSIZE_T *blk_idx = osmalloc(nnz_a * ossizeof(OSSIZE_T));
+   {
+      OSSIZE_T q = 0;
+      Ap[0] = 0;
+      for (long k = 0; k < n; k++) {
+	 for (int c = 0; c < FACTOR; c++) {
+	    for (OSSIZE_T p = bp[k]; p < bp[k + 1]; p++) {
+	       int r_end = (bi[p] == k) ? c + 1 : FACTOR;
+	       for (int r = 0; r < r_end; r++) {
+		  Ai[q] = bi[p] * FACTOR + r;
+		  blk_idx[q] = p * BLOCK_SIZE + r * FACTOR + c;
+		  q++;
+	       }
+	    }
+	    Ap[k * FACTOR + c + 1] = q;
+	 }
+      }
+      SVX_ASSERT(q == nnz_a);
+   }
+
+   int *parent = osmalloc(n_cols * ossizeof(int));
+   OSSIZE_T *lnz = osmalloc(n_cols * ossizeof(OSSIZE_T));
+   int *flag = osmalloc(n_cols * ossizeof(int));
+   ldl_symbolic(n_cols, Ap, Ai, parent, lnz, flag);
+   OSSIZE_T *Lp = osmalloc((n_cols + 1) * ossizeof(OSSIZE_T));
+   Lp[0] = 0;
+   for (long k = 0; k < n_cols; k++) Lp[k + 1] = Lp[k] + lnz[k];
+   int *Li = osmalloc((Lp[n_cols] + 1) * ossizeof(int));
+   real *Lx = osmalloc((Lp[n_cols] + 1) * ossizeof(real));
+   real *D = osmalloc(n_cols * ossizeof(real));
+   real *Y = osmalloc(n_cols * ossizeof(real));
+   int *pattern = osmalloc(n_cols * ossizeof(int));
+   real *Ax = osmalloc(nnz_a * ossizeof(real));
+   real *bx = osmalloc(bp[n] * BLOCK_SIZE * ossizeof(real));
+   real *B = osmalloc(n_cols * ossizeof(real));
+   static const real origin[FACTOR];
+   real *Zx = NULL, *Zd = NULL;
+#if FACTOR == 1
+   // We can't set p->var until we've done all three dimensions, as that
+   // would change which stations is_unknown() says are unknowns.
+   real *Zv = NULL;
+#endif
+   if (covariance) {
+      Zx = osmalloc((Lp[n_cols] + 1) * ossizeof(real));
+      Zd = osmalloc(n_cols * ossizeof(real));
+#if FACTOR == 1
+      Zv = osmalloc(n * 3 * ossizeof(real));
+#endif
+   }
+
+#if FACTOR == 1
+   int dim = 2;
+#else
+   int dim = 0; /* Collapse loop to a single iteration. */
+#endif
+   for ( ; dim >= 0; dim--) {
+      system_assemble(&sys, list, dim, covariance, origin);
+
+      // Permute the upper triangle into bx.
+      for (long k = 0; k < n; k++) {
+	 int v = perm[k];
+	 memcpy(bx + (bp[k + 1] - 1) * BLOCK_SIZE, sys.diag + v * BLOCK_SIZE,
+		BLOCK_SIZE * sizeof(real));
+	 for (OSSIZE_T p = sys.p[v]; p < sys.p[v + 1]; p++) {
+	    int row = iperm[sys.j[p]];
+	    if (row < k) {
+	       memcpy(bx + find_block(bp, bi, row, (int)k),
+		      sys.x + p * BLOCK_SIZE, BLOCK_SIZE * sizeof(real));
+	    }
+	 }
+	 memcpy(B + k * FACTOR, sys.B + v * FACTOR, FACTOR * sizeof(real));
+      }
+
+      for (OSSIZE_T p = 0; p < nnz_a; p++) Ax[p] = bx[blk_idx[p]];
+      ldl_numeric(n_cols, Ap, Ai, Ax, Lp, parent, lnz, Li, Lx, D, Y,
+		  pattern, flag);
+
+      if (covariance) {
+	 ldl_sparse_inverse(n_cols, Lp, Li, Lx, D, Zx, Zd);
+	 for (long k = 0; k < n; k++) {
+#if FACTOR == 1
+	    Zv[perm[k] * 3 + dim] = Zd[k];
+#else
+	    pos *p = stn_tab[perm[k]];
+	    if (!p->var) p->var = osmalloc(ossizeof(svar));
+	    svar *v = p->var;
+	    long c = k * FACTOR;
+	    // The off-diagonal entries of the diagonal block come first in
+	    // their columns of Z.
+	    SVX_ASSERT(Li[Lp[c]] == c + 1 && Li[Lp[c] + 1] == c + 2);
+	    SVX_ASSERT(Li[Lp[c + 1]] == c + 2);
+	    (*v)[0] = Zd[c];
+	    (*v)[1] = Zd[c + 1];
+	    (*v)[2] = Zd[c + 2];
+	    (*v)[3] = Zx[Lp[c]];
+	    (*v)[4] = Zx[Lp[c] + 1];
+	    (*v)[5] = Zx[Lp[c + 1]];
+#endif
+	 }
+	 continue;
+      }
+
+      ldl_solve(n_cols, B, Lp, Li, Lx, D);
+      for (long k = 0; k < n; k++) {
+	 pos *p = stn_tab[perm[k]];
+#if FACTOR == 1
+	 p->p[dim] = B[k];
+	 if (dim == 0) {
+	    SVX_ASSERT2(pos_fixed(p),
+		    "setting station coordinates didn't mark pos as fixed");
+	 }
+#else
+	 for (int i = 0; i < 3; i++) {
+	    p->p[i] = B[k * FACTOR + i];
+	 }
+	 SVX_ASSERT2(pos_fixed(p),
+		 "setting station coordinates didn't mark pos as fixed");
+#endif
+      }
+   }
+
+   if (covariance) {
+#if FACTOR == 1
+      for (long m = 0; m < n; m++) {
+	 pos *p = stn_tab[m];
+	 if (!p->var) p->var = osmalloc(ossizeof(svar));
+	 svar *v = p->var;
+	 for (int i = 0; i < 3; i++) (*v)[i] = Zv[m * 3 + i];
+# ifndef NO_COVARIANCES
+	 (*v)[3] = (*v)[4] = (*v)[5] = (real)0.0;
+# endif
+      }
+      osfree(Zv);
+#endif
+      osfree(Zd);
+      osfree(Zx);
+   }
+   osfree(B);
+   osfree(bx);
+   osfree(Ax);
+   osfree(pattern);
+   osfree(Y);
+   osfree(D);
+   osfree(Lx);
+   osfree(Li);
+   osfree(Lp);
+   osfree(flag);
+   osfree(lnz);
+   osfree(parent);
+   osfree(blk_idx);
+   osfree(Ai);
+   osfree(Ap);
+   osfree(bi);
+   osfree(bp);
+   osfree(iperm);
+   osfree(perm);
+   system_free(&sys);
+   return true;
+}
+
+/* The iterative solver uses the preconditioned conjugate gradient method.
+ * Each iteration multiplies by the matrix in block_system form, which needs
+ * O(number of legs) memory, and the incomplete Choleski preconditioner
+ * needs about the same again.
+ *
+ * The 'i' optimisation letter selects this solver with a block incomplete
+ * Choleski (IC(0)) preconditioner, and 'j' selects it with a block Jacobi
+ * preconditioner (which is cheaper to set up and apply, but typically needs
+ * more iterations).
+ */
+
+/* y -= A' x for FACTOR by FACTOR block A. */
+static inline void
+blk_mul_t_sub(real *y, const real *A, const real *x)
+{
+   for (int r = 0; r < FACTOR; r++) {
+      for (int c = 0; c < FACTOR; c++) y[c] -= A[r * FACTOR + c] * x[r];
+   }
+}
+
+/* C = A B for FACTOR by FACTOR blocks. */
+static void
+blk_mul(real *C, const real *A, const real *B)
+{
+   for (int r = 0; r < FACTOR; r++) {
+      for (int c = 0; c < FACTOR; c++) {
+	 real t = (real)0.0;
+	 for (int k = 0; k < FACTOR; k++) t += A[r * FACTOR + k] * B[k * FACTOR + c];
+	 C[r * FACTOR + c] = t;
+      }
+   }
+}
+
+/* C -= A B' for FACTOR by FACTOR blocks. */
+static void
+blk_mul_t_sub_blk(real *C, const real *A, const real *B)
+{
+   for (int r = 0; r < FACTOR; r++) {
+      for (int c = 0; c < FACTOR; c++) {
+	 real t = (real)0.0;
+	 for (int k = 0; k < FACTOR; k++) t += A[r * FACTOR + k] * B[c * FACTOR + k];
+	 C[r * FACTOR + c] -= t;
+      }
+   }
+}
+
+/* Invert block A, which should be symmetric positive definite.  Returns
+ * false if it isn't.
+ */
+static bool
+blk_invert(real *inv, const real *A)
+{
+#if FACTOR == 1
+   if (!(A[0] > (real)0.0)) return false;
+   inv[0] = ((real)1.0) / A[0];
+#else
+   real a = A[0], b = A[1], c = A[2];
+   real d = A[4], e = A[5], f = A[8];
+   real df_ee = d * f - e * e;
+   real ce_bf = c * e - b * f;
+   real be_cd = b * e - c * d;
+   real det = a * df_ee + b * ce_bf + c * be_cd;
+   // Check the leading principal minors are all positive.
+   if (!(a > (real)0.0) || !(a * d - b * b > (real)0.0) || !(det > (real)0.0))
+      return false;
+   real r = ((real)1.0) / det;
+   inv[0] = df_ee * r;
+   inv[1] = inv[3] = ce_bf * r;
+   inv[2] = inv[6] = be_cd * r;
+   inv[4] = (a * f - c * c) * r;
+   inv[5] = inv[7] = (b * c - a * e) * r;
+   inv[8] = (a * d - b * b) * r;
+#endif
+   return true;
+}
+
+/* Set up the structure of the factor from the strictly lower triangle of
+ * the matrix.
+ */
+static void
+ic_structure(ic_factor *ic, const block_system *a)
+{
+   long n = a->n;
+   OSSIZE_T *Lp = osmalloc((n + 1) * ossizeof(OSSIZE_T));
+   int *Lj = osmalloc((a->p[n] / 2 + 1) * ossizeof(int));
+   OSSIZE_T out = 0;
+   for (long i = 0; i < n; i++) {
+      Lp[i] = out;
+      for (OSSIZE_T k = a->p[i]; k < a->p[i + 1] && a->j[k] < i; k++) {
+	 Lj[out++] = a->j[k];
+      }
+   }
+   Lp[n] = out;
+   ic->Lp = Lp;
+   ic->Lj = Lj;
+   ic->Lx = osmalloc((out + 1) * BLOCK_SIZE * ossizeof(real));
+   ic->Xx = osmalloc((out + 1) * BLOCK_SIZE * ossizeof(real));
+}
+
+/* Copy the strictly lower triangle of the matrix into the factor. */
+static void
+ic_load(ic_factor *ic, const block_system *a)
+{
+   for (long i = 0; i < a->n; i++) {
+      OSSIZE_T k = a->p[i];
+      memcpy(ic->Lx + ic->Lp[i] * BLOCK_SIZE, a->x + k * BLOCK_SIZE,
+	     (ic->Lp[i + 1] - ic->Lp[i]) * BLOCK_SIZE * sizeof(real));
+   }
+}
+
+/* Compute the factor L D L' ~= A, where Dg holds the diagonal blocks of A
+ * and the off-diagonal blocks of A must be in ic->Lx.  The inverse of each
+ * block of D is stored in Dinv.  Returns false if the factorisation breaks
+ * down (which is possible, though unusual, for a block incomplete
+ * factorisation).
+ */
+static bool
+ic_numeric(ic_factor *ic, long n, const real *Dg, real *Dinv)
+{
+   const OSSIZE_T *Lp = ic->Lp;
+   const int *Lj = ic->Lj;
+   real *Lx = ic->Lx, *Xx = ic->Xx;
+   real D[BLOCK_SIZE];
+   for (long I = 0; I < n; I++) {
+      for (OSSIZE_T p = Lp[I]; p < Lp[I + 1]; p++) {
+	 int J = Lj[p];
+	 // X(I,J) = A(I,J) - sum(L(I,K) X(J,K)', K < J), summing over the
+	 // columns K which rows I and J both have entries in.
+	 real *X = Xx + p * BLOCK_SIZE;
+	 memcpy(X, Lx + p * BLOCK_SIZE, BLOCK_SIZE * sizeof(real));
+	 OSSIZE_T q = Lp[I], r = Lp[J];
+	 while (q < p && r < Lp[J + 1]) {
+	    if (Lj[q] < Lj[r]) {
+	       ++q;
+	    } else if (Lj[q] > Lj[r]) {
+	       ++r;
+	    } else {
+	       blk_mul_t_sub_blk(X, Lx + q * BLOCK_SIZE, Xx + r * BLOCK_SIZE);
+	       ++q;
+	       ++r;
+	    }
+	 }
+	 // L(I,J) = X(I,J) D(J)^-1.
+	 blk_mul(Lx + p * BLOCK_SIZE, X, Dinv + J * BLOCK_SIZE);
+      }
+      memcpy(D, Dg + I * BLOCK_SIZE, sizeof(D));
+      for (OSSIZE_T p = Lp[I]; p < Lp[I + 1]; p++) {
+	 blk_mul_t_sub_blk(D, Lx + p * BLOCK_SIZE, Xx + p * BLOCK_SIZE);
+      }
+      if (!blk_invert(Dinv + I * BLOCK_SIZE, D)) return false;
+   }
+   return true;
+}
+
+/* Set z = (L D L')^-1 r. */
+static void
+ic_apply(const ic_factor *ic, long n, const real *Dinv,
+	 const real *r, real *z, real *y)
+{
+   const OSSIZE_T *Lp = ic->Lp;
+   const int *Lj = ic->Lj;
+   const real *Lx = ic->Lx;
+   for (long I = 0; I < n; I++) {
+      real *yi = y + I * FACTOR;
+      for (int i = 0; i < FACTOR; i++) yi[i] = r[I * FACTOR + i];
+      for (OSSIZE_T p = Lp[I]; p < Lp[I + 1]; p++) {
+	 const real *l = Lx + p * BLOCK_SIZE;
+	 const real *yj = y + Lj[p] * FACTOR;
+	 for (int a = 0; a < FACTOR; a++) {
+	    for (int b = 0; b < FACTOR; b++) yi[a] -= l[a * FACTOR + b] * yj[b];
+	 }
+      }
+      real *zi = z + I * FACTOR;
+      for (int i = 0; i < FACTOR; i++) zi[i] = (real)0.0;
+      blk_mul_add(zi, Dinv + I * BLOCK_SIZE, yi);
+   }
+   for (long I = n - 1; I > 0; I--) {
+      for (OSSIZE_T p = Lp[I]; p < Lp[I + 1]; p++) {
+	 blk_mul_t_sub(z + Lj[p] * FACTOR, Lx + p * BLOCK_SIZE, z + I * FACTOR);
+      }
+   }
+}
+
+static void
+ic_free(ic_factor *ic)
+{
+   osfree(ic->Xx);
+   osfree(ic->Lx);
+   osfree(ic->Lj);
+   osfree(ic->Lp);
+}
+
+/* Solve iteratively using the preconditioned conjugate gradient method. */
+static void
+solve_iterative(node *list, long n, pos **stn_tab, solve_info *info)
+{
+   long n_cols = n * FACTOR;
+   bool use_ic = !(optimize & BITA('j'));
+   block_system sys;
+   system_structure(&sys, list, n, false);
+   ic_factor ic;
+   if (use_ic) ic_structure(&ic, &sys);
+   real *Dinv = osmalloc(n * BLOCK_SIZE * ossizeof(real));
+   real *x = osmalloc(n_cols * ossizeof(real));
+   real *r = osmalloc(n_cols * ossizeof(real));
+   real *z = osmalloc(n_cols * ossizeof(real));
+   real *p = osmalloc(n_cols * ossizeof(real));
+   real *q = osmalloc(n_cols * ossizeof(real));
+   // Give up if we haven't converged after this many iterations.  In exact
+   // arithmetic the conjugate gradient method converges in at most n_cols
+   // iterations, but rounding errors can slow it down.
+   long max_iterations = n_cols * 10 + 100;
+
+#if FACTOR == 1
+   int dim = 2;
+#else
+   int dim = 0; /* Collapse loop to a single iteration. */
+#endif
+   for ( ; dim >= 0; dim--) {
+      // We solve for offsets from the position of a fixed station adjacent
+      // to the network, which keeps the numbers we're working with small
+      // so the residual tolerance means the same thing wherever the survey
+      // is located.
+      real origin[FACTOR];
+      bool have_origin = false;
+      for (node *stn = list; stn && !have_origin; stn = stn->next) {
+	 for (int dirn = 0; stn->leg[dirn]; dirn++) {
+	    node *to = stn->leg[dirn]->l.to;
+	    if (fixed(to)) {
+#if FACTOR == 1
+	       origin[0] = POS(to, dim);
+#else
+	       for (int i = 0; i < 3; i++) origin[i] = POS(to, i);
+#endif
+	       have_origin = true;
+	       break;
+	    }
+	 }
+      }
+      SVX_ASSERT(have_origin);
+
+      system_assemble(&sys, list, dim, false, origin);
+      const real *Dg = sys.diag;
+      if (use_ic) ic_load(&ic, &sys);
+
+      bool have_ic = use_ic && ic_numeric(&ic, n, Dg, Dinv);
+      if (!have_ic) {
+	 // Block Jacobi preconditioner (also the fallback if the incomplete
+	 // factorisation breaks down).
+	 for (long i = 0; i < n; i++) {
+	    real *inv = Dinv + i * BLOCK_SIZE;
+	    if (!blk_invert(inv, Dg + i * BLOCK_SIZE)) {
+	       for (int j = 0; j < BLOCK_SIZE; j++) inv[j] = (real)0.0;
+	       for (int j = 0; j < FACTOR; j++) inv[j * (FACTOR + 1)] = (real)1.0;
+	    }
+	 }
+      }
+
+      // With offsets from origin, zero is a reasonable initial estimate, so
+      // the initial residual is B.
+      for (long i = 0; i < n_cols; i++) {
+	 x[i] = (real)0.0;
+	 r[i] = sys.B[i];
+      }
+      real r0_norm = sqrt(dot_product(r, r, n_cols));
+      real residual = (real)0.0;
+      long it = 0;
+      if (r0_norm > (real)0.0) {
+	 if (have_ic) {
+	    ic_apply(&ic, n, Dinv, r, z, q);
+	 } else {
+	    for (long i = 0; i < n; i++) {
+	       for (int j = 0; j < FACTOR; j++) z[i * FACTOR + j] = (real)0.0;
+	       blk_mul_add(z + i * FACTOR, Dinv + i * BLOCK_SIZE, r + i * FACTOR);
+	    }
+	 }
+	 memcpy(p, z, n_cols * sizeof(real));
+	 real rz = dot_product(r, z, n_cols);
+	 residual = (real)1.0;
+	 while (it < max_iterations) {
+	    ++it;
+	    system_multiply(&sys, p, q);
+	    real alpha = rz / dot_product(p, q, n_cols);
+	    for (long i = 0; i < n_cols; i++) {
+	       x[i] += alpha * p[i];
+	       r[i] -= alpha * q[i];
+	    }
+	    residual = sqrt(dot_product(r, r, n_cols)) / r0_norm;
+	    if (residual <= iterate_tolerance) break;
+	    if (have_ic) {
+	       ic_apply(&ic, n, Dinv, r, z, q);
+	    } else {
+	       for (long i = 0; i < n; i++) {
+		  for (int j = 0; j < FACTOR; j++) z[i * FACTOR + j] = (real)0.0;
+		  blk_mul_add(z + i * FACTOR, Dinv + i * BLOCK_SIZE, r + i * FACTOR);
+	       }
+	    }
+	    real rz_new = dot_product(r, z, n_cols);
+	    real beta = rz_new / rz;
+	    rz = rz_new;
+	    for (long i = 0; i < n_cols; i++) p[i] = z[i] + beta * p[i];
+	 }
+      }
+      // Report the worst of the three dimensions if we're solving them
+      // separately.
+      if (it > info->iterations) info->iterations = (int)it;
+      if (residual > info->residual) info->residual = residual;
+
+      for (long m = 0; m < n; m++) {
+#if FACTOR == 1
+	 stn_tab[m]->p[dim] = x[m] + origin[0];
+	 if (dim == 0) {
+	    SVX_ASSERT2(pos_fixed(stn_tab[m]),
+		    "setting station coordinates didn't mark pos as fixed");
+	 }
+#else
+	 for (int i = 0; i < 3; i++) {
+	    stn_tab[m]->p[i] = x[m * FACTOR + i] + origin[i];
+	 }
+	 SVX_ASSERT2(pos_fixed(stn_tab[m]),
+		 "setting station coordinates didn't mark pos as fixed");
+#endif
+      }
+   }
+
+   osfree(q);
+   osfree(p);
+   osfree(z);
+   osfree(r);
+   osfree(x);
+   osfree(Dinv);
+   if (use_ic) ic_free(&ic);
+   system_free(&sys);
+}
+
+#undef solve_dense
+#undef find_block
+#undef leg_weight
+#undef blk_mul_add
+#undef system_structure
+#undef system_block
+#undef system_assemble
+#undef system_multiply
+#undef system_free
+#undef solve_sparse
+#undef blk_mul_t_sub
+#undef blk_mul
+#undef blk_mul_t_sub_blk
+#undef blk_invert
+#undef ic_structure
+#undef ic_load
+#undef ic_numeric
+#undef ic_apply
+#undef ic_free
+#undef solve_iterative
+#undef BLOCK_SIZE
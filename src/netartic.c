@@ -1,6 +1,6 @@
 /* netartic.c
  * Split up network at articulation points
- * Copyright (C) 1993-2003,2005,2012,2014,2015,2024 Olly Betts
+ * Copyright (C) 1993-2003,2005,2012,2014,2015,2024,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -24,6 +24,10 @@
 
 #include <config.h>
 
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
 #include "debug.h"
 #include "cavern.h"
 #include "filename.h"
@@ -45,9 +49,8 @@ colour_fixed_point_cluster(node *stn,
     remove_stn_from_list(p_fixedlist, stn);
     add_stn_to_list(p_component_fixedlist, stn);
 
-    for (int d = 0; d < 3; d++) {
+    for (int d = 0; stn->leg[d]; d++) {
 	linkfor *leg = stn->leg[d];
-	if (!leg) break;
 	node *to = leg->l.to;
 	if (to->colour > 0 && stn->name->pos == to->name->pos) {
 	    colour_fixed_point_cluster(to, p_fixedlist, p_component_fixedlist);
@@ -66,6 +69,172 @@ typedef struct articulation {
    node *stnlist;
 } articulation;
 
+#ifdef HAVE_PTHREAD
+/* State shared by the threads solving articulations in parallel. */
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // Articulations in the order we would pass them to solve_matrix().
+    articulation **arts;
+    // For each articulation, the number of articulations which must be
+    // solved before it can be.
+    long *n_pending;
+    // Articulations which can't be solved until articulation i has been are
+    // dependents[dep_start[i]] ... dependents[dep_start[i + 1] - 1].
+    long *dep_start;
+    long *dependents;
+    // Queue of articulations which are ready to be solved.
+    long *ready;
+    long ready_head, ready_tail;
+    // Number of articulations which haven't been taken off the queue yet.
+    long n_unstarted;
+    // Details of solving each articulation.
+    solve_info *info;
+} parallel_solve;
+
+static void *
+solve_worker(void *p)
+{
+    parallel_solve *ps = p;
+    pthread_mutex_lock(&ps->mutex);
+    while (ps->n_unstarted > 0) {
+	if (ps->ready_head == ps->ready_tail) {
+	    pthread_cond_wait(&ps->cond, &ps->mutex);
+	    continue;
+	}
+	long i = ps->ready[ps->ready_head++];
+	--ps->n_unstarted;
+	pthread_mutex_unlock(&ps->mutex);
+
+	solve_matrix_unspliced(ps->arts[i]->stnlist, &ps->info[i]);
+
+	pthread_mutex_lock(&ps->mutex);
+	for (long d = ps->dep_start[i]; d < ps->dep_start[i + 1]; d++) {
+	    long j = ps->dependents[d];
+	    if (--ps->n_pending[j] == 0) ps->ready[ps->ready_tail++] = j;
+	}
+	// Wake any threads waiting for work (or to exit).
+	pthread_cond_broadcast(&ps->cond);
+    }
+    pthread_mutex_unlock(&ps->mutex);
+    return NULL;
+}
+
+/* Solve the articulations in articulation_list using up to n_threads
+ * threads, freeing the list.
+ *
+ * An articulation can only be solved once those containing the stations it
+ * attaches to have been, but otherwise articulations are independent so can
+ * be solved in any order.  We calculate exactly the same positions as
+ * solving in list order would, and splice the articulations onto fixedlist
+ * in list order too, so the output doesn't depend on the number of threads.
+ */
+static void
+solve_articulations_in_parallel(articulation *articulation_list)
+{
+    long n_arts = 0;
+    for (articulation *art = articulation_list; art; art = art->next) {
+	++n_arts;
+    }
+
+    parallel_solve ps;
+    ps.arts = osmalloc(n_arts * ossizeof(articulation *));
+    ps.n_pending = osmalloc(n_arts * ossizeof(long));
+    ps.dep_start = osmalloc((n_arts + 1) * ossizeof(long));
+    ps.ready = osmalloc(n_arts * ossizeof(long));
+    ps.info = osmalloc(n_arts * ossizeof(solve_info));
+    long *last = osmalloc(n_arts * ossizeof(long));
+
+    // Temporarily colour each station with the index of its articulation
+    // (negated and offset so it's negative, which solve_matrix() requires).
+    long i = 0;
+    for (articulation *art = articulation_list; art; art = art->next) {
+	ps.arts[i] = art;
+	ps.n_pending[i] = 0;
+	ps.dep_start[i] = 0;
+	last[i] = -1;
+	for (node *stn = art->stnlist; stn; stn = stn->next) {
+	    stn->colour = -(i + 1);
+	}
+	++i;
+    }
+    ps.dep_start[n_arts] = 0;
+
+    // Articulation i depends on an earlier articulation j if any station in
+    // i has a leg to an unfixed station in j.  Legs to stations in later
+    // articulations don't contribute to solving i.
+    for (int pass = 0; pass < 2; pass++) {
+	for (i = 0; i < n_arts; i++) {
+	    for (node *stn = ps.arts[i]->stnlist; stn; stn = stn->next) {
+		for (int d = 0; stn->leg[d]; d++) {
+		    node *to = stn->leg[d]->l.to;
+		    if (fixed(to)) continue;
+		    long j = -to->colour - 1;
+		    if (j < 0 || j >= i || last[j] == i) continue;
+		    last[j] = i;
+		    if (pass == 0) {
+			ps.n_pending[i]++;
+			ps.dep_start[j + 1]++;
+		    } else {
+			ps.dependents[ps.dep_start[j]++] = i;
+		    }
+		}
+	    }
+	}
+	for (i = 0; i < n_arts; i++) last[i] = -1;
+	if (pass == 0) {
+	    for (i = 0; i < n_arts; i++) ps.dep_start[i + 1] += ps.dep_start[i];
+	    ps.dependents = osmalloc((ps.dep_start[n_arts] + 1) * ossizeof(long));
+	} else {
+	    // Filling in advanced each dep_start[j] to dep_start[j + 1], so
+	    // shift them back.
+	    for (i = n_arts; i > 0; i--) ps.dep_start[i] = ps.dep_start[i - 1];
+	    ps.dep_start[0] = 0;
+	}
+    }
+    osfree(last);
+
+    ps.ready_head = ps.ready_tail = 0;
+    for (i = 0; i < n_arts; i++) {
+	if (ps.n_pending[i] == 0) ps.ready[ps.ready_tail++] = i;
+    }
+    ps.n_unstarted = n_arts;
+    pthread_mutex_init(&ps.mutex, NULL);
+    pthread_cond_init(&ps.cond, NULL);
+
+    // The current thread works too, so we need one fewer extra thread.  If
+    // we fail to create a thread, just carry on with the ones we have.
+    long n_extra = n_threads - 1;
+    if (n_extra > n_arts - 1) n_extra = n_arts - 1;
+    pthread_t *threads = osmalloc(n_extra * ossizeof(pthread_t));
+    long n_started = 0;
+    while (n_started < n_extra) {
+	if (pthread_create(&threads[n_started], NULL, solve_worker, &ps) != 0)
+	    break;
+	++n_started;
+    }
+    solve_worker(&ps);
+    for (long t = 0; t < n_started; t++) {
+	pthread_join(threads[t], NULL);
+    }
+    osfree(threads);
+    pthread_cond_destroy(&ps.cond);
+    pthread_mutex_destroy(&ps.mutex);
+
+    for (i = 0; i < n_arts; i++) {
+	solve_matrix_finish(ps.arts[i]->stnlist, &ps.info[i]);
+	osfree(ps.arts[i]);
+    }
+
+    osfree(ps.info);
+    osfree(ps.ready);
+    osfree(ps.dependents);
+    osfree(ps.dep_start);
+    osfree(ps.n_pending);
+    osfree(ps.arts);
+}
+#endif
+
 extern void
 articulate(void)
 {
@@ -97,7 +266,7 @@ articulate(void)
     }
     colour = -colour;
 
-    unsigned char *dirn_stack = osmalloc(stack_size);
+    int *dirn_stack = osmalloc(stack_size * sizeof(int));
     long *oldest_stack = osmalloc(stack_size * sizeof(long));
 
     /* fixedlist can be NULL here if we've had a *solve followed by survey
@@ -133,7 +302,7 @@ articulate(void)
 	    // included as they don't get their own row in the matrix.
 	    node *artlist = NULL;
 
-	    for (int i = 0; i <= 2 && stn_start->leg[i]; i++) {
+	    for (int i = 0; stn_start->leg[i]; i++) {
 		node *stn = stn_start->leg[i]->l.to;
 		if (stn->colour < 0) {
 		    // Already visited stn.
@@ -164,7 +333,7 @@ articulate(void)
 		print_prefix(stn->name);
 		printf(" set to colour %ld -> oldest_reached\n", colour);
 #endif
-		for (int j = 0; j <= 2 && stn->leg[j]; j++) {
+		for (int j = 0; stn->leg[j]; j++) {
 		    if (j == back) {
 			// Ignore the reverse of the leg we just took to get
 			// here.
@@ -190,8 +359,8 @@ articulate(void)
 			 *
 			 * To avoid this we have converted the algorithm into
 			 * an iterative one with an explicit stack which needs
-			 * only 5 bytes per recursion level of the recursive
-			 * version.
+			 * only a leg number and a colour per recursion level of
+			 * the recursive version.
 			 *
 			 * This is the point where the recursive call would be.
 			 */
@@ -287,9 +456,9 @@ articulate(void)
 		    }
 		}
 
-		SVX_ASSERT(!stn->leg[0] || stn->leg[0]->l.to->colour < 0);
-		SVX_ASSERT(!stn->leg[1] || stn->leg[1]->l.to->colour < 0);
-		SVX_ASSERT(!stn->leg[2] || stn->leg[2]->l.to->colour < 0);
+		for (int j = 0; stn->leg[j]; j++) {
+		    SVX_ASSERT(stn->leg[j]->l.to->colour < 0);
+		}
 
 		if (tos > 0) goto uniter;
 
@@ -353,8 +522,9 @@ articulate(void)
 		     * train station. */
 		    puts(msg(/*The following survey stations are not attached to a fixed point:*/71));
 		}
-		printf("%s:%d: %s: ",
-		       name->filename, name->line, msg(/*info*/485));
+		printf("%s:%u: %s: ",
+		       srcloc_filename(name->loc), srcloc_line(name->loc),
+		       msg(/*info*/485));
 		print_prefix(name);
 		putnl();
 	    }
@@ -378,7 +548,7 @@ articulate(void)
 	    // visited.
 	    stn->colour = 1;
 	    remove_stn_from_list(&stnlist, stn);
-	    for (int j = 0; j <= 2 && stn->leg[j]; j++) {
+	    for (int j = 0; stn->leg[j]; j++) {
 		if (j == back) {
 		    // Ignore the reverse of the leg we just took to get
 		    // here.
@@ -417,6 +587,13 @@ articulate(void)
     SVX_ASSERT(!fixedlist);
     fixedlist = new_fixedlist;
 
+#ifdef HAVE_PTHREAD
+    if (n_threads > 1 && articulation_list && articulation_list->next) {
+	solve_articulations_in_parallel(articulation_list);
+	articulation_list = NULL;
+    }
+#endif
+
     articulation *art = articulation_list;
     while (art) {
 	SVX_ASSERT(art->stnlist);
@@ -448,23 +625,15 @@ articulate(void)
 	} else {
 	    stn->colour = 0;
 	}
-	int f = 0;
-	for (int d = 0; d < 3; d++) {
-	    if (stn->leg[d]) {
-		if (f) {
-		    printf("awooga - gap in legs\n");
-		}
-		if (stn->leg[d]->l.reverse & FLAG_ARTICULATION) {
-		    if (!(reverse_leg(stn->leg[d])->l.reverse & FLAG_ARTICULATION)) {
-			printf("awooga - bad articulation (one way art)\n");
-		    }
-		} else {
-		    if (reverse_leg(stn->leg[d])->l.reverse & FLAG_ARTICULATION) {
-			printf("awooga - bad articulation (one way art)\n");
-		    }
+	for (int d = 0; stn->leg[d]; d++) {
+	    if (stn->leg[d]->l.reverse & FLAG_ARTICULATION) {
+		if (!(reverse_leg(stn->leg[d])->l.reverse & FLAG_ARTICULATION)) {
+		    printf("awooga - bad articulation (one way art)\n");
 		}
 	    } else {
-		f = 1;
+		if (reverse_leg(stn->leg[d])->l.reverse & FLAG_ARTICULATION) {
+		    printf("awooga - bad articulation (one way art)\n");
+		}
 	    }
 	}
     }
@@ -476,23 +645,15 @@ articulate(void)
 	do {
 	    c = 0;
 	    for (node *stn = fixedlist; stn; stn = stn->next) {
-		int f = 0;
-		for (int d = 0; d < 3; d++) {
-		    if (stn->leg[d]) {
-			node *stn2 = stn->leg[d]->l.to;
-			if (f) {
-			    printf("awooga - gap in legs\n");
-			}
-			if (stn2->colour) {
-			    if (!(stn->leg[d]->l.reverse & FLAG_ARTICULATION)) {
-				if (stn->colour == 0) {
-				    stn->colour = stn2->colour;
-				    c++;
-				}
+		for (int d = 0; stn->leg[d]; d++) {
+		    node *stn2 = stn->leg[d]->l.to;
+		    if (stn2->colour) {
+			if (!(stn->leg[d]->l.reverse & FLAG_ARTICULATION)) {
+			    if (stn->colour == 0) {
+				stn->colour = stn2->colour;
+				c++;
 			    }
 			}
-		    } else {
-			f = 1;
 		    }
 		}
 	    }
@@ -509,24 +670,14 @@ articulate(void)
     }
 
     for (node *stn = fixedlist; stn; stn = stn->next) {
-	int f = 0;
-	for (int d = 0; d < 3; d++) {
-	    if (stn->leg[d]) {
-		if (f) {
-		    printf("awooga - gap in legs\n");
-		}
-#ifdef DEBUG_ARTIC
-		if (stn->leg[d]->l.reverse & FLAG_ARTICULATION) {
-		    node *stn2 = stn->leg[d]->l.to;
-		    printf("art: %ld %ld [%p] ", stn->colour, stn2->colour, stn);
-		    print_prefix(stn->name);
-		    printf(" - [%p] ", stn2);
-		    print_prefix(stn2->name);
-		    printf("\n");
-		}
-#endif
-	    } else {
-		f = 1;
+	for (int d = 0; stn->leg[d]; d++) {
+	    if (stn->leg[d]->l.reverse & FLAG_ARTICULATION) {
+		node *stn2 = stn->leg[d]->l.to;
+		printf("art: %ld %ld [%p] ", stn->colour, stn2->colour, stn);
+		print_prefix(stn->name);
+		printf(" - [%p] ", stn2);
+		print_prefix(stn2->name);
+		printf("\n");
 	    }
 	}
     }
@@ -1,6 +1,6 @@
 /* netbits.c
  * Miscellaneous primitive network routines for Survex
- * Copyright (C) 1992-2024 Olly Betts
+ * Copyright (C) 1992-2024,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -28,6 +28,8 @@
 #include "filename.h"
 #include "message.h"
 #include "netbits.h"
+#include "parsecache.h"
+#include "pool.h"
 #include "datain.h" /* for compile_error */
 #include "validate.h" /* for compile_error */
 #include <math.h>
@@ -47,7 +49,10 @@ void clear_last_leg(void) {
    last_leg.to_name = NULL;
 }
 
-static char freeleg(node **stnptr);
+bool have_last_leg(void) {
+   return last_leg.to_name != NULL;
+}
+
 
 #ifdef NO_COVARIANCES
 static void check_var(const var *v) {
@@ -208,13 +213,13 @@ remove_stn_from_list(node **list, node *stn) {
    }
 }
 
-/* Create (uses osmalloc) a forward leg containing the data in leg, or
+/* Create (uses pool_new) a forward leg containing the data in leg, or
  * the reversed data in the reverse of leg, if leg doesn't hold data
  */
 linkfor *
 copy_link(linkfor *leg)
 {
-   linkfor *legOut = osnew(linkfor);
+   linkfor *legOut = pool_new(linkfor);
    if (data_here(leg)) {
       for (int d = 2; d >= 0; d--) legOut->d[d] = leg->d[d];
    } else {
@@ -267,11 +272,11 @@ addleg_(node *fr, node *to,
     * - this should be trapped by the caller */
    SVX_ASSERT(fr->name != to->name);
 
-   linkfor *leg = osnew(linkfor);
-   linkfor *leg2 = (linkfor*)osnew(linkcommon);
+   linkfor *leg = pool_new(linkfor);
+   linkfor *leg2 = (linkfor*)pool_new(linkcommon);
 
-   int i = freeleg(&fr);
-   int j = freeleg(&to);
+   int i = freeleg(fr);
+   int j = freeleg(to);
 
    leg->l.to = to;
    leg2->l.to = fr;
@@ -305,8 +310,6 @@ addleg_(node *fr, node *to,
 }
 
 /* Add a leg between names *fr_name and *to_name
- * If either is a three node, then it is split into two
- * and the data structure adjusted as necessary.
  */
 void
 addlegbyname(prefix *fr_name, prefix *to_name, bool fToFirst,
@@ -317,6 +320,14 @@ addlegbyname(prefix *fr_name, prefix *to_name, bool fToFirst,
 #endif
 	     )
 {
+   parse_cache_leg(fr_name, to_name, fToFirst, dx, dy, dz, vx, vy, vz
+#ifndef NO_COVARIANCES
+		   , cyz, czx, cxy
+#endif
+		   );
+#ifndef NO_COVARIANCES
+   if (f_no_covariances) cyz = czx = cxy = (real)0.0;
+#endif
    if (to_name == fr_name) {
       int type = pcs->from_equals_to_is_only_a_warning ? DIAG_WARN : DIAG_ERR;
       /* TRANSLATORS: Here a "survey leg" is a set of measurements between two
@@ -387,9 +398,8 @@ replace_pfx_(node *stn, node *from, pos *pos_with, bool move_to_fixedlist)
       add_stn_to_list(&fixedlist, stn);
    }
    stn->name->pos = pos_with;
-   for (int d = 0; d < 3; d++) {
+   for (int d = 0; stn->leg[d]; d++) {
       linkfor *leg = stn->leg[d];
-      if (!leg) break;
       node *to = leg->l.to;
       if (to == from) continue;
 
@@ -421,13 +431,14 @@ replace_pfx(const prefix *pfx_replace, const prefix *pfx_with,
 #endif
 
    /* free the (now-unused) old pos */
-   osfree(pos_replace);
+   pool_delete(pos, pos_replace);
 }
 
 // Add equating leg between existing stations whose names are name1 and name2.
 void
 process_equate(prefix *name1, prefix *name2)
 {
+   parse_cache_equate(name1, name2);
    clear_last_leg();
    if (name1 == name2) {
       /* catch something like *equate "fred fred" */
@@ -489,9 +500,6 @@ process_equate(prefix *name1, prefix *name2)
 
 /* Add a 'fake' leg (not counted or treated as a use of a fixed point) between
  * existing stations *fr and *to (which *must* be different).
- *
- * If either node is a three node, then it is split into two
- * and the data structure adjusted as necessary.
  */
 void
 addfakeleg(node *fr, node *to,
@@ -502,6 +510,9 @@ addfakeleg(node *fr, node *to,
 #endif
 	   )
 {
+#ifndef NO_COVARIANCES
+   if (f_no_covariances) cyz = czx = cxy = (real)0.0;
+#endif
    clear_last_leg();
    addleg_(fr, to, dx, dy, dz, vx, vy, vz,
 #ifndef NO_COVARIANCES
@@ -510,67 +521,51 @@ addfakeleg(node *fr, node *to,
 	   FLAG_FAKE);
 }
 
-static char
-freeleg(node **stnptr)
+int
+freeleg(node *stn)
 {
-   node *stn = *stnptr;
-
-   if (stn->leg[0] == NULL) return 0; /* leg[0] unused */
-   if (stn->leg[1] == NULL) return 1; /* leg[1] unused */
-   if (stn->leg[2] == NULL) return 2; /* leg[2] unused */
-
-   /* All legs used, so split node in two */
-   node *newstn = osnew(node);
-   linkfor *leg = osnew(linkfor);
-   linkfor *leg2 = (linkfor*)osnew(linkcommon);
-
-   *stnptr = newstn;
-
-   add_stn_to_list(fixed(stn) ? &fixedlist : &stnlist, newstn);
-   newstn->name = stn->name;
-
-   leg->l.to = newstn;
-   leg->d[0] = leg->d[1] = leg->d[2] = (real)0.0;
-
-#ifndef NO_COVARIANCES
-   for (int i = 0; i < 6; i++) leg->v[i] = (real)0.0;
-#else
-   leg->v[0] = leg->v[1] = leg->v[2] = (real)0.0;
-#endif
-   leg->l.reverse = 1 | FLAG_DATAHERE | FLAG_FAKE;
-   leg->l.flags = pcs->flags | (pcs->recorded_style << FLAGS_STYLE_BIT0);
-
-   leg2->l.to = stn;
-   leg2->l.reverse = 0;
-
-   // NB this preserves pos->stn->leg[0] pointing to the "real" fixed point
-   // for stations fixed with error estimates.
-   newstn->leg[0] = stn->leg[0];
-   // Update the reverse leg.
-   reverse_leg(newstn->leg[0])->l.to = newstn;
-   newstn->leg[1] = leg2;
-
-   stn->leg[0] = leg;
-
-   newstn->leg[2] = NULL; /* needed as newstn->leg[dirn]==NULL indicates unused */
+   int n = 0;
+   while (stn->leg[n]) n++;
+
+   if (stn->leg == stn->inline_legs) {
+      if (n == 3) {
+	 /* Move the legs to the heap, with room for 7 and the terminator. */
+	 linkfor **legs = osmalloc(8 * ossizeof(linkfor*));
+	 memcpy(legs, stn->inline_legs, 3 * sizeof(linkfor*));
+	 stn->leg = legs;
+      }
+   } else if (n >= 7 && ((n + 1) & n) == 0) {
+      /* The size of a heap array is a power of 2, so it's full. */
+      stn->leg = osrealloc(stn->leg, 2 * (n + 1) * ossizeof(linkfor*));
+   }
+   /* We always append, which preserves pos->stn->leg[0] pointing to the
+    * "real" fixed point for stations fixed with error estimates. */
+   stn->leg[n + 1] = NULL;
+   return n;
+}
 
-   return 2; /* leg[2] unused */
+void
+delete_node(node *stn)
+{
+   if (stn->leg != stn->inline_legs) osfree(stn->leg);
+   pool_delete(node, stn);
 }
 
 node *
 StnFromPfx(prefix *name)
 {
    if (name->stn != NULL) return name->stn;
-   node *stn = osnew(node);
+   node *stn = pool_new(node);
    stn->name = name;
    bool fixed = false;
    if (name->pos == NULL) {
-      name->pos = osnew(pos);
+      name->pos = pool_new(pos);
+      name->pos->var = NULL;
       unfix(stn);
    } else {
       fixed = pfx_fixed(name);
    }
-   stn->leg[0] = stn->leg[1] = stn->leg[2] = NULL;
+   init_legs(stn);
    add_stn_to_list(fixed ? &fixedlist : &stnlist, stn);
    name->stn = stn;
    // Don't re-count a station which already exists from before a `*solve`.
@@ -1,6 +1,6 @@
 /* netbits.h
  * Header file for miscellaneous primitive network routines for Survex
- * Copyright (C) 1994,1997,1998,2001,2006,2015 Olly Betts
+ * Copyright (C) 1994,1997,1998,2001,2006,2015,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -19,6 +19,9 @@
 
 void clear_last_leg(void);
 
+/* Is there a previous leg which a repeat of would be averaged with? */
+bool have_last_leg(void);
+
 node *StnFromPfx(prefix *name);
 
 linkfor *copy_link(linkfor *leg);
@@ -46,14 +49,28 @@ void add_stn_to_list(node **list, node *stn);
 /* remove from double-linked list */
 void remove_stn_from_list(node **list, node *stn);
 
+/* Set up the (empty) array of legs of a newly allocated node. */
+#define init_legs(S) ((S)->leg = (S)->inline_legs,\
+ (S)->leg[0] = (S)->leg[1] = (S)->leg[2] = (S)->leg[3] = NULL)
+
+/* Return the index of the first unused leg of stn, growing its array of
+ * legs if need be. */
+int freeleg(node *stn);
+
+/* Release node stn, which must have no legs left which refer to it. */
+void delete_node(node *stn);
+
 /* one node must only use leg[0] */
-#define one_node(S) (!(S)->leg[1] && (S)->leg[0])
+#define one_node(S) ((S)->leg[0] && !(S)->leg[1])
 
 /* two node must only use leg[0] and leg[1] */
-#define two_node(S) (!(S)->leg[2] && (S)->leg[1])
+#define two_node(S) ((S)->leg[0] && (S)->leg[1] && !(S)->leg[2])
+
+/* three node iff it uses leg[2] (it may use more legs too) */
+#define three_node(S) ((S)->leg[0] && (S)->leg[1] && (S)->leg[2])
 
-/* three node iff it uses leg[2] */
-#define three_node(S) ((S)->leg[2])
+/* node with exactly three legs, which the network reductions work on */
+#define exactly_three_node(S) (three_node(S) && !(S)->leg[3])
 
 /* NB FOR_EACH_STN() can't be nested - but it's hard to police as we can't
  * easily set stn_iter to NULL if the loop is exited with break */
@@ -1,7 +1,7 @@
 /* netskel.c
  * Survex network reduction - remove trailing traverses and concatenate
  * traverses between junctions
- * Copyright (C) 1991-2024 Olly Betts
+ * Copyright (C) 1991-2024,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -37,11 +37,13 @@
 #include "message.h"
 #include "filelist.h"
 #include "img_hosted.h"
+#include "matrix.h"
 #include "netartic.h"
 #include "netbits.h"
 #include "netskel.h"
 #include "network.h"
 #include "out.h"
+#include "pool.h"
 
 #define sqrdd(X) (sqrd((X)[0]) + sqrd((X)[1]) + sqrd((X)[2]))
 
@@ -77,6 +79,8 @@ static void write_passage_models(void);
 
 static void concatenate_trav(node *stn, int i);
 
+static void set_fixed_point_vars(void);
+
 static void err_stat(int cLegsTrav, double lenTrav,
 		     double eTot, double eTotTheo,
 		     double hTot, double hTotTheo,
@@ -139,6 +143,8 @@ solve_network(void)
 
    ++cSolves;
 
+   if (f_station_errors) set_fixed_point_vars();
+
    remove_trailing_travs();
    validate(); dump_network();
    remove_travs();
@@ -199,12 +205,11 @@ remove_trailing_travs(void)
 	 trav->next = ptrTrail;
 	 ptrTrail = trav;
 
-	 /* We want to keep all 2-nodes using legs 0 and 1 and all one nodes
-	  * using leg 0 so we may need to swap leg j with leg 2 (for a 3 node)
-	  * or leg 1 (for a fixed 2 node) */
-	 if ((j == 0 && !one_node(stn2)) || (j == 1 && three_node(stn2))) {
-	    /* i is the direction to swap with */
-	    i = (three_node(stn2)) ? 2 : 1;
+	 /* We want to keep the legs of each node contiguous so we may need to
+	  * swap leg j with the last leg */
+	 i = j;
+	 while (stn2->leg[i + 1]) i++;
+	 if (i != j) {
 	    /* change the other direction of leg i to use leg j */
 	    reverse_leg(stn2->leg[i])->l.reverse += j - i;
 	    stn2->leg[j] = stn2->leg[i];
@@ -230,16 +235,15 @@ remove_travs(void)
     * term - these messages mostly indicate how processing is progressing. */
    out_current_action(msg(/*Concatenating traverses*/126));
    FOR_EACH_STN(stn, fixedlist) {
-      for (int d = 0; d <= 2; d++) {
+      for (int d = 0; stn->leg[d]; d++) {
 	 linkfor *leg = stn->leg[d];
-	 if (!leg) break;
 	 if (!(leg->l.reverse & FLAG_REPLACEMENTLEG))
 	    concatenate_trav(stn, d);
       }
    }
    FOR_EACH_STN(stn, stnlist) {
       if (!three_node(stn)) continue;
-      for (int d = 0; d <= 2; d++) {
+      for (int d = 0; stn->leg[d]; d++) {
 	 linkfor *leg = stn->leg[d];
 	 if (!(leg->l.reverse & FLAG_REPLACEMENTLEG))
 	    concatenate_trav(stn, d);
@@ -262,7 +266,7 @@ concatenate_trav(node *stn, int i)
    if (!two_node(stn2) || fixed(stn2)) return;
 
    trav = osnew(stack);
-   newleg2 = (linkfor*)osnew(linkcommon);
+   newleg2 = (linkfor*)pool_new(linkcommon);
 
 #if PRINT_NETBITS
    printf("Concatenating trav "); print_prefix(stn->name); printf("<%p>",stn);
@@ -455,9 +459,9 @@ replace_travs(void)
       print_prefix(stn1->name);
       printf(" [%p]\n", stn1);
 #endif
-      for (i = 0; i <= 2; i++) {
+      for (i = 0; stn1->leg[i]; i++) {
 	 linkfor *leg = stn1->leg[i];
-	 if (leg && data_here(leg) &&
+	 if (data_here(leg) &&
 	     !(leg->l.reverse & (FLAG_REPLACEMENTLEG | FLAG_FAKE))) {
 	    SVX_ASSERT(fixed(stn1));
 	    SVX_ASSERT(!fZeros(&leg->v));
@@ -585,10 +589,10 @@ replace_travs(void)
 		     POS(stn1, 0), POS(stn1, 1), POS(stn1, 2));
 
       fArtic = stn1->leg[i]->l.reverse & FLAG_ARTICULATION;
-      osfree(stn1->leg[i]);
+      pool_delete(linkfor, stn1->leg[i]);
       stn1->leg[i] = ptr->join1; /* put old link back in */
 
-      osfree(stn2->leg[j]);
+      pool_delete(linkcommon, stn2->leg[j]);
       stn2->leg[j] = ptr->join2; /* and the other end */
 
 #ifdef BLUNDER_DETECTION
@@ -804,13 +808,15 @@ replace_trailing_travs(void)
 #endif
       /* We may have swapped the links round when we removed the leg.  If
        * we did then stn1->leg[i] will be in use.  The link we swapped
-       * with is the first free leg */
-      if (stn1->leg[i]) {
+       * with was the last leg, so it goes back to the first free leg */
+      {
 	 /* j is the direction to swap with */
-	 int j = (stn1->leg[1]) ? 2 : 1;
-	 /* change the other direction of leg i to use leg j */
-	 reverse_leg(stn1->leg[i])->l.reverse += j - i;
-	 stn1->leg[j] = stn1->leg[i];
+	 int j = freeleg(stn1);
+	 if (j != i) {
+	    /* change the other direction of leg i to use leg j */
+	    reverse_leg(stn1->leg[i])->l.reverse += j - i;
+	    stn1->leg[j] = stn1->leg[i];
+	 }
       }
       stn1->leg[i] = ptrTrail->join1;
       img_write_item(pimg, img_MOVE, 0, NULL,
@@ -905,6 +911,10 @@ skip_nosurvey:
       osfree(p);
    }
 
+   /* The network is now back to its original form, so we can find the
+    * covariances of the station positions in one go. */
+   if (f_station_errors) compute_station_covariances(fixedlist);
+
    /* write stations to .3d file and free legs and stations */
    for (stn1 = fixedlist; stn1; stn1 = stn1->next) {
       int d;
@@ -924,6 +934,19 @@ skip_nosurvey:
 	       stn1->name->sflags = sf | BIT(SFLAGS_SOLVED);
 	       sf &= SFLAGS_MASK;
 	       if (stn1->name->max_export) sf |= BIT(SFLAGS_EXPORTED);
+	       const svar *v = stn1->name->pos->var;
+	       if (v) {
+		  double cov[6];
+#ifdef NO_COVARIANCES
+		  for (int c = 0; c < 3; c++) {
+		     cov[c] = (*v)[c];
+		     cov[c + 3] = 0.0;
+		  }
+#else
+		  for (int c = 0; c < 6; c++) cov[c] = (*v)[c];
+#endif
+		  img_write_station_covariance(pimg, cov);
+	       }
 	       img_write_item(pimg, img_LABEL, sf, label,
 			      POS(stn1, 0), POS(stn1, 1), POS(stn1, 2));
 	    }
@@ -979,10 +1002,10 @@ skip_nosurvey:
 	  }
       }
 
-      for (i = 0; i <= 2; i++) {
+      for (i = 0; stn1->leg[i]; i++) {
 	 leg = stn1->leg[i];
 	 /* only want to think about forwards legs */
-	 if (leg && data_here(leg)) {
+	 if (data_here(leg)) {
 	    linkfor *legRev;
 	    node *stnB;
 	    int iB;
@@ -1004,24 +1027,45 @@ skip_nosurvey:
 		  totvert += fabs(leg->d[2]);
 	       }
 	    }
-	    osfree(leg);
-	    osfree(legRev);
-	    stn1->leg[i] = stnB->leg[iB] = NULL;
 	 }
       }
    }
 
    /* The station position is attached to the name, so we leave the names and
     * positions in place - they can then be picked up if we have a *solve
-    * followed by more data */
+    * followed by more data.  Each link is in the legs of exactly one node
+    * so we can free the legs here without looking at any other node. */
    for (stn1 = fixedlist; stn1; stn1 = stn2) {
       stn2 = stn1->next;
+      for (i = 0; stn1->leg[i]; i++) {
+	 leg = stn1->leg[i];
+	 if (data_here(leg)) {
+	    pool_delete(linkfor, leg);
+	 } else {
+	    pool_delete(linkcommon, leg);
+	 }
+      }
       stn1->name->stn = NULL;
-      osfree(stn1);
+      delete_node(stn1);
    }
    fixedlist = NULL;
 }
 
+/* Give stations which are fixed before we start solving a zero covariance
+ * (unless we already know it from a previous *solve), so that
+ * compute_station_covariances() can tell which stations were solved for.
+ */
+static void
+set_fixed_point_vars(void)
+{
+   for (node *stn = fixedlist; stn; stn = stn->next) {
+      pos *p = stn->name->pos;
+      if (p->var) continue;
+      p->var = osmalloc(ossizeof(svar));
+      memset(p->var, 0, sizeof(svar));
+   }
+}
+
 static void
 write_passage_models(void)
 {
@@ -0,0 +1,1504 @@
+/* parsecache.c
+ * Cache of the effects of parsing survey data files
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* While parsing a .svx file (or a Compass .dat or .clp file) we record what
+ * it does to the survey network as a list of operations: creating stations,
+ * adding legs and equates, and the final station flags and export levels.  Next time we see the same file
+ * contents read with the same settings we can replay these operations
+ * instead of parsing it again.
+ *
+ * The effects of parsing a file also depend on the stations from outside it
+ * which it refers to, so we record the state of each of those stations when
+ * the file first looks at it, and check that state matches before replaying.
+ *
+ * Anything else which depends on or changes state outside of the file (such
+ * as *include, *solve, *fix or *cs) or which gives a diagnostic means the
+ * file isn't cached - see parse_cache_abandon().
+ *
+ * The cache is stored next to the other output files.  Only records which
+ * were used or created by the current run are written out, so it doesn't
+ * grow without limit as files are edited.
+ *
+ * The same records are also how worker processes which parse the files in a
+ * Compass project in parallel pass back what each file does (see makpar.c).
+ */
+
+#include <config.h>
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cavern.h"
+#include "commands.h"
+#include "datain.h"
+#include "debug.h"
+#include "filelist.h"
+#include "filename.h"
+#include "hash.h"
+#include "netbits.h"
+#include "osalloc.h"
+#include "parsecache.h"
+#include "readval.h"
+#include "srcloc.h"
+
+bool f_cache = false;
+
+/* Counts of files replayed from the cache, and looked up but not found. */
+static unsigned long n_cache_hits = 0, n_cache_misses = 0;
+
+/* Counts of files replayed from records sent by worker processes, and for
+ * which the record couldn't be used. */
+static unsigned long n_worker_hits = 0, n_worker_misses = 0;
+
+/* Bump this if the format of the cache file changes. */
+#define CACHE_VERSION 2
+
+static const char cache_magic[8] = { 'S', 'V', 'X', 'C', 'A', 'C', 'H', 'E' };
+
+/* Operations in a record. */
+enum {
+   OP_END,
+   /* Define the next ref as an existing child of a ref. */
+   OP_PATH,
+   /* Check the state of an existing prefix. */
+   OP_STATE,
+   /* Define the next ref as a new child of a ref. */
+   OP_CHILD,
+   /* Define the next ref as a new anonymous station in a ref. */
+   OP_ANON,
+   /* Set the leg flags, style and metadata for subsequent legs. */
+   OP_CONTEXT,
+   OP_LEG,
+   OP_EQUATE,
+   /* Set the final station flags, export levels and location of a ref. */
+   OP_FINAL,
+   /* The file uses *export or *infer exports. */
+   OP_EXPORT_USED,
+   /* Pass a ref to scan_compass_station_name(). */
+   OP_SCAN,
+   /* The range of magnetic declinations the file calculated, and the grid
+    * convergence used. */
+   OP_DECLINATION
+};
+
+/* Values for the metadata in OP_CONTEXT. */
+enum { META_NONE, META_INITIAL, META_DATED };
+
+/* Bits for the station state in OP_STATE. */
+enum { STATE_STN = 1, STATE_POS = 2, STATE_FIXED = 4 };
+
+typedef struct {
+   unsigned char *p;
+   size_t len, size;
+} buffer;
+
+static void
+buf_reserve(buffer *b, size_t n)
+{
+   if (b->size - b->len >= n) return;
+   size_t new_size = b->size ? b->size : 1024;
+   while (new_size - b->len < n) new_size *= 2;
+   b->p = osrealloc(b->p, new_size);
+   b->size = new_size;
+}
+
+static void
+put_bytes(buffer *b, const void *p, size_t n)
+{
+   buf_reserve(b, n);
+   memcpy(b->p + b->len, p, n);
+   b->len += n;
+}
+
+static void
+put_byte(buffer *b, unsigned v)
+{
+   buf_reserve(b, 1);
+   b->p[b->len++] = (unsigned char)v;
+}
+
+/* Variable length unsigned integer, 7 bits per byte, least significant
+ * first. */
+static void
+put_uint(buffer *b, uint64_t v)
+{
+   while (v >= 0x80) {
+      put_byte(b, (unsigned)(v & 0x7f) | 0x80);
+      v >>= 7;
+   }
+   put_byte(b, (unsigned)v);
+}
+
+static void
+put_int(buffer *b, int v)
+{
+   /* Map small negative values to small unsigned values. */
+   put_uint(b, v < 0 ? ((uint64_t)-(v + 1) << 1) | 1 : (uint64_t)v << 1);
+}
+
+static void
+put_real(buffer *b, real v)
+{
+   put_bytes(b, &v, sizeof(v));
+}
+
+/* Identifiers are stored with their terminating nul. */
+static void
+put_ident(buffer *b, const char *s)
+{
+   size_t len = strlen(s) + 1;
+   put_uint(b, len);
+   put_bytes(b, s, len);
+}
+
+typedef struct {
+   const unsigned char *p, *end;
+   bool bad;
+} reader;
+
+static unsigned
+get_byte(reader *r)
+{
+   if (r->p == r->end) {
+      r->bad = true;
+      return 0;
+   }
+   return *r->p++;
+}
+
+static uint64_t
+get_uint(reader *r)
+{
+   uint64_t v = 0;
+   for (int shift = 0; shift < 64; shift += 7) {
+      unsigned c = get_byte(r);
+      v |= (uint64_t)(c & 0x7f) << shift;
+      if (!(c & 0x80)) return v;
+   }
+   r->bad = true;
+   return 0;
+}
+
+static int
+get_int(reader *r)
+{
+   uint64_t v = get_uint(r);
+   if (v >> 32) {
+      r->bad = true;
+      return 0;
+   }
+   return (v & 1) ? -(int)(v >> 1) - 1 : (int)(v >> 1);
+}
+
+static real
+get_real(reader *r)
+{
+   real v = 0;
+   if ((size_t)(r->end - r->p) < sizeof(v)) {
+      r->bad = true;
+      r->p = r->end;
+      return v;
+   }
+   memcpy(&v, r->p, sizeof(v));
+   r->p += sizeof(v);
+   return v;
+}
+
+static const char *
+get_ident(reader *r)
+{
+   uint64_t len = get_uint(r);
+   if (len == 0 || len > (uint64_t)(r->end - r->p) || r->p[len - 1] != '\0') {
+      r->bad = true;
+      r->p = r->end;
+      return "";
+   }
+   const char *s = (const char *)r->p;
+   r->p += len;
+   return s;
+}
+
+/* Map from a pointer to an index. */
+typedef struct {
+   const void **keys;
+   uint32_t *values;
+   size_t size, count;
+} ptr_map;
+
+static unsigned
+ptr_hash(const void *key)
+{
+   return hash_data_full((const char *)&key, sizeof(key));
+}
+
+static uint32_t *
+ptr_map_find(const ptr_map *m, const void *key)
+{
+   if (m->count == 0) return NULL;
+   size_t i = HASH_TABLE_SLOT(ptr_hash(key), m->size);
+   while (m->keys[i]) {
+      if (m->keys[i] == key) return &m->values[i];
+      i = HASH_TABLE_NEXT(i, m->size);
+   }
+   return NULL;
+}
+
+static void
+ptr_map_add(ptr_map *m, const void *key, uint32_t value)
+{
+   size_t new_size = hash_table_grow(m->size, m->count, 256);
+   if (new_size) {
+      /* Rehash into the larger table. */
+      const void **old_keys = m->keys;
+      uint32_t *old_values = m->values;
+      size_t old_size = m->size;
+      m->size = new_size;
+      m->keys = osmalloc(m->size * ossizeof(const void *));
+      memset(m->keys, 0, m->size * sizeof(const void *));
+      m->values = osmalloc(m->size * ossizeof(uint32_t));
+      m->count = 0;
+      for (size_t j = 0; j < old_size; ++j) {
+	 if (old_keys[j]) ptr_map_add(m, old_keys[j], old_values[j]);
+      }
+      osfree(old_keys);
+      osfree(old_values);
+   }
+   size_t i = HASH_TABLE_SLOT(ptr_hash(key), m->size);
+   while (m->keys[i]) i = HASH_TABLE_NEXT(i, m->size);
+   m->keys[i] = key;
+   m->values[i] = value;
+   ++m->count;
+}
+
+static void
+ptr_map_free(ptr_map *m)
+{
+   osfree(m->keys);
+   osfree(m->values);
+   m->keys = NULL;
+   m->values = NULL;
+   m->size = m->count = 0;
+}
+
+/* Hash n bytes at p, continuing from h.
+ *
+ * We hash the whole of every input file, so this works a 64-bit word at a
+ * time (with FNV-1a for any remaining bytes) - hashing a byte at a time
+ * is about as slow as parsing the file.
+ */
+#ifdef __clang__
+__attribute__((no_sanitize("unsigned-integer-overflow")))
+#endif
+static uint64_t
+hash_bytes(uint64_t h, const void *p, size_t n)
+{
+   const unsigned char *q = p;
+   while (n >= sizeof(uint64_t)) {
+      uint64_t w;
+      memcpy(&w, q, sizeof(w));
+      h = (h ^ w) * 0x9e3779b97f4a7c15u;
+      h ^= h >> 29;
+      q += sizeof(w);
+      n -= sizeof(w);
+   }
+   while (n--) {
+      h ^= *q++;
+      h *= 1099511628211u;
+   }
+   return h;
+}
+
+#define HASH_INIT 14695981039346656037u
+
+#define HASH_FIELD(H, F) hash_bytes((H), &(F), sizeof(F))
+
+static uint64_t
+hash_str_field(uint64_t h, const char *s)
+{
+   /* Include the nul so NULL and "" differ, and concatenations can't
+    * collide. */
+   if (!s) return hash_bytes(h, "\1", 1);
+   return hash_bytes(h, s, strlen(s) + 1);
+}
+
+/* Hash everything in the settings which can affect the parsing of a file.
+ *
+ * The range of declinations calculated and the grid convergence are
+ * accumulated as files are read rather than affecting how they're parsed, so
+ * aren't included - instead what a file adds to them is recorded (see
+ * parse_cache_declination()).
+ */
+static uint64_t
+hash_settings(const settings *s)
+{
+   uint64_t h = HASH_INIT;
+   h = HASH_FIELD(h, s->Truncate);
+   h = HASH_FIELD(h, s->f_clino_percent);
+   h = HASH_FIELD(h, s->f_backclino_percent);
+   h = HASH_FIELD(h, s->f_bearing_quadrants);
+   h = HASH_FIELD(h, s->f_backbearing_quadrants);
+   h = HASH_FIELD(h, s->dash_for_anon_wall_station);
+   h = HASH_FIELD(h, s->from_equals_to_is_only_a_warning);
+   h = HASH_FIELD(h, s->infer);
+   h = HASH_FIELD(h, s->Case);
+   h = HASH_FIELD(h, s->style);
+   h = HASH_FIELD(h, s->recorded_style);
+   for (const prefix *p = s->Prefix; p->up; p = p->up) {
+      h = hash_str_field(h, prefix_ident(p));
+   }
+   h = hash_bytes(h, s->Translate - 1, 257 * sizeof(short));
+   h = hash_bytes(h, s->Var, Q_MAC * sizeof(real));
+   h = hash_bytes(h, s->z, Q_MAC * sizeof(real));
+   h = hash_bytes(h, s->sc, Q_MAC * sizeof(real));
+   h = hash_bytes(h, s->units, Q_MAC * sizeof(real));
+   const reading *o = s->ordering;
+   do {
+      h = HASH_FIELD(h, *o);
+   } while (*o++ != End);
+   h = HASH_FIELD(h, s->flags);
+   h = hash_str_field(h, s->proj_str);
+   h = HASH_FIELD(h, s->dec_lat);
+   h = HASH_FIELD(h, s->dec_lon);
+   h = HASH_FIELD(h, s->dec_alt);
+   h = HASH_FIELD(h, s->declination);
+   h = HASH_FIELD(h, s->input_convergence);
+   h = HASH_FIELD(h, s->cartesian_rotation);
+   h = HASH_FIELD(h, s->cartesian_north);
+   int days[2] = { -2, -2 };
+   if (s->meta) {
+      days[0] = s->meta->days1;
+      days[1] = s->meta->days2;
+   }
+   h = hash_bytes(h, days, sizeof(days));
+   return h;
+}
+
+/* A record in the cache. */
+typedef struct {
+   uint64_t content_hash, settings_hash, size;
+   /* Hash of the record data, to detect a corrupted cache file. */
+   uint64_t check;
+   const unsigned char *data;
+   size_t len;
+   /* Was this record used or created by this run? */
+   bool used;
+   /* Is data malloced? */
+   bool owned;
+} cache_entry;
+
+static cache_entry *entries = NULL;
+static size_t n_entries = 0, max_entries = 0;
+
+/* Open addressing index into entries (storing index + 1, so 0 is empty). */
+static size_t *entry_index = NULL;
+static size_t entry_index_size = 0;
+
+static bool cache_loaded = false;
+static bool cache_changed = false;
+static char *cache_fnm = NULL;
+static unsigned char *cache_contents = NULL;
+
+static size_t
+entry_hash(uint64_t content_hash, uint64_t settings_hash)
+{
+   return (size_t)(content_hash ^ (settings_hash >> 1));
+}
+
+static cache_entry *
+find_entry(uint64_t content_hash, uint64_t settings_hash, uint64_t size)
+{
+   if (!entry_index) return NULL;
+   size_t i = HASH_TABLE_SLOT(entry_hash(content_hash, settings_hash),
+			      entry_index_size);
+   while (entry_index[i]) {
+      cache_entry *e = &entries[entry_index[i] - 1];
+      if (e->content_hash == content_hash &&
+	  e->settings_hash == settings_hash &&
+	  e->size == size) {
+	 return e;
+      }
+      i = HASH_TABLE_NEXT(i, entry_index_size);
+   }
+   return NULL;
+}
+
+static void
+index_entry(size_t n)
+{
+   const cache_entry *e = &entries[n];
+   size_t i = HASH_TABLE_SLOT(entry_hash(e->content_hash, e->settings_hash),
+			      entry_index_size);
+   while (entry_index[i]) i = HASH_TABLE_NEXT(i, entry_index_size);
+   entry_index[i] = n + 1;
+}
+
+static cache_entry *
+add_entry(void)
+{
+   if (n_entries == max_entries) {
+      max_entries = max_entries ? max_entries * 2 : 64;
+      entries = osrealloc(entries, max_entries * ossizeof(cache_entry));
+   }
+   size_t new_size = hash_table_grow(entry_index_size, n_entries, 256);
+   if (new_size) {
+      osfree(entry_index);
+      entry_index_size = new_size;
+      entry_index = osmalloc(entry_index_size * ossizeof(size_t));
+      memset(entry_index, 0, entry_index_size * sizeof(size_t));
+      for (size_t i = 0; i < n_entries; ++i) index_entry(i);
+   }
+   return &entries[n_entries++];
+}
+
+/* Add a record to the cache, taking ownership of data. */
+static void
+cache_record(const uint64_t key[3], unsigned char *data, size_t len)
+{
+   cache_entry *e = find_entry(key[0], key[1], key[2]);
+   if (e) {
+      /* The record didn't match the state of the stations this time. */
+      if (e->owned) osfree((void *)e->data);
+   } else {
+      e = add_entry();
+      e->content_hash = key[0];
+      e->settings_hash = key[1];
+      e->size = key[2];
+      index_entry(n_entries - 1);
+   }
+   e->data = data;
+   e->len = len;
+   e->check = hash_bytes(HASH_INIT, data, len);
+   e->used = true;
+   e->owned = true;
+   cache_changed = true;
+}
+
+/* Header: magic, version, byte order probe, sizeof(real) and whether
+ * covariances are stored. */
+static void
+make_header(unsigned char *header)
+{
+   uint32_t version = CACHE_VERSION;
+   uint32_t probe = 0x01020304;
+   memcpy(header, cache_magic, 8);
+   memcpy(header + 8, &version, 4);
+   memcpy(header + 12, &probe, 4);
+   header[16] = (unsigned char)sizeof(real);
+#ifdef NO_COVARIANCES
+   header[17] = 0;
+#else
+   header[17] = 1;
+#endif
+}
+
+#define HEADER_LEN 18
+
+/* Each record starts with content_hash, settings_hash, size, len and
+ * check. */
+#define ENTRY_HEADER_LEN (5 * sizeof(uint64_t))
+
+static void
+load_cache(void)
+{
+   cache_loaded = true;
+   if (!fnm_output_base) return;
+   cache_fnm = add_ext(fnm_output_base, EXT_SVX_CACHE);
+   FILE *fh = fopen(cache_fnm, "rb");
+   if (!fh) return;
+   long len = -1;
+   if (fseek(fh, 0, SEEK_END) == 0) len = ftell(fh);
+   if (len < HEADER_LEN || fseek(fh, 0, SEEK_SET) != 0) {
+      fclose(fh);
+      return;
+   }
+   cache_contents = osmalloc(len);
+   if (fread(cache_contents, len, 1, fh) != 1) len = 0;
+   fclose(fh);
+
+   unsigned char header[HEADER_LEN];
+   make_header(header);
+   if (len < HEADER_LEN || memcmp(cache_contents, header, HEADER_LEN) != 0) {
+      /* Not a cache file we can use - we'll overwrite it. */
+      osfree(cache_contents);
+      cache_contents = NULL;
+      return;
+   }
+
+   const unsigned char *p = cache_contents + HEADER_LEN;
+   const unsigned char *end = cache_contents + len;
+   while ((size_t)(end - p) >= ENTRY_HEADER_LEN) {
+      uint64_t fields[5];
+      memcpy(fields, p, sizeof(fields));
+      p += ENTRY_HEADER_LEN;
+      if (fields[3] > (uint64_t)(end - p)) break;
+      cache_entry *e = add_entry();
+      e->content_hash = fields[0];
+      e->settings_hash = fields[1];
+      e->size = fields[2];
+      e->len = fields[3];
+      e->check = fields[4];
+      e->data = p;
+      e->used = false;
+      e->owned = false;
+      index_entry(n_entries - 1);
+      p += e->len;
+   }
+}
+
+void
+parse_cache_write(void)
+{
+   if (!f_cache || !cache_loaded) return;
+   if (!cache_changed) {
+      /* Also rewrite the cache to drop any records we didn't use. */
+      for (size_t i = 0; i < n_entries; ++i) {
+	 if (!entries[i].used) {
+	    cache_changed = true;
+	    break;
+	 }
+      }
+      if (!cache_changed) return;
+   }
+   if (!cache_fnm) return;
+
+   /* Write to a temporary file and rename it into place so anything reading
+    * the cache never sees a partly written file. */
+   size_t fnm_len = strlen(cache_fnm);
+   char *tmp_fnm = osmalloc(fnm_len + 5);
+   memcpy(tmp_fnm, cache_fnm, fnm_len);
+   memcpy(tmp_fnm + fnm_len, ".tmp", 5);
+   FILE *fh = fopen(tmp_fnm, "wb");
+   if (!fh) {
+      osfree(tmp_fnm);
+      return;
+   }
+   unsigned char header[HEADER_LEN];
+   make_header(header);
+   bool ok = (fwrite(header, HEADER_LEN, 1, fh) == 1);
+   for (size_t i = 0; ok && i < n_entries; ++i) {
+      const cache_entry *e = &entries[i];
+      if (!e->used) continue;
+      uint64_t fields[5] = {
+	 e->content_hash, e->settings_hash, e->size, e->len, e->check
+      };
+      ok = (fwrite(fields, sizeof(fields), 1, fh) == 1 &&
+	    fwrite(e->data, e->len, 1, fh) == 1);
+   }
+   if (fclose(fh) != 0) ok = false;
+   if (ok) {
+#ifdef _WIN32
+      /* rename() won't replace an existing file on Microsoft Windows. */
+      remove(cache_fnm);
+#endif
+      ok = (rename(tmp_fnm, cache_fnm) == 0);
+   }
+   /* The cache is only an optimisation, so failing to write it isn't an
+    * error. */
+   if (!ok) remove(tmp_fnm);
+   osfree(tmp_fnm);
+}
+
+/* A prefix which a record refers to. */
+typedef struct {
+   prefix *pfx;
+   /* Location when the file first saw this prefix. */
+   srcloc loc;
+   /* REF_xxx */
+   unsigned char kind;
+} cache_ref;
+
+enum {
+   /* An existing prefix, which the file hasn't looked at the state of. */
+   REF_PATH,
+   /* An existing prefix, which the file has looked at the state of. */
+   REF_SEEN,
+   /* A prefix created by the file. */
+   REF_NEW
+};
+
+/* State for recording the file currently being parsed. */
+static struct {
+   /* Key for the record. */
+   uint64_t content_hash, settings_hash, size;
+   /* Hash of *pcs at the start of the file. */
+   uint64_t pcs_hash;
+   settings *pcs;
+   /* The metadata at the start, and its dates at that point. */
+   meta_data *initial_meta;
+   int initial_days1, initial_days2;
+   /* The leg flags, style and metadata we've recorded for the legs. */
+   int flags, style;
+   meta_data *meta;
+   int days1, days2;
+   bool export_used;
+   /* Has an equate involving a station from before the file been recorded? */
+   bool equated;
+   /* The range of declinations the file has calculated. */
+   real dec_min, dec_max;
+   int dec_min_days, dec_max_days;
+   /* The grid convergence in *pcs at the start. */
+   real convergence;
+   /* Is the record to be sent back from a worker process? */
+   bool send;
+   buffer ops;
+   cache_ref *refs;
+   size_t n_refs, max_refs;
+   /* Map prefix -> ref. */
+   ptr_map ref_map;
+   /* Map pos -> first REF_SEEN with that pos. */
+   ptr_map pos_map;
+} rec;
+
+/* How many calls to parse_cache_lookup() we're nested inside. */
+static int depth = 0;
+
+/* The value of depth for the file being recorded, or 0 if not recording. */
+static int recording_depth = 0;
+
+/* The next file looked up with these settings is one from a Compass project
+ * which a worker process is parsing. */
+static settings *worker_pcs = NULL;
+
+/* True in a worker process, where we record that file to send back. */
+static bool worker_send = false;
+
+/* In the main process, the record for that file from the worker. */
+static struct {
+   uint64_t key[3];
+   unsigned char *data;
+   size_t len;
+} offer;
+
+/* In a worker process, the record to send back. */
+static struct {
+   uint64_t key[3];
+   unsigned char *data;
+   size_t len;
+} sent;
+
+static uint64_t
+key_settings_hash(unsigned kind)
+{
+   uint64_t h = hash_settings(pcs);
+   h = HASH_FIELD(h, f_export_ok);
+   h = hash_str_field(h, proj_str_out);
+   h = HASH_FIELD(h, kind);
+   return h;
+}
+
+static uint32_t
+add_ref(prefix *pfx, int kind)
+{
+   if (rec.n_refs == rec.max_refs) {
+      rec.max_refs *= 2;
+      rec.refs = osrealloc(rec.refs, rec.max_refs * ossizeof(cache_ref));
+   }
+   uint32_t r = (uint32_t)rec.n_refs++;
+   rec.refs[r].pfx = pfx;
+   rec.refs[r].loc = pfx->loc;
+   rec.refs[r].kind = kind;
+   ptr_map_add(&rec.ref_map, pfx, r);
+   return r;
+}
+
+static void
+stop_recording(void)
+{
+   /* Anything the file sets is in addition to the state from before it. */
+   fExportUsed |= rec.export_used;
+   osfree(rec.ops.p);
+   osfree(rec.refs);
+   ptr_map_free(&rec.ref_map);
+   ptr_map_free(&rec.pos_map);
+   memset(&rec, 0, sizeof(rec));
+   recording_depth = 0;
+}
+
+void
+parse_cache_abandon(void)
+{
+   if (recording_depth) stop_recording();
+}
+
+/* Return the ref for an existing prefix, adding refs for it and any of its
+ * parents which don't have one yet.  Returns -1 if this isn't possible. */
+static int64_t
+existing_ref(prefix *pfx)
+{
+   uint32_t *r = ptr_map_find(&rec.ref_map, pfx);
+   if (r) return *r;
+   if (TSTBIT(pfx->sflags, SFLAGS_ANON) || !pfx->up) {
+      /* Only the root has no parent, and that's always ref 0. */
+      return -1;
+   }
+   int64_t parent = existing_ref(pfx->up);
+   if (parent < 0) return -1;
+   put_byte(&rec.ops, OP_PATH);
+   put_uint(&rec.ops, (uint64_t)parent);
+   put_ident(&rec.ops, prefix_ident(pfx));
+   return add_ref(pfx, REF_PATH);
+}
+
+void
+parse_cache_note_prefix(prefix *pfx)
+{
+   if (!recording_depth) return;
+   int64_t r = existing_ref(pfx);
+   if (r < 0) {
+      parse_cache_abandon();
+      return;
+   }
+   cache_ref *ref = &rec.refs[r];
+   if (ref->kind != REF_PATH) return;
+
+   /* Record the state of the prefix before the file changes it. */
+   if (pfx->pos && rec.equated) {
+      /* An equate earlier in the file may have merged this prefix's pos, in
+       * which case we no longer know what the state was before the file. */
+      parse_cache_abandon();
+      return;
+   }
+   ref->kind = REF_SEEN;
+   ref->loc = pfx->loc;
+   put_byte(&rec.ops, OP_STATE);
+   put_uint(&rec.ops, (uint64_t)r);
+   put_uint(&rec.ops, pfx->sflags & ~BIT(SFLAGS_UNSORTED));
+   put_uint(&rec.ops, pfx->min_export);
+   put_uint(&rec.ops, pfx->max_export);
+   unsigned state = 0;
+   if (pfx->stn) state |= STATE_STN;
+   if (pfx->pos) {
+      state |= STATE_POS;
+      if (pos_fixed(pfx->pos)) state |= STATE_FIXED;
+   }
+   put_byte(&rec.ops, state);
+   if (state & STATE_FIXED) {
+      for (int d = 0; d < 3; ++d) put_real(&rec.ops, pfx->pos->p[d]);
+   }
+   if (pfx->pos) {
+      /* Record which earlier prefix (if any) this one is equated to. */
+      uint32_t *same = ptr_map_find(&rec.pos_map, pfx->pos);
+      if (same) {
+	 put_uint(&rec.ops, *same);
+      } else {
+	 put_uint(&rec.ops, (uint64_t)r);
+	 ptr_map_add(&rec.pos_map, pfx->pos, (uint32_t)r);
+      }
+   }
+}
+
+void
+parse_cache_new_prefix(prefix *pfx, int sflag)
+{
+   if (!recording_depth) return;
+   uint32_t *parent = ptr_map_find(&rec.ref_map, pfx->up);
+   if (!parent) {
+      int64_t r = existing_ref(pfx->up);
+      if (r < 0) {
+	 parse_cache_abandon();
+	 return;
+      }
+      parent = ptr_map_find(&rec.ref_map, pfx->up);
+   }
+   if (TSTBIT(pfx->sflags, SFLAGS_ANON)) {
+      put_byte(&rec.ops, OP_ANON);
+      put_uint(&rec.ops, *parent);
+      put_uint(&rec.ops, file.line);
+   } else {
+      put_byte(&rec.ops, OP_CHILD);
+      put_uint(&rec.ops, *parent);
+      put_uint(&rec.ops, (unsigned)sflag);
+      put_uint(&rec.ops, file.line);
+      put_ident(&rec.ops, prefix_ident(pfx));
+   }
+   add_ref(pfx, REF_NEW);
+}
+
+/* Record the leg flags, style and metadata if they've changed. */
+static void
+record_context(void)
+{
+   meta_data *meta = pcs->meta;
+   if (pcs->flags == rec.flags && pcs->recorded_style == rec.style &&
+       meta == rec.meta &&
+       (!meta || (meta->days1 == rec.days1 && meta->days2 == rec.days2))) {
+      return;
+   }
+   put_byte(&rec.ops, OP_CONTEXT);
+   put_uint(&rec.ops, (unsigned)pcs->flags);
+   put_uint(&rec.ops, (unsigned)pcs->recorded_style);
+   if (!meta) {
+      put_byte(&rec.ops, META_NONE);
+   } else if (meta == rec.initial_meta &&
+	      meta->days1 == rec.initial_days1 &&
+	      meta->days2 == rec.initial_days2) {
+      put_byte(&rec.ops, META_INITIAL);
+   } else {
+      put_byte(&rec.ops, META_DATED);
+      put_int(&rec.ops, meta->days1);
+      put_int(&rec.ops, meta->days2);
+   }
+   rec.flags = pcs->flags;
+   rec.style = pcs->recorded_style;
+   rec.meta = meta;
+   if (meta) {
+      rec.days1 = meta->days1;
+      rec.days2 = meta->days2;
+   }
+}
+
+/* Look up the ref for a prefix passed to addlegbyname() or process_equate(),
+ * which the file must have already looked up or created. */
+static bool
+get_ref(const prefix *pfx, uint32_t *r)
+{
+   uint32_t *p = ptr_map_find(&rec.ref_map, pfx);
+   if (!p || rec.refs[*p].kind == REF_PATH) {
+      parse_cache_abandon();
+      return false;
+   }
+   *r = *p;
+   return true;
+}
+
+void
+parse_cache_leg(prefix *fr, prefix *to, bool fToFirst,
+		real dx, real dy, real dz,
+		real vx, real vy, real vz
+#ifndef NO_COVARIANCES
+		, real cyz, real czx, real cxy
+#endif
+		)
+{
+   if (!recording_depth) return;
+   uint32_t r_fr, r_to;
+   if (!get_ref(fr, &r_fr) || !get_ref(to, &r_to)) return;
+   record_context();
+   put_byte(&rec.ops, OP_LEG);
+   put_uint(&rec.ops, r_fr);
+   put_uint(&rec.ops, r_to);
+   put_byte(&rec.ops, fToFirst);
+   put_real(&rec.ops, dx);
+   put_real(&rec.ops, dy);
+   put_real(&rec.ops, dz);
+   put_real(&rec.ops, vx);
+   put_real(&rec.ops, vy);
+   put_real(&rec.ops, vz);
+#ifndef NO_COVARIANCES
+   put_real(&rec.ops, cyz);
+   put_real(&rec.ops, czx);
+   put_real(&rec.ops, cxy);
+#endif
+}
+
+void
+parse_cache_equate(prefix *name1, prefix *name2)
+{
+   if (!recording_depth) return;
+   uint32_t r1, r2;
+   if (!get_ref(name1, &r1) || !get_ref(name2, &r2)) return;
+   record_context();
+   put_byte(&rec.ops, OP_EQUATE);
+   put_uint(&rec.ops, r1);
+   put_uint(&rec.ops, r2);
+   /* Equating two stations which are both new in this file can't change the
+    * pos of a station which existed before it. */
+   if (rec.refs[r1].kind != REF_NEW || rec.refs[r2].kind != REF_NEW)
+      rec.equated = true;
+}
+
+void
+parse_cache_scan(prefix *stn)
+{
+   if (!recording_depth) return;
+   uint32_t r;
+   if (!get_ref(stn, &r)) return;
+   put_byte(&rec.ops, OP_SCAN);
+   put_uint(&rec.ops, r);
+}
+
+void
+parse_cache_declination(real declination, int days)
+{
+   if (!recording_depth) return;
+   /* Keep the first date with the extreme value, as get_declination() does.
+    */
+   if (declination < rec.dec_min) {
+      rec.dec_min = declination;
+      rec.dec_min_days = days;
+   }
+   if (declination > rec.dec_max) {
+      rec.dec_max = declination;
+      rec.dec_max_days = days;
+   }
+}
+
+static void
+start_recording(uint64_t content_hash, uint64_t settings_hash)
+{
+   rec.content_hash = content_hash;
+   rec.settings_hash = settings_hash;
+   rec.size = (uint64_t)file.size;
+   rec.pcs = pcs;
+   rec.pcs_hash = hash_settings(pcs);
+   rec.initial_meta = rec.meta = pcs->meta;
+   if (pcs->meta) {
+      rec.initial_days1 = rec.days1 = pcs->meta->days1;
+      rec.initial_days2 = rec.days2 = pcs->meta->days2;
+   }
+   rec.flags = pcs->flags;
+   rec.style = pcs->recorded_style;
+   rec.dec_min = HUGE_VAL;
+   rec.dec_max = -HUGE_VAL;
+   rec.convergence = pcs->convergence;
+   /* Note what the file itself sets. */
+   rec.export_used = fExportUsed;
+   fExportUsed = false;
+   rec.max_refs = 64;
+   rec.refs = osmalloc(rec.max_refs * ossizeof(cache_ref));
+   /* Ref 0 is always the root of the prefix tree. */
+   prefix *top = root;
+   while (top->up) top = top->up;
+   add_ref(top, REF_PATH);
+   recording_depth = depth;
+}
+
+/* Replay a record.  If apply is false, just check that the record is valid
+ * and matches the current state, without changing anything.
+ *
+ * If merge is true, a station which the record creates may already exist
+ * (because the record is from a worker process which didn't see the files
+ * which created it), in which case we use the existing station if parsing the
+ * file would have had the same effect as replaying the record does.  If
+ * merged isn't NULL, *merged is set to say if any stations were merged.
+ */
+static bool
+replay(const unsigned char *data, size_t len, bool apply, bool merge,
+       bool *merged)
+{
+   reader r = { data, data + len, false };
+   size_t max_refs = get_uint(&r);
+   if (r.bad || max_refs == 0 || max_refs > len) return false;
+
+   /* Existing prefixes and (once created when applying) new ones. */
+   prefix **refs = osmalloc(max_refs * ossizeof(prefix *));
+   /* Is each ref to a new prefix? */
+   bool *is_new = osmalloc(max_refs * ossizeof(bool));
+   /* Is each ref to a prefix the record creates which already exists? */
+   bool *is_merged = osmalloc(max_refs * ossizeof(bool));
+   size_t n_refs = 0;
+   if (merged) *merged = false;
+   ptr_map pos_map = { NULL, NULL, 0, 0 };
+   bool ok = false;
+
+   settings *real_pcs = pcs;
+   settings replay_pcs;
+   meta_data *dated_meta = NULL;
+   if (apply) {
+      /* addlegbyname() and process_equate() take the leg flags, style and
+       * metadata from pcs, so point pcs at a copy we can change. */
+      replay_pcs = *pcs;
+      pcs = &replay_pcs;
+   }
+
+   prefix *top = root;
+   while (top->up) top = top->up;
+   refs[n_refs] = top;
+   is_merged[n_refs] = false;
+   is_new[n_refs++] = false;
+
+#define GET_REF(V) do { \
+      uint64_t ref_ = get_uint(&r); \
+      if (ref_ >= n_refs) goto done; \
+      (V) = ref_; \
+   } while (0)
+
+   while (true) {
+      unsigned op = get_byte(&r);
+      if (r.bad) goto done;
+      switch (op) {
+	 case OP_END:
+	    ok = (r.p == r.end);
+	    goto done;
+	 case OP_PATH: {
+	    size_t parent;
+	    GET_REF(parent);
+	    const char *name = get_ident(&r);
+	    if (r.bad || n_refs == max_refs || is_new[parent]) goto done;
+	    prefix *pfx = find_prefix_child(refs[parent], name);
+	    if (!pfx) goto done;
+	    refs[n_refs] = pfx;
+	    is_merged[n_refs] = false;
+	    is_new[n_refs++] = false;
+	    break;
+	 }
+	 case OP_STATE: {
+	    size_t i;
+	    GET_REF(i);
+	    unsigned sflags_val = get_uint(&r);
+	    unsigned min_export = get_uint(&r);
+	    unsigned max_export = get_uint(&r);
+	    unsigned state = get_byte(&r);
+	    real coords[3];
+	    if (state & STATE_FIXED) {
+	       for (int d = 0; d < 3; ++d) coords[d] = get_real(&r);
+	    }
+	    size_t same = 0;
+	    if (state & STATE_POS) GET_REF(same);
+	    if (r.bad || is_new[i]) goto done;
+	    if (apply) break;
+	    const prefix *pfx = refs[i];
+	    unsigned cur_state = 0;
+	    if (pfx->stn) cur_state |= STATE_STN;
+	    if (pfx->pos) {
+	       cur_state |= STATE_POS;
+	       if (pos_fixed(pfx->pos)) cur_state |= STATE_FIXED;
+	    }
+	    if ((pfx->sflags & ~BIT(SFLAGS_UNSORTED)) != sflags_val ||
+		pfx->min_export != min_export ||
+		pfx->max_export != max_export ||
+		cur_state != state) {
+	       goto done;
+	    }
+	    if (state & STATE_FIXED) {
+	       for (int d = 0; d < 3; ++d) {
+		  if (pfx->pos->p[d] != coords[d]) goto done;
+	       }
+	    }
+	    if (state & STATE_POS) {
+	       /* Check the same prefixes are equated to each other. */
+	       uint32_t *p = ptr_map_find(&pos_map, pfx->pos);
+	       if (same == i) {
+		  if (p) goto done;
+		  ptr_map_add(&pos_map, pfx->pos, (uint32_t)i);
+	       } else {
+		  if (!p || *p != same) goto done;
+	       }
+	    }
+	    break;
+	 }
+	 case OP_CHILD: {
+	    size_t parent;
+	    GET_REF(parent);
+	    int sflag = get_uint(&r);
+	    unsigned line = get_uint(&r);
+	    const char *name = get_ident(&r);
+	    if (r.bad || n_refs == max_refs) goto done;
+	    prefix *pfx = NULL;
+	    bool exists = false;
+	    if ((!apply && !is_new[parent]) || (apply && merge)) {
+	       pfx = find_prefix_child(refs[parent], name);
+	       exists = (pfx != NULL);
+	    }
+	    if (exists) {
+	       /* The file created this so it mustn't exist yet, unless we can
+		* merge with it. */
+	       if (!merge) goto done;
+	       if (!apply && pfx->pos) {
+		  /* If this station is fixed, parsing the file could have
+		   * equated it to another fixed point.  Its position also
+		   * mustn't be shared with another prefix the file refers to,
+		   * as that could change the effect of the file's equates. */
+		  if (pos_fixed(pfx->pos) || ptr_map_find(&pos_map, pfx->pos))
+		     goto done;
+		  ptr_map_add(&pos_map, pfx->pos, (uint32_t)n_refs);
+	       }
+	       if (merged) *merged = true;
+	    } else if (apply) {
+	       file.line = line;
+	       pfx = new_prefix_child(refs[parent], name, sflag);
+	    }
+	    refs[n_refs] = pfx;
+	    is_merged[n_refs] = exists;
+	    is_new[n_refs++] = !exists;
+	    break;
+	 }
+	 case OP_ANON: {
+	    size_t parent;
+	    GET_REF(parent);
+	    unsigned line = get_uint(&r);
+	    if (r.bad || n_refs == max_refs) goto done;
+	    prefix *pfx = NULL;
+	    if (apply) {
+	       file.line = line;
+	       pfx = new_anon_station(refs[parent]);
+	    }
+	    refs[n_refs] = pfx;
+	    is_merged[n_refs] = false;
+	    is_new[n_refs++] = true;
+	    break;
+	 }
+	 case OP_CONTEXT: {
+	    int flags_val = get_uint(&r);
+	    int style = get_uint(&r);
+	    unsigned meta_type = get_byte(&r);
+	    int days1 = 0, days2 = 0;
+	    if (meta_type == META_DATED) {
+	       days1 = get_int(&r);
+	       days2 = get_int(&r);
+	    } else if (meta_type != META_NONE && meta_type != META_INITIAL) {
+	       goto done;
+	    }
+	    if (r.bad) goto done;
+	    if (!apply) break;
+	    pcs->flags = flags_val;
+	    pcs->recorded_style = style;
+	    if (meta_type == META_DATED && dated_meta &&
+		dated_meta->days1 == days1 && dated_meta->days2 == days2) {
+	       /* Only the flags or style changed. */
+	       pcs->meta = dated_meta;
+	       break;
+	    }
+	    if (dated_meta && dated_meta->ref_count == 0) osfree(dated_meta);
+	    dated_meta = NULL;
+	    if (meta_type == META_NONE) {
+	       pcs->meta = NULL;
+	    } else if (meta_type == META_INITIAL) {
+	       pcs->meta = real_pcs->meta;
+	    } else {
+	       dated_meta = osnew(meta_data);
+	       dated_meta->ref_count = 0;
+	       dated_meta->days1 = days1;
+	       dated_meta->days2 = days2;
+	       pcs->meta = dated_meta;
+	    }
+	    break;
+	 }
+	 case OP_LEG: {
+	    size_t fr, to;
+	    GET_REF(fr);
+	    GET_REF(to);
+	    bool fToFirst = get_byte(&r);
+	    real v[9];
+#ifdef NO_COVARIANCES
+	    int n_values = 6;
+#else
+	    int n_values = 9;
+#endif
+	    for (int k = 0; k < n_values; ++k) v[k] = get_real(&r);
+	    if (r.bad) goto done;
+	    if (!apply) break;
+	    addlegbyname(refs[fr], refs[to], fToFirst,
+			 v[0], v[1], v[2], v[3], v[4], v[5]
+#ifndef NO_COVARIANCES
+			 , v[6], v[7], v[8]
+#endif
+			 );
+	    break;
+	 }
+	 case OP_EQUATE: {
+	    size_t name1, name2;
+	    GET_REF(name1);
+	    GET_REF(name2);
+	    if (apply) process_equate(refs[name1], refs[name2]);
+	    break;
+	 }
+	 case OP_FINAL: {
+	    size_t i;
+	    GET_REF(i);
+	    unsigned sflags_val = get_uint(&r);
+	    unsigned min_export = get_uint(&r);
+	    unsigned max_export = get_uint(&r);
+	    unsigned line = get_uint(&r);
+	    if (r.bad) goto done;
+	    prefix *pfx = refs[i];
+	    if (is_merged[i]) {
+	       /* Parsing the file would have found this existing station, so
+		* it must be a station which the file only used in legs and
+		* equates, and looking it up mustn't have given a
+		* diagnostic. */
+	       if (!apply) {
+		  const unsigned ok_sflags = BIT(SFLAGS_IDENT_INLINE) |
+					     BIT(SFLAGS_SUSPECTTYPO);
+		  if ((sflags_val & ~ok_sflags) || line ||
+		      TSTBIT(pfx->sflags, SFLAGS_SURVEY) ||
+		      (min_export != 0 && min_export != USHRT_MAX) ||
+		      (pfx->min_export != 0 && pfx->min_export != USHRT_MAX)) {
+		     goto done;
+		  }
+		  break;
+	       }
+	       /* As read_prefix() does for an existing station. */
+	       pfx->sflags &= ~BIT(SFLAGS_SUSPECTTYPO);
+	       if (min_export == USHRT_MAX) pfx->min_export = USHRT_MAX;
+	       if (max_export > pfx->max_export) pfx->max_export = max_export;
+	       break;
+	    }
+	    if (!apply) break;
+	    pfx->sflags = sflags_val | (pfx->sflags & BIT(SFLAGS_UNSORTED));
+	    pfx->min_export = min_export;
+	    pfx->max_export = max_export;
+	    if (line) pfx->loc = srcloc_make(file.filename, line);
+	    break;
+	 }
+	 case OP_EXPORT_USED:
+	    if (apply) fExportUsed = true;
+	    break;
+	 case OP_SCAN: {
+	    size_t i;
+	    GET_REF(i);
+	    if (apply) scan_compass_station_name(refs[i]);
+	    break;
+	 }
+	 case OP_DECLINATION: {
+	    real dec_min = get_real(&r);
+	    int dec_min_days = get_int(&r);
+	    real dec_max = get_real(&r);
+	    int dec_max_days = get_int(&r);
+	    real convergence = get_real(&r);
+	    if (r.bad) goto done;
+	    if (!apply) break;
+	    /* Combine with the range from before the file as get_declination()
+	     * would have. */
+	    if (dec_min < real_pcs->min_declination) {
+	       real_pcs->min_declination = dec_min;
+	       real_pcs->min_declination_days = dec_min_days;
+	    }
+	    if (dec_max > real_pcs->max_declination) {
+	       real_pcs->max_declination = dec_max;
+	       real_pcs->max_declination_days = dec_max_days;
+	    }
+	    if (real_pcs->convergence == HUGE_REAL) {
+	       real_pcs->convergence = convergence;
+	    }
+	    break;
+	 }
+	 default:
+	    goto done;
+      }
+   }
+#undef GET_REF
+
+done:
+   if (apply) {
+      SVX_ASSERT(ok);
+      if (dated_meta && dated_meta->ref_count == 0) osfree(dated_meta);
+      pcs = real_pcs;
+      /* As at the end of data_file_survex(). */
+      clear_last_leg();
+      f_export_ok = false;
+   }
+   ptr_map_free(&pos_map);
+   osfree(is_merged);
+   osfree(is_new);
+   osfree(refs);
+   return ok;
+}
+
+bool
+parse_cache_lookup(unsigned kind)
+{
+   ++depth;
+   /* Is this the file from a Compass project which a worker process is
+    * parsing? */
+   bool worker_file = (worker_pcs && worker_pcs == pcs);
+   worker_pcs = NULL;
+   bool send = (worker_file && worker_send);
+   bool offered = (worker_file && !worker_send);
+   if (!f_cache && !send && !offered) return false;
+   /* A nested file means the including file can't be cached. */
+   parse_cache_abandon();
+   if (have_last_leg()) {
+      /* A repeated leg at the start of the file would be averaged with the
+       * last leg of the including file, so just parse it. */
+      if (offered) ++n_worker_misses;
+      return false;
+   }
+
+   uint64_t c_hash = hash_bytes(HASH_INIT, file.buf, (size_t)file.size);
+   uint64_t s_hash = key_settings_hash(kind);
+   if (f_cache) {
+      if (!cache_loaded) load_cache();
+      cache_entry *e = find_entry(c_hash, s_hash, (uint64_t)file.size);
+      if (e &&
+	  hash_bytes(HASH_INIT, e->data, e->len) == e->check &&
+	  replay(e->data, e->len, false, false, NULL)) {
+	 replay(e->data, e->len, true, false, NULL);
+	 if (!e->used) {
+	    e->used = true;
+	 }
+	 ++n_cache_hits;
+	 --depth;
+	 return true;
+      }
+      ++n_cache_misses;
+   }
+   if (offered) {
+      bool merged;
+      if (offer.data &&
+	  offer.key[0] == c_hash &&
+	  offer.key[1] == s_hash &&
+	  offer.key[2] == (uint64_t)file.size &&
+	  replay(offer.data, offer.len, false, true, &merged)) {
+	 replay(offer.data, offer.len, true, true, NULL);
+	 if (f_cache && !merged) {
+	    /* The record is what parsing the file here would have recorded,
+	     * so cache it. */
+	    cache_record(offer.key, offer.data, offer.len);
+	    offer.data = NULL;
+	 }
+	 ++n_worker_hits;
+	 --depth;
+	 return true;
+      }
+      ++n_worker_misses;
+   }
+   if (!f_cache && !send) return false;
+   start_recording(c_hash, s_hash);
+   rec.send = send;
+   return false;
+}
+
+void
+parse_cache_send_next(void)
+{
+   worker_pcs = pcs;
+   worker_send = true;
+}
+
+bool
+parse_cache_take_record(uint64_t key[3], unsigned char **data, size_t *len)
+{
+   worker_pcs = NULL;
+   if (!sent.data) return false;
+   memcpy(key, sent.key, sizeof(sent.key));
+   *data = sent.data;
+   *len = sent.len;
+   sent.data = NULL;
+   return true;
+}
+
+void
+parse_cache_offer_record(const uint64_t key[3], unsigned char *data,
+			 size_t len)
+{
+   parse_cache_discard_record();
+   worker_pcs = pcs;
+   worker_send = false;
+   if (data) memcpy(offer.key, key, sizeof(offer.key));
+   offer.data = data;
+   offer.len = len;
+}
+
+void
+parse_cache_discard_record(void)
+{
+   worker_pcs = NULL;
+   osfree(offer.data);
+   offer.data = NULL;
+}
+
+typedef struct {
+   unsigned line;
+   size_t ref;
+} final_entry;
+
+static int
+cmp_final_entry(const void *a, const void *b)
+{
+   const final_entry *x = a, *y = b;
+   if (x->line != y->line) return x->line < y->line ? -1 : 1;
+   return (x->ref > y->ref) - (x->ref < y->ref);
+}
+
+void
+parse_cache_store(void)
+{
+   if (recording_depth && recording_depth == depth) {
+      /* The file must leave the settings as it found them, since we don't
+       * record changes to them. */
+      if (pcs != rec.pcs || pcs->meta != rec.initial_meta ||
+	  hash_settings(pcs) != rec.pcs_hash) {
+	 stop_recording();
+	 --depth;
+	 return;
+      }
+      final_entry *finals = osmalloc(rec.n_refs * ossizeof(final_entry));
+      size_t n_finals = 0;
+      for (size_t i = 1; i < rec.n_refs; ++i) {
+	 const cache_ref *ref = &rec.refs[i];
+	 if (ref->kind == REF_PATH) continue;
+	 const prefix *pfx = ref->pfx;
+	 unsigned line = 0;
+	 if (pfx->loc != ref->loc) {
+	    if (srcloc_filename(pfx->loc) != file.filename) {
+	       osfree(finals);
+	       stop_recording();
+	       --depth;
+	       return;
+	    }
+	    line = srcloc_line(pfx->loc);
+	 }
+	 finals[n_finals].line = line;
+	 finals[n_finals].ref = i;
+	 ++n_finals;
+      }
+      /* Replaying OP_FINAL sets each location with srcloc_make(), which
+       * starts a new range whenever the line number goes backwards, so
+       * write them in order of line number. */
+      qsort(finals, n_finals, sizeof(final_entry), cmp_final_entry);
+      for (size_t k = 0; k < n_finals; ++k) {
+	 const prefix *pfx = rec.refs[finals[k].ref].pfx;
+	 put_byte(&rec.ops, OP_FINAL);
+	 put_uint(&rec.ops, finals[k].ref);
+	 put_uint(&rec.ops, pfx->sflags & ~BIT(SFLAGS_UNSORTED));
+	 put_uint(&rec.ops, pfx->min_export);
+	 put_uint(&rec.ops, pfx->max_export);
+	 put_uint(&rec.ops, finals[k].line);
+      }
+      osfree(finals);
+      if (fExportUsed) put_byte(&rec.ops, OP_EXPORT_USED);
+      if (rec.dec_min <= rec.dec_max || pcs->convergence != rec.convergence) {
+	 put_byte(&rec.ops, OP_DECLINATION);
+	 put_real(&rec.ops, rec.dec_min);
+	 put_int(&rec.ops, rec.dec_min_days);
+	 put_real(&rec.ops, rec.dec_max);
+	 put_int(&rec.ops, rec.dec_max_days);
+	 put_real(&rec.ops, pcs->convergence);
+      }
+      put_byte(&rec.ops, OP_END);
+
+      buffer data = { NULL, 0, 0 };
+      put_uint(&data, rec.n_refs);
+      put_bytes(&data, rec.ops.p, rec.ops.len);
+
+      uint64_t key[3] = { rec.content_hash, rec.settings_hash, rec.size };
+      if (rec.send) {
+	 memcpy(sent.key, key, sizeof(key));
+	 sent.data = data.p;
+	 sent.len = data.len;
+      } else {
+	 cache_record(key, data.p, data.len);
+      }
+      stop_recording();
+   }
+   --depth;
+}
+
+void
+print_parse_cache_stats(void)
+{
+   printf("Parse cache: %lu hits, %lu misses\n",
+	  n_cache_hits, n_cache_misses);
+   printf("Files parsed by worker processes: %lu merged, %lu reparsed\n",
+	  n_worker_hits, n_worker_misses);
+}
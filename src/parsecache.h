@@ -0,0 +1,107 @@
+/* parsecache.h
+ * Cache of the effects of parsing survey data files
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef PARSECACHE_H
+#define PARSECACHE_H
+
+#include <stdint.h>
+
+#include "cavern.h"
+
+/* Set by --cache to enable reading and writing the cache. */
+extern bool f_cache;
+
+/* If the cache has a record for the current file which is valid given the
+ * current settings and the stations it refers to, apply the effects of
+ * parsing the file from it and return true.  kind distinguishes file formats
+ * which are parsed differently.
+ *
+ * Otherwise start recording the effects of parsing the file and return false,
+ * in which case the caller should parse the file and then call
+ * parse_cache_store().
+ */
+bool parse_cache_lookup(unsigned kind);
+
+/* Finish recording the effects of parsing the current file, and if it can be
+ * cached add a record for it to the cache. */
+void parse_cache_store(void);
+
+/* Stop recording the current file - its effects depend on something outside
+ * of the file and the settings it was read with, so it can't be cached.
+ */
+void parse_cache_abandon(void);
+
+/* Hooks to record what parsing the current file does. */
+
+/* An existing prefix has been looked up. */
+void parse_cache_note_prefix(prefix *p);
+
+/* A new prefix has been created, with initial station flags sflag. */
+void parse_cache_new_prefix(prefix *p, int sflag);
+
+/* addlegbyname() is being called. */
+void parse_cache_leg(prefix *fr, prefix *to, bool fToFirst,
+		     real dx, real dy, real dz,
+		     real vx, real vy, real vz
+#ifndef NO_COVARIANCES
+		     , real cyz, real czx, real cxy
+#endif
+		     );
+
+/* process_equate() is being called. */
+void parse_cache_equate(prefix *name1, prefix *name2);
+
+/* scan_compass_station_name() is being called. */
+void parse_cache_scan(prefix *stn);
+
+/* A magnetic declination has been calculated for a date. */
+void parse_cache_declination(real declination, int days);
+
+/* Used to parse the files in a Compass project in worker processes (see
+ * makpar.c).
+ *
+ * In a worker, parse_cache_send_next() says to record the next file looked up
+ * with the current settings even if --cache isn't in use, and
+ * parse_cache_take_record() then returns the record (if the file could be
+ * recorded) to send back.  The caller takes ownership of *data.
+ *
+ * The main process passes each record it gets back to
+ * parse_cache_offer_record(), which takes ownership of data (NULL if there's
+ * no record).  If the next file looked up with the current settings matches
+ * the record, it's replayed - the worker didn't see the stations created by
+ * files before this one in the project which other workers parsed, so a
+ * station the record creates may be merged with an existing station if that
+ * has the same effect as parsing the file would.  Call
+ * parse_cache_discard_record() once the file has been processed.
+ */
+void parse_cache_send_next(void);
+bool parse_cache_take_record(uint64_t key[3], unsigned char **data,
+			     size_t *len);
+void parse_cache_offer_record(const uint64_t key[3], unsigned char *data,
+			      size_t len);
+void parse_cache_discard_record(void);
+
+/* Write out the cache (if anything has changed). */
+void parse_cache_write(void);
+
+/* Report how many files were replayed from the cache (cavern
+ * --internal-stats). */
+void print_parse_cache_stats(void);
+
+#endif
@@ -0,0 +1,224 @@
+/* pool.c
+ * Pool allocation for cavern's network data structures
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cavern.h"
+#include "hash.h"
+#include "pool.h"
+
+/* Size of the blocks we allocate objects from. */
+#define POOL_BLOCK_SIZE 65536
+
+struct pool_block {
+   union {
+      pool_block *next;
+      /* Ensure the objects which follow the header are suitably aligned. */
+      double d;
+      void *p;
+   } u;
+};
+
+pool prefix_pool = POOL_INIT(prefix);
+pool pos_pool = POOL_INIT(pos);
+pool node_pool = POOL_INIT(node);
+pool linkfor_pool = POOL_INIT(linkfor);
+pool linkcommon_pool = POOL_INIT(linkcommon);
+arena ident_arena = ARENA_INIT("identifiers");
+
+/* Hash set of the identifiers interned in ident_arena.  Uses open addressing
+ * with linear probing, and doubles in size when it gets half full.
+ */
+static const char **ident_table = NULL;
+static OSSIZE_T ident_table_size = 0; /* Always a power of 2 (or 0). */
+static OSSIZE_T ident_table_count = 0;
+static unsigned long n_ident_reused = 0;
+
+void *
+pool_alloc(pool *p)
+{
+   void *obj = p->free_list;
+   if (obj) {
+      p->free_list = *(void**)obj;
+   } else {
+      if ((OSSIZE_T)(p->end - p->next) < p->size) {
+	 pool_block *b = osmalloc(POOL_BLOCK_SIZE);
+	 b->u.next = p->blocks;
+	 p->blocks = b;
+	 ++p->n_blocks;
+	 p->next = (char*)(b + 1);
+	 p->end = (char*)b + POOL_BLOCK_SIZE;
+      }
+      obj = p->next;
+      p->next += p->size;
+   }
+   ++p->n_allocs;
+   if (++p->n_live > p->n_peak) p->n_peak = p->n_live;
+   return obj;
+}
+
+void
+pool_free(pool *p, void *obj)
+{
+   if (!obj) return;
+   *(void**)obj = p->free_list;
+   p->free_list = obj;
+   --p->n_live;
+}
+
+void
+pool_release(pool *p)
+{
+   while (p->blocks) {
+      pool_block *b = p->blocks;
+      p->blocks = b->u.next;
+      osfree(b);
+   }
+   p->free_list = NULL;
+   p->next = p->end = NULL;
+   p->n_live = 0;
+}
+
+char *
+arena_alloc(arena *a, OSSIZE_T size)
+{
+   if ((OSSIZE_T)(a->end - a->next) < size) {
+      OSSIZE_T block_size = POOL_BLOCK_SIZE;
+      if (size > block_size / 4) {
+	 /* Give a large object a block to itself, and keep using the current
+	  * block for small objects.
+	  */
+	 pool_block *b = osmalloc(ossizeof(pool_block) + size);
+	 if (a->blocks) {
+	    b->u.next = a->blocks->u.next;
+	    a->blocks->u.next = b;
+	 } else {
+	    b->u.next = NULL;
+	    a->blocks = b;
+	 }
+	 ++a->n_blocks;
+	 ++a->n_allocs;
+	 a->n_bytes += size;
+	 return (char*)(b + 1);
+      }
+      pool_block *b = osmalloc(block_size);
+      b->u.next = a->blocks;
+      a->blocks = b;
+      ++a->n_blocks;
+      a->next = (char*)(b + 1);
+      a->end = (char*)b + block_size;
+   }
+   char *obj = a->next;
+   a->next += size;
+   ++a->n_allocs;
+   a->n_bytes += size;
+   return obj;
+}
+
+char *
+arena_strdup(arena *a, const char *str)
+{
+   OSSIZE_T len = strlen(str) + 1;
+   return memcpy(arena_alloc(a, len), str, len);
+}
+
+void
+arena_release(arena *a)
+{
+   while (a->blocks) {
+      pool_block *b = a->blocks;
+      a->blocks = b->u.next;
+      osfree(b);
+   }
+   a->next = a->end = NULL;
+}
+
+const char *
+intern_ident(const char *str, OSSIZE_T len)
+{
+   OSSIZE_T i;
+   const char *p;
+   OSSIZE_T new_size = hash_table_grow(ident_table_size, ident_table_count,
+				       1024);
+   if (new_size) {
+      /* Rehash into the larger table. */
+      const char **old_table = ident_table;
+      OSSIZE_T old_size = ident_table_size;
+      ident_table_size = new_size;
+      ident_table = osmalloc(ident_table_size * ossizeof(const char *));
+      memset(ident_table, 0, ident_table_size * sizeof(const char *));
+      for (OSSIZE_T j = 0; j < old_size; ++j) {
+	 p = old_table[j];
+	 if (!p) continue;
+	 i = HASH_TABLE_SLOT(hash_data_full(p, strlen(p) + 1),
+			     ident_table_size);
+	 while (ident_table[i]) i = HASH_TABLE_NEXT(i, ident_table_size);
+	 ident_table[i] = p;
+      }
+      osfree(old_table);
+   }
+   i = HASH_TABLE_SLOT(hash_data_full(str, len), ident_table_size);
+   while ((p = ident_table[i]) != NULL) {
+      if (strcmp(p, str) == 0) {
+	 ++n_ident_reused;
+	 return p;
+      }
+      i = HASH_TABLE_NEXT(i, ident_table_size);
+   }
+   char *new_ident = arena_alloc(&ident_arena, len);
+   memcpy(new_ident, str, len);
+   ident_table[i] = new_ident;
+   ++ident_table_count;
+   return new_ident;
+}
+
+static pool *const pools[] = {
+   &prefix_pool, &pos_pool, &node_pool, &linkfor_pool, &linkcommon_pool
+};
+
+void
+release_pools(void)
+{
+   for (size_t i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+      pool_release(pools[i]);
+   }
+   arena_release(&ident_arena);
+   osfree(ident_table);
+   ident_table = NULL;
+   ident_table_size = ident_table_count = 0;
+}
+
+void
+print_pool_stats(void)
+{
+   for (size_t i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+      const pool *p = pools[i];
+      printf("Pool %s: %lu allocated, %lu peak, %lu live, "
+	     "%lu blocks (%lu bytes, %lu bytes each)\n",
+	     p->name, p->n_allocs, p->n_peak, p->n_live, p->n_blocks,
+	     p->n_blocks * POOL_BLOCK_SIZE, (unsigned long)p->size);
+   }
+   const arena *a = &ident_arena;
+   printf("Pool %s: %lu allocated (%lu bytes), %lu blocks, %lu reused\n",
+	  a->name, a->n_allocs, (unsigned long)a->n_bytes, a->n_blocks,
+	  n_ident_reused);
+}
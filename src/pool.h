@@ -0,0 +1,92 @@
+/* pool.h
+ * Pool allocation for cavern's network data structures
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "osalloc.h"
+
+/* A large chunk of memory which objects are carved out of. */
+typedef struct pool_block pool_block;
+
+/* A pool of fixed-size objects.  Objects are carved out of large blocks and
+ * freed objects are kept on a free list for reuse, so allocating and freeing
+ * is cheap and there's no per-object malloc overhead.  The blocks are only
+ * released by pool_release().
+ */
+typedef struct {
+   const char *name;
+   OSSIZE_T size;
+   void *free_list;
+   char *next, *end;
+   pool_block *blocks;
+   /* Statistics. */
+   unsigned long n_allocs, n_live, n_peak, n_blocks;
+} pool;
+
+#define POOL_ALIGN \
+   (sizeof(double) > sizeof(void*) ? sizeof(double) : sizeof(void*))
+
+#define POOL_INIT(T) { #T, \
+   (ossizeof(T) + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN, \
+   NULL, NULL, NULL, NULL, 0, 0, 0, 0 }
+
+void *pool_alloc(pool *p);
+void pool_free(pool *p, void *obj);
+void pool_release(pool *p);
+
+/* An arena for variable-sized objects which are never freed individually
+ * (such as the identifiers in station names).
+ */
+typedef struct {
+   const char *name;
+   char *next, *end;
+   pool_block *blocks;
+   /* Statistics. */
+   unsigned long n_allocs, n_blocks;
+   OSSIZE_T n_bytes;
+} arena;
+
+#define ARENA_INIT(NAME) { NAME, NULL, NULL, NULL, 0, 0, 0 }
+
+char *arena_alloc(arena *a, OSSIZE_T size);
+char *arena_strdup(arena *a, const char *str);
+void arena_release(arena *a);
+
+/* The pools cavern uses - allocate like osnew(T), e.g. pool_new(node). */
+extern pool prefix_pool, pos_pool, node_pool, linkfor_pool, linkcommon_pool;
+extern arena ident_arena;
+
+/* Return the copy in ident_arena of the len bytes at str (len includes the
+ * terminating nul), adding it if there isn't one yet.  Each distinct
+ * identifier is only stored once, so interned identifiers can be compared by
+ * comparing pointers.
+ */
+const char *intern_ident(const char *str, OSSIZE_T len);
+
+#define pool_new(T) ((T*)pool_alloc(&T##_pool))
+#define pool_delete(T, P) pool_free(&T##_pool, (P))
+
+/* Release all the memory in cavern's pools. */
+void release_pools(void);
+
+/* Report allocation statistics for cavern's pools to stdout. */
+void print_pool_stats(void);
+
+#endif
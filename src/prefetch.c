@@ -0,0 +1,382 @@
+/* prefetch.c
+ * Read files which will be *include-d ahead of time on worker threads
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Parsing has to happen in order, as how a file is interpreted depends on
+ * the settings in effect where it is included from, and tokenising depends
+ * on those settings too (*set can change which characters are blanks,
+ * comments, etc).  But reading the files doesn't, so we spot *include
+ * commands in each file as it's loaded and read the files they name on
+ * worker threads, which hides the latency of opening and reading each file
+ * (which can be considerable on a network filing system).
+ *
+ * Spotting *include is done by a quick scan of the raw file which assumes
+ * the default character settings, so it can miss some commands (e.g. if
+ * *set keyword is used) or find some which won't actually be processed (e.g.
+ * after *set comment *).  Neither matters - a file which wasn't read ahead
+ * just gets read by the parser, and a file read unnecessarily is discarded
+ * at the end.
+ */
+
+#include <config.h>
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "cavern.h"
+#include "filelist.h"
+#include "filename.h"
+#include "osalloc.h"
+#include "prefetch.h"
+
+#ifdef HAVE_PTHREAD
+
+/* Number of threads to read files with.  This is about overlapping I/O
+ * latency rather than using CPU cores, so doesn't depend on --threads.
+ */
+#define PREFETCH_THREADS 4
+
+/* Stop reading ahead while this many bytes have been read but not yet used
+ * by the parser. */
+#define PREFETCH_MAX_PENDING (64 * 1024 * 1024)
+
+typedef enum { JOB_QUEUED, JOB_READING, JOB_DONE } job_state;
+
+typedef struct prefetch_job {
+   struct prefetch_job *next;
+   char *pth;
+   char *fnm;
+   job_state state;
+   /* Set once state is JOB_DONE - filename is NULL if the read failed. */
+   char *filename;
+   unsigned char *buf;
+   size_t len;
+} prefetch_job;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+/* Jobs in the order we expect the parser to want the files, which is a
+ * depth-first walk of the *include tree.  Jobs are removed from the list
+ * when the parser takes them. */
+static prefetch_job *jobs = NULL;
+
+/* Bytes read by jobs which are still in the list. */
+static size_t pending_bytes = 0;
+
+static bool shutting_down = false;
+
+static pthread_t threads[PREFETCH_THREADS];
+static int n_started = 0;
+
+/* Have we tried starting the worker threads? */
+static bool started = false;
+
+static bool
+is_blank(unsigned char c)
+{
+   return c == ' ' || c == '\t' || c == ',';
+}
+
+static bool
+is_eol(unsigned char c)
+{
+   return c == '\n' || c == '\r' || c == '\032';
+}
+
+/* Return a list of jobs to read the files included by filename, which has
+ * contents buf. */
+static prefetch_job *
+scan_includes(const char *filename, const unsigned char *buf, size_t len)
+{
+   prefetch_job *head = NULL;
+   prefetch_job **tail = &head;
+   char *pth = NULL;
+   size_t i = 0;
+   while (i < len) {
+      while (i < len && is_blank(buf[i])) ++i;
+      if (len - i > 8 && buf[i] == '*') {
+	 static const char cmd[] = "include";
+	 size_t j;
+	 for (j = 0; j < sizeof(cmd) - 1; ++j) {
+	    if ((buf[i + 1 + j] | 32) != cmd[j]) break;
+	 }
+	 i += 1 + j;
+	 if (j == sizeof(cmd) - 1 && (is_blank(buf[i]) || buf[i] == '\"')) {
+	    size_t start, end;
+	    while (i < len && is_blank(buf[i])) ++i;
+	    if (i < len && buf[i] == '\"') {
+	       start = ++i;
+	       while (i < len && buf[i] != '\"' && !is_eol(buf[i])) ++i;
+	       end = (i < len && buf[i] == '\"') ? i : start;
+	    } else {
+	       start = i;
+	       while (i < len && !is_blank(buf[i]) && !is_eol(buf[i]) &&
+		      buf[i] != ';') ++i;
+	       end = i;
+	    }
+	    if (end > start) {
+	       prefetch_job *job = osnew(prefetch_job);
+	       if (!pth) pth = path_from_fnm(filename);
+	       job->pth = osstrdup(pth);
+	       job->fnm = osmalloc(end - start + 1);
+	       memcpy(job->fnm, buf + start, end - start);
+	       job->fnm[end - start] = '\0';
+	       job->state = JOB_QUEUED;
+	       job->filename = NULL;
+	       job->buf = NULL;
+	       job->len = 0;
+	       *tail = job;
+	       tail = &job->next;
+	    }
+	 }
+      }
+      /* Skip to the start of the next line. */
+      const void *nl = memchr(buf + i, '\n', len - i);
+      if (!nl) break;
+      i = (const unsigned char *)nl - buf + 1;
+   }
+   *tail = NULL;
+   osfree(pth);
+   return head;
+}
+
+/* Read the whole of fh into *p_buf and close fh. */
+static bool
+read_all(FILE *fh, unsigned char **p_buf, size_t *p_len)
+{
+   size_t len = 0, alloc = 65536;
+   struct stat st;
+   /* Start with a buffer the right size for a regular file. */
+   if (fstat(fileno(fh), &st) == 0 && S_ISREG(st.st_mode) &&
+       st.st_size >= 0 && st.st_size < LONG_MAX)
+      alloc = (size_t)st.st_size + 1;
+   unsigned char *buf = osmalloc(alloc);
+   while (1) {
+      len += FREAD(buf + len, 1, alloc - len, fh);
+      if (len < alloc) break;
+      alloc *= 2;
+      buf = osrealloc(buf, alloc);
+   }
+   bool ok = !FERROR(fh) && len <= LONG_MAX;
+   (void)fclose(fh);
+   if (!ok) {
+      osfree(buf);
+      return false;
+   }
+   *p_buf = buf;
+   *p_len = len;
+   return true;
+}
+
+static void
+free_job(prefetch_job *job)
+{
+   osfree(job->pth);
+   osfree(job->fnm);
+   osfree(job->filename);
+   osfree(job->buf);
+   osfree(job);
+}
+
+static void *
+prefetch_worker(void *unused)
+{
+   (void)unused;
+   pthread_mutex_lock(&mutex);
+   while (!shutting_down) {
+      prefetch_job *job = NULL;
+      if (pending_bytes < PREFETCH_MAX_PENDING) {
+	 for (job = jobs; job; job = job->next) {
+	    if (job->state == JOB_QUEUED) break;
+	 }
+      }
+      if (!job) {
+	 pthread_cond_wait(&cond, &mutex);
+	 continue;
+      }
+      job->state = JOB_READING;
+      pthread_mutex_unlock(&mutex);
+
+      char *filename = NULL;
+      unsigned char *buf = NULL;
+      size_t len = 0;
+      prefetch_job *children = NULL;
+      FILE *fh = fopen_portable(job->pth, job->fnm, EXT_SVX_DATA, "rb",
+				&filename);
+      if (fh) {
+	 if (read_all(fh, &buf, &len)) {
+	    children = scan_includes(filename, buf, len);
+	 } else {
+	    osfree(filename);
+	    filename = NULL;
+	 }
+      }
+
+      pthread_mutex_lock(&mutex);
+      job->filename = filename;
+      job->buf = buf;
+      job->len = len;
+      job->state = JOB_DONE;
+      pending_bytes += len;
+      if (children) {
+	 /* The parser will want the files this one includes straight after
+	  * this one. */
+	 prefetch_job *last = children;
+	 while (last->next) last = last->next;
+	 last->next = job->next;
+	 job->next = children;
+      }
+      pthread_cond_broadcast(&cond);
+   }
+   pthread_mutex_unlock(&mutex);
+   return NULL;
+}
+
+void
+prefetch_includes(const char *filename, const unsigned char *buf, size_t len)
+{
+   prefetch_job *children = scan_includes(filename, buf, len);
+   if (!children) return;
+
+   if (!started) {
+      started = true;
+      shutting_down = false;
+      while (n_started < PREFETCH_THREADS) {
+	 if (pthread_create(&threads[n_started], NULL, prefetch_worker, NULL))
+	    break;
+	 ++n_started;
+      }
+   }
+   if (n_started == 0) {
+      /* Couldn't start any threads, so we'll just read files as needed. */
+      while (children) {
+	 prefetch_job *next = children->next;
+	 free_job(children);
+	 children = next;
+      }
+      return;
+   }
+
+   pthread_mutex_lock(&mutex);
+   /* The parser will want the files this one includes before anything
+    * already queued. */
+   prefetch_job *last = children;
+   while (last->next) last = last->next;
+   last->next = jobs;
+   jobs = children;
+   pthread_cond_broadcast(&cond);
+   pthread_mutex_unlock(&mutex);
+}
+
+bool
+prefetch_take(const char *pth, const char *fnm,
+	      char **filename, unsigned char **buf, size_t *len)
+{
+   if (n_started == 0) return false;
+
+   pthread_mutex_lock(&mutex);
+   prefetch_job **p = &jobs;
+   while (*p && (strcmp((*p)->fnm, fnm) != 0 || strcmp((*p)->pth, pth) != 0))
+      p = &(*p)->next;
+   prefetch_job *job = *p;
+   if (!job) {
+      pthread_mutex_unlock(&mutex);
+      return false;
+   }
+   while (job->state == JOB_READING) {
+      pthread_cond_wait(&cond, &mutex);
+   }
+   /* A worker may have inserted jobs before this one while we waited. */
+   p = &jobs;
+   while (*p != job) p = &(*p)->next;
+   *p = job->next;
+   pending_bytes -= job->len;
+   /* Space may have been freed up for more reading ahead. */
+   pthread_cond_broadcast(&cond);
+   pthread_mutex_unlock(&mutex);
+
+   /* If the read hasn't started we just do it ourselves. */
+   bool ok = (job->filename != NULL);
+   if (ok) {
+      *filename = job->filename;
+      *buf = job->buf;
+      *len = job->len;
+      job->filename = NULL;
+      job->buf = NULL;
+   }
+   free_job(job);
+   return ok;
+}
+
+void
+prefetch_finish(void)
+{
+   if (!started) return;
+
+   pthread_mutex_lock(&mutex);
+   shutting_down = true;
+   pthread_cond_broadcast(&cond);
+   pthread_mutex_unlock(&mutex);
+   while (n_started > 0) {
+      pthread_join(threads[--n_started], NULL);
+   }
+
+   while (jobs) {
+      prefetch_job *next = jobs->next;
+      free_job(jobs);
+      jobs = next;
+   }
+   pending_bytes = 0;
+   started = false;
+}
+
+#else
+
+void
+prefetch_includes(const char *filename, const unsigned char *buf, size_t len)
+{
+   (void)filename;
+   (void)buf;
+   (void)len;
+}
+
+bool
+prefetch_take(const char *pth, const char *fnm,
+	      char **filename, unsigned char **buf, size_t *len)
+{
+   (void)pth;
+   (void)fnm;
+   (void)filename;
+   (void)buf;
+   (void)len;
+   return false;
+}
+
+void
+prefetch_finish(void)
+{
+}
+
+#endif
@@ -0,0 +1,48 @@
+/* prefetch.h
+ * Read files which will be *include-d ahead of time on worker threads
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Look through the contents of file filename for *include commands and
+ * start reading the files they name in the background.  Files read this way
+ * are themselves looked through, so the whole tree of included files gets
+ * read ahead of the parser.
+ */
+void prefetch_includes(const char *filename,
+		       const unsigned char *buf, size_t len);
+
+/* If file fnm relative to path pth has been read in the background then
+ * return true and set *filename, *buf and *len (the caller takes ownership of
+ * *filename and *buf, which should be released with osfree()).
+ *
+ * Waits for the read to finish if it's in progress.  Returns false if the
+ * file hasn't been queued for reading or couldn't be read, in which case the
+ * caller should open and read it in the usual way.
+ */
+bool prefetch_take(const char *pth, const char *fnm,
+		   char **filename, unsigned char **buf, size_t *len);
+
+/* Stop the worker threads and discard anything read which hasn't been used. */
+void prefetch_finish(void);
+
+#endif
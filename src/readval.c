@@ -1,6 +1,6 @@
 /* readval.c
  * Routines to read a prefix or number from the current input file
- * Copyright (C) 1991-2024 Olly Betts
+ * Copyright (C) 1991-2024,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -19,42 +19,199 @@
 
 #include <config.h>
 
+#include <inttypes.h>
 #include <limits.h>
 #include <stddef.h> /* for offsetof */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #include "cavern.h"
 #include "commands.h" /* For match_tok(), etc */
 #include "date.h"
 #include "debug.h"
 #include "filename.h"
+#include "hash.h"
 #include "message.h"
 #include "readval.h"
 #include "datain.h"
 #include "netbits.h"
 #include "osalloc.h"
+#include "parsecache.h"
+#include "pool.h"
 #include "str.h"
 
 int root_depr_count = 0;
 
-static prefix *
-new_anon_station(void)
+prefix *
+new_anon_station(prefix *survey)
 {
-    prefix *name = osnew(prefix);
+    prefix *name = pool_new(prefix);
     name->pos = NULL;
     name->ident.p = NULL;
     name->stn = NULL;
-    name->up = pcs->Prefix;
+    name->up = survey;
     name->down = NULL;
-    name->filename = file.filename;
-    name->line = file.line;
+    name->loc = srcloc_make(file.filename, file.line);
     name->min_export = name->max_export = 0;
     name->sflags = BIT(SFLAGS_ANON);
     /* Keep linked list of anon stations for node stats. */
     name->right = anon_list;
     anon_list = name;
+    parse_cache_new_prefix(name, BIT(SFLAGS_ANON));
     return name;
 }
 
+/* Index of the children of every prefix in the tree, keyed on the parent and
+ * the child's identifier.  This allows us to find an existing child without
+ * walking the list of its siblings, which is slow for a survey with a lot of
+ * stations.  We use open addressing with linear probing, and double the size
+ * of the table when it gets half full.
+ */
+static prefix **child_index = NULL;
+static size_t child_index_size = 0; /* Always a power of 2 (or 0). */
+static size_t child_index_count = 0;
+
+/* Hash of the parent pointer and the identifier.
+ *
+ * Identifiers which don't fit inline in a prefix are interned (see
+ * intern_ident()), and for those interned is the interned copy and we can
+ * just hash and compare the pointer.  For an inline identifier, interned is
+ * NULL.
+ */
+static unsigned
+child_hash(const prefix *parent, const char *name, const char *interned)
+{
+   unsigned h = hash_data_full((const char *)&parent, sizeof(parent));
+   if (interned)
+      return hash_data_full_more(h, (const char *)&interned,
+				 sizeof(interned));
+   return hash_data_full_more(h, name, strlen(name));
+}
+
+static unsigned
+prefix_hash(const prefix *p)
+{
+   if (TSTBIT(p->sflags, SFLAGS_IDENT_INLINE))
+      return child_hash(p->up, p->ident.i, NULL);
+   return child_hash(p->up, NULL, p->ident.p);
+}
+
+static prefix *
+find_child(const prefix *parent, const char *name, const char *interned)
+{
+   if (child_index_count == 0) return NULL;
+   size_t i = HASH_TABLE_SLOT(child_hash(parent, name, interned),
+			      child_index_size);
+   prefix *p;
+   while ((p = child_index[i]) != NULL) {
+      if (p->up == parent) {
+	 if (TSTBIT(p->sflags, SFLAGS_IDENT_INLINE)) {
+	    if (!interned && strcmp(p->ident.i, name) == 0) return p;
+	 } else {
+	    if (p->ident.p == interned) return p;
+	 }
+      }
+      i = HASH_TABLE_NEXT(i, child_index_size);
+   }
+   return NULL;
+}
+
+static void
+index_child(prefix *child)
+{
+   size_t new_size = hash_table_grow(child_index_size, child_index_count,
+				     1024);
+   if (new_size) {
+      /* Rehash into the larger table. */
+      prefix **old_index = child_index;
+      size_t old_size = child_index_size;
+      child_index_size = new_size;
+      child_index = osmalloc(child_index_size * ossizeof(prefix *));
+      memset(child_index, 0, child_index_size * sizeof(prefix *));
+      for (size_t j = 0; j < old_size; ++j) {
+	 prefix *p = old_index[j];
+	 if (!p) continue;
+	 size_t i = HASH_TABLE_SLOT(prefix_hash(p), child_index_size);
+	 while (child_index[i]) i = HASH_TABLE_NEXT(i, child_index_size);
+	 child_index[i] = p;
+      }
+      osfree(old_index);
+   }
+   size_t i = HASH_TABLE_SLOT(prefix_hash(child), child_index_size);
+   while (child_index[i]) i = HASH_TABLE_NEXT(i, child_index_size);
+   child_index[i] = child;
+   ++child_index_count;
+}
+
+/* Create a new child of parent called name with sflag set, and add it to the
+ * tree.  If the identifier is too long to store inline, interned must be the
+ * interned copy of it, otherwise NULL.
+ */
+static prefix *
+new_child(prefix *parent, const char *name, const char *interned, int sflag)
+{
+   /* Cache the child we last added so we can usually add an increasing
+    * sequence of names to a survey without needing to sort them later. */
+   static prefix *cached_survey = NULL, *cached_station = NULL;
+   prefix *ptr = pool_new(prefix);
+   ptr->sflags = sflag;
+   if (interned) {
+      ptr->ident.p = interned;
+   } else {
+      strcpy(ptr->ident.i, name);
+      ptr->sflags |= BIT(SFLAGS_IDENT_INLINE);
+   }
+   ptr->down = NULL;
+   ptr->pos = NULL;
+   ptr->stn = NULL;
+   ptr->up = parent;
+   ptr->loc = srcloc_make(file.filename, file.line);
+   ptr->min_export = ptr->max_export = 0;
+
+   /* We keep the children in sorted order if we can do so cheaply, and
+    * otherwise flag the parent so they get sorted before the tree is
+    * traversed.
+    */
+   prefix *head = parent->down;
+   if (cached_survey == parent &&
+       strcmp(prefix_ident(cached_station), name) < 0 &&
+       (!cached_station->right ||
+	strcmp(prefix_ident(cached_station->right), name) > 0)) {
+      ptr->right = cached_station->right;
+      cached_station->right = ptr;
+   } else {
+      if (head && strcmp(prefix_ident(head), name) < 0)
+	 parent->sflags |= BIT(SFLAGS_UNSORTED);
+      ptr->right = head;
+      parent->down = ptr;
+   }
+   cached_survey = parent;
+   cached_station = ptr;
+
+   index_child(ptr);
+   parse_cache_new_prefix(ptr, sflag);
+   return ptr;
+}
+
+prefix *
+find_prefix_child(const prefix *parent, const char *name)
+{
+   size_t len = strlen(name) + 1;
+   const char *interned = NULL;
+   if (len > sizeof(parent->ident.i)) interned = intern_ident(name, len);
+   return find_child(parent, name, interned);
+}
+
+prefix *
+new_prefix_child(prefix *parent, const char *name, int sflag)
+{
+   size_t len = strlen(name) + 1;
+   const char *interned = NULL;
+   if (len > sizeof(parent->ident.i)) interned = intern_ident(name, len);
+   return new_child(parent, name, interned, sflag);
+}
+
 static char *id = NULL;
 static size_t id_len = 0;
 
@@ -71,12 +228,13 @@ read_prefix(unsigned pfx_flags)
    bool fImplicitPrefix = true;
    int depth = -1;
    filepos here;
-   filepos fp_firstsep;
+   filepos fp_firstsep = {0}; // Initialise to avoid warning.
 
    skipblanks();
    get_pos(&here);
 #ifndef NO_DEPRECATED
    if (isRoot(ch)) {
+      parse_cache_abandon();
       if (!(pfx_flags & PFX_ALLOW_ROOT)) {
 	 compile_diagnostic(DIAG_ERR|DIAG_COL, /*ROOT is deprecated*/25);
 	 longjmp(jbSkipLine, 1);
@@ -116,7 +274,7 @@ read_prefix(unsigned pfx_flags)
 	       longjmp(jbSkipLine, 1);
 	    }
 	    pcs->flags |= BIT(FLAGS_ANON_ONE_END) | BIT(FLAGS_IMPLICIT_SPLAY);
-	    return new_anon_station();
+	    return new_anon_station(pcs->Prefix);
 	 }
 	 if (isSep(first_ch) && ch == first_ch) {
 	    nextch();
@@ -132,7 +290,7 @@ anon_wall_station:
 		  longjmp(jbSkipLine, 1);
 	       }
 	       pcs->flags |= BIT(FLAGS_ANON_ONE_END) | BIT(FLAGS_IMPLICIT_SPLAY);
-	       pfx = new_anon_station();
+	       pfx = new_anon_station(pcs->Prefix);
 	       pfx->sflags |= BIT(SFLAGS_WALL);
 	       return pfx;
 	    }
@@ -150,7 +308,7 @@ anon_wall_station:
 		     longjmp(jbSkipLine, 1);
 		  }
 		  pcs->flags |= BIT(FLAGS_ANON_ONE_END);
-		  return new_anon_station();
+		  return new_anon_station(pcs->Prefix);
 	       }
 	    }
 	 }
@@ -208,75 +366,16 @@ anon_wall_station:
       id[i++] = '\0';
 
       back_ptr = ptr;
-      ptr = ptr->down;
+      const char *interned = NULL;
+      if (i > sizeof(ptr->ident.i)) interned = intern_ident(id, i);
+      ptr = find_child(back_ptr, id, interned);
       if (ptr == NULL) {
-	 /* Special case first time around at each level */
-	 ptr = osnew(prefix);
-	 ptr->sflags = BIT(SFLAGS_SURVEY);
-	 if (i <= sizeof(ptr->ident.i)) {
-	     memcpy(ptr->ident.i, id, i);
-	     ptr->sflags |= BIT(SFLAGS_IDENT_INLINE);
-	 } else {
-	     char *new_id = osmalloc(i);
-	     memcpy(new_id, id, i);
-	     ptr->ident.p = new_id;
-	 }
-	 ptr->right = ptr->down = NULL;
-	 ptr->pos = NULL;
-	 ptr->stn = NULL;
-	 ptr->up = back_ptr;
-	 ptr->filename = file.filename;
-	 ptr->line = file.line;
-	 ptr->min_export = ptr->max_export = 0;
+	 ptr = new_child(back_ptr, id, interned, BIT(SFLAGS_SURVEY));
 	 if (fSuspectTypo && !fImplicitPrefix)
 	    ptr->sflags |= BIT(SFLAGS_SUSPECTTYPO);
-	 back_ptr->down = ptr;
 	 fNew = true;
       } else {
-	 /* Use caching to speed up adding an increasing sequence to a
-	  * large survey */
-	 static prefix *cached_survey = NULL, *cached_station = NULL;
-	 prefix *ptrPrev = NULL;
-	 int cmp = 1; /* result of strcmp ( -ve for <, 0 for =, +ve for > ) */
-	 if (cached_survey == back_ptr) {
-	    cmp = strcmp(prefix_ident(cached_station), id);
-	    if (cmp <= 0) ptr = cached_station;
-	 }
-	 while (ptr && (cmp = strcmp(prefix_ident(ptr), id)) < 0) {
-	    ptrPrev = ptr;
-	    ptr = ptr->right;
-	 }
-	 if (cmp) {
-	    /* ie we got to one that was higher, or the end */
-	    prefix *newptr = osnew(prefix);
-	    newptr->sflags = BIT(SFLAGS_SURVEY);
-	    if (strlen(id) < sizeof(newptr->ident.i)) {
-		memcpy(newptr->ident.i, id, i);
-		newptr->sflags |= BIT(SFLAGS_IDENT_INLINE);
-	    } else {
-		char *new_id = osmalloc(i);
-		memcpy(new_id, id, i);
-		newptr->ident.p = new_id;
-	    }
-	    if (ptrPrev == NULL)
-	       back_ptr->down = newptr;
-	    else
-	       ptrPrev->right = newptr;
-	    newptr->right = ptr;
-	    newptr->down = NULL;
-	    newptr->pos = NULL;
-	    newptr->stn = NULL;
-	    newptr->up = back_ptr;
-	    newptr->filename = file.filename;
-	    newptr->line = file.line;
-	    newptr->min_export = newptr->max_export = 0;
-	    if (fSuspectTypo && !fImplicitPrefix)
-	       newptr->sflags |= BIT(SFLAGS_SUSPECTTYPO);
-	    ptr = newptr;
-	    fNew = true;
-	 }
-	 cached_survey = back_ptr;
-	 cached_station = ptr;
+	 parse_cache_note_prefix(ptr);
       }
       depth++;
       f_optional = false; /* disallow after first level */
@@ -336,7 +435,7 @@ anon_wall_station:
       }
       s = osstrdup(sprint_prefix(survey));
       p = sprint_prefix(ptr);
-      if (survey->filename) {
+      if (survey->loc) {
 	 compile_diagnostic_pfx(DIAG_ERR, survey,
 				/*Station “%s” not exported from survey “%s”*/26,
 				p, s);
@@ -414,7 +513,7 @@ read_walls_station(char * const walls_prefix[3], bool anon_allowed, bool *p_new)
 		longjmp(jbSkipLine, 1);
 	    }
 	    pcs->flags |= BIT(FLAGS_ANON_ONE_END) | BIT(FLAGS_IMPLICIT_SPLAY);
-	    prefix *pfx = new_anon_station();
+	    prefix *pfx = new_anon_station(pcs->Prefix);
 	    pfx->sflags |= BIT(SFLAGS_WALL);
 	    // An anonymous station is always new.
 	    if (p_new) *p_new = true;
@@ -515,78 +614,23 @@ read_walls_station(char * const walls_prefix[3], bool anon_allowed, bool *p_new)
 		}
 	    }
 	    prefix *back_ptr = ptr;
-	    ptr = ptr->down;
+	    bool first_child = (back_ptr->down == NULL);
+	    size_t name_len = strlen(name) + 1;
+	    const char *interned = NULL;
+	    if (name_len > sizeof(ptr->ident.i))
+		interned = intern_ident(name, name_len);
+	    ptr = find_child(back_ptr, name, interned);
 	    if (ptr == NULL) {
-		/* Special case first time around at each level */
 		/* No need to check if we're at the station level - if the
 		 * prefix is new the station must be. */
 		if (p_new) *p_new = true;
-		ptr = osnew(prefix);
-		ptr->sflags = sflag;
-		if (strlen(name) < sizeof(ptr->ident.i)) {
-		    strcpy(ptr->ident.i, name);
-		    ptr->sflags |= BIT(SFLAGS_IDENT_INLINE);
-		    if (i >= 3) osfree(name);
-		} else {
-		    ptr->ident.p = (i < 3 ? osstrdup(name) : name);
-		}
-		name = NULL;
-		ptr->right = ptr->down = NULL;
-		ptr->pos = NULL;
-		ptr->stn = NULL;
-		ptr->up = back_ptr;
-		ptr->filename = file.filename; // FIXME: Or location of #Prefix, etc for it?
-		ptr->line = file.line; // FIXME: Or location of #Prefix, etc for it?
-		ptr->min_export = ptr->max_export = 0;
-		back_ptr->down = ptr;
+		// FIXME: Use location of #Prefix, etc for filename and line?
+		ptr = new_child(back_ptr, name, interned, sflag);
 	    } else {
-		/* Use caching to speed up adding an increasing sequence to a
-		 * large survey */
-		static prefix *cached_survey = NULL, *cached_station = NULL;
-		prefix *ptrPrev = NULL;
-		int cmp = 1; /* result of strcmp ( -ve for <, 0 for =, +ve for > ) */
-		if (cached_survey == back_ptr) {
-		    cmp = strcmp(prefix_ident(cached_station), name);
-		    if (cmp <= 0) ptr = cached_station;
-		}
-		while (ptr && (cmp = strcmp(prefix_ident(ptr), name))<0) {
-		    ptrPrev = ptr;
-		    ptr = ptr->right;
-		}
-		if (cmp) {
-		    /* ie we got to one that was higher, or the end */
-		    if (p_new) *p_new = true;
-		    prefix *newptr = osnew(prefix);
-		    newptr->sflags = sflag;
-		    if (strlen(name) < sizeof(newptr->ident.i)) {
-			strcpy(newptr->ident.i, name);
-			newptr->sflags |= BIT(SFLAGS_IDENT_INLINE);
-			if (i >= 3) osfree(name);
-		    } else {
-			newptr->ident.p = (i < 3 ? osstrdup(name) : name);
-		    }
-		    name = NULL;
-		    if (ptrPrev == NULL)
-			back_ptr->down = newptr;
-		    else
-			ptrPrev->right = newptr;
-		    newptr->right = ptr;
-		    newptr->down = NULL;
-		    newptr->pos = NULL;
-		    newptr->stn = NULL;
-		    newptr->up = back_ptr;
-		    newptr->filename = file.filename; // FIXME
-		    newptr->line = file.line;
-		    newptr->min_export = newptr->max_export = 0;
-		    ptr = newptr;
-		} else {
-		    ptr->sflags |= sflag;
-		}
-		if (!TSTBIT(ptr->sflags, SFLAGS_SURVEY)) {
-		    ptr->min_export = USHRT_MAX;
-		}
-		cached_survey = back_ptr;
-		cached_station = ptr;
+		ptr->sflags |= sflag;
+	    }
+	    if (!first_child && !TSTBIT(ptr->sflags, SFLAGS_SURVEY)) {
+		ptr->min_export = USHRT_MAX;
 	    }
 	    if (name == p) osfree(p);
 	}
@@ -604,14 +648,56 @@ read_walls_station(char * const walls_prefix[3], bool anon_allowed, bool *p_new)
     }
 }
 
+/* Powers of ten which are exactly representable as a double. */
+static const double exact_powers_of_ten[] = {
+   1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+   1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Return mantissa * 10**exp10 correctly rounded to the nearest double.
+ *
+ * digits is NULL unless there were too many significant digits to fit in
+ * mantissa, in which case it holds all of them (and mantissa is ignored).
+ */
+static real
+decimal_to_real(uint64_t mantissa, int exp10, string *digits)
+{
+   char buf[48];
+   if (!digits) {
+      /* If mantissa and the power of ten are both exactly representable
+       * then the IEEE division (or multiplication) is correctly rounded.
+       * This handles all but the most unusual numbers in survey data. */
+      if (mantissa <= ((uint64_t)1 << 53) && exp10 >= -22 && exp10 <= 0) {
+	 return (real)mantissa / exact_powers_of_ten[-exp10];
+      }
+      snprintf(buf, sizeof(buf), "%" PRIu64 "e%d", mantissa, exp10);
+      return strtod(buf, NULL);
+   }
+   /* We avoid using a decimal point so this doesn't depend on the locale. */
+   snprintf(buf, sizeof(buf), "e%d", exp10);
+   s_append(digits, buf);
+   real r = strtod(s_str(digits), NULL);
+   s_free(digits);
+   return r;
+}
+
 /* if numeric expr is omitted: if f_optional return HUGE_REAL, else longjmp */
 real
 read_number(bool f_optional, bool f_unsigned)
 {
    bool fPositive = true, fDigits = false;
-   real n = (real)0.0;
    filepos fp;
    int ch_old;
+   /* We accumulate the digits read as an integer and track the decimal
+    * exponent to apply to it, then convert the result to a double in a
+    * single correctly rounded step.  If there are more significant digits
+    * than fit in a uint64_t (which is very rare in practice) we switch to
+    * collecting them in a string. */
+   uint64_t mantissa = 0;
+   int exp10 = 0;
+   int n_sig_digits = 0;
+   string digits = S_INIT;
+   bool use_string = false;
 
    get_pos(&fp);
    ch_old = ch;
@@ -620,25 +706,38 @@ read_number(bool f_optional, bool f_unsigned)
       if (isSign(ch)) nextch();
    }
 
-   while (isdigit(ch)) {
-      n = n * (real)10.0 + (char)(ch - '0');
-      nextch();
-      fDigits = true;
-   }
-
-   if (isDecimal(ch)) {
-      real mult = (real)1.0;
-      nextch();
-      while (isdigit(ch)) {
-	 mult *= (real).1;
-	 n += (char)(ch - '0') * mult;
+   bool in_fraction = false;
+   while (1) {
+      if (isdigit(ch)) {
+	 int d = ch - '0';
+	 if (use_string) {
+	    s_appendch(&digits, ch);
+	 } else if (n_sig_digits < 19) {
+	    mantissa = mantissa * 10 + d;
+	    /* Leading zeros aren't significant. */
+	    if (mantissa) ++n_sig_digits;
+	 } else {
+	    char buf[24];
+	    snprintf(buf, sizeof(buf), "%" PRIu64, mantissa);
+	    s_append(&digits, buf);
+	    s_appendch(&digits, ch);
+	    use_string = true;
+	 }
+	 if (in_fraction) --exp10;
 	 fDigits = true;
-	 nextch();
+      } else if (isDecimal(ch) && !in_fraction) {
+	 in_fraction = true;
+      } else {
+	 break;
       }
+      nextch();
    }
 
    /* !'fRead' => !fDigits so fDigits => 'fRead' */
-   if (fDigits) return (fPositive ? n : -n);
+   if (fDigits) {
+      real n = decimal_to_real(mantissa, exp10, use_string ? &digits : NULL);
+      return (fPositive ? n : -n);
+   }
 
    /* didn't read a valid number.  If it's optional, reset filepos & return */
    set_pos(&fp);
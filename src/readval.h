@@ -1,6 +1,6 @@
 /* readval.h
  * Routines to read a prefix or number from the current input file
- * Copyright (C) 1991-2024 Olly Betts
+ * Copyright (C) 1991-2024,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -40,6 +40,15 @@ enum {
 
 prefix *read_prefix(unsigned flags);
 
+/* Create a new anonymous station in survey. */
+prefix *new_anon_station(prefix *survey);
+
+/* Find the child of parent called name, or return NULL if there isn't one. */
+prefix *find_prefix_child(const prefix *parent, const char *name);
+
+/* Create a new child of parent called name with station flags sflag. */
+prefix *new_prefix_child(prefix *parent, const char *name, int sflag);
+
 // Read a sequence of NAMES characters.  Returns NULL if none.
 // Caller is responsible for calling osfree() on the returned value.
 char *read_walls_prefix(void);
@@ -0,0 +1,109 @@
+/* srcloc.c
+ * Compact references to locations in survey data files
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <config.h>
+
+#include <stddef.h>
+
+#include "debug.h"
+#include "osalloc.h"
+#include "srcloc.h"
+
+typedef struct {
+   const char *filename;
+   unsigned first_line;
+   /* The location of first_line.  This range runs up to the base of the next
+    * range (or next_loc for the last range).
+    */
+   srcloc base;
+} srcloc_range;
+
+static srcloc_range *ranges = NULL;
+static size_t n_ranges = 0, max_ranges = 0;
+
+/* One more than the highest location handed out so far. */
+static srcloc next_loc = SRCLOC_NONE + 1;
+
+srcloc
+srcloc_make(const char *filename, unsigned line)
+{
+   if (!filename) return SRCLOC_NONE;
+   if (n_ranges) {
+      /* We can extend the most recent range if it's for the same file and
+       * we're not going backwards. */
+      const srcloc_range *r = &ranges[n_ranges - 1];
+      if (r->filename == filename && line >= r->first_line) {
+	 srcloc loc = r->base + (line - r->first_line);
+	 SVX_ASSERT(loc >= r->base);
+	 if (loc >= next_loc) next_loc = loc + 1;
+	 return loc;
+      }
+   }
+   if (n_ranges == max_ranges) {
+      max_ranges = max_ranges ? max_ranges * 2 : 64;
+      ranges = osrealloc(ranges, max_ranges * ossizeof(srcloc_range));
+   }
+   srcloc_range *r = &ranges[n_ranges++];
+   r->filename = filename;
+   r->first_line = line;
+   r->base = next_loc++;
+   SVX_ASSERT(next_loc != SRCLOC_NONE);
+   return r->base;
+}
+
+static const srcloc_range *
+find_range(srcloc loc)
+{
+   /* Binary search for the last range with base <= loc. */
+   size_t lo = 0, hi = n_ranges;
+   SVX_ASSERT(loc != SRCLOC_NONE && loc < next_loc);
+   while (hi - lo > 1) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (ranges[mid].base <= loc) {
+	 lo = mid;
+      } else {
+	 hi = mid;
+      }
+   }
+   return &ranges[lo];
+}
+
+const char *
+srcloc_filename(srcloc loc)
+{
+   if (loc == SRCLOC_NONE) return NULL;
+   return find_range(loc)->filename;
+}
+
+unsigned
+srcloc_line(srcloc loc)
+{
+   if (loc == SRCLOC_NONE) return 0;
+   const srcloc_range *r = find_range(loc);
+   return r->first_line + (loc - r->base);
+}
+
+void
+srcloc_release(void)
+{
+   osfree(ranges);
+   ranges = NULL;
+   n_ranges = max_ranges = 0;
+   next_loc = SRCLOC_NONE + 1;
+}
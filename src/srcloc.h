@@ -0,0 +1,50 @@
+/* srcloc.h
+ * Compact references to locations in survey data files
+ * Copyright (C) 2026 Olly Betts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef SRCLOC_H
+#define SRCLOC_H
+
+#include <stdint.h>
+
+/* A file and line number packed into 32 bits.
+ *
+ * Locations are allocated in increasing order as the data is read.  Each
+ * stretch of consecutive lines in one file gets a range of values, and a
+ * table of these ranges maps a location back to the file and line.
+ */
+typedef uint32_t srcloc;
+
+/* Value for "no location". */
+#define SRCLOC_NONE 0
+
+/* Return the location for line of filename.  filename must remain valid and
+ * is compared by pointer, so pass file.filename rather than a copy.
+ */
+srcloc srcloc_make(const char *filename, unsigned line);
+
+/* Return the filename for loc (NULL for SRCLOC_NONE). */
+const char *srcloc_filename(srcloc loc);
+
+/* Return the line number for loc (0 for SRCLOC_NONE). */
+unsigned srcloc_line(srcloc loc);
+
+/* Free the table of locations. */
+void srcloc_release(void);
+
+#endif
@@ -44,23 +44,33 @@ magfield_ magfield;*/
 #define b 6356.7523142
 #define r_0 6371.2
 
-double thgeomag(double lat, double lon, double h, double dat) {
+/* The calculation is split into parts which depend on only some of the
+ * inputs, and each part is only redone if those inputs have changed since the
+ * previous call.  When processing a survey project the declination is usually
+ * calculated at the same location for many different survey dates, so
+ * typically only the time-interpolated coefficients need recalculating.
+ */
+
+static double P[nmax+1][nmax+1];
+static double DP[nmax+1][nmax+1];
+static double gnm[nmax+1][nmax+1];
+static double hnm[nmax+1][nmax+1];
+static double sm[nmax+1];
+static double cm[nmax+1];
+
+/* Geocentric co-latitude, its cosine, sine and reciprocal sine, and radial
+ * distance. */
+static double theta, c, s, inv_s, r;
+
+/* Calculate the values which depend on latitude and height. */
+static void compute_position(double lat, double h) {
 
   int n,m;
 
-  static double P[nmax+1][nmax+1];
-  static double DP[nmax+1][nmax+1];
-  static double gnm[nmax+1][nmax+1];
-  static double hnm[nmax+1][nmax+1];
-  static double sm[nmax+1];
-  static double cm[nmax+1];
-
   static double root[nmax+1];
   static double roots[nmax+1][nmax+1][2];
 
-
-  double yearfrac,sr,r,theta,c,s,psi,fn,fn_0,B_r,B_theta,B_phi,X,Y; /* Z */
-  double sinpsi, cospsi, inv_s;
+  double sr;
 
   static int been_here = 0;
 
@@ -138,6 +148,13 @@ double thgeomag(double lat, double lon, double h, double dat) {
         (2.0*n-1) - DP[n-2][m] * roots[m][n][0]) * roots[m][n][1];
     }
   }
+}
+
+/* Calculate the coefficients interpolated to date dat. */
+static void compute_coefficients(double dat) {
+
+  int n,m;
+  double yearfrac;
 
   /* compute gnm, hnm at dat */
 
@@ -157,12 +174,44 @@ double thgeomag(double lat, double lon, double h, double dat) {
       }
     }
   }
+}
+
+/* Calculate the values which depend on longitude. */
+static void compute_longitude(double lon) {
+
+  int m;
 
   /* compute sm (sin(m lon) and cm (cos(m lon)) */
   for (m = 0;m<=nmaxl;m++) {
     sm[m] = sin(m * lon);
     cm[m] = cos(m * lon);
   }
+}
+
+double thgeomag(double lat, double lon, double h, double dat) {
+
+  int n,m;
+
+  static double last_lat, last_lon, last_h, last_dat;
+  static int been_here = 0;
+
+  double psi,fn,fn_0,B_r,B_theta,B_phi,X,Y; /* Z */
+  double sinpsi, cospsi;
+
+  if (!been_here || lat != last_lat || h != last_h) {
+    compute_position(lat, h);
+    last_lat = lat;
+    last_h = h;
+  }
+  if (!been_here || dat != last_dat) {
+    compute_coefficients(dat);
+    last_dat = dat;
+  }
+  if (!been_here || lon != last_lon) {
+    compute_longitude(lon);
+    last_lon = lon;
+  }
+  been_here = 1;
 
   /* compute B fields */
   B_r = 0.0;
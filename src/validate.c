@@ -5,7 +5,7 @@
  *   NB The checks currently done aren't very comprehensive - more will be
  *    added if bugs require them
  *
- *   Copyright (C) 1993,1994,1996,2000,2001,2024 Olly Betts
+ *   Copyright (C) 1993,1994,1996,2000,2001,2024,2026 Olly Betts
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -135,95 +135,84 @@ validate_station_list(void)
 	     fOk = false;
 	 }
 
-	 bool fGap = false;
 #if 0
 	 printf("V [%p]<-[%p]->[%p] ", stn->prev, stn, stn->next); print_prefix(stn->name); putnl();
 #endif
 	 SVX_ASSERT(stn->prev == NULL || stn->prev->next == stn);
 	 SVX_ASSERT(stn->next == NULL || stn->next->prev == stn);
-	 for (d = 0; d <= 2; d++) {
-	    if (!stn->leg[d]) {
-	       fGap = true;
-	    } else {
-	       if (fGap) {
+	 for (d = 0; stn->leg[d]; d++) {
+	    stn2 = stn->leg[d]->l.to;
+	    SVX_ASSERT(stn2);
+	    d2 = reverse_leg_dirn(stn->leg[d]);
+	    if (stn2->leg[d2] == NULL) {
+	       /* fine iff stn is at the disconnected end of a fragment */
+	       node *s;
+	       /* NB: don't use FOR_EACH_STN as it isn't reentrant at present */
+	       for (s = stnlist; s; s = s->next) if (s == stn) break;
+	       if (!s) for (s = fixedlist; s; s = s->next) if (s == stn) break;
+	       if (s) {
 		  printf("*** Station '");
 		  print_prefix(stn->name);
-		  printf("', leg %d is used, but an earlier leg isn't\n", d);
+		  printf("', leg %d doesn't reciprocate from station '", d);
+		  print_prefix(stn2->name);
+		  printf("'\n");
 		  fOk = false;
 	       }
-	       stn2 = stn->leg[d]->l.to;
-	       SVX_ASSERT(stn2);
-	       d2 = reverse_leg_dirn(stn->leg[d]);
-	       if (stn2->leg[d2] == NULL) {
-		  /* fine iff stn is at the disconnected end of a fragment */
-		  node *s;
-		  /* NB: don't use FOR_EACH_STN as it isn't reentrant at present */
-		  for (s = stnlist; s; s = s->next) if (s == stn) break;
-		  if (!s) for (s = fixedlist; s; s = s->next) if (s == stn) break;
-		  if (s) {
-		     printf("*** Station '");
-		     print_prefix(stn->name);
-		     printf("', leg %d doesn't reciprocate from station '", d);
-		     print_prefix(stn2->name);
-		     printf("'\n");
-		     fOk = false;
-		  }
-	       } else if (stn2->leg[d2]->l.to == NULL) {
+	    } else if (stn2->leg[d2]->l.to == NULL) {
+	       printf("*** Station '");
+	       print_prefix(stn2->name);
+	       printf("' [%p], leg %d points to NULL\n", stn2, d2);
+	       fOk = false;
+	    } else if (stn2->leg[d2]->l.to!=stn) {
+	       /* fine iff stn is at the disconnected end of a fragment */
+	       node *s;
+	       /* NB: don't use FOR_EACH_STN as it isn't reentrant at present */
+	       for (s = stnlist; s; s = s->next) if (s == stn) break;
+	       if (!s) for (s = fixedlist; s; s = s->next) if (s == stn) break;
+	       if (s) {
 		  printf("*** Station '");
+		  print_prefix(stn->name);
+		  printf("' [%p], leg %d reciprocates via station '", stn, d);
 		  print_prefix(stn2->name);
-		  printf("' [%p], leg %d points to NULL\n", stn2, d2);
+		  printf("' to station '");
+		  print_prefix(stn2->leg[d2]->l.to->name);
+		  printf("'\n");
 		  fOk = false;
-	       } else if (stn2->leg[d2]->l.to!=stn) {
-		  /* fine iff stn is at the disconnected end of a fragment */
-		  node *s;
-		  /* NB: don't use FOR_EACH_STN as it isn't reentrant at present */
-		  for (s = stnlist; s; s = s->next) if (s == stn) break;
-		  if (!s) for (s = fixedlist; s; s = s->next) if (s == stn) break;
-		  if (s) {
+	       }
+	    } else if ((data_here(stn->leg[d]) != 0) ^
+		       (data_here(stn2->leg[d2]) == 0)) {
+	       printf("*** Station '");
+	       print_prefix(stn->name);
+	       printf("' [%p], leg %d reciprocates via station '", stn, d);
+	       print_prefix(stn2->name);
+	       if (data_here(stn->leg[d]))
+		  printf("' - data on both legs\n");
+	       else
+		  printf("' - data on neither leg\n");
+	       fOk = false;
+	    }
+	    if (data_here(stn->leg[d])) {
+	       int i;
+	       for (i = 0; i < 3; i++)
+		  if (fabs(stn->leg[d]->d[i]) > MAX_POS) {
 		     printf("*** Station '");
 		     print_prefix(stn->name);
-		     printf("' [%p], leg %d reciprocates via station '", stn, d);
-		     print_prefix(stn2->name);
-		     printf("' to station '");
-		     print_prefix(stn2->leg[d2]->l.to->name);
-		     printf("'\n");
+		     printf("', leg %d, d[%d] = %g\n",
+			    d, i, (double)(stn->leg[d]->d[i]));
 		     fOk = false;
 		  }
-	       } else if ((data_here(stn->leg[d]) != 0) ^
-			  (data_here(stn2->leg[d2]) == 0)) {
-		  printf("*** Station '");
-		  print_prefix(stn->name);
-		  printf("' [%p], leg %d reciprocates via station '", stn, d);
-		  print_prefix(stn2->name);
-		  if (data_here(stn->leg[d]))
-		     printf("' - data on both legs\n");
-		  else
-		     printf("' - data on neither leg\n");
-		  fOk = false;
-	       }
-	       if (data_here(stn->leg[d])) {
-		  int i;
-		  for (i = 0; i < 3; i++)
-		     if (fabs(stn->leg[d]->d[i]) > MAX_POS) {
-			printf("*** Station '");
-			print_prefix(stn->name);
-			printf("', leg %d, d[%d] = %g\n",
-			       d, i, (double)(stn->leg[d]->d[i]));
-			fOk = false;
-		     }
-	       }
 	    }
+	 }
 
-	    if (fixed(stn)) {
-	       if (fabs(POS(stn, 0)) > MAX_POS ||
-		   fabs(POS(stn, 1)) > MAX_POS ||
-		   fabs(POS(stn, 2)) > MAX_POS) {
-		  printf("*** Station '");
-		  print_prefix(stn->name);
-		  printf("' fixed at coords (%f,%f,%f)\n",
-			 POS(stn, 0), POS(stn, 1), POS(stn, 2) );
-		  fOk = false;
-	       }
+	 if (fixed(stn)) {
+	    if (fabs(POS(stn, 0)) > MAX_POS ||
+		fabs(POS(stn, 1)) > MAX_POS ||
+		fabs(POS(stn, 2)) > MAX_POS) {
+	       printf("*** Station '");
+	       print_prefix(stn->name);
+	       printf("' fixed at coords (%f,%f,%f)\n",
+		      POS(stn, 0), POS(stn, 1), POS(stn, 2) );
+	       fOk = false;
 	    }
 	 }
       }
@@ -244,13 +233,11 @@ dump_node(node *stn)
    printf(" stn [%p] name (%p) colour %ld %sfixed\n",
 	  stn, stn->name, stn->colour, fixed(stn) ? "" : "un");
 
-   for (d = 0; d <= 2; d++) {
-      if (stn->leg[d]) {
-	 printf("  leg %d -> stn [%p] rev %d ", d, stn->leg[d]->l.to,
-		reverse_leg_dirn(stn->leg[d]));
-	 print_prefix(stn->leg[d]->l.to->name);
-	 putnl();
-      }
+   for (d = 0; stn->leg[d]; d++) {
+      printf("  leg %d -> stn [%p] rev %u ", d, stn->leg[d]->l.to,
+	     reverse_leg_dirn(stn->leg[d]));
+      print_prefix(stn->leg[d]->l.to->name);
+      putnl();
    }
 }
 
@@ -54,12 +54,15 @@ esac
 
 : ${TESTS=${*:-"singlefix singlereffix oneleg midpoint lollipop fixedlollipop\
  cross firststn\
- deltastar deltastar2 deltastarhanging\
+ deltastar deltastar2 deltastarhanging sparsegrid threads iterate\
+ nocovsparse nocoviterate densenet\
+ stationerrors stationerrors8\
+ nocovariances\
  bug3 calibrate_tape nosurvey2 cartesian cartesian2\
  lengthunits angleunits cmd_alias cmd_alias_bad cmd_truncate cmd_truncate_bad\
- cmd_case cmd_case_bad cmd_fix cmd_fix2 cmd_fix_bad cmd_fix_bad2\
+ cmd_case cmd_case_bad cmd_fix cmd_fix2 cmd_fix_bad cmd_fix_bad2 numrounding\
  cmd_solve cmd_entrance cmd_entrance_bad cmd_sd cmd_sd_bad cmd_set\
- cmd_set_bad cmd_set_dot_in_name\
+ cmd_set_bad cmd_set_dot_in_name cmd_set_scan\
  beginroot revcomplist break_replace_pfx bug0 bug1 bug2 bug4 bug5\
  expobug require export export2 includecomment\
  self_loop self_eq_loop reenterwarn cmd_default cmd_default_bad\
@@ -94,7 +97,7 @@ esac
  backread.dat corrections.dat depthguage.dat flags.dat karstcompat.dat\
  lrud.dat nomeasure.dat noteam.dat\
  badmak.mak\
- fixfeet.mak utm.mak\
+ fixfeet.mak makthreads.mak utm.mak\
  clptest.dat clptest.clp\
  walls.srv\
  badopts.srv\
@@ -105,7 +108,7 @@ esac
  badunits badbegin anonstn anonstnbad anonstnrev doubleinc reenterlots\
  cs csbad csbadsdfix csfeet cslonglat omitfixaroundsolve repeatreading\
  mixedeols utf8bom nonewlineateof suspectreadings cmd_data_default\
- cmd_data_ignore\
+ cmd_data_ignore parsecache\
  quadrant_bearing bad_quadrant_bearing\
  samename tabinhighlight legacytokens\
  component_count_bug component_count_bug2\
@@ -183,6 +186,13 @@ for file in $TESTS ; do
   # svg : Convert to SVG with survexport and compare with <testcase_name>.svg
   pos=
 
+  # Extra options to pass to cavern.
+  cavernopts=
+
+  # yes : Run cavern twice, checking the output of the second run (which
+  # should use the cache written by the first).
+  rerun=
+
   case $file in
     backread.dat|clptest.dat|clptest.clp|depthguage.dat|karstcompat.dat)
       pos=dump
@@ -226,6 +236,10 @@ for file in $TESTS ; do
 	  survexportopt=*)
 	    survexportopts="$survexportopts "`expr "$1" : 'survexportopt=\(.*\)'`
 	    ;;
+	  cavernopt=*)
+	    cavernopts="$cavernopts "`expr "$1" : 'cavernopt=\(.*\)'`
+	    ;;
+	  rerun=*) rerun=`expr "$1" : 'rerun=\(.*\)'` ;;
 	esac
       done
       ;;
@@ -245,7 +259,14 @@ for file in $TESTS ; do
   rm -f tmp.*
   pwd=`pwd`
   cd "$srcdir"
-  srcdir=. SOURCE_DATE_EPOCH=1 $CAVERN "$input" --output="$pwd/tmp" > "$pwd/tmp.out"
+  if test yes = "$rerun" ; then
+    srcdir=. SOURCE_DATE_EPOCH=1 $CAVERN $cavernopts "$input" --output="$pwd/tmp" --cache > /dev/null
+    test -f "$pwd/tmp.cache" || exit 1
+    # Check the second run actually uses the cache.
+    srcdir=. SOURCE_DATE_EPOCH=1 $CAVERN $cavernopts "$input" --output="$pwd/tmp" --cache --internal-stats > "$pwd/tmp.out"
+    grep '^Parse cache: [1-9][0-9]* hits' "$pwd/tmp.out" > /dev/null || exit 1
+  fi
+  srcdir=. SOURCE_DATE_EPOCH=1 $CAVERN $cavernopts "$input" --output="$pwd/tmp" > "$pwd/tmp.out"
   exitcode=$?
   cd "$pwd"
   test -n "$VERBOSE" && cat tmp.out
@@ -409,9 +430,10 @@ for file in $TESTS ; do
   esac
 
   if test -f "$outfile" ; then
-    # Version and time used info from output, working around Apple's stone-age
-    # sed.
-    sed '1,/^Copyright/d;/^\(CPU \)*[Tt]ime used  *[0-9][0-9.]*s$/d;s!.*/src/\(cavern: \)!\1!' tmp.out > tmp.out2
+    # Version and time used info from output, and the --internal-stats pool
+    # statistics (which depend on the sizes of structures on this platform),
+    # working around Apple's stone-age sed.
+    sed '1,/^Copyright/d;/^\(CPU \)*[Tt]ime used  *[0-9][0-9.]*s$/d;/^Pool [a-z]*: /d;s!.*/src/\(cavern: \)!\1!' tmp.out > tmp.out2
     mv tmp.out2 tmp.out
     # Check output is as expected.
     if $QUIET_DIFF "$outfile" tmp.out ; then
@@ -0,0 +1,64 @@
+#!/bin/sh
+#
+# Survex test suite - check the blocked dense matrix solver
+# Copyright (C) 2026 Olly Betts
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+testdir=`echo $0 | sed 's!/[^/]*$!!' || echo '.'`
+
+test -x "$testdir"/../src/cavern || testdir=.
+
+# Make testdir absolute.
+testdir=`cd "$testdir" && pwd`
+
+# allow us to run tests standalone more easily
+: ${srcdir="$testdir"}
+if [ -z "$SURVEXLIB" ] ; then
+  SURVEXLIB=`cd "$srcdir/../lib" && pwd`
+  export SURVEXLIB
+fi
+
+: ${CHOLESKIBENCH="$testdir"/../src/choleskibench}
+
+# Suppress checking for leaks on exit if we're build with lsan - we don't
+# generally waste effort to free all allocations as the OS will reclaim
+# memory on exit.
+LSAN_OPTIONS=leak_check_at_exit=0
+export LSAN_OPTIONS
+
+vg_error=123
+vg_log=$testdir/vg.log
+if [ -n "$VALGRIND" ] ; then
+  rm -f "$vg_log"
+  CHOLESKIBENCH="$VALGRIND --log-file=$vg_log --error-exitcode=$vg_error $CHOLESKIBENCH"
+fi
+
+# Compares choleski_blocked() with choleski() for a range of sizes, so this
+# tests whichever SIMD code choleski_blocked() uses on this platform.
+$CHOLESKIBENCH --check
+exitcode=$?
+if [ -n "$VALGRIND" ] ; then
+  if [ $exitcode = "$vg_error" ] ; then
+    cat "$vg_log"
+    rm "$vg_log"
+    exit 1
+  fi
+  rm "$vg_log"
+fi
+test $exitcode = 0 || exit 1
+
+test -n "$VERBOSE" && echo "Test passed"
+exit 0
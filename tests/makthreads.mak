@@ -0,0 +1,8 @@
+/ pos=dump warn=0 cavernopt=--threads=3 /
+[subdir;
+#cave1a.dat;
+[subsubdir;
+#cave2.dat;
+];
+#cave1b.dat;
+];